@@ -0,0 +1,433 @@
+// Microbenchmarks for the decode, scan and shuffle paths.
+//
+//   bench [-n iterations] [-m budgetMB] [-b baseline.json] [-t percent] [-C]
+//         IMAGE_DIR [TREE_DIR...]
+//
+// Every JPEG in IMAGE_DIR is loaded through createImageFromJpeg, warm
+// (page cache primed) and cold (dropped with posix_fadvise first), with
+// the header, decode, convert and upload stages taken from the stage
+// histograms.  The same images, shuffled, are then read cold after being
+// prefetched in playback order and in disk order, with the reads the disk
+// saw from /proc/diskstats.  Each TREE_DIR is scanned with
+// ScanImageDirectory and the result shuffled with InitRandomPlaybackOrder.
+// Cold scans need -C and root, as they drop the whole dentry and inode
+// cache.
+//
+// Results go to stdout as JSON, one benchmark per line so runs diff
+// cleanly.  With -b, means slower than the baseline by more than -t
+// percent (10 by default) are reported and the exit status is 1.
+//
+// Built with the software OpenVG backend, so no GPU is needed.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+#include "pislides.h"
+
+#define MAX_RESULTS 256
+#define MAX_SAMPLES 64
+#define MAX_FILES 256
+
+typedef struct {
+  char name[128];
+  const char * variant;
+  int iterations;
+  double mean, min, p50, max;	// ms
+  char extra[256];		// more JSON members, "" or starting with ", "
+} Result;
+
+static Result results[MAX_RESULTS];
+static int resultCount;
+static int iterations = 5;
+
+
+static int CompareDoubles(const void * a, const void * b)
+{
+  double da = *(const double *) a, db = *(const double *) b;
+  return (da > db) - (da < db);
+}
+
+static Result * AddResult(const char * name, const char * variant, double * samples, int count)
+{
+  Result * r = results + resultCount;
+  int i;
+  if (resultCount == MAX_RESULTS || count == 0) {
+    return NULL;
+  }
+  resultCount++;
+  snprintf(r->name, sizeof(r->name), "%s", name);
+  r->variant = variant;
+  r->iterations = count;
+  r->mean = 0.0;
+  for (i = 0; i < count; i++) {
+    r->mean += samples[i];
+  }
+  r->mean /= count;
+  qsort(samples, count, sizeof(double), CompareDoubles);
+  r->min = samples[0];
+  r->p50 = samples[count / 2];
+  r->max = samples[count - 1];
+  r->extra[0] = '\0';
+  return r;
+}
+
+static void DropFromPageCache(const char * path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+}
+
+// drops clean dentries and inodes system wide.  Returns 0 if allowed.
+static int DropDentryCache()
+{
+  sync();
+  int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  int ok = write(fd, "2", 1) == 1;
+  close(fd);
+  return ok ? 0 : -1;
+}
+
+static void BenchDecode(const char * path, const char * name, int cold)
+{
+  double samples[MAX_SAMPLES];
+  int i, width = 0, height = 0;
+
+  if (!cold) {
+    ReleaseImage(createImageFromJpeg(path));	// prime caches
+  }
+  ResetStageStats();
+  for (i = 0; i < iterations; i++) {
+    if (cold) {
+      DropFromPageCache(path);
+    }
+    double start = vgwrap_now_ms();
+    VGImage img = createImageFromJpeg(path);
+    samples[i] = vgwrap_now_ms() - start;
+    if (img == VG_INVALID_HANDLE) {
+      return;
+    }
+    width = vgGetParameteri(img, VG_IMAGE_WIDTH);
+    height = vgGetParameteri(img, VG_IMAGE_HEIGHT);
+    ReleaseImage(img);
+  }
+
+  char fullName[128];
+  snprintf(fullName, sizeof(fullName), "decode.%s", name);
+  Result * r = AddResult(fullName, cold ? "cold" : "warm", samples, iterations);
+  if (r == NULL) {
+    return;
+  }
+  StageSummary header, decode, convert, upload;
+  GetStageStats(STAGE_HEADER, &header);
+  GetStageStats(STAGE_DECODE, &decode);
+  GetStageStats(STAGE_CONVERT, &convert);
+  GetStageStats(STAGE_UPLOAD, &upload);
+  snprintf(r->extra, sizeof(r->extra),
+	   ", \"width\": %d, \"height\": %d, \"mpix_per_s\": %.2f, \"header_ms\": %.3f"
+	   ", \"decode_ms\": %.3f, \"convert_ms\": %.3f, \"upload_ms\": %.3f",
+	   width, height, width * (double) height / 1000.0 / r->mean, header.mean_ms,
+	   decode.mean_ms, convert.mean_ms, upload.mean_ms);
+}
+
+static void BenchImages(const char * dir)
+{
+  struct dirent ** entries;
+  char path[1024], name[128];
+  int n = scandir(dir, &entries, NULL, alphasort), i;
+
+  if (n < 0) {
+    fprintf(stderr, "Failed opening '%s'\n", dir);
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    if (fnmatch("*.jpg", entries[i]->d_name, 0) == 0 || fnmatch("*.JPG", entries[i]->d_name, 0) == 0) {
+      snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name);
+      snprintf(name, sizeof(name), "%.*s", (int) strlen(entries[i]->d_name) - 4, entries[i]->d_name);
+      BenchDecode(path, name, 0);
+      BenchDecode(path, name, 1);
+    }
+    free(entries[i]);
+  }
+  free(entries);
+}
+
+// read a whole file, returning its size
+static long ReadWhole(const char * path)
+{
+  static char buf[1 << 16];
+  long total = 0;
+  ssize_t n;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    total += n;
+  }
+  close(fd);
+  return total;
+}
+
+static void BenchPrefetch(const char * dir, int diskOrder)
+{
+  double samples[MAX_SAMPLES];
+  char * paths[MAX_FILES];
+  struct dirent ** entries;
+  struct stat st;
+  DiskStats before, after;
+  long reads = 0, merged = 0, sectors = 0, bytes = 0;
+  double diskMs = 0.0;
+  int n = scandir(dir, &entries, NULL, alphasort), count = 0, i, j;
+
+  if (n < 0) {
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    if (count < MAX_FILES &&
+	(fnmatch("*.jpg", entries[i]->d_name, 0) == 0 || fnmatch("*.JPG", entries[i]->d_name, 0) == 0)) {
+      paths[count] = malloc(strlen(dir) + strlen(entries[i]->d_name) + 2);
+      sprintf(paths[count], "%s/%s", dir, entries[i]->d_name);
+      count++;
+    }
+    free(entries[i]);
+  }
+  free(entries);
+  // the order they would be shown in, the same for both runs
+  srand(1);
+  for (i = count - 1; i > 0; i--) {
+    j = rand() % (i + 1);
+    char * t = paths[i];
+    paths[i] = paths[j];
+    paths[j] = t;
+  }
+  int stats = count > 0 && stat(paths[0], &st) == 0;
+
+  for (i = 0; i < iterations && count > 0; i++) {
+    for (j = 0; j < count; j++) {
+      DropFromPageCache(paths[j]);
+    }
+    stats = stats && ReadDiskStats(st.st_dev, &before) == 0;
+    double start = vgwrap_now_ms();
+    PrefetchFiles(paths, count, diskOrder);
+    for (j = 0, bytes = 0; j < count; j++) {
+      bytes += ReadWhole(paths[j]);
+    }
+    samples[i] = vgwrap_now_ms() - start;
+    if (stats && ReadDiskStats(st.st_dev, &after) == 0) {
+      reads += after.reads - before.reads;
+      merged += after.merged - before.merged;
+      sectors += after.sectors - before.sectors;
+      diskMs += after.readMs - before.readMs;
+    }
+  }
+
+  Result * r = AddResult("prefetch.images", diskOrder ? "disk" : "playback", samples, i);
+  if (r) {
+    snprintf(r->extra, sizeof(r->extra),
+	     ", \"files\": %d, \"mb\": %.1f, \"disk_reads\": %.1f, \"disk_merged\": %.1f"
+	     ", \"disk_mb\": %.1f, \"disk_ms\": %.1f",
+	     count, bytes / (1024.0 * 1024.0), reads / (double) i, merged / (double) i,
+	     sectors / 2048.0 / i, diskMs / i);
+  }
+  for (j = 0; j < count; j++) {
+    free(paths[j]);
+  }
+}
+
+static void BenchTree(const char * dir, int cold)
+{
+  double scanSamples[MAX_SAMPLES], shuffleSamples[MAX_SAMPLES];
+  char name[128];
+  const char * base = strrchr(dir, '/') ? strrchr(dir, '/') + 1 : dir;
+  int i;
+
+  if (cold && DropDentryCache() != 0) {
+    fprintf(stderr, "cold scans need root, skipping\n");
+    return;
+  }
+  if (!cold) {
+    InitFileRecords();
+    ScanImageDirectory((char *) dir);
+  }
+  for (i = 0; i < iterations; i++) {
+    if (cold) {
+      DropDentryCache();
+    }
+    InitFileRecords();
+    double start = vgwrap_now_ms();
+    ScanImageDirectory((char *) dir);
+    scanSamples[i] = vgwrap_now_ms() - start;
+  }
+  snprintf(name, sizeof(name), "scan.%s", base);
+  Result * r = AddResult(name, cold ? "cold" : "warm", scanSamples, iterations);
+  if (r) {
+    snprintf(r->extra, sizeof(r->extra), ", \"files\": %d, \"files_per_s\": %.0f",
+	     fileRecordCount, fileRecordCount * 1000.0 / r->mean);
+  }
+  if (cold) {
+    return;
+  }
+
+  for (i = 0; i < iterations; i++) {
+    double start = vgwrap_now_ms();
+    InitRandomPlaybackOrder();
+    shuffleSamples[i] = vgwrap_now_ms() - start;
+  }
+  snprintf(name, sizeof(name), "shuffle.%s", base);
+  r = AddResult(name, "warm", shuffleSamples, iterations);
+  if (r) {
+    snprintf(r->extra, sizeof(r->extra), ", \"files\": %d", fileRecordCount);
+  }
+}
+
+static void PrintResults()
+{
+  int i;
+  printf("{\"benchmarks\": [\n");
+  for (i = 0; i < resultCount; i++) {
+    Result * r = results + i;
+    printf("{\"name\": \"%s\", \"variant\": \"%s\", \"iterations\": %d, \"mean_ms\": %.3f"
+	   ", \"min_ms\": %.3f, \"p50_ms\": %.3f, \"max_ms\": %.3f%s}%s\n",
+	   r->name, r->variant, r->iterations, r->mean, r->min, r->p50, r->max, r->extra,
+	   i < resultCount - 1 ? "," : "");
+  }
+  printf("]}\n");
+}
+
+// StringMember copies the value of "key": "value" in line to value
+static int StringMember(const char * line, const char * key, char * value, int size)
+{
+  char pattern[64];
+  snprintf(pattern, sizeof(pattern), "\"%s\": \"", key);
+  const char * p = strstr(line, pattern);
+  if (p == NULL) {
+    return 0;
+  }
+  p += strlen(pattern);
+  const char * end = strchr(p, '"');
+  if (end == NULL || end - p >= size) {
+    return 0;
+  }
+  memcpy(value, p, end - p);
+  value[end - p] = '\0';
+  return 1;
+}
+
+// CompareWithBaseline reports results slower than the baseline by more
+// than threshold percent.  Returns the number of regressions.
+static int CompareWithBaseline(const char * path, double threshold)
+{
+  char line[1024], name[128], variant[16];
+  int regressions = 0, i;
+
+  FILE * fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "Failed opening baseline '%s'\n", path);
+    return 0;
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    const char * mean = strstr(line, "\"mean_ms\": ");
+    if (mean == NULL || !StringMember(line, "name", name, sizeof(name)) ||
+	!StringMember(line, "variant", variant, sizeof(variant))) {
+      continue;
+    }
+    double baseline = atof(mean + strlen("\"mean_ms\": "));
+    for (i = 0; i < resultCount; i++) {
+      Result * r = results + i;
+      if (strcmp(r->name, name) == 0 && strcmp(r->variant, variant) == 0 && baseline > 0.0) {
+	double change = (r->mean - baseline) * 100.0 / baseline;
+	if (change > threshold) {
+	  fprintf(stderr, "regression: %s (%s) %.3f ms, was %.3f ms, %+.1f%%\n",
+		  name, variant, r->mean, baseline, change);
+	  regressions++;
+	}
+      }
+    }
+  }
+  fclose(fp);
+  return regressions;
+}
+
+
+int main(int argc, char ** argv)
+{
+  const char * baseline = NULL;
+  double threshold = 10.0;
+  size_t budgetMB = 512;
+  int coldScans = 0, opt, i;
+
+  while ((opt = getopt(argc, argv, "n:m:b:t:C")) != -1) {
+    switch (opt) {
+    case 'n':
+      iterations = atoi(optarg);
+      break;
+    case 'm':
+      budgetMB = atoi(optarg);
+      break;
+    case 'b':
+      baseline = optarg;
+      break;
+    case 't':
+      threshold = atof(optarg);
+      break;
+    case 'C':
+      coldScans = 1;
+      break;
+    default:
+      optind = argc + 1;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: bench [-n iterations] [-m budgetMB] [-b baseline.json] [-t percent] [-C]\n"
+	    "             IMAGE_DIR [TREE_DIR...]\n");
+    return 2;
+  }
+  if (iterations < 1 || iterations > MAX_SAMPLES) {
+    iterations = iterations < 1 ? 1 : MAX_SAMPLES;
+  }
+
+  // messages from the decoder would break up the JSON
+  int json = dup(1);
+  if (freopen("/dev/null", "w", stdout) == NULL) {
+    return 1;
+  }
+
+  // nothing is shown, so keep the surface small
+  int width, height;
+  setenv("PISLIDES_SOFT_SIZE", "64x64", 0);
+  vgwrap_init(&width, &height, 0);
+  SetImageBudget(budgetMB * 1024 * 1024);
+  srand(1);
+
+  BenchImages(argv[optind]);
+  BenchPrefetch(argv[optind], 0);
+  BenchPrefetch(argv[optind], 1);
+  for (i = optind + 1; i < argc; i++) {
+    BenchTree(argv[i], 0);
+    if (coldScans) {
+      BenchTree(argv[i], 1);
+    }
+  }
+  vgwrap_finish();
+
+  fflush(stdout);
+  dup2(json, 1);
+  close(json);
+  PrintResults();
+  fflush(stdout);
+
+  return baseline && CompareWithBaseline(baseline, threshold) ? 1 : 0;
+}
@@ -0,0 +1,260 @@
+// Synthetic corpus for the benchmarks.
+//
+//   gencorpus images DIR [MP...]   JPEGs of each flavour at each size in
+//                                  megapixels (2 6 12 24 by default)
+//   gencorpus tree DIR FILES       a directory tree of FILES pictures
+//
+// Pictures are smooth gradients with fine noise on top, which compresses
+// about like a photograph.  Tree files are hard links to a few small
+// JPEGs, so a million of them costs inodes but hardly any space.  Every
+// tenth file is not a JPEG, for the scan to skip.  Nothing is rewritten
+// if it is already there, so the corpus is made once.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <jpeglib.h>
+
+#define FILES_PER_DIR 100
+#define DIRS_PER_DIR 100
+#define LINKS_PER_SEED 50000	// ext4 allows 65000 links to a file
+
+typedef enum { BASELINE, PROGRESSIVE, GRAYSCALE, CMYK, RESTART, ADOBE_RGB, FLAVOURS } Flavour;
+
+static const char *flavour_names[FLAVOURS] = { "baseline", "progressive", "grayscale", "cmyk", "restart", "adobergb" };
+
+
+static int exists(const char *path)
+{
+  struct stat st;
+  return stat(path, &st) == 0;
+}
+
+static int make_dir(const char *path)
+{
+  if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+    printf("Failed creating '%s'\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+static void put32(JOCTET *p, unsigned v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+// WriteAdobeRgbProfile embeds an Adobe RGB (1998) profile, primaries and
+// a 563/256 gamma, as a single APP2 marker
+static void WriteAdobeRgbProfile(j_compress_ptr cinfo)
+{
+  static const char *tags[6] = { "rXYZ", "gXYZ", "bXYZ", "rTRC", "gTRC", "bTRC" };
+  static const double primaries[3][3] = {
+    {0.6097, 0.3111, 0.0195}, {0.2053, 0.6257, 0.0609}, {0.1492, 0.0632, 0.7446}
+  };
+  JOCTET marker[14 + 132 + 6 * 12 + 3 * 20 + 14];
+  JOCTET *icc = marker + 14;
+  unsigned offset = 132 + 6 * 12;
+  int i, c;
+
+  memset(marker, 0, sizeof(marker));
+  memcpy(marker, "ICC_PROFILE", 12);
+  marker[12] = 1;
+  marker[13] = 1;
+  put32(icc, sizeof(marker) - 14);
+  memcpy(icc + 12, "mntr", 4);
+  memcpy(icc + 16, "RGB ", 4);
+  memcpy(icc + 20, "XYZ ", 4);
+  memcpy(icc + 36, "acsp", 4);
+  put32(icc + 128, 6);
+  for (i = 0; i < 3; i++) {
+    memcpy(icc + 132 + i * 12, tags[i], 4);
+    put32(icc + 136 + i * 12, offset);
+    put32(icc + 140 + i * 12, 20);
+    memcpy(icc + offset, "XYZ ", 4);
+    for (c = 0; c < 3; c++) {
+      put32(icc + offset + 8 + c * 4, (unsigned) lround(primaries[i][c] * 65536.0));
+    }
+    offset += 20;
+  }
+  // one curve shared by the three channels
+  for (i = 3; i < 6; i++) {
+    memcpy(icc + 132 + i * 12, tags[i], 4);
+    put32(icc + 136 + i * 12, offset);
+    put32(icc + 140 + i * 12, 14);
+  }
+  memcpy(icc + offset, "curv", 4);
+  put32(icc + offset + 8, 1);
+  icc[offset + 12] = 563 >> 8;
+  icc[offset + 13] = 563 & 255;
+  jpeg_write_marker(cinfo, JPEG_APP0 + 2, marker, sizeof(marker));
+}
+
+// WriteJpeg writes a width x height picture.  Returns 0 on success.
+static int WriteJpeg(const char *path, int width, int height, Flavour flavour)
+{
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  int components = flavour == GRAYSCALE ? 1 : flavour == CMYK ? 4 : 3;
+  int x, y, c;
+
+  FILE *fp = fopen(path, "wb");
+  if (fp == NULL) {
+    printf("Failed opening '%s' for writing\n", path);
+    return -1;
+  }
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+  jpeg_stdio_dest(&cinfo, fp);
+  cinfo.image_width = width;
+  cinfo.image_height = height;
+  cinfo.input_components = components;
+  cinfo.in_color_space = flavour == GRAYSCALE ? JCS_GRAYSCALE : flavour == CMYK ? JCS_CMYK : JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, 90, TRUE);
+  if (flavour == PROGRESSIVE) {
+    jpeg_simple_progression(&cinfo);
+  }
+  if (flavour == RESTART) {
+    cinfo.restart_in_rows = 1;
+  }
+  jpeg_start_compress(&cinfo, TRUE);
+  if (flavour == ADOBE_RGB) {
+    WriteAdobeRgbProfile(&cinfo);
+  }
+
+  // per column and per row waves, summed per pixel
+  float *wx = malloc(sizeof(float) * width * 4);
+  float *wy = malloc(sizeof(float) * height * 4);
+  JSAMPLE *row = malloc((size_t) width * components);
+  for (c = 0; c < 4; c++) {
+    for (x = 0; x < width; x++) {
+      wx[c * width + x] = 60.0f * sinf(x * (0.004f + c * 0.003f));
+    }
+    for (y = 0; y < height; y++) {
+      wy[c * height + y] = 50.0f * cosf(y * (0.003f + c * 0.002f));
+    }
+  }
+  unsigned seed = 12345;
+  for (y = 0; y < height; y++) {
+    JSAMPLE *p = row;
+    for (x = 0; x < width; x++) {
+      for (c = 0; c < components; c++) {
+	seed = seed * 1103515245 + 12345;
+	int v = 128 + (int) (wx[c * width + x] + wy[c * height + y]) + (int) ((seed >> 16) & 31) - 16;
+	*p++ = v < 0 ? 0 : v > 255 ? 255 : v;
+      }
+    }
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  free(row);
+  free(wx);
+  free(wy);
+  if (fclose(fp) != 0) {
+    printf("Failed writing '%s'\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+static int MakeImages(const char *dir, int argc, char **argv)
+{
+  static const char *defaultSizes[] = { "2", "6", "12", "24" };
+  const char **sizes = argc ? (const char **) argv : defaultSizes;
+  int count = argc ? argc : 4;
+  char path[1024];
+  int i, f;
+
+  if (make_dir(dir) != 0) {
+    return -1;
+  }
+  for (i = 0; i < count; i++) {
+    // 3:2 like most cameras, to a multiple of 16 so every flavour has
+    // whole MCUs
+    double mp = atof(sizes[i]);
+    int height = (int) (sqrt(mp * 1e6 / 1.5) / 16 + 0.5) * 16;
+    int width = height * 3 / 2;
+    for (f = 0; f < FLAVOURS; f++) {
+      snprintf(path, sizeof(path), "%s/%s-%smp.jpg", dir, flavour_names[f], sizes[i]);
+      if (exists(path)) {
+	continue;
+      }
+      printf("writing %s, %dx%d\n", path, width, height);
+      if (WriteJpeg(path, width, height, f) != 0) {
+	return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+static int MakeTree(const char *dir, long files)
+{
+  char seed[1024], path[1024], done[1024];
+  long i;
+
+  snprintf(done, sizeof(done), "%s/.complete", dir);
+  if (exists(done)) {
+    return 0;
+  }
+  if (make_dir(dir) != 0) {
+    return -1;
+  }
+  printf("writing %s, %ld files\n", dir, files);
+
+  // two levels of directories, FILES_PER_DIR pictures in each leaf
+  for (i = 0; i < files; i++) {
+    long leaf = i / FILES_PER_DIR;
+    if (i % LINKS_PER_SEED == 0) {
+      snprintf(seed, sizeof(seed), "%s/.seed%ld.jpeg", dir, i / LINKS_PER_SEED);
+      if (!exists(seed) && WriteJpeg(seed, 64, 48, BASELINE) != 0) {
+	return -1;
+      }
+    }
+    if (i % FILES_PER_DIR == 0) {
+      snprintf(path, sizeof(path), "%s/%03ld", dir, leaf / DIRS_PER_DIR);
+      if (leaf % DIRS_PER_DIR == 0 && make_dir(path) != 0) {
+	return -1;
+      }
+      snprintf(path, sizeof(path), "%s/%03ld/%03ld", dir, leaf / DIRS_PER_DIR, leaf % DIRS_PER_DIR);
+      if (make_dir(path) != 0) {
+	return -1;
+      }
+    }
+    snprintf(path, sizeof(path), "%s/%03ld/%03ld/IMG_%07ld.%s", dir, leaf / DIRS_PER_DIR,
+	     leaf % DIRS_PER_DIR, i, i % 10 == 9 ? "txt" : i % 2 ? "JPG" : "jpg");
+    if (link(seed, path) != 0 && errno != EEXIST) {
+      printf("Failed creating '%s'\n", path);
+      return -1;
+    }
+  }
+  FILE *fp = fopen(done, "w");
+  if (fp) {
+    fclose(fp);
+  }
+  return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+  if (argc >= 3 && strcmp(argv[1], "images") == 0) {
+    return MakeImages(argv[2], argc - 3, argv + 3) != 0;
+  }
+  if (argc == 4 && strcmp(argv[1], "tree") == 0) {
+    return MakeTree(argv[2], atol(argv[3])) != 0;
+  }
+  printf("usage: gencorpus images DIR [MP...]\n"
+	 "       gencorpus tree DIR FILES\n");
+  return 2;
+}
@@ -27,12 +27,20 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <map>
+#include <algorithm>
 #include <float.h>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #include "ft2build.h"
 #include FT_FREETYPE_H
 #include FT_OUTLINE_H
 
+#include "../vgwrap_fontfile.h"
+
 #define OUTPUT_INTS
 
 class Vector2
@@ -63,14 +71,257 @@ bool isOn( char b )
 	return b & 1 ? true : false;
 }
 
+struct GlyphData
+{
+	std::vector<int>		gpvecindices;
+	std::vector<int>		givecindices;
+	std::vector<int>		gpvecsizes;
+	std::vector<int>		givecsizes;
+	std::vector<Vector2>	gpvec;
+	std::vector<char>		givec;
+	std::vector<float>		gbbox;
+	std::vector<float>		advances;
+};
+
+//converts the outline of one glyph and appends it to d, returns false if
+//freetype can't load the glyph
+bool appendGlyph( FT_Face face, FT_UInt glyphIndex, GlyphData &d )
+{
+	if( FT_Load_Glyph( face, glyphIndex, FT_LOAD_NO_BITMAP | FT_LOAD_NO_HINTING | FT_LOAD_IGNORE_TRANSFORM ) )
+		return false;
+
+	float advance = convFTFixed( face->glyph->advance.x );
+
+	FT_Outline &outline = face->glyph->outline;
+	std::vector<Vector2>		pvec;
+	std::vector<unsigned char>	ivec;
+	float minx = 10000000.0f,miny = 100000000.0f,maxx = -10000000.0f,maxy = -10000000.0f;
+	int s = 0,e;
+	bool on;
+	Vector2 last,v,nv;
+	for(int con=0;con<outline.n_contours;++con)
+	{
+		int pnts = 1;
+		e = outline.contours[con]+1;
+		last = convFTVector(outline.points[s]);
+
+		//read the contour start point
+		ivec.push_back(2);
+		pvec.push_back(last);
+
+		int i=s+1;
+		while(i<=e)
+		{
+			int c = (i == e) ? s : i;
+			int n = (i == e-1) ? s : (i+1);
+			v = convFTVector(outline.points[c]);
+			on = isOn( outline.tags[c] );
+			if( on )
+			{	//line
+				++i;
+				ivec.push_back(4);
+				pvec.push_back(v);
+				pnts += 1;
+			}
+			else
+			{	//spline
+				if( isOn( outline.tags[n] ) )
+				{	//next on
+					nv = convFTVector( outline.points[n] );
+					i += 2;
+				}
+				else
+				{	//next off, use middle point
+					nv = (v + convFTVector( outline.points[n] )) * 0.5f;
+					++i;
+				}
+				ivec.push_back(10);
+				pvec.push_back(v);
+				pvec.push_back(nv);
+				pnts += 2;
+			}
+			last = nv;
+		}
+		ivec.push_back(0);
+		s = e;
+	}
+
+	for(int i=0;i<pvec.size();++i)
+	{
+		if( pvec[i].x < minx ) minx = pvec[i].x;
+		if( pvec[i].x > maxx ) maxx = pvec[i].x;
+		if( pvec[i].y < miny ) miny = pvec[i].y;
+		if( pvec[i].y > maxy ) maxy = pvec[i].y;
+	}
+	if(!pvec.size())
+	{	//e.g. space doesn't contain any data
+		minx = 0.0f;
+		miny = 0.0f;
+		maxx = 0.0f;
+		maxy = 0.0f;
+	}
+
+	d.gpvecindices.push_back( d.gpvec.size() );
+	d.givecindices.push_back( d.givec.size() );
+
+	d.gpvecsizes.push_back( pvec.size() );
+	d.givecsizes.push_back( ivec.size() );
+
+	d.gbbox.push_back( minx );
+	d.gbbox.push_back( miny );
+	d.gbbox.push_back( maxx );
+	d.gbbox.push_back( maxy );
+	d.advances.push_back(advance);
+
+	d.gpvec.insert( d.gpvec.end(), pvec.begin(), pvec.end() );
+	d.givec.insert( d.givec.end(), ivec.begin(), ivec.end() );
+	return true;
+}
+
+//pads the output to a 4 byte boundary and returns the new offset
+uint32_t alignOutput( FILE* f, uint32_t offset )
+{
+	while( offset & 3 )
+	{
+		fputc( 0, f );
+		++offset;
+	}
+	return offset;
+}
+
+//writes a binary font file (see vgwrap_fontfile.h) covering every
+//character in the face's Unicode charmap
+int writeBinaryFont( FT_Face face, const char* filename )
+{
+	GlyphData d;
+	std::map<FT_UInt,int> glyphIds;
+	std::vector< std::pair<uint32_t,uint32_t> > cmap;
+
+	FT_UInt glyphIndex;
+	FT_ULong cc = FT_Get_First_Char( face, &glyphIndex );
+	while( glyphIndex != 0 )
+	{
+		if( cc >= 32 )
+		{
+			std::map<FT_UInt,int>::iterator it = glyphIds.find( glyphIndex );
+			int id;
+			if( it != glyphIds.end() )
+				id = it->second;	//several characters can share a glyph
+			else if( appendGlyph( face, glyphIndex, d ) )
+			{
+				id = d.advances.size() - 1;
+				glyphIds[glyphIndex] = id;
+			}
+			else
+				id = -1;
+			if( id >= 0 )
+				cmap.push_back( std::make_pair( (uint32_t)cc, (uint32_t)id ) );
+		}
+		cc = FT_Get_Next_Char( face, cc, &glyphIndex );
+	}
+	if( cmap.empty() )
+	{
+		printf("warning: no glyphs found\n");
+		return -1;
+	}
+
+	//quantize coordinates to int16 with the finest power of two step that
+	//still fits the largest coordinate
+	float maxc = 0.0f;
+	for(int i=0;i<d.gpvec.size();i++)
+	{
+		maxc = std::max( maxc, (float)fabs( d.gpvec[i].x ) );
+		maxc = std::max( maxc, (float)fabs( d.gpvec[i].y ) );
+	}
+	float scale = 1.0f / 32768.0f;
+	while( maxc / scale > 32767.0f )
+		scale *= 2.0f;
+
+	//hashed cmap at most half full
+	uint32_t slots = 1;
+	while( slots < cmap.size() * 2 )
+		slots <<= 1;
+	std::vector<uint32_t> table( slots * 2, VGWRAP_FONTFILE_EMPTY_SLOT );
+	for(int i=0;i<cmap.size();i++)
+	{
+		uint32_t slot = vgwrap_fontfile_hash( cmap[i].first ) & (slots - 1);
+		while( table[slot * 2] != VGWRAP_FONTFILE_EMPTY_SLOT )
+			slot = (slot + 1) & (slots - 1);
+		table[slot * 2] = cmap[i].first;
+		table[slot * 2 + 1] = cmap[i].second;
+	}
+
+	std::vector<int32_t> advances( d.advances.size() );
+	for(int i=0;i<d.advances.size();i++)
+		advances[i] = (int32_t)(65536.0f*d.advances[i]);
+
+	std::vector<int16_t> points( d.gpvec.size() * 2 );
+	for(int i=0;i<d.gpvec.size();i++)
+	{
+		points[i*2] = (int16_t)lrintf( d.gpvec[i].x / scale );
+		points[i*2+1] = (int16_t)lrintf( d.gpvec[i].y / scale );
+	}
+
+	FILE* f = fopen(filename, "wb");
+	if(!f)
+	{
+		printf("couldn't open %s for writing\n", filename);
+		return -1;
+	}
+
+	uint32_t glyphCount = d.advances.size();
+	VGFontFileHeader h;
+	memset( &h, 0, sizeof(h) );
+	h.magic = VGWRAP_FONTFILE_MAGIC;
+	h.glyphCount = glyphCount;
+	h.pointScale = scale;
+	h.cmapSlots = slots;
+	h.instructionBytes = d.givec.size();
+	h.pointCount = d.gpvec.size();
+
+	uint32_t offset = sizeof(h);
+	h.instructionIndicesOffset = offset;	offset += glyphCount * 4;
+	h.instructionCountsOffset = offset;		offset += glyphCount * 4;
+	h.pointIndicesOffset = offset;			offset += glyphCount * 4;
+	h.advancesOffset = offset;				offset += glyphCount * 4;
+	h.cmapOffset = offset;					offset += slots * 8;
+	h.pointsOffset = offset;				offset += points.size() * 2;
+	offset = (offset + 3) & ~3u;
+	h.instructionsOffset = offset;			offset += d.givec.size();
+	h.fileSize = (offset + 3) & ~3u;
+
+	fwrite( &h, sizeof(h), 1, f );
+	fwrite( &d.givecindices[0], 4, glyphCount, f );
+	fwrite( &d.givecsizes[0], 4, glyphCount, f );
+	fwrite( &d.gpvecindices[0], 4, glyphCount, f );
+	fwrite( &advances[0], 4, glyphCount, f );
+	fwrite( &table[0], 4, table.size(), f );
+	if( points.size() )
+		fwrite( &points[0], 2, points.size(), f );
+	alignOutput( f, h.pointsOffset + points.size() * 2 );
+	fwrite( &d.givec[0], 1, d.givec.size(), f );
+	alignOutput( f, h.instructionsOffset + d.givec.size() );
+	fclose(f);
+
+	printf("%d glyphs, %d characters written (%u bytes)\n", glyphCount, (int)cmap.size(), h.fileSize);
+	return 0;
+}
+
 int main (int argc, char * const argv[])
 {
 	FT_Library library;
 	FT_Face face;
 
-	if(argc < 4)
+	bool binary = argc > 1 && strcmp( argv[1], "-b" ) == 0;
+	if(binary)
+	{
+		argv++;
+		argc--;
+	}
+	if(argc < (binary ? 3 : 4))
 	{
 		printf("usage: font2openvg input_font_file output.c prefix\n");
+		printf("       font2openvg -b input_font_file output.vgf\n");
 		exit(-1);
 	}
 
@@ -93,6 +344,14 @@ int main (int argc, char * const argv[])
               96,     /* horizontal device resolution    */
               96 );   /* vertical device resolution      */
 
+	if(binary)
+	{
+		int result = writeBinaryFont( face, argv[2] );
+		FT_Done_Face( face );
+		FT_Done_FreeType( library );
+		return result ? -1 : 0;
+	}
+
 	FILE* f = fopen(argv[2], "wt");
 	if(!f)
 	{
@@ -100,14 +359,13 @@ int main (int argc, char * const argv[])
 		exit(-1);
 	}
 
-	std::vector<int>		gpvecindices;
-	std::vector<int>		givecindices;
-	std::vector<int>		gpvecsizes;
-	std::vector<int>		givecsizes;
-	std::vector<Vector2>	gpvec;
-	std::vector<char>		givec;
-	std::vector<float>		gbbox;
-	std::vector<float>		advances;
+	GlyphData d;
+	std::vector<int>		&gpvecindices = d.gpvecindices;
+	std::vector<int>		&givecindices = d.givecindices;
+	std::vector<int>		&givecsizes = d.givecsizes;
+	std::vector<Vector2>	&gpvec = d.gpvec;
+	std::vector<char>		&givec = d.givec;
+	std::vector<float>		&advances = d.advances;
 
 	unsigned int characterMap[256];
 	int glyphs = 0;
@@ -120,119 +378,8 @@ int main (int argc, char * const argv[])
 
 		int glyphIndex = FT_Get_Char_Index( face, cc );
 
-		if( !FT_Load_Glyph( face, glyphIndex, FT_LOAD_NO_BITMAP | FT_LOAD_NO_HINTING | FT_LOAD_IGNORE_TRANSFORM ) )
+		if( appendGlyph( face, glyphIndex, d ) )
 		{
-			float advance = convFTFixed( face->glyph->advance.x );
-			if( cc == ' ' )
-			{	//space doesn't contain any data
-				gpvecindices.push_back( gpvec.size() );
-				givecindices.push_back( givec.size() );
-
-				gpvecsizes.push_back( 0 );
-				givecsizes.push_back( 0 );
-
-				gbbox.push_back(0);
-				gbbox.push_back(0);
-				gbbox.push_back(0);
-				gbbox.push_back(0);
-
-				advances.push_back(advance);
-
-				//write glyph index to character map
-				characterMap[cc] = glyphs++;
-				continue;
-			}
-
-			FT_Outline &outline = face->glyph->outline;
-			std::vector<Vector2>		pvec;
-			std::vector<unsigned char>	ivec;
-			float minx = 10000000.0f,miny = 100000000.0f,maxx = -10000000.0f,maxy = -10000000.0f;
-			int s = 0,e;
-			bool on;
-			Vector2 last,v,nv;
-			for(int con=0;con<outline.n_contours;++con)
-			{
-				int pnts = 1;
-				e = outline.contours[con]+1;
-				last = convFTVector(outline.points[s]);
-
-				//read the contour start point
-				ivec.push_back(2);
-				pvec.push_back(last);
-
-				int i=s+1;
-				while(i<=e)
-				{
-					int c = (i == e) ? s : i;
-					int n = (i == e-1) ? s : (i+1);
-					v = convFTVector(outline.points[c]);
-					on = isOn( outline.tags[c] );
-					if( on )
-					{	//line
-						++i;
-						ivec.push_back(4);
-						pvec.push_back(v);
-						pnts += 1;
-					}
-					else
-					{	//spline
-						if( isOn( outline.tags[n] ) )
-						{	//next on
-							nv = convFTVector( outline.points[n] );
-							i += 2;
-						}
-						else
-						{	//next off, use middle point
-							nv = (v + convFTVector( outline.points[n] )) * 0.5f;
-							++i;
-						}
-						ivec.push_back(10);
-						pvec.push_back(v);
-						pvec.push_back(nv);
-						pnts += 2;
-					}
-					last = nv;
-				}
-				ivec.push_back(0);
-				s = e;
-			}
-
-			for(int i=0;i<pvec.size();++i)
-			{
-				if( pvec[i].x < minx ) minx = pvec[i].x;
-				if( pvec[i].x > maxx ) maxx = pvec[i].x;
-				if( pvec[i].y < miny ) miny = pvec[i].y;
-				if( pvec[i].y > maxy ) maxy = pvec[i].y;
-			}
-			if(!pvec.size())
-			{
-				minx = 0.0f;
-				miny = 0.0f;
-				maxx = 0.0f;
-				maxy = 0.0f;
-			}
-
-			gpvecindices.push_back( gpvec.size() );
-			givecindices.push_back( givec.size() );
-
-			gpvecsizes.push_back( pvec.size() );
-			givecsizes.push_back( ivec.size() );
-
-			gbbox.push_back( minx );
-			gbbox.push_back( miny );
-			gbbox.push_back( maxx );
-			gbbox.push_back( maxy );
-			advances.push_back(advance);
-
-			int size;
-			size = gpvec.size();
-			gpvec.resize( size + pvec.size() );
-			memcpy( &(gpvec[size]), &(pvec[0]), pvec.size() * sizeof(Vector2) );
-
-			size = givec.size();
-			givec.resize( size + ivec.size() );
-			memcpy( &(givec[size]), &(ivec[0]), ivec.size() * sizeof(char) );
-
 			//write glyph index to character map
 			characterMap[cc] = glyphs++;
 		}
@@ -13,44 +13,101 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <dirent.h>
-#include <fnmatch.h>
+#include <time.h>
 
-#include "vgwrap.h"
+#include "pislides.h"
 
 int screenWidth, screenHeight;
 
+// slide timing.  A slide is fully visible for SLIDE_HOLD_MS between fades.
+#define SLIDE_FADE_MS 1000.0
+#define SLIDE_HOLD_MS 12000.0
+#define DISPLAY_REFRESH_MS (1000.0 / 60.0)
+
+// the first slide is picked from at least this many images, unless the
+// scan takes longer than STARTUP_WAIT_MS to find them
+#define STARTUP_HANDFUL 8
+#define STARTUP_WAIT_MS 1000.0
+
+// slides after the current one offered for decoding ahead.  The memory
+// governor decides how many are.
+#define LOOKAHEAD_SLIDES 4
+
+// slides after those read into the page cache together, in the order
+// they are on the disk
+#define PREFETCH_SLIDES 16
+
+// executor workers.  Two decode ahead at normal priority, which with the
+// main thread drawing leaves a core of a four core Pi for the rest; the
+// background ones only run when a core is idle.
+#define DISPLAY_WORKERS 2
+#define BACKGROUND_WORKERS 1
+
+// processes decoding images from a directory, one for each display worker
+// so decoding ahead isn't held up; 0 decodes in the slideshow itself
+#ifndef DECODER_PROCESSES
+#define DECODER_PROCESSES DISPLAY_WORKERS
+#endif
 
-typedef struct _CenteredScaledImage {
-  VGImage img;
-  VGfloat imageHeight;
-  VGfloat imageWidth;
-  // scaling ratios for each dimension, smallest indicates the dominant axis
-  // for scaling
-  VGfloat scaleX;
-  VGfloat scaleY;
+// images on each collage page, 2 to MAX_COLLAGE; 0 shows them one at a
+// time
+#ifndef COLLAGE
+#define COLLAGE 0
+#endif
+#if COLLAGE > MAX_COLLAGE
+#error COLLAGE is more than MAX_COLLAGE images a page
+#endif
 
-  // final scaling factor used in setting up the transform
-  VGfloat finalScale;
-  VGfloat offsetX;
-  VGfloat offsetY;
-} CenteredScaledImage;
+// a paused slideshow carries on by itself after this long
+#define PAUSE_TIMEOUT_MS (10 * 60 * 1000.0)
+
+// a rotation in which nothing could be shown is tried again after this
+// long, rather than at once
+#define EMPTY_ROTATION_WAIT_MS 10000.0
+
+// GPU memory allowed for slide images, in megabytes.  Two slides are
+// resident during a fade.
+#ifndef IMAGE_BUDGET_MB
+#define IMAGE_BUDGET_MB 64
+#endif
+
+// the images each rotation is made of, all of them unless PLAYLIST or a
+// "playlist" command picks out some by date
+#ifndef PLAYLIST
+#define PLAYLIST "all"
+#endif
+static Playlist playlist;
 
+// when startup or a reload began, until the first image is up
+static double firstImageWanted = 0;
 
+
+// LoadScaledImage returns NULL if the image couldn't be loaded
 CenteredScaledImage * LoadScaledImage(char * filename)
+{
+  TiledImage * img = createTiledImageFromJpeg(filename);
+  if (img == NULL) {
+    return NULL;
+  }
+  return MakeScaledImage(img);
+}
+
+// MakeScaledImage places an image on screen, scaled to fit and centered.
+// The image becomes owned.
+CenteredScaledImage * MakeScaledImage(TiledImage * img)
 {
   CenteredScaledImage * csv = (CenteredScaledImage *) malloc(sizeof(CenteredScaledImage));
-  
-  csv->img = createImageFromJpeg(filename);
+  csv->img = img;
+  csv->collage = NULL;
 
   // calculate transform to make the image appear scaled and centered
   // on screen
   VGfloat imageHeight, imageWidth;
   VGfloat screenWidthf = (VGfloat) screenWidth;
   VGfloat screenHeightf = (VGfloat) screenHeight;
-  imageWidth = (VGfloat) vgGetParameteri(csv->img, VG_IMAGE_WIDTH);
+  imageWidth = (VGfloat) csv->img->width;
   csv->imageWidth = imageWidth;
-  imageHeight = (VGfloat) vgGetParameteri(csv->img, VG_IMAGE_HEIGHT);
+  imageHeight = (VGfloat) csv->img->height;
   csv->imageHeight = imageHeight;
 
   VGfloat scaleX, scaleY;
@@ -85,10 +142,27 @@ CenteredScaledImage * LoadScaledImage(char * filename)
 
 void FreeScaledImage(CenteredScaledImage * csv)
 {
-  vgDestroyImage(csv->img);
+  if (csv->collage) {
+    FreeCollage(csv->collage);
+  }
+  else {
+    releaseTiledImage(csv->img);
+  }
   free(csv);
 }
 
+// DrawScaledImage draws the image, or collage, through the current image
+// transform
+void DrawScaledImage(CenteredScaledImage * csv, VGfloat opacity)
+{
+  if (csv->collage) {
+    DrawCollage(csv->collage, opacity);
+  }
+  else {
+    drawTiledImage(csv->img, opacity);
+  }
+}
+
 // Given an already initialized frame buffer, resets the image transform
 // and draws the image.
 void SetTransformAndDrawScaledImage(CenteredScaledImage * csv)
@@ -98,7 +172,7 @@ void SetTransformAndDrawScaledImage(CenteredScaledImage * csv)
   Translate(csv->offsetX, csv->offsetY);
   Scale(csv->finalScale, csv->finalScale);
 
-  vgDrawImage(csv->img);  
+  DrawScaledImage(csv, 1.0f);
 }
 
 
@@ -110,290 +184,455 @@ void render_image(char * filename)
   Background(0, 0, 0);
 
   CenteredScaledImage * csv = LoadScaledImage(filename);
-  vgSeti(VG_BLEND_MODE, VG_BLEND_SRC);
-  SetTransformAndDrawScaledImage(csv);
-  FreeScaledImage(csv);
+  if (csv) {
+    vgSeti(VG_BLEND_MODE, VG_BLEND_SRC);
+    SetTransformAndDrawScaledImage(csv);
+    FreeScaledImage(csv);
+  }
 
   End();
 }
 
 
-
-// Traverse a directory structure, depth first, marking each containing
-// folder's images together in case the slide show is to be sequential.
-//
-// Once we have a list of all images, we have a database which we can use
-// to display randomly and to also ensure that images are always displayed at
-// least once in a given rotation of the entire image set.
-//
-
-typedef struct _PhotoFileRecord {
-  char * relativeFilePath;
-  int directoryGroupIndex;
-} PhotoFileRecord;
-
-// The master store of photo file records
-PhotoFileRecord * fileRecords = NULL;
-int fileRecordCount = 0;
-
-// used during construction
-int fileRecordAllocated = 0;
-int currentDirectoryGroup;
-
-// an array of indexes into the photo file record which is the playback
-// order for random playback.  This array is populated once per cycle and
-// is always fileRecordCount in size.
-int * randomPlaybackOrderArray = NULL;
-
-
-void InitFileRecords()
+// transition to a loaded slide or collage page
+static void ShowPage(CenteredScaledImage * csv)
 {
-  int i;
-  if (fileRecords) {
-    // free all filepath strings
-    PhotoFileRecord * curRecord = fileRecords;
-    for (i = 0; i < fileRecordCount; i++) {
-      free(curRecord->relativeFilePath);
-      curRecord++;
-    }
-    free((void *) fileRecords);
-    fileRecords = NULL;
+  TransitionTo(csv);
+  if (firstImageWanted > 0) {
+    printf("startup: first image after %.1f ms\n", vgwrap_now_ms() - firstImageWanted);
+    firstImageWanted = 0;
   }
-  fileRecordCount = 0;
-  fileRecordAllocated = 0;
-  currentDirectoryGroup = 0;
+#ifdef CAPTURE_DIR
+  CaptureScreen();
+  PrintCaptureStats();
+#endif
+  PrintFrameStats();
+  PrintOverlayStats();
+  PrintImagePoolStats();
+  PrintTileStats();
+  PrintColorStats();
+  PrintMemoryStats();
+  PrintHistoryStats();
+  PrintSlideCacheStats();
+  PrintPrefetchStats();
+  PrintExecutorStats();
+  PrintDecoderStats();
+  PrintHttpStats();
+  PrintCollageStats();
+  PrintStageStats();
 }
 
-// Adds a new file record. relativeFilePath memory becomes owned.
-void AddFileRecord(char * relativeFilePath)
+// ShowSlide transitions to a new image.  Returns 0 if it couldn't be
+// loaded, leaving the previous slide up.
+int ShowSlide(char * filename)
 {
-#define FILE_RECORD_ARRAY_GROWTH 50
-  if (fileRecordCount == fileRecordAllocated) {
-    fileRecordAllocated += FILE_RECORD_ARRAY_GROWTH;
-    fileRecords = (PhotoFileRecord *) realloc(fileRecords, fileRecordAllocated * sizeof(PhotoFileRecord));
+  UpdateMemoryGovernor(vgwrap_now_ms());
+  CenteredScaledImage * csv = LoadSlide(filename);
+  if (csv == NULL) {
+    return 0;
   }
+  ShowPage(csv);
+  return 1;
+}
 
-  PhotoFileRecord * curRec = fileRecords + fileRecordCount;
-  fileRecordCount++;
-  curRec->relativeFilePath = relativeFilePath;
-  curRec->directoryGroupIndex = currentDirectoryGroup;
+// ShowCollage transitions to a page of count images.  Returns 0 if none
+// could be loaded, leaving the previous slide up.
+int ShowCollage(char ** paths, int count)
+{
+  UpdateMemoryGovernor(vgwrap_now_ms());
+  CenteredScaledImage * csv = LoadCollage(paths, count);
+  if (csv == NULL) {
+    return 0;
+  }
+  ShowPage(csv);
+  return 1;
 }
 
+// BrowseHistory holds the slide just shown, and steps back through the
+// slides shown before it and forward again for as long as the viewer
+// asks.  Those come from the history without decoding.  Returns
+// COMMAND_NONE to go on with a new slide, when the viewer asks for the
+// one after the newest or a slide's hold runs out, or the reload or quit
+// command that ended browsing.
+int BrowseHistory()
+{
+  int back = 0, command = HoldSlide();
+  while (command == COMMAND_PREVIOUS || (command == COMMAND_NEXT && back > 0)) {
+    int step = command == COMMAND_PREVIOUS ? 1 : -1;
+    CenteredScaledImage * csv = HistorySlide(back + step);
+    if (csv) {
+      back += step;
+      TransitionTo(csv);
+    }
+    command = HoldSlide();
+  }
+  return command == COMMAND_NEXT ? COMMAND_NONE : command;
+}
 
-// meant to be called recursively.  relativeDirPath should *not* end in a
-// trailing slash.
-void ScanImageDirectory(char * relativeDirPath)
+// DisplayImagesAsDiscovered shows images while the catalog scan is still
+// running.  Returns COMMAND_NONE once it has finished, with the images it
+// found that weren't shown left as the playback order, or the reload or
+// quit command that stopped it.
+int DisplayImagesAsDiscovered(double startupBegin)
 {
-  // array accumulator for paths of subdirs that need to be processed
-  // recursively.  We process them sequentially at the end so as to avoid
-  // messing up the current directory count and to keep the entries in the file
-  // record array grouped together.
-  char ** childDirsArray = NULL;
-  int childDirsAllocated = 0;
-  int childDirsCount = 0;
-
-  DIR * dirp = opendir(relativeDirPath);
-  struct dirent * dp;
-  while ((dp = readdir(dirp)) != NULL) {
-    if (dp->d_type == DT_REG || dp->d_type == DT_DIR) {
-      // construct the path for this entry on the heap to save away
-      int dirPathLength = strlen(relativeDirPath);
-      char * entryPath = malloc(dirPathLength + strlen(dp->d_name) + 2);
-      strcpy(entryPath, relativeDirPath);
-      *(entryPath + dirPathLength) = '/';
-      strcpy(entryPath + dirPathLength + 1, dp->d_name);
-
-      if (dp->d_type == DT_DIR) {
-	if (strcmp(dp->d_name, ".") == 0 ||
-	    strcmp(dp->d_name, "..") == 0) {
-	  free(entryPath);
-	}
-	else {
-	  if (childDirsAllocated == childDirsCount) {
-	    childDirsAllocated += 16;
-	    childDirsArray = realloc(childDirsArray, childDirsAllocated * sizeof(char *));
-	  }
-	  *(childDirsArray + childDirsCount) = entryPath;
-	  childDirsCount++;
-	}
-      }
-      else {
-	// we only process files that have JPG or jpg extensions.  Ignore
-	// all other files.
-	if (fnmatch("*.JPG", dp->d_name, 0) == 0 ||
-	    fnmatch("*.jpg", dp->d_name, 0) == 0) {
-	  AddFileRecord(entryPath);
-	}
-	else {
-	  free(entryPath);
+  char * filename;
+  int i, j, k, count, prefetchAt = 0;
+  char * picked[LOOKAHEAD_SLIDES + PREFETCH_SLIDES], * upcoming[LOOKAHEAD_SLIDES];
+  firstImageWanted = startupBegin;
+  // nothing is picked yet
+  SetSlideLookahead(NULL, 0);
+  for (i = 0; (filename = NextDiscoveredImage(STARTUP_HANDFUL, STARTUP_WAIT_MS)) != NULL; i++) {
+    // pick the images after this one now, so they can be read and decoded
+    // ahead like a rotation's, a window beyond the lookahead at a time
+    count = UpcomingDiscoveredImages(picked, LOOKAHEAD_SLIDES + PREFETCH_SLIDES);
+    if (i >= prefetchAt && count > LOOKAHEAD_SLIDES) {
+      PrefetchImages(picked + LOOKAHEAD_SLIDES, count - LOOKAHEAD_SLIDES);
+      prefetchAt = i + count - LOOKAHEAD_SLIDES;
+    }
+
+    int command = COMMAND_NONE, played = 0;
+    if (IsClipPath(filename)) {
+      command = PlayClip(filename, SLIDE_HOLD_MS, PAUSE_TIMEOUT_MS, &played);
+    }
+    else if (ShowSlide(filename)) {
+      for (j = 0, k = 0; j < LOOKAHEAD_SLIDES && k < count; k++) {
+	if (!IsClipPath(picked[k])) {
+	  upcoming[j++] = picked[k];
 	}
       }
+      SetSlideLookahead(upcoming, j);
+      command = BrowseHistory();
+      played = 1;
     }
-  }
-  closedir(dirp);
-  currentDirectoryGroup++;
-
-  // now process the subdirs
-  if (childDirsArray) {
-    char ** currentChildDirPath = childDirsArray;
-    int i;
-    for (i = 0; i < childDirsCount; i++) {
-      ScanImageDirectory(*currentChildDirPath);
-      free((void *) *currentChildDirPath);
-      currentChildDirPath++;
+    if (!played) {
+      // nothing was shown to wait on, so see to the events here
+      command = PollCommand();
+    }
+    if (command == COMMAND_RELOAD || command == COMMAND_QUIT) {
+      return command;
+    }
+    if (command == COMMAND_PLAYLIST) {
+      // the catalog isn't dated yet, so the playlist starts once the scan
+      // finishes
+      RequestedPlaylist(&playlist);
     }
-    free((void *)childDirsArray);
   }
+  return COMMAND_NONE;
 }
 
-
-void InitRandomPlaybackOrder()
+// after a rotation in which nothing could be shown, wait
+// EMPTY_ROTATION_WAIT_MS before the next rather than spin through the
+// catalog.  Returns COMMAND_NONE then, or the reload, quit or playlist
+// command that came first.
+static int WaitAfterEmptyRotation()
 {
-  if (randomPlaybackOrderArray) {
-    free(randomPlaybackOrderArray);
+  double until = vgwrap_now_ms() + EMPTY_ROTATION_WAIT_MS;
+  int command;
+  printf("No image could be shown, trying again in %.0f s\n", EMPTY_ROTATION_WAIT_MS / 1000.0);
+  while ((command = WaitForEvents(until)) != COMMAND_NONE && command != COMMAND_RELOAD &&
+	 command != COMMAND_QUIT && command != COMMAND_PLAYLIST) {
+  }
+  if (command == COMMAND_PLAYLIST) {
+    RequestedPlaylist(&playlist);
   }
+  return command;
+}
 
-  randomPlaybackOrderArray = malloc(sizeof(int) * fileRecordCount);
+// DisplayImagesInPlaybackOrder shows one rotation.  Returns COMMAND_NONE
+// at its end, or the reload, quit or playlist command that stopped it.
+// Going back and forth through the history leaves the place in the
+// rotation alone, so it carries on without repeating or skipping images.
+int DisplayImagesInPlaybackOrder()
+{
+  int i, j, k, shown = 0;
+  PhotoFileRecord * selectedPhoto;
+  int imageIndexToDisplay;
+  char * upcoming[LOOKAHEAD_SLIDES], * prefetch[PREFETCH_SLIDES];
+  for (i = 0; i < playbackOrderCount; i++) {
+    imageIndexToDisplay = *(randomPlaybackOrderArray + i);
+    selectedPhoto = fileRecords + imageIndexToDisplay;
 
-  int i;
-  int * curIndex = randomPlaybackOrderArray;
-  for (i = 0; i < fileRecordCount; i++) {
-    *curIndex = i;
-    curIndex++;
-  }
+    // every PREFETCH_SLIDES slides, read the next window of them beyond
+    // the lookahead
+    if (i % PREFETCH_SLIDES == 0) {
+      for (j = 0; j < PREFETCH_SLIDES && i + 1 + LOOKAHEAD_SLIDES + j < playbackOrderCount; j++) {
+	prefetch[j] = fileRecords[randomPlaybackOrderArray[i + 1 + LOOKAHEAD_SLIDES + j]].relativeFilePath;
+      }
+      PrefetchImages(prefetch, j);
+    }
 
-  // implementation of the Durstenfeld version of the Fisher-Yates shuffle
-  for (i = fileRecordCount - 1; i > 0; i--) {
-    // pick random element // 0 <= k <= i
-    int k = rand() % (i + 1);
-    int temp = randomPlaybackOrderArray[k];
-    randomPlaybackOrderArray[k] = randomPlaybackOrderArray[i];
-    randomPlaybackOrderArray[i] = temp;
+    int command = COMMAND_NONE, played = 0;
+    if (IsClipPath(selectedPhoto->relativeFilePath)) {
+      command = PlayClip(selectedPhoto->relativeFilePath, SLIDE_HOLD_MS, PAUSE_TIMEOUT_MS, &played);
+    }
+    else if (ShowSlide(selectedPhoto->relativeFilePath)) {
+      // decode the next few slides while this one is up, clips decode as
+      // they play
+      for (j = 0, k = i + 1; j < LOOKAHEAD_SLIDES && k < playbackOrderCount; k++) {
+	char * path = fileRecords[randomPlaybackOrderArray[k]].relativeFilePath;
+	if (!IsClipPath(path)) {
+	  upcoming[j++] = path;
+	}
+      }
+      SetSlideLookahead(upcoming, j);
+      command = BrowseHistory();
+      played = 1;
+    }
+    if (!played) {
+      command = PollCommand();
+    }
+    shown += played;
+    if (command == COMMAND_PLAYLIST) {
+      RequestedPlaylist(&playlist);
+      return command;
+    }
+    if (command == COMMAND_RELOAD || command == COMMAND_QUIT) {
+      return command;
+    }
   }
+  return shown > 0 ? COMMAND_NONE : WaitAfterEmptyRotation();
+}
 
-#ifdef BOGUS_WAY
-  // array that contains the indexes of unused photos.  This array is
-  // always kept compacted and is how we select the next index for the
-  // playback array, to avoid having to spin the random generator multiple
-  // times to find an unallocated entry.
-  int unusedArraySize = fileRecordCount;
-  int * unusedPhotoIndexes = malloc(sizeof(int) * fileRecordCount);
-
-  int selectedItem;
-  int i, j;
-  int * curIndex = unusedPhotoIndexes;
-  for (i = 0; i < fileRecordCount; i++) {
-    *curIndex = i;
-    curIndex++;
-  }
-  
-  curIndex = randomPlaybackOrderArray;
-  for (i = 0; i < fileRecordCount; i++) {
-    // select a random item from the unused array, then compact the array
-    selectedItem = rand() % unusedArraySize;
-    *curIndex++ = *(unusedPhotoIndexes + selectedItem);
-    
-    for (j = selectedItem; j < unusedArraySize - 1; j++) {
-      *(unusedPhotoIndexes + j) = *(unusedPhotoIndexes + j + 1);
+// the images for a collage page, from position *at in the rotation up to
+// the next clip, which plays on its own.  Moves *at past them and returns
+// how many.
+static int CollectCollagePage(int * at, char ** page)
+{
+  int count = 0;
+  while (count < COLLAGE && *at < playbackOrderCount) {
+    char * path = fileRecords[randomPlaybackOrderArray[*at]].relativeFilePath;
+    if (IsClipPath(path)) {
+      break;
     }
-    unusedArraySize--;
+    page[count++] = path;
+    (*at)++;
   }
-
-  free(unusedPhotoIndexes);
-#endif
-
+  return count;
 }
 
-
-#if 0
-
-void PrintRandomPlaybackOrder()
+// DisplayCollagesInPlaybackOrder shows one rotation COLLAGE images a
+// page, decoding each page's images while the one before is up.  Pages
+// aren't kept in the history, so previous is ignored.  Returns like
+// DisplayImagesInPlaybackOrder.
+int DisplayCollagesInPlaybackOrder()
 {
-  printf("Random playback order for %d files:\n", fileRecordCount);
-  int i;
-  int * curIndex = randomPlaybackOrderArray;
-  for (i = 0; i < fileRecordCount; i++) {
-    printf("%d: %d\n", i, *curIndex++);
+  char * page[MAX_COLLAGE], * next[MAX_COLLAGE];
+  int i = 0, shown = 0;
+  while (i < playbackOrderCount) {
+    int command = COMMAND_NONE, played = 0;
+    char * path = fileRecords[randomPlaybackOrderArray[i]].relativeFilePath;
+    if (IsClipPath(path)) {
+      command = PlayClip(path, SLIDE_HOLD_MS, PAUSE_TIMEOUT_MS, &played);
+      i++;
+    }
+    else {
+      int count = CollectCollagePage(&i, page), after = i;
+      int nextCount = CollectCollagePage(&after, next);
+      if (ShowCollage(page, count)) {
+	if (nextCount > 0) {
+	  PrepareCollage(next, nextCount);
+	}
+	while ((command = HoldSlide()) == COMMAND_PREVIOUS) {
+	}
+	played = 1;
+      }
+    }
+    if (!played) {
+      command = PollCommand();
+    }
+    shown += played;
+    if (command == COMMAND_PLAYLIST) {
+      RequestedPlaylist(&playlist);
+      return command;
+    }
+    if (command == COMMAND_RELOAD || command == COMMAND_QUIT) {
+      return command;
+    }
   }
-  printf("\n");
+  return shown > 0 ? COMMAND_NONE : WaitAfterEmptyRotation();
 }
 
-
-void PrintFileRecords()
+// InitPlaylistPlaybackOrder shuffles the images in the playlist into the
+// next rotation, or every image if it has none
+void InitPlaylistPlaybackOrder()
 {
-  PhotoFileRecord * fileRec = fileRecords;
-  int i;
-
-  for (i = 0; i < fileRecordCount; i++) {
-    printf("%d: %s %d\n", i, fileRec->relativeFilePath, fileRec->directoryGroupIndex);
-    fileRec++;
+  int * records;
+  if (playlist.kind == PLAYLIST_ALL) {
+    InitRandomPlaybackOrder();
+    return;
+  }
+  double started = vgwrap_now_ms();
+  WaitForPhotoDates();
+  int count = SelectPlaylist(&playlist, &records);
+  if (count == 0) {
+    printf("No images in the playlist, showing them all\n");
+    InitRandomPlaybackOrder();
+    return;
   }
+  InitSelectedPlaybackOrder(records, count);
+  printf("playlist: %d of %d images in %.2f ms\n", count, fileRecordCount, vgwrap_now_ms() - started);
 }
 
-#endif
-
-#ifdef RAW_TERMINAL
 
-// wait for a specific character 
-void waituntil(int endchar) {
-    int key;
-
-    for (;;) {
-        key = getchar();
-        if (key == endchar || key == '\n') {
-            break;
-        }
-    }
-}
+#ifdef SHOW_CLOCK
 
-#endif
+// Clock overlay in the bottom right corner, redrawn only when the
+// displayed minute changes
+#define CLOCK_WIDTH 180
+#define CLOCK_HEIGHT 64
+#define CLOCK_MARGIN 24
 
+static char clockText[16];
 
-void DisplayImagesInPlaybackOrder()
+static int RefreshClock(void * context, double now)
 {
-  int i;
-  PhotoFileRecord * selectedPhoto;
-  int imageIndexToDisplay;
-  for (i = 0; i < fileRecordCount; i++) {
-    imageIndexToDisplay = *(randomPlaybackOrderArray + i);
-    selectedPhoto = fileRecords + imageIndexToDisplay;
-    render_image(selectedPhoto->relativeFilePath);
-    sleep(12);
+  char text[16];
+  time_t t = time(NULL);
+  strftime(text, sizeof(text), "%H:%M", localtime(&t));
+  if (strcmp(text, clockText) == 0) {
+    return 0;
   }
+  strcpy(clockText, text);
+  return 1;
 }
 
-
-void IntSignalHandler(int sig, siginfo_t *siginfo, void * context)
+static void DrawClock(void * context, VGint x, VGint y, VGint width, VGint height)
 {
-#ifdef RAW_TERMINAL
-  restoreterm();
-#endif
-  vgwrap_finish();
-  exit(0);
+  StrokeWidth(0);
+  Fill(0, 0, 0, 0.5);
+  Roundrect(x, y, width, height, 16, 16);
+  Fill(255, 255, 255, 1);
+  TextMid(x + width / 2.0f, y + height / 4.0f, clockText, SansTypeface, height / 2);
 }
 
+#endif
+
 
 int main(int argc, char ** argv)
 {
+  // started again as a decoder process
+  if (argc > 2 && strcmp(argv[1], DECODER_ARG) == 0) {
+#ifdef RGB565_IMAGES
+    SetRgb565Images(1);
+#endif
+    return RunDecoderProcess(atoi(argv[2]));
+  }
+
   srand(time(NULL));
 
-  InitFileRecords();
-  ScanImageDirectory("images");
+  // a directory tree, or the URL of a manifest listing the images
+  char * imagesLocation = argc > 1 ? argv[1] : "images";
 
-#ifdef RAW_TERMINAL
-  saveterm();
-  rawterm();
+  // before any thread starts, so they all leave signals to the loop
+#ifndef CONTROL_SOCKET
+#define CONTROL_SOCKET NULL
 #endif
-  vgwrap_init(&screenWidth, &screenHeight, 1);
+  if (InitEventLoop(CONTROL_SOCKET) != 0) {
+    return 1;
+  }
+  if (ParsePlaylist(PLAYLIST, &playlist) != 0) {
+    printf("Failed to read playlist '%s'\n", PLAYLIST);
+    return 1;
+  }
 
-  while (1) {
-    InitRandomPlaybackOrder();
-    DisplayImagesInPlaybackOrder();
+  // the scan runs while the display comes up, and slides start as soon
+  // as a few images are known
+  double startupBegin = vgwrap_now_ms();
+  InitExecutor(DISPLAY_WORKERS, BACKGROUND_WORKERS);
+  if (StartDecoderProcesses(DECODER_PROCESSES) != 0) {
+    printf("Decoding images without decoder processes\n");
   }
+  InitFileRecords();
+  StartCatalogScan(imagesLocation);
 
-#ifdef RAW_TERMINAL
-  restoreterm();
+  vgwrap_init(&screenWidth, &screenHeight, 1);
+  printf("startup: display init %.1f ms\n", vgwrap_now_ms() - startupBegin);
+
+  TransitionSettings transitionSettings;
+  transitionSettings.fadeMs = SLIDE_FADE_MS;
+  transitionSettings.holdMs = SLIDE_HOLD_MS;
+#ifdef KEN_BURNS
+  transitionSettings.kenBurns = 1;
+#else
+  transitionSettings.kenBurns = 0;
+#endif
+  transitionSettings.kenBurnsZoom = 0.10f;
+  transitionSettings.kenBurnsPan = 0.04f;
+  transitionSettings.refreshMs = DISPLAY_REFRESH_MS;
+  transitionSettings.pauseTimeoutMs = PAUSE_TIMEOUT_MS;
+  InitTransitions(&transitionSettings);
+  SetImageBudget((size_t) IMAGE_BUDGET_MB * 1024 * 1024);
+#ifdef RGB565_IMAGES
+  SetRgb565Images(1);
+  // a slide decodes to a screen sized RGB565 raster at most
+  InitMemoryGovernor((size_t) screenWidth * screenHeight * 2);
+#else
+  // a slide decodes to a screen sized RGBA raster at most
+  InitMemoryGovernor((size_t) screenWidth * screenHeight * 4);
+#endif
+  RegisterMemoryShedder(IdleImageBytes, TrimImagePool);
+  RegisterMemoryShedder(SlideCacheBytes, ShedSlideCache);
+  RegisterMemoryShedder(CompressedSlideBytes, ShedCompressedSlides);
+  InitSlideHistory(screenWidth, screenHeight);
+
+#if defined(STATS_FILE) || defined(STATS_SOCKET)
+#ifndef STATS_FILE
+#define STATS_FILE NULL
+#endif
+#ifndef STATS_SOCKET
+#define STATS_SOCKET NULL
+#endif
+  InitStats(STATS_FILE, STATS_SOCKET, 10000.0);
+#endif
+
+#ifdef CAPTURE_DIR
+  // one capture per slide is plenty for remote monitoring
+  InitCapture(CAPTURE_DIR, CAPTURE_PNG, 5000.0);
+#endif
+
+#ifdef SHOW_CLOCK
+  RefreshClock(NULL, 0);
+  AddOverlay(screenWidth - CLOCK_WIDTH - CLOCK_MARGIN, CLOCK_MARGIN,
+	     CLOCK_WIDTH, CLOCK_HEIGHT, DrawClock, RefreshClock, 1000.0, NULL);
 #endif
+
+  int command = DisplayImagesAsDiscovered(startupBegin);
+  // the first rotation finishes with the images the scan found that
+  // weren't shown while it ran, unless a playlist picks out fewer
+  int firstRotation = 1;
+  while (command != COMMAND_QUIT) {
+    if (command == COMMAND_RELOAD) {
+      StopCatalogScan();
+      InitFileRecords();
+      StartCatalogScan(imagesLocation);
+      command = DisplayImagesAsDiscovered(vgwrap_now_ms());
+      firstRotation = 1;
+      continue;
+    }
+    if (fileRecordCount == 0) {
+      // nothing to show until the images are rescanned
+      printf("No images found\n");
+      while ((command = WaitForEvents(-1.0)) != COMMAND_RELOAD && command != COMMAND_QUIT) {
+      }
+      continue;
+    }
+    if (!firstRotation || playbackOrderCount == 0 || playlist.kind != PLAYLIST_ALL) {
+      InitPlaylistPlaybackOrder();
+    }
+    firstRotation = 0;
+    command = COLLAGE > 1 ? DisplayCollagesInPlaybackOrder() : DisplayImagesInPlaybackOrder();
+    PrintEventStats();
+  }
+
+  StopCatalogScan();
+  FinishSlideHistory();
+  FinishSlideCache();
+  FinishCollages();
+  FinishPrefetch();
+  FinishExecutor();
+  StopDecoderProcesses();
+  FinishTransitions();
+  FinishEventLoop();
   vgwrap_finish();
 
   return 0;
@@ -0,0 +1,304 @@
+// Shared declarations for the pislides app modules.  The GPU wrapper API
+// is in vgwrap.h.
+
+#include <time.h>
+#include <sys/types.h>
+
+#include "vgwrap.h"
+
+extern int screenWidth, screenHeight;
+
+
+typedef struct _CenteredScaledImage {
+  TiledImage * img;
+  struct _Collage * collage;	// drawn instead of img, if set
+  VGfloat imageHeight;
+  VGfloat imageWidth;
+  // scaling ratios for each dimension, smallest indicates the dominant axis
+  // for scaling
+  VGfloat scaleX;
+  VGfloat scaleY;
+
+  // final scaling factor used in setting up the transform
+  VGfloat finalScale;
+  VGfloat offsetX;
+  VGfloat offsetY;
+} CenteredScaledImage;
+
+extern CenteredScaledImage * LoadScaledImage(char * filename);
+extern CenteredScaledImage * MakeScaledImage(TiledImage * img);
+extern void FreeScaledImage(CenteredScaledImage * csv);
+extern void SetTransformAndDrawScaledImage(CenteredScaledImage * csv);
+extern void DrawScaledImage(CenteredScaledImage * csv, VGfloat opacity);
+
+
+// Catalog (pislides_catalog.c)
+
+typedef struct _PhotoFileRecord {
+  char * relativeFilePath;
+  int directoryGroupIndex;
+  time_t takenAt;		// local time as if UTC, 0 if not known
+} PhotoFileRecord;
+
+extern PhotoFileRecord * fileRecords;
+extern int fileRecordCount;
+extern int * randomPlaybackOrderArray;
+extern int playbackOrderCount;
+
+extern void InitFileRecords();
+extern void AddFileRecord(char * relativeFilePath);
+extern void ScanImageDirectory(char * relativeDirPath);
+extern void InitRandomPlaybackOrder();
+extern void InitSelectedPlaybackOrder(int * records, int count);
+extern void StartCatalogScan(char * root);
+extern char * NextDiscoveredImage(int handful, double waitMs);
+extern int UpcomingDiscoveredImages(char ** paths, int max);
+extern void StopCatalogScan();
+extern void WaitForPhotoDates();
+
+
+// Date index (pislides_dates.c)
+
+enum {
+  PLAYLIST_ALL,
+  PLAYLIST_DATES,
+  PLAYLIST_ON_THIS_DAY
+};
+
+typedef struct _Playlist {
+  int kind;
+  time_t from, to;		// PLAYLIST_DATES, from up to but not including to
+  int days;			// PLAYLIST_ON_THIS_DAY, days either side of today
+} Playlist;
+
+extern time_t ReadPhotoDate(const char * path, int * fromExif);
+extern void IndexPhotoDates(volatile int * cancelled);
+extern int ParsePlaylist(const char * spec, Playlist * playlist);
+extern int SelectPlaylist(const Playlist * playlist, int ** records);
+
+
+// Executor (pislides_executor.c)
+
+enum {
+  LANE_DISPLAY,			// decoding the next slides
+  LANE_BACKGROUND,		// anything that can wait, at idle priority
+  LANE_COUNT
+};
+
+enum { TASK_IDLE, TASK_QUEUED, TASK_RUNNING, TASK_FINISHED };
+
+typedef struct _Task {
+  void (*run)(struct _Task * task);
+  void * context;
+  volatile int cancelled;	// run should return early once this is set
+  // the executor's
+  int state;
+  int lane;
+  double queuedAt;
+  struct _Task * next;
+} Task;
+
+typedef struct _ExecutorStats {
+  int workers, queued, running, peakQueued;
+  long submitted, completed, cancelled;
+  double maxWaitMs;		// longest a task was queued
+  double utilisation;		// fraction of the workers' time busy
+} ExecutorStats;
+
+extern void InitExecutor(int displayWorkers, int backgroundWorkers);
+extern void SubmitTask(Task * task, int lane);
+extern int UnqueueTask(Task * task);
+extern void CancelTask(Task * task);
+extern int TaskFinished(Task * task);
+extern void WaitTask(Task * task);
+extern int ExecutorWorkers(int lane);
+extern void GetExecutorStats(int lane, ExecutorStats * stats);
+extern void PrintExecutorStats();
+extern void FinishExecutor();
+
+
+// Image sources (pislides_source.c, pislides_http.c)
+
+extern void ScanImageSource(char * location);
+extern VGubyte * DecodeImage(const char * path, unsigned maxWidth, unsigned maxHeight,
+			     unsigned * width, unsigned * height, VGImageFormat * format);
+extern void FreeDecodedImage(VGubyte * pixels);
+extern int IsHttpLocation(const char * location);
+extern void ScanHttpManifest(char * url);
+extern VGubyte * DecodeHttpImage(const char * url, unsigned maxWidth, unsigned maxHeight,
+				 unsigned * width, unsigned * height, VGImageFormat * format);
+extern void PrintHttpStats();
+
+
+// Decoder processes (pislides_decoder.c)
+
+// the argument a decoder process is started with, before its socket
+#define DECODER_ARG "--decoder"
+
+extern int RunDecoderProcess(int socket);
+extern int StartDecoderProcesses(int count);
+extern VGubyte * DecodeInDecoderProcess(const char * path, unsigned maxWidth, unsigned maxHeight,
+					unsigned * width, unsigned * height, VGImageFormat * format);
+extern int FreeDecoderRaster(VGubyte * pixels);
+extern void PrintDecoderStats();
+extern void StopDecoderProcesses();
+
+
+// Slide history and lookahead (pislides_history.c)
+
+extern void InitSlideHistory(unsigned width, unsigned height);
+extern void SetSlideLookahead(char ** paths, int count);
+extern CenteredScaledImage * LoadSlide(char * filename);
+extern CenteredScaledImage * HistorySlide(int back);
+extern size_t SlideCacheBytes();
+extern void ShedSlideCache(size_t bytes);
+extern void PrintHistoryStats();
+extern void FinishSlideHistory();
+
+
+// Compressed slide cache (pislides_slidecache.c)
+
+extern void SetSlideCacheBudget(size_t bytes);
+extern void CacheSlide(const char * path, unsigned maxWidth, unsigned maxHeight,
+		       VGubyte * raster, VGImageFormat format, unsigned width, unsigned height);
+extern int IsSlideCached(const char * path, unsigned maxWidth, unsigned maxHeight);
+extern VGubyte * LoadCachedSlide(const char * path, unsigned maxWidth, unsigned maxHeight,
+				 unsigned * width, unsigned * height, VGImageFormat * format);
+extern size_t CompressedSlideBytes();
+extern void ShedCompressedSlides(size_t bytes);
+extern void PrintSlideCacheStats();
+extern void FinishSlideCache();
+
+
+// Prefetch (pislides_prefetch.c)
+
+typedef struct _DiskStats {
+  long reads;			// completed
+  long merged;			// merged into others before they were issued
+  long sectors;			// 512 byte sectors read
+  double readMs;		// spent reading
+} DiskStats;
+
+extern int ReadDiskStats(dev_t device, DiskStats * stats);
+extern void PrefetchFiles(char ** paths, int count, int diskOrder);
+extern void PrefetchImages(char ** paths, int count);
+extern void PrintPrefetchStats();
+extern void FinishPrefetch();
+
+
+// Clips (pislides_clip.c)
+
+extern int IsClipPath(const char * path);
+extern int PlayClip(char * path, double holdMs, double pauseTimeoutMs, int * played);
+
+
+// Collages (pislides_collage.c)
+
+#define MAX_COLLAGE 16
+
+typedef struct _Collage Collage;
+
+extern void PrepareCollage(char ** paths, int count);
+extern CenteredScaledImage * LoadCollage(char ** paths, int count);
+extern void DrawCollage(Collage * collage, VGfloat opacity);
+extern void FreeCollage(Collage * collage);
+extern void PrintCollageStats();
+extern void FinishCollages();
+
+
+// Transitions (pislides_transition.c)
+
+typedef struct _TransitionSettings {
+  double fadeMs;		// cross-fade length, 0 to cut
+  double holdMs;		// time a slide stays up between fades
+  int kenBurns;			// animate pan and zoom while a slide is up
+  VGfloat kenBurnsZoom;		// zoom range as a fraction, e.g. 0.08
+  VGfloat kenBurnsPan;		// pan range as a fraction of the screen
+  double refreshMs;		// display refresh period
+  double pauseTimeoutMs;	// resume after a pause this long, 0 never
+} TransitionSettings;
+
+extern void InitTransitions(const TransitionSettings * settings);
+extern void TransitionTo(CenteredScaledImage * incoming);
+extern int HoldSlide();
+extern void FinishTransitions();
+extern void PrintFrameStats();
+
+
+// Events (pislides_events.c)
+
+enum {
+  COMMAND_NONE,
+  COMMAND_NEXT,
+  COMMAND_PREVIOUS,
+  COMMAND_PAUSE,
+  COMMAND_RESUME,
+  COMMAND_TOGGLE_PAUSE,
+  COMMAND_RELOAD,
+  COMMAND_QUIT,
+  COMMAND_PLAYLIST
+};
+
+// runs on the event loop's thread when a decode has completed
+typedef void (*DecodeCompleteFunc)();
+
+extern int InitEventLoop(const char * controlSocket);
+extern int WaitForEvents(double until);
+extern int PollCommand();
+extern void UntakeCommand(int command);
+extern void RequestedPlaylist(Playlist * playlist);
+extern void SetDecodeCompleteHandler(DecodeCompleteFunc handler);
+extern void SignalDecodeComplete();
+extern void PrintEventStats();
+extern void FinishEventLoop();
+
+
+// Overlays (pislides_overlay.c)
+
+// draws an overlay inside its region, transforms are reset beforehand
+typedef void (*OverlayDrawFunc)(void * context, VGint x, VGint y, VGint width, VGint height);
+// returns nonzero when the overlay's content changed
+typedef int (*OverlayRefreshFunc)(void * context, double now);
+
+extern int AddOverlay(VGint x, VGint y, VGint width, VGint height,
+		      OverlayDrawFunc draw, OverlayRefreshFunc refresh,
+		      double intervalMs, void * context);
+extern void RemoveOverlay(int id);
+extern void InvalidateOverlay(int id);
+extern void MoveOverlay(int id, VGint x, VGint y, VGint width, VGint height);
+extern void ComposeOverlays();
+extern double NextOverlayRefresh(double limit);
+extern long UpdateOverlays(double now);
+extern void PrintOverlayStats();
+
+
+// Memory governor (pislides_memory.c)
+
+typedef struct _MemoryLimits {
+  size_t cacheBytes;		// decoded and compressed caches, in all
+  int decodeAhead;		// slides to decode ahead of the one shown
+  int decodeThreads;		// display lane tasks to run at once
+} MemoryLimits;
+
+typedef struct _MemoryStatus {
+  size_t total;			// memory we may use, the tighter of RAM and cgroup
+  size_t available;		// of which free or reclaimable now
+  size_t cached;		// held by registered caches
+  int cgroupLimited;
+  size_t cgroupLimit;
+  size_t cgroupRoom;
+  double stall;			// PSI some avg10, percent
+  int underPressure;
+} MemoryStatus;
+
+// returns the bytes a cache holds
+typedef size_t (*MemoryUsageFunc)();
+// brings a cache down to at most the given bytes
+typedef void (*MemoryShedFunc)(size_t bytes);
+
+extern void InitMemoryGovernor(size_t bytesPerSlide);
+extern void RegisterMemoryShedder(MemoryUsageFunc usage, MemoryShedFunc shed);
+extern double NextMemoryPoll(double limit);
+extern void UpdateMemoryGovernor(double now);
+extern const MemoryLimits * GetMemoryLimits();
+extern void PrintMemoryStats();
@@ -0,0 +1,451 @@
+// Traverse a directory structure, depth first, marking each containing
+// folder's images together in case the slide show is to be sequential.
+//
+// Once we have a list of all images, we have a database which we can use
+// to display randomly and to also ensure that images are always displayed at
+// least once in a given rotation of the entire image set.
+//
+// At startup the scan runs on a thread of its own, so slides can be shown
+// while it is still going.  Until it finishes, slides are drawn at random
+// from a reservoir of the images found so far and not yet shown.  Once it
+// finishes the rest of the reservoir, shuffled, becomes the playback
+// order, finishing the first rotation the usual way, and the full
+// shuffled rotations follow.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "pislides.h"
+
+
+// The master store of photo file records
+PhotoFileRecord * fileRecords = NULL;
+int fileRecordCount = 0;
+
+// used during construction
+int fileRecordAllocated = 0;
+int currentDirectoryGroup;
+
+// an array of indexes into the photo file record which is the playback
+// order for random playback.  This array is populated once per cycle and
+// is playbackOrderCount in size, fileRecordCount unless a playlist picked
+// out fewer.
+int * randomPlaybackOrderArray = NULL;
+int playbackOrderCount = 0;
+
+// background scan state.  fileRecords may move while the scan runs, so
+// it is only touched with catalogLock held until the scan is joined.
+static pthread_mutex_t catalogLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t catalogGrew = PTHREAD_COND_INITIALIZER;
+static pthread_t scanThread;
+static int scanRunning = 0;
+static int scanFinished = 0;
+static volatile int scanCancelled = 0;
+static double scanStarted;
+
+// dating the records once the scan has found them all, at idle priority
+static Task datingTask;
+
+// indexes of records found by the background scan and not yet shown
+static int * reservoir = NULL;
+static int reservoirCount = 0;
+static int reservoirAllocated = 0;
+// the first chosenCount of the reservoir were picked ahead by
+// UpcomingDiscoveredImages, in the order they are to be shown
+static int chosenCount = 0;
+static int startupSlidesShown = 0;
+
+static void Shuffle(int * order, int count);
+
+
+void InitFileRecords()
+{
+  int i;
+  if (fileRecords) {
+    // free all filepath strings
+    PhotoFileRecord * curRecord = fileRecords;
+    for (i = 0; i < fileRecordCount; i++) {
+      free(curRecord->relativeFilePath);
+      curRecord++;
+    }
+    free((void *) fileRecords);
+    fileRecords = NULL;
+  }
+  fileRecordCount = 0;
+  fileRecordAllocated = 0;
+  currentDirectoryGroup = 0;
+}
+
+// Adds a new file record. relativeFilePath memory becomes owned.
+void AddFileRecord(char * relativeFilePath)
+{
+  pthread_mutex_lock(&catalogLock);
+  // grow geometrically, large trees would spend the scan copying
+  // otherwise
+  if (fileRecordCount == fileRecordAllocated) {
+    fileRecordAllocated = fileRecordAllocated ? fileRecordAllocated * 2 : 64;
+    fileRecords = (PhotoFileRecord *) realloc(fileRecords, fileRecordAllocated * sizeof(PhotoFileRecord));
+  }
+
+  PhotoFileRecord * curRec = fileRecords + fileRecordCount;
+  curRec->relativeFilePath = relativeFilePath;
+  curRec->directoryGroupIndex = currentDirectoryGroup;
+  curRec->takenAt = 0;
+
+  if (scanRunning) {
+    if (reservoirCount == reservoirAllocated) {
+      reservoirAllocated = reservoirAllocated ? reservoirAllocated * 2 : 64;
+      reservoir = realloc(reservoir, reservoirAllocated * sizeof(int));
+    }
+    reservoir[reservoirCount++] = fileRecordCount;
+    pthread_cond_signal(&catalogGrew);
+  }
+  fileRecordCount++;
+  pthread_mutex_unlock(&catalogLock);
+}
+
+
+// meant to be called recursively.  relativeDirPath should *not* end in a
+// trailing slash.
+void ScanImageDirectory(char * relativeDirPath)
+{
+  // array accumulator for paths of subdirs that need to be processed
+  // recursively.  We process them sequentially at the end so as to avoid
+  // messing up the current directory count and to keep the entries in the file
+  // record array grouped together.
+  char ** childDirsArray = NULL;
+  int childDirsAllocated = 0;
+  int childDirsCount = 0;
+
+  DIR * dirp = opendir(relativeDirPath);
+  struct dirent * dp;
+  if (dirp == NULL) {
+    printf("Failed opening directory '%s'\n", relativeDirPath);
+    return;
+  }
+  while (!scanCancelled && (dp = readdir(dirp)) != NULL) {
+    if (dp->d_type == DT_REG || dp->d_type == DT_DIR) {
+      // construct the path for this entry on the heap to save away
+      int dirPathLength = strlen(relativeDirPath);
+      char * entryPath = malloc(dirPathLength + strlen(dp->d_name) + 2);
+      strcpy(entryPath, relativeDirPath);
+      *(entryPath + dirPathLength) = '/';
+      strcpy(entryPath + dirPathLength + 1, dp->d_name);
+
+      if (dp->d_type == DT_DIR) {
+	if (strcmp(dp->d_name, ".") == 0 ||
+	    strcmp(dp->d_name, "..") == 0) {
+	  free(entryPath);
+	}
+	else if (fnmatch("*.seq", dp->d_name, 0) == 0 ||
+		 fnmatch("*.SEQ", dp->d_name, 0) == 0) {
+	  // a clip's frames, played as one entry
+	  AddFileRecord(entryPath);
+	}
+	else {
+	  if (childDirsAllocated == childDirsCount) {
+	    childDirsAllocated += 16;
+	    childDirsArray = realloc(childDirsArray, childDirsAllocated * sizeof(char *));
+	  }
+	  *(childDirsArray + childDirsCount) = entryPath;
+	  childDirsCount++;
+	}
+      }
+      else {
+	// we only process files that have JPG or jpg extensions, and AVI
+	// clips.  Ignore all other files.
+	if (fnmatch("*.JPG", dp->d_name, 0) == 0 ||
+	    fnmatch("*.jpg", dp->d_name, 0) == 0 ||
+	    fnmatch("*.AVI", dp->d_name, 0) == 0 ||
+	    fnmatch("*.avi", dp->d_name, 0) == 0) {
+	  AddFileRecord(entryPath);
+	}
+	else {
+	  free(entryPath);
+	}
+      }
+    }
+  }
+  closedir(dirp);
+  currentDirectoryGroup++;
+
+  // now process the subdirs
+  if (childDirsArray) {
+    char ** currentChildDirPath = childDirsArray;
+    int i;
+    for (i = 0; i < childDirsCount; i++) {
+      if (!scanCancelled) {
+	ScanImageDirectory(*currentChildDirPath);
+      }
+      free((void *) *currentChildDirPath);
+      currentChildDirPath++;
+    }
+    free((void *)childDirsArray);
+  }
+}
+
+
+static void DateCatalog(Task * task)
+{
+  IndexPhotoDates(&task->cancelled);
+}
+
+static void * ScanMain(void * root)
+{
+  ScanImageSource((char *) root);
+  // the records don't move any more, so they can be dated without the lock
+  if (!scanCancelled) {
+    datingTask.run = DateCatalog;
+    SubmitTask(&datingTask, LANE_BACKGROUND);
+  }
+  pthread_mutex_lock(&catalogLock);
+  scanFinished = 1;
+  pthread_cond_broadcast(&catalogGrew);
+  printf("catalog: scanned %d images in %.1f ms\n", fileRecordCount, vgwrap_now_ms() - scanStarted);
+  pthread_mutex_unlock(&catalogLock);
+  return NULL;
+}
+
+// StartCatalogScan scans the images source at root on a background
+// thread.  Take images with NextDiscoveredImage until it returns NULL,
+// after which the catalog is complete.
+void StartCatalogScan(char * root)
+{
+  scanStarted = vgwrap_now_ms();
+  scanFinished = 0;
+  scanRunning = 1;
+  chosenCount = 0;
+  startupSlidesShown = 0;
+  if (pthread_create(&scanThread, NULL, ScanMain, root) != 0) {
+    // scan here instead, the reservoir is then the whole catalog
+    ScanMain(root);
+    pthread_mutex_lock(&catalogLock);
+    scanRunning = 0;
+    pthread_mutex_unlock(&catalogLock);
+  }
+}
+
+// NextDiscoveredImage returns the path of a random image found by the
+// background scan that hasn't been shown yet.  The first call waits for
+// handful images to be found, or for waitMs once at least one has been.
+// Later calls wait only if every image found so far has been shown.
+// Images picked ahead by UpcomingDiscoveredImages come first.  Returns
+// NULL once the scan has finished, with the images it found that weren't
+// returned left as the playback order, those picked ahead first and the
+// rest shuffled.
+char * NextDiscoveredImage(int handful, double waitMs)
+{
+  char * path = NULL;
+  double deadline = vgwrap_now_ms() + waitMs;
+  int finished, joinScan;
+
+  pthread_mutex_lock(&catalogLock);
+  for (;;) {
+    int wanted = startupSlidesShown == 0 && vgwrap_now_ms() < deadline ? handful : 1;
+    if (reservoirCount >= wanted || scanFinished) {
+      break;
+    }
+    if (wanted > 1 && reservoirCount > 0) {
+      // wait for more, but no longer than the deadline
+      struct timeval now;
+      struct timespec until;
+      double waitLeft = deadline - vgwrap_now_ms();
+      gettimeofday(&now, NULL);
+      long long ns = (long long) now.tv_usec * 1000 + (long long) (waitLeft * 1000000.0);
+      until.tv_sec = now.tv_sec + ns / 1000000000;
+      until.tv_nsec = ns % 1000000000;
+      pthread_cond_timedwait(&catalogGrew, &catalogLock, &until);
+    }
+    else {
+      pthread_cond_wait(&catalogGrew, &catalogLock);
+    }
+  }
+  finished = scanFinished;
+  joinScan = scanRunning;
+  if (!finished) {
+    if (chosenCount > 0) {
+      path = fileRecords[reservoir[0]].relativeFilePath;
+      memmove(reservoir, reservoir + 1, (reservoirCount - 1) * sizeof(int));
+      reservoirCount--;
+      chosenCount--;
+    }
+    else {
+      int pick = rand() % reservoirCount;
+      path = fileRecords[reservoir[pick]].relativeFilePath;
+      reservoir[pick] = reservoir[--reservoirCount];
+    }
+    startupSlidesShown++;
+  }
+  pthread_mutex_unlock(&catalogLock);
+
+  if (finished) {
+    if (joinScan) {
+      pthread_join(scanThread, NULL);
+    }
+    scanRunning = 0;
+    Shuffle(reservoir + chosenCount, reservoirCount - chosenCount);
+    free(randomPlaybackOrderArray);
+    randomPlaybackOrderArray = reservoir;
+    playbackOrderCount = reservoirCount;
+    reservoir = NULL;
+    reservoirCount = reservoirAllocated = chosenCount = 0;
+  }
+  return path;
+}
+
+// UpcomingDiscoveredImages fills paths with up to max of the images
+// NextDiscoveredImage will return next, picking them now if they haven't
+// been, so they can be decoded ahead.  Returns how many; fewer once the
+// images found so far run out.
+int UpcomingDiscoveredImages(char ** paths, int max)
+{
+  int i;
+  pthread_mutex_lock(&catalogLock);
+  while (chosenCount < max && chosenCount < reservoirCount) {
+    int pick = chosenCount + rand() % (reservoirCount - chosenCount);
+    int temp = reservoir[pick];
+    reservoir[pick] = reservoir[chosenCount];
+    reservoir[chosenCount++] = temp;
+  }
+  for (i = 0; i < max && i < chosenCount; i++) {
+    paths[i] = fileRecords[reservoir[i]].relativeFilePath;
+  }
+  pthread_mutex_unlock(&catalogLock);
+  return i;
+}
+
+// StopCatalogScan abandons a background scan, and the dating of its
+// records, and the images it found that weren't shown yet.  The records
+// found so far are kept.
+void StopCatalogScan()
+{
+  pthread_mutex_lock(&catalogLock);
+  int running = scanRunning;
+  scanCancelled = 1;
+  pthread_mutex_unlock(&catalogLock);
+  if (running) {
+    pthread_join(scanThread, NULL);
+  }
+  CancelTask(&datingTask);
+  WaitTask(&datingTask);
+  scanRunning = 0;
+  scanCancelled = 0;
+  free(reservoir);
+  reservoir = NULL;
+  reservoirCount = reservoirAllocated = chosenCount = 0;
+}
+
+// WaitForPhotoDates waits until the records the last scan found are dated
+void WaitForPhotoDates()
+{
+  WaitTask(&datingTask);
+}
+
+
+// implementation of the Durstenfeld version of the Fisher-Yates shuffle
+static void Shuffle(int * order, int count)
+{
+  int i;
+  for (i = count - 1; i > 0; i--) {
+    // pick random element // 0 <= k <= i
+    int k = rand() % (i + 1);
+    int temp = order[k];
+    order[k] = order[i];
+    order[i] = temp;
+  }
+}
+
+void InitRandomPlaybackOrder()
+{
+  if (randomPlaybackOrderArray) {
+    free(randomPlaybackOrderArray);
+  }
+
+  randomPlaybackOrderArray = malloc(sizeof(int) * fileRecordCount);
+  playbackOrderCount = fileRecordCount;
+
+  int i;
+  int * curIndex = randomPlaybackOrderArray;
+  for (i = 0; i < fileRecordCount; i++) {
+    *curIndex = i;
+    curIndex++;
+  }
+
+  Shuffle(randomPlaybackOrderArray, playbackOrderCount);
+
+#ifdef BOGUS_WAY
+  // array that contains the indexes of unused photos.  This array is
+  // always kept compacted and is how we select the next index for the
+  // playback array, to avoid having to spin the random generator multiple
+  // times to find an unallocated entry.
+  int unusedArraySize = fileRecordCount;
+  int * unusedPhotoIndexes = malloc(sizeof(int) * fileRecordCount);
+
+  int selectedItem;
+  int i, j;
+  int * curIndex = unusedPhotoIndexes;
+  for (i = 0; i < fileRecordCount; i++) {
+    *curIndex = i;
+    curIndex++;
+  }
+  
+  curIndex = randomPlaybackOrderArray;
+  for (i = 0; i < fileRecordCount; i++) {
+    // select a random item from the unused array, then compact the array
+    selectedItem = rand() % unusedArraySize;
+    *curIndex++ = *(unusedPhotoIndexes + selectedItem);
+    
+    for (j = selectedItem; j < unusedArraySize - 1; j++) {
+      *(unusedPhotoIndexes + j) = *(unusedPhotoIndexes + j + 1);
+    }
+    unusedArraySize--;
+  }
+
+  free(unusedPhotoIndexes);
+#endif
+
+}
+
+// InitSelectedPlaybackOrder plays count records, such as a playlist from
+// SelectPlaylist, in random order.  The records array becomes owned.
+void InitSelectedPlaybackOrder(int * records, int count)
+{
+  free(randomPlaybackOrderArray);
+  randomPlaybackOrderArray = records;
+  playbackOrderCount = count;
+  Shuffle(randomPlaybackOrderArray, playbackOrderCount);
+}
+
+
+#if 0
+
+void PrintRandomPlaybackOrder()
+{
+  printf("Random playback order for %d files:\n", fileRecordCount);
+  int i;
+  int * curIndex = randomPlaybackOrderArray;
+  for (i = 0; i < fileRecordCount; i++) {
+    printf("%d: %d\n", i, *curIndex++);
+  }
+  printf("\n");
+}
+
+
+void PrintFileRecords()
+{
+  PhotoFileRecord * fileRec = fileRecords;
+  int i;
+
+  for (i = 0; i < fileRecordCount; i++) {
+    printf("%d: %s %d\n", i, fileRec->relativeFilePath, fileRec->directoryGroupIndex);
+    fileRec++;
+  }
+}
+
+#endif
@@ -0,0 +1,505 @@
+// Clips: motion JPEG videos and image sequences, played at their frame
+// rate in place of a slide.
+//
+// A clip is an .avi file of JPEG frames, as cameras and
+// "ffmpeg -c:v mjpeg" write them, or a directory named *.seq holding
+// numbered JPEG frames, played in name order at SEQUENCE_FPS.  A clip
+// shorter than a slide's hold is looped until it has been up as long.
+//
+// Frames are decoded ahead on the executor's display workers, one per
+// worker at a time, and only as far down as the JPEG decoder's DCT
+// scaling goes while still covering the screen; the GPU scales the rest
+// of the way when it draws.  Two images are kept for the whole clip and
+// each frame is uploaded into the one not drawn last, with
+// vgImageSubData, so the upload never waits for the GPU to finish with
+// the frame before.  Every frame is due at a time set by the frame rate.
+// When decoding falls behind, the newest frame that is due is shown and
+// the ones before it are dropped, and frames already due are never
+// started, so a clip keeps to its clock instead of slowing down.
+//
+// Frames are decoded in pislides itself rather than the decoder
+// processes, which would cost a round trip for every frame.
+//
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+#include "pislides.h"
+
+#ifndef SEQUENCE_FPS
+#define SEQUENCE_FPS 25
+#endif
+
+// frames in the pipeline, decoding or waiting to be shown, at most
+#define MAX_CLIP_QUEUE 8
+
+// LISTs nest three deep in an AVI, movi/rec at most
+#define MAX_AVI_DEPTH 4
+
+typedef struct _Clip {
+  char * path;
+  int fd;			// the AVI, -1 for a sequence
+  int count;
+  int allocated;
+  off_t * offsets;		// where the AVI's frames are
+  unsigned * sizes;
+  char ** names;		// the sequence's frames
+  char video[2];		// the AVI's video stream number
+  int streams;
+  double frameMs;
+} Clip;
+
+// a frame in the pipeline
+typedef struct _ClipFrame {
+  Task decode;
+  Clip * clip;
+  long number;			// counting on through loops, -1 if free
+  VGubyte * pixels;
+  unsigned width, height;
+  VGImageFormat format;
+  double decodeMs;
+} ClipFrame;
+
+typedef struct _MemoryReader {
+  const VGubyte * data;
+  size_t size;
+  size_t at;
+} MemoryReader;
+
+// decoding cost of the clip playing
+static long framesDecoded;
+static double decodeMs;
+
+
+static unsigned Le32(const unsigned char * p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (unsigned) p[3] << 24;
+}
+
+static int AddAviFrame(Clip * clip, off_t offset, unsigned size)
+{
+  if (clip->count == clip->allocated) {
+    int allocated = clip->allocated ? clip->allocated * 2 : 256;
+    off_t * offsets = realloc(clip->offsets, allocated * sizeof(off_t));
+    if (offsets == NULL) {
+      return -1;
+    }
+    clip->offsets = offsets;
+    unsigned * sizes = realloc(clip->sizes, allocated * sizeof(unsigned));
+    if (sizes == NULL) {
+      return -1;
+    }
+    clip->sizes = sizes;
+    clip->allocated = allocated;
+  }
+  clip->offsets[clip->count] = offset;
+  clip->sizes[clip->count] = size;
+  clip->count++;
+  return 0;
+}
+
+// walk the chunks from at to end, descending into LISTs, for the frame
+// period, the video stream and its frames.  Frames of zero bytes, which
+// repeat the one before, are left out, and idx1 isn't needed.
+static int ScanAviChunks(Clip * clip, off_t at, off_t end, int depth)
+{
+  unsigned char header[8], fields[28];
+  while (at + 8 <= end && pread(clip->fd, header, 8, at) == 8) {
+    unsigned size = Le32(header + 4);
+    off_t data = at + 8;
+    if (memcmp(header, "LIST", 4) == 0 || memcmp(header, "RIFF", 4) == 0) {
+      // the AVIX RIFFs of a large file carry on the movi of the first
+      if (depth < MAX_AVI_DEPTH && ScanAviChunks(clip, data + 4, data + size, depth + 1) != 0) {
+	return -1;
+      }
+    }
+    else if (memcmp(header, "avih", 4) == 0) {
+      if (pread(clip->fd, fields, 4, data) == 4 && Le32(fields) > 0) {
+	clip->frameMs = Le32(fields) / 1000.0;
+      }
+    }
+    else if (memcmp(header, "strh", 4) == 0) {
+      // the first video stream, its rate is the more exact
+      if (pread(clip->fd, fields, 28, data) == 28 && memcmp(fields, "vids", 4) == 0 &&
+	  clip->video[0] == 0) {
+	clip->video[0] = '0' + clip->streams / 10;
+	clip->video[1] = '0' + clip->streams % 10;
+	if (Le32(fields + 20) > 0 && Le32(fields + 24) > 0) {
+	  clip->frameMs = 1000.0 * Le32(fields + 20) / Le32(fields + 24);
+	}
+      }
+      clip->streams++;
+    }
+    else if (memcmp(header, clip->video[0] ? clip->video : "00", 2) == 0 && header[2] == 'd' &&
+	     (header[3] == 'c' || header[3] == 'b') && size > 0) {
+      if (AddAviFrame(clip, data, size) != 0) {
+	return -1;
+      }
+    }
+    at = data + size + (size & 1);
+  }
+  return 0;
+}
+
+static int OpenAvi(Clip * clip)
+{
+  unsigned char header[12];
+  struct stat st;
+  clip->fd = open(clip->path, O_RDONLY | O_CLOEXEC);
+  if (clip->fd < 0 || fstat(clip->fd, &st) != 0 || pread(clip->fd, header, 12, 0) != 12 ||
+      memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "AVI ", 4) != 0) {
+    return -1;
+  }
+  return ScanAviChunks(clip, 0, st.st_size, 0);
+}
+
+static int IsFrameFile(const struct dirent * entry)
+{
+  return fnmatch("*.jpg", entry->d_name, FNM_CASEFOLD) == 0;
+}
+
+static int OpenSequence(Clip * clip)
+{
+  struct dirent ** entries;
+  int i, count = scandir(clip->path, &entries, IsFrameFile, versionsort);
+  if (count < 0) {
+    return -1;
+  }
+  clip->names = malloc((count ? count : 1) * sizeof(char *));
+  for (i = 0; i < count; i++) {
+    if (clip->names && asprintf(clip->names + clip->count, "%s/%s", clip->path, entries[i]->d_name) > 0) {
+      clip->count++;
+    }
+    free(entries[i]);
+  }
+  free(entries);
+  clip->frameMs = 1000.0 / SEQUENCE_FPS;
+  return clip->names ? 0 : -1;
+}
+
+static void CloseClip(Clip * clip)
+{
+  int i;
+  if (clip->fd >= 0) {
+    close(clip->fd);
+  }
+  for (i = 0; clip->names && i < clip->count; i++) {
+    free(clip->names[i]);
+  }
+  free(clip->names);
+  free(clip->offsets);
+  free(clip->sizes);
+}
+
+static int OpenClip(char * path, Clip * clip)
+{
+  memset(clip, 0, sizeof(Clip));
+  clip->path = path;
+  clip->fd = -1;
+  clip->frameMs = 1000.0 / SEQUENCE_FPS;
+  if ((fnmatch("*.seq", path, FNM_CASEFOLD) == 0 ? OpenSequence(clip) : OpenAvi(clip)) != 0 ||
+      clip->count == 0) {
+    printf("Failed opening clip '%s'\n", path);
+    CloseClip(clip);
+    return -1;
+  }
+  return 0;
+}
+
+// read frame index's compressed data.  Returns NULL on failure.
+static VGubyte * ReadFrame(Clip * clip, int index, size_t * size)
+{
+  struct stat st;
+  VGubyte * data;
+  if (clip->fd >= 0) {
+    *size = clip->sizes[index];
+    data = malloc(*size);
+    if (data && pread(clip->fd, data, *size, clip->offsets[index]) != (ssize_t) *size) {
+      free(data);
+      data = NULL;
+    }
+    return data;
+  }
+  int fd = open(clip->names[index], O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  data = NULL;
+  if (fstat(fd, &st) == 0 && st.st_size > 0 && (data = malloc(st.st_size)) != NULL) {
+    *size = st.st_size;
+    if (read(fd, data, *size) != (ssize_t) *size) {
+      free(data);
+      data = NULL;
+    }
+  }
+  close(fd);
+  return data;
+}
+
+static long ReadMemory(void * context, void * buf, size_t size)
+{
+  MemoryReader * reader = context;
+  if (size > reader->size - reader->at) {
+    size = reader->size - reader->at;
+  }
+  memcpy(buf, reader->data + reader->at, size);
+  reader->at += size;
+  return size;
+}
+
+static void DecodeFrame(Task * task)
+{
+  ClipFrame * frame = task->context;
+  Clip * clip = frame->clip;
+  MemoryReader reader;
+  double started = vgwrap_now_ms();
+  frame->pixels = NULL;
+  reader.data = ReadFrame(clip, frame->number % clip->count, &reader.size);
+  if (reader.data == NULL) {
+    printf("Failed reading frame %ld of '%s'\n", frame->number % clip->count, clip->path);
+    return;
+  }
+  reader.at = 0;
+  SetDecodeCancel(&task->cancelled);
+  frame->pixels = decodeJpegStreamScaled(ReadMemory, &reader, clip->path, screenWidth, screenHeight,
+					 &frame->width, &frame->height, &frame->format);
+  SetDecodeCancel(NULL);
+  free((void *) reader.data);
+  frame->decodeMs = vgwrap_now_ms() - started;
+}
+
+static void SubmitFrame(ClipFrame * frame, long number)
+{
+  frame->number = number;
+  frame->pixels = NULL;
+  SubmitTask(&frame->decode, LANE_DISPLAY);
+}
+
+// free a frame slot once its decode has finished
+static void ReleaseFrame(ClipFrame * frame)
+{
+  if (frame->pixels) {
+    framesDecoded++;
+    decodeMs += frame->decodeMs;
+    free(frame->pixels);
+    frame->pixels = NULL;
+  }
+  frame->number = -1;
+}
+
+// upload a frame into *image and present it, making the image again if
+// the frame's size differs.  Returns 0 if no image could be made for it.
+static int ShowFrame(CenteredScaledImage ** image, ClipFrame * frame)
+{
+  CenteredScaledImage * csv = *image;
+  if (csv && (csv->img->width != (int) frame->width || csv->img->height != (int) frame->height ||
+	      csv->img->format != frame->format)) {
+    FreeScaledImage(csv);
+    csv = *image = NULL;
+  }
+  if (csv == NULL) {
+    TiledImage * img = createTiledImage(frame->format, frame->width, frame->height);
+    if (img == NULL) {
+      printf("Failed creating a %ux%u image for clip frames\n", frame->width, frame->height);
+      return 0;
+    }
+    csv = *image = MakeScaledImage(img);
+  }
+
+  uint64_t stage = StageBegin();
+  tiledImageSubData(csv->img, frame->pixels, ImageBytes(frame->format, frame->width, 1), 0, frame->height);
+  StageEnd(STAGE_UPLOAD, stage);
+  stage = StageBegin();
+  StartClear(screenWidth, screenHeight, 0, 0, 0);
+  SetTransformAndDrawScaledImage(csv);
+  ComposeOverlays();
+  StageEnd(STAGE_DRAW, stage);
+  End();
+  return 1;
+}
+
+// keep the frame up while paused.  Returns the command that ended the
+// pause, COMMAND_RESUME if it timed out.
+static int HoldFrame(double pauseTimeoutMs)
+{
+  double pausedAt = vgwrap_now_ms();
+  for (;;) {
+    double now = vgwrap_now_ms();
+    double until = pauseTimeoutMs > 0.0 ? pausedAt + pauseTimeoutMs : now + 3600000.0;
+    int command = WaitForEvents(NextMemoryPoll(NextOverlayRefresh(until)));
+    now = vgwrap_now_ms();
+    UpdateOverlays(now);
+    UpdateMemoryGovernor(now);
+    if (command == COMMAND_NONE && pauseTimeoutMs > 0.0 && now >= until) {
+      return COMMAND_RESUME;
+    }
+    if (command != COMMAND_NONE && command != COMMAND_PAUSE) {
+      return command == COMMAND_TOGGLE_PAUSE ? COMMAND_RESUME : command;
+    }
+  }
+}
+
+
+// IsClipPath tells whether a catalog entry is a clip rather than an image
+int IsClipPath(const char * path)
+{
+  return fnmatch("*.avi", path, FNM_CASEFOLD) == 0 || fnmatch("*.seq", path, FNM_CASEFOLD) == 0;
+}
+
+// PlayClip plays the clip at path in place of a slide, looping it until
+// it has been up for holdMs, and lets go of the slide that was up, so the
+// next one cuts in.  Pausing holds the frame on screen, for
+// pauseTimeoutMs at most, and previous is ignored as clips aren't kept in
+// the history.  *played is set if the clip could be opened.  Returns
+// COMMAND_NONE when the clip is over, skipped or can't be played, or the
+// reload, quit or playlist command that stopped it.
+int PlayClip(char * path, double holdMs, double pauseTimeoutMs, int * played)
+{
+  Clip clip;
+  ClipFrame frames[MAX_CLIP_QUEUE];
+  CenteredScaledImage * images[2] = { NULL, NULL };
+  int queue, i, back = 0, command = COMMAND_NONE;
+  long total, submitted = 0, next = 0, shown = 0, dropped = 0;
+  double start, firstShown = 0.0, lastShown = 0.0, pausedMs = 0.0;
+
+  *played = OpenClip(path, &clip) == 0;
+  if (!*played) {
+    return COMMAND_NONE;
+  }
+  double loopMs = clip.count * clip.frameMs;
+  long loops = (long) (holdMs / loopMs);
+  if (loops < 1 || loops * loopMs < holdMs) {
+    loops++;
+  }
+  total = clip.count * loops;
+  framesDecoded = 0;
+  decodeMs = 0.0;
+
+  // a frame decoding on every worker and two more waiting their turn
+  queue = ExecutorWorkers(LANE_DISPLAY) + 2;
+  if (queue > MAX_CLIP_QUEUE) {
+    queue = MAX_CLIP_QUEUE;
+  }
+  memset(frames, 0, sizeof(frames));
+  for (i = 0; i < queue; i++) {
+    frames[i].decode.run = DecodeFrame;
+    frames[i].decode.context = frames + i;
+    frames[i].clip = &clip;
+    frames[i].number = -1;
+  }
+  FinishTransitions();
+
+  // the clock starts with the first frame
+  for (i = 0; i < queue && submitted < total; i++) {
+    SubmitFrame(frames + i, submitted++);
+  }
+  WaitTask(&frames[0].decode);
+  start = vgwrap_now_ms();
+
+  while (next < total) {
+    double now = vgwrap_now_ms();
+    long due = (long) ((now - start) / clip.frameMs);
+    ClipFrame * best = NULL, * early = NULL, * decoding = NULL;
+    for (i = 0; i < queue; i++) {
+      ClipFrame * frame = frames + i;
+      if (frame->number < 0) {
+	// frames already due would only be dropped when they're done
+	if (submitted < due) {
+	  submitted = due;
+	}
+	if (submitted >= total) {
+	  continue;
+	}
+	SubmitFrame(frame, submitted++);
+      }
+      if (!TaskFinished(&frame->decode)) {
+	if (decoding == NULL || frame->number < decoding->number) {
+	  decoding = frame;
+	}
+      }
+      else if (frame->pixels == NULL || frame->number < next) {
+	// failed, or overtaken by a later frame
+	ReleaseFrame(frame);
+      }
+      else if (frame->number <= due) {
+	if (best == NULL || frame->number > best->number) {
+	  best = frame;
+	}
+      }
+      else if (early == NULL || frame->number < early->number) {
+	early = frame;
+      }
+    }
+
+    if (best) {
+      dropped += best->number - next;
+      next = best->number + 1;
+      if (ShowFrame(images + back, best)) {
+	lastShown = vgwrap_now_ms();
+	if (shown++ == 0) {
+	  firstShown = lastShown;
+	}
+	back ^= 1;
+      }
+      ReleaseFrame(best);
+      UpdateMemoryGovernor(vgwrap_now_ms());
+      command = PollCommand();
+    }
+    else if (early) {
+      command = WaitForEvents(NextMemoryPoll(start + early->number * clip.frameMs));
+      UpdateMemoryGovernor(vgwrap_now_ms());
+    }
+    else if (decoding) {
+      WaitTask(&decoding->decode);
+      command = PollCommand();
+    }
+    else {
+      // nothing more is coming
+      dropped += total - next;
+      break;
+    }
+
+    if (command == COMMAND_PAUSE || command == COMMAND_TOGGLE_PAUSE) {
+      double pausedAt = vgwrap_now_ms();
+      command = HoldFrame(pauseTimeoutMs);
+      // carry on from the frame it stopped at
+      start += vgwrap_now_ms() - pausedAt;
+      pausedMs += vgwrap_now_ms() - pausedAt;
+    }
+    if (command == COMMAND_RESUME || command == COMMAND_PREVIOUS) {
+      command = COMMAND_NONE;
+    }
+    if (command != COMMAND_NONE) {
+      break;
+    }
+  }
+
+  for (i = 0; i < queue; i++) {
+    if (frames[i].number >= 0) {
+      CancelTask(&frames[i].decode);
+      WaitTask(&frames[i].decode);
+      ReleaseFrame(frames + i);
+    }
+  }
+  for (i = 0; i < 2; i++) {
+    if (images[i]) {
+      FreeScaledImage(images[i]);
+    }
+  }
+
+  double playedMs = lastShown - firstShown - pausedMs;
+  printf("clip: '%s' %d frames x %ld at %.1f fps, %ld shown, %.1f fps sustained, %ld dropped, decode %.1f ms mean on %d workers\n",
+	 path, clip.count, loops, 1000.0 / clip.frameMs, shown,
+	 playedMs > 0.0 ? (shown - 1) * 1000.0 / playedMs : 0.0, dropped,
+	 framesDecoded ? decodeMs / framesDecoded : 0.0, ExecutorWorkers(LANE_DISPLAY));
+  CloseClip(&clip);
+  return command == COMMAND_NEXT ? COMMAND_NONE : command;
+}
@@ -0,0 +1,289 @@
+// Collages: pages of several images at once, in a grid, for portrait
+// photos on a landscape screen.
+//
+// A page of 2 to MAX_COLLAGE images is laid out in the grid that shows a
+// portrait photo largest.  Each image is decoded to fit its cell, which
+// the decoder does mostly by DCT scaling, so a 16-up page decodes about
+// as much as one full screen slide.  The decoded images are packed into
+// an image atlas, one screen sized page from the image pool in the usual
+// case, and the whole collage is drawn in one pass, each image a child of
+// the atlas drawn with its own translation.  The next page's images are
+// decoded while the current page is up.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pislides.h"
+
+// pixels between cells
+#define COLLAGE_GAP 8
+
+// the grid is chosen for images this wide for their height
+#define COLLAGE_ASPECT (2.0 / 3.0)
+
+typedef struct _CollageCell {
+  Task decode;
+  char * path;
+  unsigned maxWidth, maxHeight;
+  VGubyte * pixels;
+  unsigned width, height;
+  VGImageFormat format;
+  VGfloat x, y;			// the cell's bottom left, then the image's
+  VGImage image;		// in one of the collage's atlases
+} CollageCell;
+
+struct _Collage {
+  int count;
+  CollageCell cells[MAX_COLLAGE];
+  ImageAtlas * atlases[3];	// one for each raster format
+  int atlasCount;
+};
+
+// the next page, decoding while the current one is up
+static Collage * pending;
+
+static long pagesBuilt, pagesPrepared, cellsShown;
+static double buildMs;
+
+
+// the grid for count cells that shows a COLLAGE_ASPECT image largest
+static void ChooseGrid(int count, int * columns, int * rows)
+{
+  double best = 0.0;
+  int c;
+  for (c = 1; c <= count; c++) {
+    int r = (count + c - 1) / c;
+    double width = (double) screenWidth / c - COLLAGE_GAP;
+    double height = (double) screenHeight / r - COLLAGE_GAP;
+    double fitted = width < height * COLLAGE_ASPECT ? width : height * COLLAGE_ASPECT;
+    if (fitted > best) {
+      best = fitted;
+      *columns = c;
+      *rows = r;
+    }
+  }
+}
+
+static void DecodeCell(Task * task)
+{
+  CollageCell * cell = task->context;
+  SetDecodeCancel(&task->cancelled);
+  cell->pixels = DecodeImage(cell->path, cell->maxWidth, cell->maxHeight, &cell->width, &cell->height,
+			     &cell->format);
+  SetDecodeCancel(NULL);
+}
+
+// lay out a page and start decoding its images
+static Collage * NewCollage(char ** paths, int count)
+{
+  int columns = 1, rows = 1, i;
+  Collage * collage = calloc(1, sizeof(Collage));
+  if (collage == NULL) {
+    return NULL;
+  }
+  if (count > MAX_COLLAGE) {
+    count = MAX_COLLAGE;
+  }
+  collage->count = count;
+  ChooseGrid(count, &columns, &rows);
+  int cellWidth = screenWidth / columns, cellHeight = screenHeight / rows;
+  for (i = 0; i < count; i++) {
+    CollageCell * cell = collage->cells + i;
+    int row = i / columns, column = i % columns;
+    // a short last row is centered
+    int inRow = count - row * columns < columns ? count - row * columns : columns;
+    cell->path = strdup(paths[i]);
+    cell->maxWidth = cellWidth - COLLAGE_GAP;
+    cell->maxHeight = cellHeight - COLLAGE_GAP;
+    cell->x = (screenWidth - inRow * cellWidth) / 2 + column * cellWidth;
+    // rows go down from the top
+    cell->y = screenHeight - (screenHeight - rows * cellHeight) / 2 - (row + 1) * cellHeight;
+    cell->image = VG_INVALID_HANDLE;
+    cell->decode.run = DecodeCell;
+    cell->decode.context = cell;
+    SubmitTask(&cell->decode, LANE_DISPLAY);
+  }
+  return collage;
+}
+
+static int SamePage(Collage * collage, char ** paths, int count)
+{
+  int i;
+  if (collage == NULL || collage->count != count) {
+    return 0;
+  }
+  for (i = 0; i < count; i++) {
+    if (strcmp(collage->cells[i].path, paths[i]) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static ImageAtlas * AtlasFor(Collage * collage, VGImageFormat format)
+{
+  int i;
+  for (i = 0; i < collage->atlasCount; i++) {
+    if (collage->atlases[i]->format == format) {
+      return collage->atlases[i];
+    }
+  }
+  if (collage->atlasCount == 3) {
+    return NULL;
+  }
+  ImageAtlas * atlas = createImageAtlas(format, screenWidth, screenHeight);
+  if (atlas) {
+    collage->atlases[collage->atlasCount++] = atlas;
+  }
+  return atlas;
+}
+
+// tallest first, so the atlas shelves fill
+static int CompareCellHeights(const void * a, const void * b)
+{
+  const CollageCell * ca = *(CollageCell * const *) a, * cb = *(CollageCell * const *) b;
+  return (int) cb->height - (int) ca->height;
+}
+
+// pack the decoded images into atlases and place them in their cells.
+// Returns the images placed.
+static int PackCollage(Collage * collage)
+{
+  CollageCell * order[MAX_COLLAGE];
+  int i, count = 0, placed = 0;
+  for (i = 0; i < collage->count; i++) {
+    if (collage->cells[i].pixels) {
+      order[count++] = collage->cells + i;
+    }
+  }
+  qsort(order, count, sizeof(CollageCell *), CompareCellHeights);
+
+  uint64_t stage = StageBegin();
+  for (i = 0; i < count; i++) {
+    CollageCell * cell = order[i];
+    ImageAtlas * atlas = AtlasFor(collage, cell->format);
+    if (atlas) {
+      cell->image = atlasImageFromRaster(atlas, cell->pixels, ImageBytes(cell->format, cell->width, 1),
+					 cell->width, cell->height);
+    }
+    if (cell->image != VG_INVALID_HANDLE) {
+      // centered in its cell
+      cell->x += (cell->maxWidth + COLLAGE_GAP - cell->width) / 2;
+      cell->y += (cell->maxHeight + COLLAGE_GAP - cell->height) / 2;
+      placed++;
+    }
+    FreeDecodedImage(cell->pixels);
+    cell->pixels = NULL;
+  }
+  StageEnd(STAGE_UPLOAD, stage);
+  return placed;
+}
+
+
+// PrepareCollage starts decoding the images of the page to be shown
+// next, unless they already are
+void PrepareCollage(char ** paths, int count)
+{
+  if (SamePage(pending, paths, count)) {
+    return;
+  }
+  FreeCollage(pending);
+  pending = NewCollage(paths, count);
+}
+
+// LoadCollage makes a page of count images, at most MAX_COLLAGE, to be
+// shown like a slide.  Images that can't be loaded are left out.  Returns
+// NULL if none could be.
+CenteredScaledImage * LoadCollage(char ** paths, int count)
+{
+  double started = vgwrap_now_ms();
+  Collage * collage;
+  int i;
+  if (SamePage(pending, paths, count)) {
+    collage = pending;
+    pending = NULL;
+    pagesPrepared++;
+  }
+  else {
+    FreeCollage(pending);
+    pending = NULL;
+    collage = NewCollage(paths, count);
+  }
+  if (collage == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < collage->count; i++) {
+    WaitTask(&collage->cells[i].decode);
+  }
+  int placed = PackCollage(collage);
+  if (placed == 0) {
+    FreeCollage(collage);
+    return NULL;
+  }
+
+  CenteredScaledImage * csv = calloc(1, sizeof(CenteredScaledImage));
+  csv->collage = collage;
+  csv->imageWidth = screenWidth;
+  csv->imageHeight = screenHeight;
+  csv->scaleX = csv->scaleY = csv->finalScale = 1.0f;
+  pagesBuilt++;
+  cellsShown += placed;
+  buildMs += vgwrap_now_ms() - started;
+  return csv;
+}
+
+// DrawCollage draws every image of a page through the current image
+// transform, each moved to its cell
+void DrawCollage(Collage * collage, VGfloat opacity)
+{
+  VGfloat m[9];
+  int i;
+  vgGetMatrix(m);
+  for (i = 0; i < collage->count; i++) {
+    CollageCell * cell = collage->cells + i;
+    if (cell->image != VG_INVALID_HANDLE) {
+      vgLoadMatrix(m);
+      vgTranslate(cell->x, cell->y);
+      DrawImageOpacity(cell->image, opacity);
+    }
+  }
+  vgLoadMatrix(m);
+}
+
+void FreeCollage(Collage * collage)
+{
+  int i;
+  if (collage == NULL) {
+    return;
+  }
+  for (i = 0; i < collage->count; i++) {
+    CollageCell * cell = collage->cells + i;
+    CancelTask(&cell->decode);
+    WaitTask(&cell->decode);
+    FreeDecodedImage(cell->pixels);
+    free(cell->path);
+  }
+  for (i = 0; i < collage->atlasCount; i++) {
+    releaseImageAtlas(collage->atlases[i]);
+  }
+  free(collage);
+}
+
+void PrintCollageStats()
+{
+  if (pagesBuilt == 0) {
+    return;
+  }
+  printf("collage: %ld pages, %ld decoded ahead, %.1f images a page, built in %.1f ms mean\n",
+	 pagesBuilt, pagesPrepared, (double) cellsShown / pagesBuilt, buildMs / pagesBuilt);
+  PrintAtlasStats();
+}
+
+// FinishCollages stops decoding the next page
+void FinishCollages()
+{
+  FreeCollage(pending);
+  pending = NULL;
+}
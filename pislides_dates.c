@@ -0,0 +1,404 @@
+// Date index: when each photo was taken, for "on this day" and date range
+// playlists.
+//
+// Once the scan has found every image, IndexPhotoDates reads each one's
+// EXIF DateTimeOriginal, falling back to the file's modification time, and
+// sorts the records twice: by date, and by day of the year whatever the
+// year.  A playlist is then one or two binary searches and a copy of the
+// records between them, O(log n + k) for k images, rather than a pass over
+// the whole catalog, so choosing one from 100,000 photos takes a moment.
+//
+// Dates are kept as local time counted as if it were UTC, the way cameras
+// write them, so the day of the year and the calendar fields come from
+// gmtime_r and don't move with the time zone or daylight saving.  Images
+// with no date, such as those fetched over HTTP, are in no date playlist.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "pislides.h"
+
+
+// DateTimeOriginal is nearly always in an APP1 segment right after the
+// SOI marker, and near the start of it, before the thumbnail.  A first
+// read of EXIF_READ_FIRST bytes usually has it; otherwise the rest of the
+// segment, up to its 64 KB limit, is read too.
+#define EXIF_READ_FIRST 4096
+#define EXIF_READ_MAX (65536 + 4096)
+
+#define TAG_DATE_TIME 0x0132
+#define TAG_EXIF_IFD 0x8769
+#define TAG_DATE_TIME_ORIGINAL 0x9003
+
+// record indexes sorted by takenAt, and by DayKey of takenAt; only dated
+// records are in either
+static int * byDate = NULL;
+static int * byDay = NULL;
+static int datedCount = 0;
+
+
+// a day of the year as month * 32 + day, which sorts like the calendar
+// and has a place for 29 February in every year.  The sorts and searches
+// call this a lot, so the month and day are worked out directly rather
+// than with gmtime_r, counting in 400 year eras from 1 March 2000.
+static int DayKey(time_t date)
+{
+  long long days = (date >= 0 ? date : date - 86399) / 86400 - 11017;
+  long long era = (days >= 0 ? days : days - 146096) / 146097;
+  int dayOfEra = (int) (days - era * 146097);
+  int yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+  int dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+  int monthFromMarch = (5 * dayOfYear + 2) / 153;
+  int day = dayOfYear - (153 * monthFromMarch + 2) / 5 + 1;
+  int month = monthFromMarch < 10 ? monthFromMarch + 3 : monthFromMarch - 9;
+  return month * 32 + day;
+}
+
+static unsigned Get16(const unsigned char * p, int bigEndian)
+{
+  return bigEndian ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+}
+
+static unsigned Get32(const unsigned char * p, int bigEndian)
+{
+  return bigEndian ? ((unsigned) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3] :
+    p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned) p[3] << 24);
+}
+
+// ParseExifDate reads "YYYY:MM:DD HH:MM:SS" from the 19 bytes at text,
+// which needn't be terminated.  Returns 0 for a blank or malformed date,
+// which some cameras write when their clock isn't set.
+static time_t ParseExifDate(const unsigned char * text)
+{
+  char date[20];
+  struct tm tm;
+  memcpy(date, text, 19);
+  date[19] = '\0';
+  memset(&tm, 0, sizeof(tm));
+  if (sscanf(date, "%4d:%2d:%2d %2d:%2d:%2d", &tm.tm_year, &tm.tm_mon,
+	     &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 ||
+      tm.tm_year < 1900 || tm.tm_mon < 1 || tm.tm_mon > 12 || tm.tm_mday < 1 || tm.tm_mday > 31) {
+    return 0;
+  }
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  return timegm(&tm);
+}
+
+// FindTag returns the offset in tiff of the value of tag in the IFD at
+// offset ifd, or 0 if it isn't there.  Values of four bytes or less are
+// in the entry itself.  Offsets come from the file, so the bounds checks
+// compare against the space left rather than add to them, which could
+// wrap.
+static unsigned FindTag(const unsigned char * tiff, unsigned length, unsigned ifd,
+			int bigEndian, unsigned tag, unsigned * count)
+{
+  unsigned i, entries;
+  if (length < 2 || ifd < 8 || ifd > length - 2) {
+    return 0;
+  }
+  entries = Get16(tiff + ifd, bigEndian);
+  // no more entries than there is room for
+  if (entries > (length - ifd - 2) / 12) {
+    entries = (length - ifd - 2) / 12;
+  }
+  for (i = 0; i < entries; i++) {
+    const unsigned char * entry = tiff + ifd + 2 + i * 12;
+    if (Get16(entry, bigEndian) == tag) {
+      *count = Get32(entry + 4, bigEndian);
+      return *count <= 4 ? (unsigned) (entry + 8 - tiff) : Get32(entry + 8, bigEndian);
+    }
+  }
+  return 0;
+}
+
+// ExifDate returns DateTimeOriginal from the EXIF TIFF structure, or the
+// DateTime the file was last written if there's no DateTimeOriginal
+static time_t ExifDate(const unsigned char * tiff, unsigned length)
+{
+  unsigned count, offset;
+  if (length < 8 || (memcmp(tiff, "II*\0", 4) != 0 && memcmp(tiff, "MM\0*", 4) != 0)) {
+    return 0;
+  }
+  int bigEndian = tiff[0] == 'M';
+  unsigned ifd0 = Get32(tiff + 4, bigEndian);
+  unsigned exifIfd = FindTag(tiff, length, ifd0, bigEndian, TAG_EXIF_IFD, &count);
+  if (exifIfd != 0 && exifIfd <= length - 4) {
+    offset = FindTag(tiff, length, Get32(tiff + exifIfd, bigEndian), bigEndian,
+		     TAG_DATE_TIME_ORIGINAL, &count);
+    if (offset != 0 && count >= 19 && length >= 19 && offset <= length - 19) {
+      time_t date = ParseExifDate(tiff + offset);
+      if (date != 0) {
+	return date;
+      }
+    }
+  }
+  offset = FindTag(tiff, length, ifd0, bigEndian, TAG_DATE_TIME, &count);
+  if (offset != 0 && count >= 19 && length >= 19 && offset <= length - 19) {
+    return ParseExifDate(tiff + offset);
+  }
+  return 0;
+}
+
+// ReadPhotoDate returns when the image at path was taken, from its EXIF
+// data, or else when the file was last modified.  Returns 0 if neither
+// can be had.  *fromExif is set if the date came from EXIF.
+time_t ReadPhotoDate(const char * path, int * fromExif)
+{
+  struct stat st;
+  struct tm tm;
+  ssize_t length;
+
+  *fromExif = 0;
+  if (IsHttpLocation(path)) {
+    return 0;
+  }
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  unsigned char * buf = malloc(EXIF_READ_MAX);
+  length = buf != NULL ? pread(fd, buf, EXIF_READ_FIRST, 0) : -1;
+  // walk the markers from SOI to the first scan looking for APP1 Exif
+  if (length >= 4 && buf[0] == 0xff && buf[1] == 0xd8) {
+    ssize_t at = 2;
+    while (at + 4 <= length && buf[at] == 0xff && buf[at + 1] != 0xda) {
+      ssize_t segment = (buf[at + 2] << 8) | buf[at + 3];
+      if (buf[at + 1] == 0xe1 && segment >= 8 && at + 10 <= length &&
+	  memcmp(buf + at + 4, "Exif\0\0", 6) == 0) {
+	// as much of the segment as was read, then all of it
+	time_t date = ExifDate(buf + at + 10, segment - 8 < length - at - 10 ? segment - 8 : length - at - 10);
+	if (date == 0 && at + 2 + segment > length && at + 2 + segment <= EXIF_READ_MAX) {
+	  ssize_t more = pread(fd, buf + length, at + 2 + segment - length, length);
+	  if (more > 0) {
+	    length += more;
+	    date = ExifDate(buf + at + 10, segment - 8 < length - at - 10 ? segment - 8 : length - at - 10);
+	  }
+	}
+	if (date != 0) {
+	  free(buf);
+	  close(fd);
+	  *fromExif = 1;
+	  return date;
+	}
+	break;
+      }
+      at += 2 + segment;
+    }
+  }
+  free(buf);
+  int statted = fstat(fd, &st) == 0;
+  close(fd);
+  if (!statted || localtime_r(&st.st_mtime, &tm) == NULL) {
+    return 0;
+  }
+  return timegm(&tm);
+}
+
+static int CompareDates(const void * a, const void * b)
+{
+  time_t da = fileRecords[*(const int *) a].takenAt;
+  time_t db = fileRecords[*(const int *) b].takenAt;
+  return da < db ? -1 : da > db;
+}
+
+static int CompareDays(const void * a, const void * b)
+{
+  time_t da = fileRecords[*(const int *) a].takenAt;
+  time_t db = fileRecords[*(const int *) b].takenAt;
+  int ka = DayKey(da), kb = DayKey(db);
+  if (ka != kb) {
+    return ka - kb;
+  }
+  return da < db ? -1 : da > db;
+}
+
+// IndexPhotoDates dates every record in the catalog and builds the sorted
+// indexes.  It runs in the executor's background lane once the scan is
+// done, and gives up if cancelled becomes set.
+void IndexPhotoDates(volatile int * cancelled)
+{
+  double started = vgwrap_now_ms();
+  int i, fromExif;
+
+  free(byDate);
+  free(byDay);
+  byDate = byDay = NULL;
+  datedCount = 0;
+  if (fileRecordCount == 0) {
+    return;
+  }
+  int * dated = malloc(sizeof(int) * fileRecordCount);
+  int * days = malloc(sizeof(int) * fileRecordCount);
+  if (dated == NULL || days == NULL) {
+    free(dated);
+    free(days);
+    return;
+  }
+  int count = 0, exif = 0;
+  for (i = 0; i < fileRecordCount; i++) {
+    if (*cancelled) {
+      free(dated);
+      free(days);
+      return;
+    }
+    fileRecords[i].takenAt = ReadPhotoDate(fileRecords[i].relativeFilePath, &fromExif);
+    if (fileRecords[i].takenAt != 0) {
+      dated[count++] = i;
+      exif += fromExif;
+    }
+  }
+  memcpy(days, dated, sizeof(int) * count);
+  qsort(dated, count, sizeof(int), CompareDates);
+  qsort(days, count, sizeof(int), CompareDays);
+  byDate = dated;
+  byDay = days;
+  datedCount = count;
+  printf("dates: indexed %d images in %.1f ms, %d from EXIF\n",
+	 count, vgwrap_now_ms() - started, exif);
+}
+
+// the first place in byDate dated at or after date
+static int FirstOnOrAfter(time_t date)
+{
+  int low = 0, high = datedCount;
+  while (low < high) {
+    int mid = low + (high - low) / 2;
+    if (fileRecords[byDate[mid]].takenAt < date) {
+      low = mid + 1;
+    }
+    else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+// the first place in byDay with a day key of at least key
+static int FirstDayOnOrAfter(int key)
+{
+  int low = 0, high = datedCount;
+  while (low < high) {
+    int mid = low + (high - low) / 2;
+    if (DayKey(fileRecords[byDay[mid]].takenAt) < key) {
+      low = mid + 1;
+    }
+    else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+// append the records from index places from up to to
+static int Append(int * records, int count, const int * index, int from, int to)
+{
+  memcpy(records + count, index + from, sizeof(int) * (to - from));
+  return count + to - from;
+}
+
+// ParsePlaylist reads a playlist from its text form: "all", "onthisday"
+// with an optional number of days either side, "year YYYY", or "dates
+// YYYY-MM-DD YYYY-MM-DD" including both days.  Returns 0, or -1 if spec
+// isn't one of those.
+int ParsePlaylist(const char * spec, Playlist * playlist)
+{
+  struct tm from, to;
+  int year, end;
+
+  memset(playlist, 0, sizeof(Playlist));
+  memset(&from, 0, sizeof(from));
+  memset(&to, 0, sizeof(to));
+  if (strcmp(spec, "all") == 0) {
+    playlist->kind = PLAYLIST_ALL;
+    return 0;
+  }
+  if (strncmp(spec, "onthisday", 9) == 0 && (spec[9] == '\0' || spec[9] == ' ')) {
+    playlist->kind = PLAYLIST_ON_THIS_DAY;
+    end = 0;
+    if (spec[9] == '\0' ||
+	(sscanf(spec + 9, " %d %n", &playlist->days, &end) == 1 && end > 0 && spec[9 + end] == '\0' &&
+	 playlist->days >= 0 && playlist->days < 183)) {
+      return 0;
+    }
+    return -1;
+  }
+  end = 0;
+  if (sscanf(spec, "year %d %n", &year, &end) == 1 && end > 0 && spec[end] == '\0' &&
+      year >= 1900 && year < 10000) {
+    from.tm_year = year - 1900;
+    from.tm_mday = 1;
+    to.tm_year = year + 1 - 1900;
+    to.tm_mday = 1;
+    playlist->kind = PLAYLIST_DATES;
+    playlist->from = timegm(&from);
+    playlist->to = timegm(&to);
+    return 0;
+  }
+  end = 0;
+  if (sscanf(spec, "dates %d-%d-%d %d-%d-%d %n", &from.tm_year, &from.tm_mon, &from.tm_mday,
+	     &to.tm_year, &to.tm_mon, &to.tm_mday, &end) == 6 && end > 0 && spec[end] == '\0' &&
+      from.tm_year >= 1900 && to.tm_year >= 1900) {
+    from.tm_year -= 1900;
+    from.tm_mon -= 1;
+    to.tm_year -= 1900;
+    to.tm_mon -= 1;
+    // through the end of the last day
+    to.tm_mday += 1;
+    playlist->kind = PLAYLIST_DATES;
+    playlist->from = timegm(&from);
+    playlist->to = timegm(&to);
+    return playlist->from < playlist->to ? 0 : -1;
+  }
+  return -1;
+}
+
+// SelectPlaylist returns the records in playlist, unordered, in a new
+// array in *records, and how many there are.  PLAYLIST_ALL selects
+// nothing here, it is the whole catalog.
+int SelectPlaylist(const Playlist * playlist, int ** records)
+{
+  int count = 0;
+
+  *records = NULL;
+  if (datedCount == 0 || playlist->kind == PLAYLIST_ALL) {
+    return 0;
+  }
+  *records = malloc(sizeof(int) * datedCount);
+  if (*records == NULL) {
+    return 0;
+  }
+  if (playlist->kind == PLAYLIST_DATES) {
+    count = Append(*records, count, byDate, FirstOnOrAfter(playlist->from),
+		   FirstOnOrAfter(playlist->to));
+  }
+  else {
+    // today's day of the year, days either side, in local time like the
+    // dates themselves
+    struct tm tm;
+    time_t now = time(NULL);
+    localtime_r(&now, &tm);
+    time_t today = timegm(&tm);
+    int first = DayKey(today - (time_t) playlist->days * 86400);
+    int last = DayKey(today + (time_t) playlist->days * 86400);
+    if (first <= last) {
+      count = Append(*records, count, byDay, FirstDayOnOrAfter(first), FirstDayOnOrAfter(last + 1));
+    }
+    else {
+      // the window takes in the new year
+      count = Append(*records, count, byDay, FirstDayOnOrAfter(first), datedCount);
+      count = Append(*records, count, byDay, 0, FirstDayOnOrAfter(last + 1));
+    }
+  }
+  if (count == 0) {
+    free(*records);
+    *records = NULL;
+  }
+  return count;
+}
@@ -0,0 +1,700 @@
+// Decoder processes.  Images from the directory source are decoded in a
+// small pool of separate processes, so a malformed JPEG that crashes
+// libjpeg, or a decode that runs away with memory, takes down a decoder
+// rather than the slideshow holding the display.  A decoder that dies is
+// started again for the next image.
+//
+// Decoders are this program started again with DECODER_ARG.  Each has a
+// SOCK_SEQPACKET socket to the slideshow.  The slideshow opens the image
+// and passes the open file over the socket with SCM_RIGHTS, so decoders
+// need no access to the file system.  The decoder writes the raster into
+// a memfd and passes that back the same way; the slideshow maps it and
+// uploads straight from the mapping, so the pixels are never copied.
+// Stage timings and counters from the decode come back with the reply,
+// and the slideshow times the whole round trip as the decoder stage.
+// The decoder seals the memfd's size before passing it, and the
+// slideshow checks the seals and that the raster the reply describes
+// fits in it, so a misbehaving decoder can't make the mapping fault.  A
+// decode that takes longer than DECODE_TIMEOUT_MS is given up on and its
+// decoder killed.
+//
+// Once started a decoder closes every other file, caps its heap at
+// DECODER_MEMORY_MB, and restricts itself with a seccomp filter to the
+// few system calls decoding needs: reading and writing what it was
+// given, memory, and the socket.  Anything else kills it.
+//
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include "pislides.h"
+
+#define MAX_DECODERS 8
+
+// a decoder's heap is capped at this many megabytes
+#ifndef DECODER_MEMORY_MB
+#define DECODER_MEMORY_MB 256
+#endif
+
+// a decode taking longer than this has a decoder stuck in a loop
+#ifndef DECODE_TIMEOUT_MS
+#define DECODE_TIMEOUT_MS 30000
+#endif
+
+// how often a decode waited for is checked for being cancelled
+#define CANCEL_POLL_MS 20
+
+extern char ** environ;
+
+typedef struct _DecodeRequest {
+  unsigned maxWidth, maxHeight;
+  char name[256];		// for messages
+} DecodeRequest;
+
+typedef struct _DecodeReply {
+  int ok;
+  unsigned width, height;
+  VGImageFormat format;
+  size_t length;
+  // what the decode's stages took and what it added to the counters,
+  // which the slideshow records as its own
+  uint64_t stageNs[STAGE_COUNT];
+  uint64_t counts[COUNTER_COUNT];
+} DecodeReply;
+
+typedef struct _DecoderProcess {
+  pid_t pid;
+  int fd;			// the slideshow's end of its socket, -1 if not running
+  int busy;
+} DecoderProcess;
+
+// a raster mapped from a decoder's memfd
+typedef struct _RasterMapping {
+  VGubyte * pixels;
+  size_t length;
+} RasterMapping;
+
+static pthread_mutex_t decoderLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t decoderFree = PTHREAD_COND_INITIALIZER;
+static DecoderProcess decoders[MAX_DECODERS];
+static int decoderCount;
+static char decoderPath[4096];
+
+static RasterMapping * mappings;
+static int mappingCount, mappingAllocated;
+
+static long decodes, decodesFailed, decodersDied, decodesCancelled, decodesTimedOut, decodesRejected;
+static long decodersStarted;
+
+
+// send a message, with a file descriptor if fd >= 0
+static int SendWithFd(int socket, const void * message, size_t length, int fd)
+{
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { (void *) message, length };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (fd >= 0) {
+    memset(control, 0, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  return sendmsg(socket, &msg, MSG_NOSIGNAL) == (ssize_t) length ? 0 : -1;
+}
+
+// receive a message of exactly length bytes, and the file descriptor
+// that came with it into *fd, or -1.  Returns 0 at the end, -1 on errors.
+static int ReceiveWithFd(int socket, void * message, size_t length, int * fd)
+{
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { message, length };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  *fd = -1;
+  ssize_t n = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+  struct cmsghdr * cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+  if (n == (ssize_t) length) {
+    return 1;
+  }
+  if (*fd >= 0) {
+    close(*fd);
+    *fd = -1;
+  }
+  return n == 0 ? 0 : -1;
+}
+
+
+// Decoder side
+
+// the rasters being made, at most one at a time in practice
+#define MAX_RASTER_FDS 4
+static struct {
+  void * pixels;
+  size_t length;
+  int fd;
+} rasterFds[MAX_RASTER_FDS];
+
+static void * AllocateRaster(size_t length)
+{
+  int i;
+  for (i = 0; i < MAX_RASTER_FDS && rasterFds[i].pixels; i++) {
+  }
+  if (i == MAX_RASTER_FDS) {
+    return NULL;
+  }
+  int fd = memfd_create("pislides raster", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    return NULL;
+  }
+  void * pixels = ftruncate(fd, length) == 0 ?
+    mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+  if (pixels == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  rasterFds[i].pixels = pixels;
+  rasterFds[i].length = length;
+  rasterFds[i].fd = fd;
+  return pixels;
+}
+
+static int RasterFd(void * pixels)
+{
+  int i;
+  for (i = 0; i < MAX_RASTER_FDS; i++) {
+    if (rasterFds[i].pixels == pixels) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void FreeRasterFd(void * pixels)
+{
+  int i = RasterFd(pixels);
+  if (i >= 0) {
+    munmap(rasterFds[i].pixels, rasterFds[i].length);
+    close(rasterFds[i].fd);
+    rasterFds[i].pixels = NULL;
+  }
+}
+
+static long ReadImageFd(void * context, void * buf, size_t size)
+{
+  ssize_t n;
+  do {
+    n = read(*(int *) context, buf, size);
+  } while (n < 0 && errno == EINTR);
+  return n;
+}
+
+#if defined(__x86_64__)
+#define SECCOMP_ARCH AUDIT_ARCH_X86_64
+#elif defined(__i386__)
+#define SECCOMP_ARCH AUDIT_ARCH_I386
+#elif defined(__aarch64__)
+#define SECCOMP_ARCH AUDIT_ARCH_AARCH64
+#elif defined(__arm__)
+#define SECCOMP_ARCH AUDIT_ARCH_ARM
+#endif
+
+#ifndef SECCOMP_RET_KILL_PROCESS
+#define SECCOMP_RET_KILL_PROCESS SECCOMP_RET_KILL
+#endif
+
+#define ALLOW(nr) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (nr), 0, 1), BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW)
+
+// Sandbox allows only the system calls a decoder needs from here on.
+// Returns -1 if the kernel or architecture can't.
+static int Sandbox()
+{
+#ifdef SECCOMP_ARCH
+  struct sock_filter filter[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SECCOMP_ARCH, 1, 0),
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS),
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+    // the image, the raster, messages and the socket
+    ALLOW(__NR_read),
+    ALLOW(__NR_write),
+    ALLOW(__NR_close),
+    ALLOW(__NR_recvmsg),
+    ALLOW(__NR_sendmsg),
+    ALLOW(__NR_memfd_create),
+    ALLOW(__NR_ftruncate),
+#ifdef __NR_ftruncate64
+    ALLOW(__NR_ftruncate64),
+#endif
+    ALLOW(__NR_lseek),
+#ifdef __NR__llseek
+    ALLOW(__NR__llseek),
+#endif
+    ALLOW(__NR_fcntl),
+#ifdef __NR_fcntl64
+    ALLOW(__NR_fcntl64),
+#endif
+    ALLOW(__NR_fstat),
+#ifdef __NR_fstat64
+    ALLOW(__NR_fstat64),
+#endif
+#ifdef __NR_newfstatat
+    ALLOW(__NR_newfstatat),
+#endif
+#ifdef __NR_statx
+    ALLOW(__NR_statx),
+#endif
+    // memory
+#ifdef __NR_mmap
+    ALLOW(__NR_mmap),
+#endif
+#ifdef __NR_mmap2
+    ALLOW(__NR_mmap2),
+#endif
+    ALLOW(__NR_munmap),
+    ALLOW(__NR_mremap),
+    ALLOW(__NR_madvise),
+    ALLOW(__NR_mprotect),
+    ALLOW(__NR_brk),
+    ALLOW(__NR_getrandom),
+    // locks, clocks and leaving
+    ALLOW(__NR_futex),
+#ifdef __NR_futex_time64
+    ALLOW(__NR_futex_time64),
+#endif
+    ALLOW(__NR_clock_gettime),
+#ifdef __NR_clock_gettime64
+    ALLOW(__NR_clock_gettime64),
+#endif
+    ALLOW(__NR_gettimeofday),
+    ALLOW(__NR_rt_sigreturn),
+    ALLOW(__NR_exit),
+    ALLOW(__NR_exit_group),
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS)
+  };
+  struct sock_fprog program = { sizeof(filter) / sizeof(filter[0]), filter };
+  if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0) {
+    return -1;
+  }
+  return prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program);
+#else
+  return -1;
+#endif
+}
+
+// RunDecoderProcess is the whole life of a decoder, decoding images that
+// come on socket until it closes.  Returns the exit status.
+int RunDecoderProcess(int socket)
+{
+  struct rlimit limit;
+  DecodeRequest request;
+  DecodeReply reply;
+  StageSummary stage;
+  int fd, status, i;
+
+  // go with the slideshow, and don't take its messages with us
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  if (getppid() == 1) {
+    return 1;
+  }
+  for (fd = 3; fd < 1024; fd++) {
+    if (fd != socket) {
+      close(fd);
+    }
+  }
+  limit.rlim_cur = limit.rlim_max = (rlim_t) DECODER_MEMORY_MB * 1024 * 1024;
+  setrlimit(RLIMIT_DATA, &limit);
+  SetRasterAllocator(AllocateRaster, FreeRasterFd);
+  if (Sandbox() != 0) {
+    printf("Failed sandboxing the decoder process, decoding without\n");
+  }
+
+  while ((status = ReceiveWithFd(socket, &request, sizeof(request), &fd)) > 0) {
+    memset(&reply, 0, sizeof(reply));
+    request.name[sizeof(request.name) - 1] = '\0';
+    ResetStageStats();
+    for (i = 0; i < COUNTER_COUNT; i++) {
+      reply.counts[i] = GetCountStat(i);
+    }
+    VGubyte * pixels = fd < 0 ? NULL :
+      decodeJpegStreamToFit(ReadImageFd, &fd, request.name, request.maxWidth, request.maxHeight,
+			    &reply.width, &reply.height, &reply.format);
+    for (i = 0; i < STAGE_COUNT; i++) {
+      GetStageStats(i, &stage);
+      reply.stageNs[i] = (uint64_t) (stage.mean_ms * stage.count * 1e6);
+    }
+    for (i = 0; i < COUNTER_COUNT; i++) {
+      reply.counts[i] = GetCountStat(i) - reply.counts[i];
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+    int raster = pixels ? RasterFd(pixels) : -1;
+    // the slideshow maps the raster only if its size can't change
+    if (raster >= 0 && fcntl(rasterFds[raster].fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0) {
+      raster = -1;
+    }
+    reply.ok = raster >= 0;
+    reply.length = raster >= 0 ? rasterFds[raster].length : 0;
+    if (SendWithFd(socket, &reply, sizeof(reply), raster >= 0 ? rasterFds[raster].fd : -1) != 0) {
+      return 1;
+    }
+    if (pixels) {
+      FreeRasterFd(pixels);
+    }
+  }
+  return status == 0 ? 0 : 1;
+}
+
+
+// Slideshow side
+
+// start a decoder.  Called with decoderLock held.
+static int StartDecoder(DecoderProcess * d)
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t none;
+  char fdText[16];
+  int sv[2];
+
+  // the decoder's end has to survive exec, the slideshow's mustn't
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) != 0) {
+    return -1;
+  }
+  fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+  snprintf(fdText, sizeof(fdText), "%d", sv[1]);
+  char * argv[] = { decoderPath, DECODER_ARG, fdText, NULL };
+
+  // its own process group so ^C reaches only the slideshow, which then
+  // closes the socket, and the signals the slideshow blocks unblocked
+  posix_spawn_file_actions_init(&actions);
+  posix_spawnattr_init(&attr);
+  sigemptyset(&none);
+  posix_spawnattr_setsigmask(&attr, &none);
+  posix_spawnattr_setpgroup(&attr, 0);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+  int failed = posix_spawn(&d->pid, decoderPath, &actions, &attr, argv, environ);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  close(sv[1]);
+  if (failed) {
+    close(sv[0]);
+    return -1;
+  }
+  d->fd = sv[0];
+  decodersStarted++;
+  return 0;
+}
+
+// stop a decoder, whatever it is doing
+static void StopDecoder(DecoderProcess * d)
+{
+  if (d->fd < 0) {
+    return;
+  }
+  close(d->fd);
+  d->fd = -1;
+  kill(d->pid, SIGKILL);
+  waitpid(d->pid, NULL, 0);
+}
+
+// take a free decoder, starting it if need be.  Returns NULL if none can
+// be started.
+static DecoderProcess * TakeDecoder()
+{
+  DecoderProcess * d = NULL;
+  int i;
+  pthread_mutex_lock(&decoderLock);
+  while (d == NULL) {
+    for (i = 0; i < decoderCount && d == NULL; i++) {
+      if (!decoders[i].busy) {
+	d = decoders + i;
+      }
+    }
+    if (d == NULL) {
+      pthread_cond_wait(&decoderFree, &decoderLock);
+    }
+  }
+  if (d->fd < 0 && StartDecoder(d) != 0) {
+    printf("Failed starting a decoder process, decoding here\n");
+    d = NULL;
+  }
+  else {
+    d->busy = 1;
+  }
+  pthread_mutex_unlock(&decoderLock);
+  return d;
+}
+
+static void GiveBackDecoder(DecoderProcess * d)
+{
+  pthread_mutex_lock(&decoderLock);
+  d->busy = 0;
+  pthread_cond_signal(&decoderFree);
+  pthread_mutex_unlock(&decoderLock);
+}
+
+// wait for the reply to a decode, giving up if the decode is cancelled
+// or takes longer than DECODE_TIMEOUT_MS.  Returns 1 with the reply, 0 if
+// the decoder died, -1 if cancelled, -2 if timed out.
+static int AwaitReply(DecoderProcess * d, DecodeReply * reply, int * rasterFd)
+{
+  struct pollfd pfd = { d->fd, POLLIN, 0 };
+  double deadline = vgwrap_now_ms() + DECODE_TIMEOUT_MS;
+  *rasterFd = -1;
+  for (;;) {
+    if (vgwrap_now_ms() >= deadline) {
+      return -2;
+    }
+    int ready = poll(&pfd, 1, CANCEL_POLL_MS);
+    if (ready > 0) {
+      return ReceiveWithFd(d->fd, reply, sizeof(*reply), rasterFd) > 0 ? 1 : 0;
+    }
+    if (ready < 0 && errno != EINTR) {
+      return 0;
+    }
+    if (DecodeCancelled()) {
+      return -1;
+    }
+  }
+}
+
+// whether a reply describes a raster decode_jpeg could have made, no
+// larger than asked for, that fits in its sealed memfd
+static int ValidRaster(const DecodeReply * reply, int rasterFd, unsigned maxWidth, unsigned maxHeight)
+{
+  struct stat st;
+  int seals = rasterFd < 0 ? -1 : fcntl(rasterFd, F_GET_SEALS);
+  if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) != (F_SEAL_SHRINK | F_SEAL_GROW) ||
+      fstat(rasterFd, &st) != 0) {
+    return 0;
+  }
+  if (reply->format != VG_sL_8 && reply->format != VG_sRGB_565 && reply->format != VG_sABGR_8888 &&
+      reply->format != VG_sRGBA_8888) {
+    return 0;
+  }
+  if (reply->width == 0 || reply->height == 0 || reply->width > maxWidth || reply->height > maxHeight) {
+    return 0;
+  }
+  size_t needed = ImageBytes(reply->format, reply->width, 1) * reply->height;
+  return (size_t) st.st_size >= reply->length && reply->length >= needed;
+}
+
+// StartDecoderProcesses sets up count decoder processes, each started
+// when first needed.  Returns 0, or -1 if decoders can't be run, when
+// images are decoded in this process.
+int StartDecoderProcesses(int count)
+{
+  int i;
+  ssize_t n = readlink("/proc/self/exe", decoderPath, sizeof(decoderPath) - 1);
+  if (n <= 0 || count <= 0) {
+    return -1;
+  }
+  decoderPath[n] = '\0';
+  decoderCount = count < MAX_DECODERS ? count : MAX_DECODERS;
+  for (i = 0; i < decoderCount; i++) {
+    decoders[i].fd = -1;
+    decoders[i].busy = 0;
+  }
+  return 0;
+}
+
+// DecodeInDecoderProcess is decodeJpegToFit in a decoder process.  The
+// raster is shared memory, freed with FreeDecodedImage.  If the decoder
+// dies it is started again for the next image, and this one fails.
+VGubyte * DecodeInDecoderProcess(const char * path, unsigned maxWidth, unsigned maxHeight,
+				  unsigned * width, unsigned * height, VGImageFormat * format)
+{
+  DecodeRequest request;
+  DecodeReply reply;
+  int rasterFd, replied, i;
+
+  if (decoderCount == 0) {
+    return decodeJpegToFit(path, maxWidth, maxHeight, width, height, format);
+  }
+  uint64_t stage = StageBegin();
+  int imageFd = open(path, O_RDONLY | O_CLOEXEC);
+  if (imageFd < 0) {
+    printf("Failed opening '%s' for reading!\n", path);
+    return NULL;
+  }
+  StageEnd(STAGE_OPEN, stage);
+  uint64_t roundTrip = StageBegin();
+  DecoderProcess * d = TakeDecoder();
+  if (d == NULL) {
+    close(imageFd);
+    return decodeJpegToFit(path, maxWidth, maxHeight, width, height, format);
+  }
+
+  memset(&request, 0, sizeof(request));
+  request.maxWidth = maxWidth;
+  request.maxHeight = maxHeight;
+  strncpy(request.name, path, sizeof(request.name) - 1);
+  int sent = SendWithFd(d->fd, &request, sizeof(request), imageFd);
+  if (sent != 0) {
+    // it died between images, which is no fault of this one
+    pthread_mutex_lock(&decoderLock);
+    StopDecoder(d);
+    decodersDied++;
+    if (StartDecoder(d) == 0) {
+      sent = SendWithFd(d->fd, &request, sizeof(request), imageFd);
+    }
+    pthread_mutex_unlock(&decoderLock);
+  }
+  replied = sent == 0 ? AwaitReply(d, &reply, &rasterFd) : 0;
+  close(imageFd);
+  if (replied > 0) {
+    // starting the decoder included, if it had to be
+    StageEnd(STAGE_DECODER, roundTrip);
+    for (i = 0; i < STAGE_COUNT; i++) {
+      if (reply.stageNs[i] > 0 && i != STAGE_DECODER) {
+	StageRecord(i, reply.stageNs[i]);
+      }
+    }
+    for (i = 0; i < COUNTER_COUNT; i++) {
+      CountStat(i, reply.counts[i]);
+    }
+  }
+
+  pthread_mutex_lock(&decoderLock);
+  decodes++;
+  if (replied <= 0) {
+    // a decoder that died, is stuck, or is busy with a decode nobody wants
+    if (replied == 0) {
+      printf("Decoder process died decoding '%s'\n", path);
+      decodersDied++;
+    }
+    else if (replied == -2) {
+      printf("Decoder process timed out decoding '%s'\n", path);
+      decodesTimedOut++;
+    }
+    else {
+      decodesCancelled++;
+    }
+    StopDecoder(d);
+  }
+  else if (!reply.ok) {
+    decodesFailed++;
+  }
+  else if (!ValidRaster(&reply, rasterFd, maxWidth, maxHeight)) {
+    // a decoder that says it made something it didn't isn't to be trusted
+    printf("Decoder process sent a bad raster for '%s'\n", path);
+    decodesRejected++;
+    StopDecoder(d);
+    replied = 0;
+  }
+  pthread_mutex_unlock(&decoderLock);
+  GiveBackDecoder(d);
+  if (replied <= 0 || !reply.ok) {
+    if (rasterFd >= 0) {
+      close(rasterFd);
+    }
+    return NULL;
+  }
+
+  VGubyte * pixels = rasterFd < 0 ? MAP_FAILED :
+    mmap(NULL, reply.length, PROT_READ | PROT_WRITE, MAP_SHARED, rasterFd, 0);
+  if (rasterFd >= 0) {
+    close(rasterFd);
+  }
+  if (pixels == MAP_FAILED) {
+    printf("Failed mapping the raster of '%s'\n", path);
+    return NULL;
+  }
+  pthread_mutex_lock(&decoderLock);
+  if (mappingCount == mappingAllocated) {
+    mappingAllocated = mappingAllocated ? mappingAllocated * 2 : 16;
+    mappings = realloc(mappings, mappingAllocated * sizeof(RasterMapping));
+  }
+  mappings[mappingCount].pixels = pixels;
+  mappings[mappingCount].length = reply.length;
+  mappingCount++;
+  pthread_mutex_unlock(&decoderLock);
+
+  *width = reply.width;
+  *height = reply.height;
+  *format = reply.format;
+  return pixels;
+}
+
+// FreeDecoderRaster unmaps a raster from DecodeInDecoderProcess.  Returns
+// 0 if pixels isn't one.
+int FreeDecoderRaster(VGubyte * pixels)
+{
+  size_t length = 0;
+  int i;
+  pthread_mutex_lock(&decoderLock);
+  for (i = 0; i < mappingCount; i++) {
+    if (mappings[i].pixels == pixels) {
+      length = mappings[i].length;
+      mappings[i] = mappings[--mappingCount];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&decoderLock);
+  if (length == 0) {
+    return 0;
+  }
+  munmap(pixels, length);
+  return 1;
+}
+
+void PrintDecoderStats()
+{
+  if (decoderCount == 0) {
+    return;
+  }
+  pthread_mutex_lock(&decoderLock);
+  printf("decoders: %d processes, %ld started, %ld decodes, %ld failed, %ld died, %ld timed out, "
+	 "%ld rejected, %ld cancelled\n", decoderCount, decodersStarted, decodes, decodesFailed,
+	 decodersDied, decodesTimedOut, decodesRejected, decodesCancelled);
+  pthread_mutex_unlock(&decoderLock);
+}
+
+// StopDecoderProcesses stops every decoder.  None may be busy.
+void StopDecoderProcesses()
+{
+  int i;
+  pthread_mutex_lock(&decoderLock);
+  for (i = 0; i < decoderCount; i++) {
+    StopDecoder(decoders + i);
+  }
+  decoderCount = 0;
+  pthread_mutex_unlock(&decoderLock);
+}
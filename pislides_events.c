@@ -0,0 +1,591 @@
+// Event loop.  Everything the slideshow waits for goes through one epoll
+// instance:
+//
+//   timerfd     the next deadline: end of the hold, an overlay refresh
+//   signalfd    SIGINT and SIGTERM quit cleanly, SIGHUP rescans images
+//   terminal    keys typed on the controlling terminal, in raw mode
+//   evdev       keyboards and IR remotes, see PISLIDES_INPUT below
+//   socket      one line commands on a Unix-domain control socket
+//   eventfd     decode completions posted by other threads
+//
+// Waiting with WaitForEvents returns as soon as a command arrives, and
+// PollCommand lets frame loops check between frames, so a key press is
+// acted on within a frame rather than at the end of the hold.
+//
+// Keys: right arrow, n or Enter for the next slide, left arrow or b for
+// the previous one, space or p to pause and resume, r to rescan the
+// images, q to quit.  The control socket takes the same commands by name,
+// "next", "previous", "pause", "resume", "toggle", "reload" and "quit",
+// one per line, and answers each with "ok" or "unknown command".  It
+// also takes "playlist" followed by a playlist as ParsePlaylist reads
+// them, such as "playlist onthisday 3" or "playlist year 2019", which
+// starts a rotation of just those images; "playlist all" goes back to
+// every image.
+//
+// PISLIDES_INPUT can name evdev devices to read, separated by commas, or
+// be "auto" for every device with arrow keys.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+
+#include "pislides.h"
+
+#define MAX_EVENTS 16
+#define MAX_INPUT_DEVICES 8
+#define MAX_CONTROL_CLIENTS 8
+#define CONTROL_LINE_MAX 128
+
+typedef enum {
+  SOURCE_TIMER, SOURCE_SIGNAL, SOURCE_TERMINAL, SOURCE_INPUT,
+  SOURCE_LISTEN, SOURCE_CLIENT, SOURCE_DECODE
+} SourceType;
+
+typedef struct {
+  SourceType type;
+  int fd;
+  char line[CONTROL_LINE_MAX];	// partial command from a control client
+  int lineLength;
+} Source;
+
+static int epollFd = -1;
+static Source timerSource = { SOURCE_TIMER, -1 };
+static Source signalSource = { SOURCE_SIGNAL, -1 };
+static Source terminalSource = { SOURCE_TERMINAL, -1 };
+static Source decodeSource = { SOURCE_DECODE, -1 };
+static Source listenSource = { SOURCE_LISTEN, -1 };
+static Source inputSources[MAX_INPUT_DEVICES];
+static Source clientSources[MAX_CONTROL_CLIENTS];
+static int inputCount;
+static char controlPath[108];
+static DecodeCompleteFunc decodeComplete;
+
+// commands arrive faster than they are taken only when keys are mashed,
+// keep a few
+#define COMMAND_QUEUE 8
+static int commandQueue[COMMAND_QUEUE];
+static int commandHead, commandCount;
+
+static long commandsReceived;
+
+// the last playlist asked for with COMMAND_PLAYLIST
+static Playlist requestedPlaylist;
+
+
+static void QueueCommand(int command)
+{
+  if (command == COMMAND_NONE) {
+    return;
+  }
+  commandsReceived++;
+  if (commandCount == COMMAND_QUEUE) {
+    // drop the oldest, the newest says what the viewer wants now
+    commandHead = (commandHead + 1) % COMMAND_QUEUE;
+    commandCount--;
+  }
+  commandQueue[(commandHead + commandCount) % COMMAND_QUEUE] = command;
+  commandCount++;
+}
+
+static int TakeCommand()
+{
+  if (commandCount == 0) {
+    return COMMAND_NONE;
+  }
+  int command = commandQueue[commandHead];
+  commandHead = (commandHead + 1) % COMMAND_QUEUE;
+  commandCount--;
+  return command;
+}
+
+static int Watch(Source * source)
+{
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = source;
+  return epoll_ctl(epollFd, EPOLL_CTL_ADD, source->fd, &ev);
+}
+
+static void Unwatch(Source * source)
+{
+  epoll_ctl(epollFd, EPOLL_CTL_DEL, source->fd, NULL);
+  close(source->fd);
+  source->fd = -1;
+}
+
+static int CommandFromName(const char * name)
+{
+  static const struct {
+    const char * name;
+    int command;
+  } names[] = {
+    { "next", COMMAND_NEXT }, { "previous", COMMAND_PREVIOUS },
+    { "pause", COMMAND_PAUSE }, { "resume", COMMAND_RESUME },
+    { "toggle", COMMAND_TOGGLE_PAUSE }, { "reload", COMMAND_RELOAD },
+    { "quit", COMMAND_QUIT }
+  };
+  unsigned i;
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strcmp(name, names[i].name) == 0) {
+      return names[i].command;
+    }
+  }
+  return COMMAND_NONE;
+}
+
+static int CommandFromKey(int key)
+{
+  switch (key) {
+  case 'n':
+  case '\n':
+  case '\r':
+    return COMMAND_NEXT;
+  case 'b':
+    return COMMAND_PREVIOUS;
+  case ' ':
+  case 'p':
+    return COMMAND_TOGGLE_PAUSE;
+  case 'r':
+    return COMMAND_RELOAD;
+  case 'q':
+    return COMMAND_QUIT;
+  }
+  return COMMAND_NONE;
+}
+
+static int CommandFromKeyCode(int code)
+{
+  switch (code) {
+  case KEY_RIGHT:
+  case KEY_N:
+  case KEY_ENTER:
+  case KEY_NEXT:
+  case KEY_NEXTSONG:
+  case KEY_FASTFORWARD:
+    return COMMAND_NEXT;
+  case KEY_LEFT:
+  case KEY_B:
+  case KEY_PREVIOUS:
+  case KEY_PREVIOUSSONG:
+  case KEY_REWIND:
+    return COMMAND_PREVIOUS;
+  case KEY_SPACE:
+  case KEY_P:
+  case KEY_PLAYPAUSE:
+  case KEY_PAUSE:
+    return COMMAND_TOGGLE_PAUSE;
+  case KEY_PLAY:
+    return COMMAND_RESUME;
+  case KEY_R:
+    return COMMAND_RELOAD;
+  case KEY_Q:
+    return COMMAND_QUIT;
+  }
+  return COMMAND_NONE;
+}
+
+static void ReadTerminal()
+{
+  unsigned char keys[64];
+  ssize_t n = read(terminalSource.fd, keys, sizeof(keys));
+  ssize_t i;
+  if (n == 0) {
+    Unwatch(&terminalSource);	// stdin closed
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    // arrow keys come as ESC [ C and ESC [ D
+    if (keys[i] == 0x1b && i + 2 < n && keys[i + 1] == '[') {
+      if (keys[i + 2] == 'C') {
+	QueueCommand(COMMAND_NEXT);
+      }
+      else if (keys[i + 2] == 'D') {
+	QueueCommand(COMMAND_PREVIOUS);
+      }
+      i += 2;
+      continue;
+    }
+    QueueCommand(CommandFromKey(keys[i]));
+  }
+}
+
+static void ReadInput(Source * source)
+{
+  struct input_event events[16];
+  ssize_t n = read(source->fd, events, sizeof(events));
+  int i;
+  if (n < 0 && errno == ENODEV) {
+    Unwatch(source);		// unplugged
+    return;
+  }
+  for (i = 0; i < n / (ssize_t) sizeof(struct input_event); i++) {
+    if (events[i].type == EV_KEY && events[i].value == 1) {
+      QueueCommand(CommandFromKeyCode(events[i].code));
+    }
+  }
+}
+
+static void ReadSignals()
+{
+  struct signalfd_siginfo info;
+  while (read(signalSource.fd, &info, sizeof(info)) == sizeof(info)) {
+    QueueCommand(info.ssi_signo == SIGHUP ? COMMAND_RELOAD : COMMAND_QUIT);
+  }
+}
+
+static void AcceptClient()
+{
+  int fd = accept(listenSource.fd, NULL, NULL);
+  int i;
+  if (fd < 0) {
+    return;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+    Source * client = clientSources + i;
+    if (client->fd < 0) {
+      client->type = SOURCE_CLIENT;
+      client->fd = fd;
+      client->lineLength = 0;
+      if (Watch(client) != 0) {
+	close(fd);
+	client->fd = -1;
+      }
+      return;
+    }
+  }
+  close(fd);			// too many clients
+}
+
+static void Reply(Source * client, const char * text)
+{
+  if (send(client->fd, text, strlen(text), MSG_NOSIGNAL) < 0) {
+    // the client is gone, the next read will say so
+  }
+}
+
+static void ReadClient(Source * client)
+{
+  char buf[256];
+  ssize_t n = read(client->fd, buf, sizeof(buf));
+  ssize_t i;
+  if (n <= 0) {
+    if (n == 0 || errno != EAGAIN) {
+      Unwatch(client);
+    }
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    if (buf[i] == '\n') {
+      client->line[client->lineLength] = '\0';
+      if (client->lineLength > 0 && client->line[client->lineLength - 1] == '\r') {
+	client->line[client->lineLength - 1] = '\0';
+      }
+      int command = CommandFromName(client->line);
+      if (strncmp(client->line, "playlist ", 9) == 0 &&
+	  ParsePlaylist(client->line + 9, &requestedPlaylist) == 0) {
+	command = COMMAND_PLAYLIST;
+      }
+      QueueCommand(command);
+      Reply(client, command == COMMAND_NONE ? "unknown command\n" : "ok\n");
+      client->lineLength = 0;
+    }
+    else if (client->lineLength < CONTROL_LINE_MAX - 1) {
+      client->line[client->lineLength++] = buf[i];
+    }
+  }
+}
+
+static void ReadDecodeCompletions()
+{
+  uint64_t count;
+  if (read(decodeSource.fd, &count, sizeof(count)) == sizeof(count) && decodeComplete) {
+    decodeComplete();
+  }
+}
+
+// arm the timer for an absolute vgwrap_now_ms() time, or disarm it
+static void ArmTimer(double until)
+{
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (until > 0.0) {
+    long long ns = (long long) (until * 1000000.0);
+    spec.it_value.tv_sec = ns / 1000000000;
+    spec.it_value.tv_nsec = ns % 1000000000;
+  }
+  timerfd_settime(timerSource.fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+// Dispatch waits up to timeoutMs (-1 forever) and handles what is ready.
+// Returns 1 if the timer fired.
+static int Dispatch(int timeoutMs)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int fired = 0, i;
+  int n = epoll_wait(epollFd, events, MAX_EVENTS, timeoutMs);
+  for (i = 0; i < n; i++) {
+    Source * source = events[i].data.ptr;
+    uint64_t expirations;
+    switch (source->type) {
+    case SOURCE_TIMER:
+      if (read(source->fd, &expirations, sizeof(expirations)) > 0) {
+	fired = 1;
+      }
+      break;
+    case SOURCE_SIGNAL:
+      ReadSignals();
+      break;
+    case SOURCE_TERMINAL:
+      ReadTerminal();
+      break;
+    case SOURCE_INPUT:
+      ReadInput(source);
+      break;
+    case SOURCE_LISTEN:
+      AcceptClient();
+      break;
+    case SOURCE_CLIENT:
+      ReadClient(source);
+      break;
+    case SOURCE_DECODE:
+      ReadDecodeCompletions();
+      break;
+    }
+  }
+  return fired;
+}
+
+// open an evdev device if it has arrow keys
+static void OpenInputDevice(const char * path, int quiet)
+{
+  unsigned long keys[KEY_MAX / (8 * sizeof(unsigned long)) + 1];
+  if (inputCount == MAX_INPUT_DEVICES) {
+    return;
+  }
+  int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    if (!quiet) {
+      printf("Failed opening input device '%s'\n", path);
+    }
+    return;
+  }
+  memset(keys, 0, sizeof(keys));
+  int bitsPerLong = 8 * sizeof(unsigned long);
+  if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) < 0 ||
+      !(keys[KEY_RIGHT / bitsPerLong] & (1UL << (KEY_RIGHT % bitsPerLong)))) {
+    close(fd);
+    return;
+  }
+  Source * source = inputSources + inputCount;
+  source->type = SOURCE_INPUT;
+  source->fd = fd;
+  if (Watch(source) == 0) {
+    inputCount++;
+  }
+  else {
+    close(fd);
+  }
+}
+
+static void OpenInputDevices(const char * spec)
+{
+  char path[300];
+  if (strcmp(spec, "auto") == 0) {
+    DIR * dir = opendir("/dev/input");
+    struct dirent * dp;
+    if (dir == NULL) {
+      return;
+    }
+    while ((dp = readdir(dir)) != NULL) {
+      if (strncmp(dp->d_name, "event", 5) == 0) {
+	snprintf(path, sizeof(path), "/dev/input/%s", dp->d_name);
+	OpenInputDevice(path, 1);
+      }
+    }
+    closedir(dir);
+    return;
+  }
+  while (*spec) {
+    int length = strcspn(spec, ",");
+    snprintf(path, sizeof(path), "%.*s", length, spec);
+    OpenInputDevice(path, 0);
+    spec += length + (spec[length] == ',');
+  }
+}
+
+static void OpenControlSocket(const char * path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(controlPath, sizeof(controlPath), "%s", path);
+  strcpy(addr.sun_path, controlPath);
+  unlink(controlPath);
+  listenSource.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listenSource.fd < 0 || bind(listenSource.fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+      listen(listenSource.fd, 4) != 0 || Watch(&listenSource) != 0) {
+    printf("Failed listening for commands on '%s'\n", controlPath);
+    if (listenSource.fd >= 0) {
+      close(listenSource.fd);
+      listenSource.fd = -1;
+    }
+    controlPath[0] = '\0';
+  }
+}
+
+
+// InitEventLoop sets up the event sources.  It blocks the signals it
+// handles, so it must be called before any thread is started for them
+// to stay blocked everywhere.  controlSocket may be NULL.
+int InitEventLoop(const char * controlSocket)
+{
+  sigset_t signals;
+  int i;
+
+  for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+    clientSources[i].fd = -1;
+  }
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+  timerSource.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  decodeSource.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGHUP);
+  sigprocmask(SIG_BLOCK, &signals, NULL);
+  signalSource.fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (epollFd < 0 || timerSource.fd < 0 || decodeSource.fd < 0 || signalSource.fd < 0 ||
+      Watch(&timerSource) != 0 || Watch(&decodeSource) != 0 || Watch(&signalSource) != 0) {
+    printf("Failed setting up the event loop\n");
+    return -1;
+  }
+
+  if (isatty(STDIN_FILENO)) {
+    saveterm();
+    rawterm();
+    terminalSource.fd = STDIN_FILENO;
+    fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+    Watch(&terminalSource);
+  }
+  if (getenv("PISLIDES_INPUT")) {
+    OpenInputDevices(getenv("PISLIDES_INPUT"));
+  }
+  if (controlSocket) {
+    OpenControlSocket(controlSocket);
+  }
+  return 0;
+}
+
+// WaitForEvents handles events until a command arrives or the vgwrap_now_ms()
+// time until passes, whichever is first.  until < 0 waits for a command
+// only.  Returns the command, or COMMAND_NONE at the deadline.
+int WaitForEvents(double until)
+{
+  int command = TakeCommand();
+  if (command != COMMAND_NONE) {
+    return command;
+  }
+  if (until >= 0.0 && until <= vgwrap_now_ms()) {
+    Dispatch(0);
+    return TakeCommand();
+  }
+  ArmTimer(until >= 0.0 ? until : 0.0);
+  for (;;) {
+    int fired = Dispatch(-1);
+    command = TakeCommand();
+    if (command != COMMAND_NONE || fired) {
+      break;
+    }
+  }
+  ArmTimer(0.0);
+  return command;
+}
+
+// PollCommand handles whatever events are ready without waiting.  Returns
+// the oldest command not yet taken.
+int PollCommand()
+{
+  if (commandCount == 0 && epollFd >= 0) {
+    Dispatch(0);
+  }
+  return TakeCommand();
+}
+
+// UntakeCommand puts a command back to be returned next
+void UntakeCommand(int command)
+{
+  if (command == COMMAND_NONE) {
+    return;
+  }
+  if (commandCount == COMMAND_QUEUE) {
+    commandCount--;
+  }
+  commandHead = (commandHead + COMMAND_QUEUE - 1) % COMMAND_QUEUE;
+  commandQueue[commandHead] = command;
+  commandCount++;
+}
+
+// RequestedPlaylist gives the playlist last asked for by a
+// COMMAND_PLAYLIST
+void RequestedPlaylist(Playlist * playlist)
+{
+  *playlist = requestedPlaylist;
+}
+
+// SetDecodeCompleteHandler sets what runs on the event loop's thread
+// after another thread calls SignalDecodeComplete
+void SetDecodeCompleteHandler(DecodeCompleteFunc handler)
+{
+  decodeComplete = handler;
+}
+
+// SignalDecodeComplete wakes the event loop from any thread
+void SignalDecodeComplete()
+{
+  uint64_t one = 1;
+  if (write(decodeSource.fd, &one, sizeof(one)) != sizeof(one)) {
+    // already signalled and not yet read, which is just as good
+  }
+}
+
+void PrintEventStats()
+{
+  printf("events: %ld commands, %d input devices%s%s\n", commandsReceived, inputCount,
+	 terminalSource.fd >= 0 ? ", terminal" : "", controlPath[0] ? ", control socket" : "");
+}
+
+void FinishEventLoop()
+{
+  int i;
+  if (terminalSource.fd >= 0) {
+    restoreterm();
+    fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) & ~O_NONBLOCK);
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+    terminalSource.fd = -1;
+  }
+  for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+    if (clientSources[i].fd >= 0) {
+      Unwatch(clientSources + i);
+    }
+  }
+  if (listenSource.fd >= 0) {
+    Unwatch(&listenSource);
+    unlink(controlPath);
+  }
+}
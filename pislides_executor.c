@@ -0,0 +1,359 @@
+// Executor: worker threads shared by everything that runs off the main
+// thread, in priority lanes.
+//
+// LANE_DISPLAY is for work a slide deadline depends on, decoding the next
+// slides.  Its workers run at normal priority.  LANE_BACKGROUND is for
+// work nobody is waiting on, such as dating the catalog or warming caches.
+// Its workers run in the SCHED_IDLE scheduling class and the idle I/O
+// class, so they only get a core, or the disk, that nothing else wants,
+// and never delay a slide.
+//
+// Decodes on LANE_DISPLAY are limited to the memory governor's decode
+// threads at once, each needing its own source and raster buffers, so
+// when memory is short the lane's other workers wait.
+//
+// Each lane has a queue shared by its workers, so whichever worker is free
+// takes the oldest task; with a handful of workers that is what stealing
+// from each other's queues would amount to.  Work doesn't cross lanes: a
+// display worker running background work would do it at normal priority,
+// and a background worker can't be trusted with a deadline.
+//
+// Tasks belong to whoever submits them, usually embedded in a larger
+// structure.  Cancelling is cooperative: a queued task is taken off its
+// queue, a running one has its cancelled flag set and is expected to
+// notice and return early.  The executor doesn't touch a task again once
+// it has finished, so its owner may free it after WaitTask.
+//
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "pislides.h"
+
+#define MAX_WORKERS 8
+
+// from linux/ioprio.h, which not every libc installs
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+typedef struct _Lane {
+  Task * head;
+  Task * tail;
+  int workers;
+  int queued;
+  int running;
+  // counters since InitExecutor, busy time since the last stats
+  long submitted, completed, cancelled;
+  int peakQueued;
+  double maxWaitMs;
+  double busyMs;
+  double busySince;
+} Lane;
+
+static const char * laneNames[LANE_COUNT] = { "display", "background" };
+
+static pthread_mutex_t executorLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t taskQueued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t taskFinished = PTHREAD_COND_INITIALIZER;
+static Lane lanes[LANE_COUNT];
+static pthread_t workers[MAX_WORKERS];
+static int workerLanes[MAX_WORKERS];
+static double workerStarted[MAX_WORKERS];	// the task running, 0 if none
+static int workerCount;
+static int stopping;
+
+
+// lower the calling thread to the idle CPU and I/O classes.  Failing that
+// it runs at normal priority, which is only less polite.
+static void BecomeIdle()
+{
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+    printf("Failed setting SCHED_IDLE for background work\n");
+  }
+  syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+}
+
+// how many of a lane's tasks may run at once.  The governor's limit
+// changes as memory does; a worker held back by it is woken when a task
+// finishes.
+static int LaneLimit(int laneIndex)
+{
+  if (laneIndex != LANE_DISPLAY) {
+    return MAX_WORKERS;
+  }
+  // 0 until the governor has started
+  int threads = GetMemoryLimits()->decodeThreads;
+  return threads > 0 ? threads : 1;
+}
+
+// take the oldest task off a lane.  Called with executorLock held.
+static Task * Dequeue(Lane * lane)
+{
+  Task * task = lane->head;
+  if (task) {
+    lane->head = task->next;
+    if (lane->head == NULL) {
+      lane->tail = NULL;
+    }
+    task->next = NULL;
+    lane->queued--;
+  }
+  return task;
+}
+
+static void * WorkerMain(void * arg)
+{
+  int worker = (long) arg, laneIndex = workerLanes[worker];
+  Lane * lane = lanes + laneIndex;
+  if (laneIndex == LANE_BACKGROUND) {
+    BecomeIdle();
+  }
+
+  pthread_mutex_lock(&executorLock);
+  for (;;) {
+    Task * task = lane->running < LaneLimit(laneIndex) ? Dequeue(lane) : NULL;
+    if (task == NULL) {
+      if (stopping) {
+	break;
+      }
+      pthread_cond_wait(&taskQueued, &executorLock);
+      continue;
+    }
+    task->state = TASK_RUNNING;
+    double started = vgwrap_now_ms();
+    double waited = started - task->queuedAt;
+    if (waited > lane->maxWaitMs) {
+      lane->maxWaitMs = waited;
+    }
+    lane->running++;
+    workerStarted[worker] = started;
+    pthread_mutex_unlock(&executorLock);
+
+    task->run(task);
+
+    pthread_mutex_lock(&executorLock);
+    lane->running--;
+    // the time since the last stats, the rest was counted then
+    lane->busyMs += vgwrap_now_ms() - (started > lane->busySince ? started : lane->busySince);
+    workerStarted[worker] = 0.0;
+    if (task->cancelled) {
+      lane->cancelled++;
+    }
+    else {
+      lane->completed++;
+    }
+    task->state = TASK_FINISHED;
+    pthread_cond_broadcast(&taskFinished);
+    // a worker held back by the lane's limit may go now
+    pthread_cond_broadcast(&taskQueued);
+  }
+  pthread_mutex_unlock(&executorLock);
+  return NULL;
+}
+
+
+// InitExecutor starts displayWorkers workers for LANE_DISPLAY and
+// backgroundWorkers for LANE_BACKGROUND.  A lane without workers runs its
+// tasks as they are submitted.
+void InitExecutor(int displayWorkers, int backgroundWorkers)
+{
+  int counts[LANE_COUNT], i, l;
+  counts[LANE_DISPLAY] = displayWorkers;
+  counts[LANE_BACKGROUND] = backgroundWorkers;
+
+  stopping = 0;
+  workerCount = 0;
+  for (l = 0; l < LANE_COUNT; l++) {
+    memset(lanes + l, 0, sizeof(Lane));
+    lanes[l].busySince = vgwrap_now_ms();
+    for (i = 0; i < counts[l] && workerCount < MAX_WORKERS; i++) {
+      workerLanes[workerCount] = l;
+      if (pthread_create(workers + workerCount, NULL, WorkerMain, (void *) (long) workerCount) != 0) {
+	printf("Failed starting %s workers, running their tasks as submitted\n", laneNames[l]);
+	break;
+      }
+      lanes[l].workers++;
+      workerCount++;
+    }
+  }
+}
+
+// SubmitTask queues task on a lane, to have task->run called on one of
+// its workers.  task->run and task->context must be set; the rest is the
+// executor's.  The task must not be submitted again until it has
+// finished.
+void SubmitTask(Task * task, int laneIndex)
+{
+  Lane * lane = lanes + laneIndex;
+  task->next = NULL;
+  task->lane = laneIndex;
+  task->cancelled = 0;
+  task->queuedAt = vgwrap_now_ms();
+
+  pthread_mutex_lock(&executorLock);
+  lane->submitted++;
+  if (lane->workers == 0) {
+    // nobody to hand it to
+    task->state = TASK_RUNNING;
+    pthread_mutex_unlock(&executorLock);
+    task->run(task);
+    pthread_mutex_lock(&executorLock);
+    lane->completed++;
+    task->state = TASK_FINISHED;
+    pthread_mutex_unlock(&executorLock);
+    return;
+  }
+  task->state = TASK_QUEUED;
+  if (lane->tail) {
+    lane->tail->next = task;
+  }
+  else {
+    lane->head = task;
+  }
+  lane->tail = task;
+  lane->queued++;
+  if (lane->queued > lane->peakQueued) {
+    lane->peakQueued = lane->queued;
+  }
+  pthread_cond_broadcast(&taskQueued);
+  pthread_mutex_unlock(&executorLock);
+}
+
+// take a queued task off its lane.  Called with executorLock held.
+static int Unqueue(Task * task)
+{
+  Lane * lane = lanes + task->lane;
+  Task ** link = &lane->head, * prev = NULL;
+  if (task->state != TASK_QUEUED) {
+    return 0;
+  }
+  while (*link != task) {
+    prev = *link;
+    link = &prev->next;
+  }
+  *link = task->next;
+  if (lane->tail == task) {
+    lane->tail = prev;
+  }
+  lane->queued--;
+  task->next = NULL;
+  task->state = TASK_FINISHED;
+  return 1;
+}
+
+// UnqueueTask takes a task off its lane if it hasn't started, so the
+// caller can do the work itself.  Returns 0 if it has started, or
+// finished.
+int UnqueueTask(Task * task)
+{
+  pthread_mutex_lock(&executorLock);
+  int taken = Unqueue(task);
+  pthread_mutex_unlock(&executorLock);
+  return taken;
+}
+
+// CancelTask takes a queued task off its lane without running it, or asks
+// a running one to stop.  A task that never ran finishes at once.
+void CancelTask(Task * task)
+{
+  pthread_mutex_lock(&executorLock);
+  if (Unqueue(task)) {
+    lanes[task->lane].cancelled++;
+  }
+  task->cancelled = 1;
+  pthread_mutex_unlock(&executorLock);
+}
+
+// TaskFinished tells whether a task has run, or was cancelled before it
+// could.  A task that was never submitted counts as finished.
+int TaskFinished(Task * task)
+{
+  pthread_mutex_lock(&executorLock);
+  int finished = task->state == TASK_FINISHED || task->state == TASK_IDLE;
+  pthread_mutex_unlock(&executorLock);
+  return finished;
+}
+
+// WaitTask waits for a task to finish
+void WaitTask(Task * task)
+{
+  pthread_mutex_lock(&executorLock);
+  while (task->state == TASK_QUEUED || task->state == TASK_RUNNING) {
+    pthread_cond_wait(&taskFinished, &executorLock);
+  }
+  pthread_mutex_unlock(&executorLock);
+}
+
+// ExecutorWorkers returns how many workers a lane has
+int ExecutorWorkers(int laneIndex)
+{
+  return lanes[laneIndex].workers;
+}
+
+// GetExecutorStats fills in a lane's queue depth and how busy its workers
+// have been since the last call, as a fraction of their time
+void GetExecutorStats(int laneIndex, ExecutorStats * stats)
+{
+  Lane * lane = lanes + laneIndex;
+  int i;
+  pthread_mutex_lock(&executorLock);
+  double now = vgwrap_now_ms(), elapsed = now - lane->busySince;
+  // with the tasks still running so far
+  for (i = 0; i < workerCount; i++) {
+    if (workerLanes[i] == laneIndex && workerStarted[i] > 0.0) {
+      lane->busyMs += now - (workerStarted[i] > lane->busySince ? workerStarted[i] : lane->busySince);
+    }
+  }
+  stats->workers = lane->workers;
+  stats->queued = lane->queued;
+  stats->running = lane->running;
+  stats->peakQueued = lane->peakQueued;
+  stats->submitted = lane->submitted;
+  stats->completed = lane->completed;
+  stats->cancelled = lane->cancelled;
+  stats->maxWaitMs = lane->maxWaitMs;
+  stats->utilisation = lane->workers > 0 && elapsed > 0.0 ? lane->busyMs / (elapsed * lane->workers) : 0.0;
+  lane->busyMs = 0.0;
+  lane->busySince = now;
+  pthread_mutex_unlock(&executorLock);
+}
+
+void PrintExecutorStats()
+{
+  ExecutorStats stats;
+  int l;
+  for (l = 0; l < LANE_COUNT; l++) {
+    GetExecutorStats(l, &stats);
+    if (stats.submitted == 0) {
+      continue;
+    }
+    printf("executor: %s %d workers %.0f%% busy, %d queued (peak %d), %ld done, %ld cancelled, waited up to %.1f ms\n",
+	   laneNames[l], stats.workers, stats.utilisation * 100.0, stats.queued, stats.peakQueued,
+	   stats.completed, stats.cancelled, stats.maxWaitMs);
+  }
+}
+
+// FinishExecutor lets the workers finish what is queued and stops them
+void FinishExecutor()
+{
+  int i;
+  pthread_mutex_lock(&executorLock);
+  stopping = 1;
+  pthread_cond_broadcast(&taskQueued);
+  pthread_mutex_unlock(&executorLock);
+  for (i = 0; i < workerCount; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  workerCount = 0;
+  memset(lanes, 0, sizeof(lanes));
+}
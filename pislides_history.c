@@ -0,0 +1,396 @@
+// Slide history and lookahead.  Slides are decoded to rasters already
+// fitted to the screen, which are kept after they are shown, so stepping
+// back through the last few slides, and forward again, only has to upload
+// a raster that is ready.  In the other direction the next slides in
+// playback order are decoded ahead in the executor's display lane, while
+// the current one is up.  A slide dropped from the lookahead while it is
+// being decoded has its decode cancelled.
+//
+// The history keeps as many slides decoded as fit in half the memory
+// governor's cache allowance, at least MIN_HISTORY.  Older slides, up to
+// MAX_HISTORY, are handed to the compressed slide cache, which has the
+// rest of the allowance, and are expanded again to be shown; the one
+// before is expanded ahead on a display worker while stepping back.  The
+// lookahead is as many as the governor allows decoding ahead.  Both are
+// shed, oldest and furthest first, when memory gets tight.
+//
+// Slides are looked for in the compressed cache before they are decoded,
+// so images that come round again soon, as they do in short playlists,
+// are only expanded.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pislides.h"
+
+#define MIN_HISTORY 2
+#define MAX_HISTORY 32
+#define MAX_LOOKAHEAD 4
+
+typedef struct _SlideRaster {
+  char * path;
+  VGubyte * pixels;		// bottom row first
+  VGImageFormat format;
+  unsigned width, height;
+  Task decode;			// decoding ahead, pixels are set once finished
+  int expanded;			// pixels are from the compressed cache, to show it
+} SlideRaster;
+
+static unsigned fitWidth, fitHeight;
+
+// shown slides, newest first
+static SlideRaster * history[MAX_HISTORY];
+static int historyCount;
+
+// upcoming slides in playback order, and those dropped from it while
+// they were being decoded, freed once their decode gives up.  All of it
+// is only touched by the main thread; the decodes only write their own
+// raster.
+static SlideRaster * lookahead[MAX_LOOKAHEAD];
+static int lookaheadCount;
+static SlideRaster * dropped[MAX_LOOKAHEAD];
+static int droppedCount;
+static int decodingAhead;
+
+static long lookaheadHits, lookaheadWaits, decodedNow, historyShown, decodesCancelled;
+
+
+static size_t RasterBytes(const SlideRaster * raster)
+{
+  return raster->pixels ? ImageBytes(raster->format, raster->width, raster->height) : 0;
+}
+
+static void FreeRaster(SlideRaster * raster)
+{
+  WaitTask(&raster->decode);
+  FreeDecodedImage(raster->pixels);
+  free(raster->path);
+  free(raster);
+}
+
+// get a raster's pixels from the compressed cache, or decoding its image
+static void Rasterize(SlideRaster * raster)
+{
+  raster->pixels = LoadCachedSlide(raster->path, fitWidth, fitHeight, &raster->width, &raster->height,
+				   &raster->format);
+  if (raster->pixels == NULL) {
+    raster->pixels = DecodeImage(raster->path, fitWidth, fitHeight, &raster->width, &raster->height,
+				 &raster->format);
+  }
+}
+
+static void DecodeRaster(Task * task)
+{
+  SlideRaster * raster = task->context;
+  SetDecodeCancel(&task->cancelled);
+  Rasterize(raster);
+  SetDecodeCancel(NULL);
+}
+
+static SlideRaster * NewRaster(const char * path)
+{
+  SlideRaster * raster = calloc(1, sizeof(SlideRaster));
+  raster->path = strdup(path);
+  raster->decode.run = DecodeRaster;
+  raster->decode.context = raster;
+  return raster;
+}
+
+// a lookahead slide is ready once its decode has finished and worked
+static int RasterReady(SlideRaster * raster)
+{
+  return TaskFinished(&raster->decode) && raster->pixels != NULL;
+}
+
+// free the dropped slides whose decodes have given up
+static void ReapDropped()
+{
+  int i = 0;
+  while (i < droppedCount) {
+    if (TaskFinished(&dropped[i]->decode)) {
+      FreeRaster(dropped[i]);
+      dropped[i] = dropped[--droppedCount];
+    }
+    else {
+      i++;
+    }
+  }
+}
+
+// drop lookahead entry i, cancelling its decode
+static void DropLookahead(int i)
+{
+  SlideRaster * raster = lookahead[i];
+  if (!TaskFinished(&raster->decode)) {
+    decodesCancelled++;
+  }
+  CancelTask(&raster->decode);
+  if (TaskFinished(&raster->decode)) {
+    FreeRaster(raster);
+  }
+  else {
+    ReapDropped();
+    if (droppedCount == MAX_LOOKAHEAD) {
+      // only as many decodes run as there are display workers, so this
+      // is a short wait for a cancelled one
+      WaitTask(&dropped[0]->decode);
+      ReapDropped();
+    }
+    dropped[droppedCount++] = raster;
+  }
+  memmove(lookahead + i, lookahead + i + 1, (lookaheadCount - i - 1) * sizeof(SlideRaster *));
+  lookaheadCount--;
+}
+
+// hand a history slide's pixels to the compressed cache
+static void CompressRaster(SlideRaster * raster)
+{
+  WaitTask(&raster->decode);
+  if (raster->pixels) {
+    CacheSlide(raster->path, fitWidth, fitHeight, raster->pixels, raster->format,
+	       raster->width, raster->height);
+    raster->pixels = NULL;
+  }
+  raster->expanded = 0;
+}
+
+// make room in the history for one more slide, keeping the decoded ones
+// within half the governor's cache allowance and giving the compressed
+// cache the rest
+static void TrimHistory(size_t incoming)
+{
+  size_t allowed = GetMemoryLimits()->cacheBytes, held = incoming;
+  int i, compressing = 0;
+  for (i = 0; i < historyCount; i++) {
+    SlideRaster * raster = history[i];
+    if (raster->expanded) {
+      CompressRaster(raster);
+    }
+    held += RasterBytes(raster);
+    if (!compressing && held > allowed / 2 && i + 1 >= MIN_HISTORY) {
+      compressing = 1;
+    }
+    if (compressing) {
+      held -= RasterBytes(raster);
+      CompressRaster(raster);
+    }
+  }
+  // the oldest, and those the cache has let go of
+  while (historyCount >= MAX_HISTORY ||
+	 (historyCount > MIN_HISTORY && history[historyCount - 1]->pixels == NULL &&
+	  !IsSlideCached(history[historyCount - 1]->path, fitWidth, fitHeight))) {
+    FreeRaster(history[--historyCount]);
+  }
+  SetSlideCacheBudget(allowed > held ? allowed - held : 0);
+}
+
+// MakeSlideImage uploads a raster and places it on screen
+static CenteredScaledImage * MakeSlideImage(SlideRaster * raster)
+{
+  TiledImage * img = createTiledImageFromRaster(raster->pixels, raster->format,
+						&raster->width, &raster->height);
+  if (img == NULL) {
+    printf("Failed creating an image for '%s'\n", raster->path);
+    return NULL;
+  }
+  return MakeScaledImage(img);
+}
+
+
+// InitSlideHistory sets the size slides are fitted to, width x height.
+// Slides are decoded ahead if the executor has display workers.
+void InitSlideHistory(unsigned width, unsigned height)
+{
+  fitWidth = width;
+  fitHeight = height;
+  decodingAhead = ExecutorWorkers(LANE_DISPLAY) > 0;
+  if (!decodingAhead) {
+    printf("No display workers, decoding as slides are shown\n");
+  }
+}
+
+// SetSlideLookahead sets the slides coming up next, in order.  As many
+// as memory allows are decoded ahead; slides no longer listed are
+// dropped.
+void SetSlideLookahead(char ** paths, int count)
+{
+  int i, j, wanted = GetMemoryLimits()->decodeAhead;
+  if (wanted > MAX_LOOKAHEAD) {
+    wanted = MAX_LOOKAHEAD;
+  }
+  if (count > wanted) {
+    count = wanted;
+  }
+  if (!decodingAhead) {
+    count = 0;
+  }
+
+  ReapDropped();
+  SlideRaster * kept[MAX_LOOKAHEAD];
+  for (i = 0; i < count; i++) {
+    kept[i] = NULL;
+    for (j = 0; j < lookaheadCount; j++) {
+      if (strcmp(lookahead[j]->path, paths[i]) == 0) {
+	kept[i] = lookahead[j];
+	memmove(lookahead + j, lookahead + j + 1, (lookaheadCount - j - 1) * sizeof(SlideRaster *));
+	lookaheadCount--;
+	break;
+      }
+    }
+  }
+  while (lookaheadCount > 0) {
+    DropLookahead(lookaheadCount - 1);
+  }
+  // nearest first, the lane takes them in order
+  for (i = 0; i < count; i++) {
+    if (kept[i] == NULL) {
+      kept[i] = NewRaster(paths[i]);
+      SubmitTask(&kept[i]->decode, LANE_DISPLAY);
+    }
+  }
+  memcpy(lookahead, kept, count * sizeof(SlideRaster *));
+  lookaheadCount = count;
+}
+
+// LoadSlide returns the image for a new slide and adds it to the history,
+// from the lookahead if it was decoded ahead (waiting for it if it is
+// being decoded) or decoded now.  Returns NULL if it couldn't be loaded.
+CenteredScaledImage * LoadSlide(char * filename)
+{
+  SlideRaster * raster = NULL;
+  int i, decodeNow = 1;
+
+  for (i = 0; i < lookaheadCount; i++) {
+    if (strcmp(lookahead[i]->path, filename) == 0) {
+      raster = lookahead[i];
+      memmove(lookahead + i, lookahead + i + 1, (lookaheadCount - i - 1) * sizeof(SlideRaster *));
+      lookaheadCount--;
+      // decoding it here is as quick as waiting if it hasn't started
+      if (!UnqueueTask(&raster->decode)) {
+	lookaheadHits++;
+	if (!TaskFinished(&raster->decode)) {
+	  lookaheadWaits++;
+	  WaitTask(&raster->decode);
+	}
+	decodeNow = 0;
+      }
+      break;
+    }
+  }
+
+  if (decodeNow) {
+    if (raster == NULL) {
+      raster = NewRaster(filename);
+    }
+    Rasterize(raster);
+    decodedNow++;
+  }
+  CenteredScaledImage * csv = raster->pixels ? MakeSlideImage(raster) : NULL;
+  if (csv == NULL) {
+    FreeRaster(raster);
+    return NULL;
+  }
+
+  TrimHistory(RasterBytes(raster));
+  memmove(history + 1, history, historyCount * sizeof(SlideRaster *));
+  history[0] = raster;
+  historyCount++;
+  return csv;
+}
+
+// HistorySlide returns the image for the slide shown back slides before
+// the newest, 0 being the newest, without decoding.  Returns NULL if the
+// history doesn't reach that far.
+CenteredScaledImage * HistorySlide(int back)
+{
+  int i;
+  if (back < 0 || back >= historyCount) {
+    return NULL;
+  }
+  SlideRaster * raster = history[back];
+  WaitTask(&raster->decode);
+  if (raster->pixels == NULL) {
+    raster->pixels = LoadCachedSlide(raster->path, fitWidth, fitHeight, &raster->width, &raster->height,
+				     &raster->format);
+    if (raster->pixels == NULL) {
+      return NULL;
+    }
+    raster->expanded = 1;
+  }
+  historyShown++;
+  CenteredScaledImage * csv = MakeSlideImage(raster);
+
+  // only the slides either side stay expanded, and the one before is
+  // expanded ahead of stepping back to it
+  for (i = 0; i < historyCount; i++) {
+    if (history[i]->expanded && (i < back - 1 || i > back + 1)) {
+      CompressRaster(history[i]);
+    }
+  }
+  if (back + 1 < historyCount && history[back + 1]->pixels == NULL &&
+      IsSlideCached(history[back + 1]->path, fitWidth, fitHeight)) {
+    history[back + 1]->expanded = 1;
+    SubmitTask(&history[back + 1]->decode, LANE_DISPLAY);
+  }
+  return csv;
+}
+
+// SlideCacheBytes returns the memory held by decoded slides
+size_t SlideCacheBytes()
+{
+  size_t bytes = 0;
+  int i;
+  for (i = 0; i < historyCount; i++) {
+    if (TaskFinished(&history[i]->decode)) {
+      bytes += RasterBytes(history[i]);
+    }
+  }
+  for (i = 0; i < lookaheadCount; i++) {
+    if (RasterReady(lookahead[i])) {
+      bytes += RasterBytes(lookahead[i]);
+    }
+  }
+  return bytes;
+}
+
+// ShedSlideCache frees decoded slides until at most bytes are held: the
+// oldest history first, then the furthest lookahead, cancelling its
+// decode if it isn't done.  The newest slide is kept, it is the one being
+// shown.
+void ShedSlideCache(size_t bytes)
+{
+  while (historyCount > 1 && SlideCacheBytes() > bytes) {
+    FreeRaster(history[--historyCount]);
+  }
+  while (lookaheadCount > 0 && SlideCacheBytes() > bytes) {
+    DropLookahead(lookaheadCount - 1);
+  }
+}
+
+void PrintHistoryStats()
+{
+  int ready = 0, i;
+  for (i = 0; i < lookaheadCount; i++) {
+    ready += RasterReady(lookahead[i]);
+  }
+  printf("history: %d slides, %d of %d ahead ready, %zu MB, %ld decoded ahead (%ld waited for), %ld decoded when shown, %ld shown again, %ld decodes cancelled\n",
+	 historyCount, ready, lookaheadCount, SlideCacheBytes() / (1024 * 1024),
+	 lookaheadHits, lookaheadWaits, decodedNow, historyShown, decodesCancelled);
+}
+
+// FinishSlideHistory cancels the decodes ahead and frees every slide
+void FinishSlideHistory()
+{
+  while (lookaheadCount > 0) {
+    DropLookahead(lookaheadCount - 1);
+  }
+  while (droppedCount > 0) {
+    WaitTask(&dropped[0]->decode);
+    ReapDropped();
+  }
+  while (historyCount > 0) {
+    FreeRaster(history[--historyCount]);
+  }
+}
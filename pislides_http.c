@@ -0,0 +1,812 @@
+// HTTP image source, for showing photos kept on a NAS or web server
+// without copying them to every frame.
+//
+// The images location is the URL of a manifest, a text file listing one
+// image per line as a URL, absolute or relative to the manifest.  Blank
+// lines and lines starting with # are skipped.  Images are decoded as
+// their bytes arrive, through a libjpeg source reading the socket, and
+// written to a local cache on the way.  A cached image is revalidated
+// with If-None-Match and If-Modified-Since, so an unchanged one costs a
+// 304 rather than the transfer, and when the server can't be reached the
+// cached copy is shown.  The manifest is cached the same way.  The cache
+// is kept under HTTP_CACHE_MB by removing the least recently used files,
+// and at most HTTP_MAX_FETCHES requests are in flight at once.
+//
+// Plain http only, unless built with HTTPS_SOURCE (see the Makefile).
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef HTTPS_SOURCE
+#include <signal.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#include "pislides.h"
+
+#ifndef HTTP_CACHE_DIR
+#define HTTP_CACHE_DIR "cache"
+#endif
+#ifndef HTTP_CACHE_MB
+#define HTTP_CACHE_MB 256
+#endif
+#ifndef HTTP_MAX_FETCHES
+#define HTTP_MAX_FETCHES 2
+#endif
+
+#define HTTP_TIMEOUT_S 10
+#define MAX_REDIRECTS 4
+#define MAX_URL 2048
+
+// the cache is trimmed to this share of its limit, so it isn't trimmed
+// again on the very next fetch
+#define CACHE_TRIM_PERCENT 90
+
+typedef struct _HttpConnection {
+  int fd;
+#ifdef HTTPS_SOURCE
+  SSL * ssl;
+#endif
+  char buffer[8192];
+  int bufferStart, bufferEnd;
+
+  // response
+  int status;
+  char etag[256];
+  char lastModified[64];
+  char location[MAX_URL];
+  int chunked;
+  long long remaining;		// left in the body or chunk, -1 to the close
+  int ended;
+  long long received;
+
+  FILE * tee;			// cache file the body is copied to
+  int teeFailed;
+} HttpConnection;
+
+static pthread_mutex_t fetchLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fetchSlotFree = PTHREAD_COND_INITIALIZER;
+static int fetchesActive;
+
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static long long cacheBytes = -1;	// -1 until the cache has been sized
+
+// counted with fetchLock held
+static long fetched, notModified, offline, failed;
+static long long bytesFetched;
+
+#ifdef HTTPS_SOURCE
+static pthread_once_t sslOnce = PTHREAD_ONCE_INIT;
+static SSL_CTX * sslContext;
+
+static void InitSsl()
+{
+  // a server closing on us mid-write must not kill the slideshow
+  signal(SIGPIPE, SIG_IGN);
+  sslContext = SSL_CTX_new(TLS_client_method());
+  if (sslContext) {
+    SSL_CTX_set_default_verify_paths(sslContext);
+    SSL_CTX_set_verify(sslContext, SSL_VERIFY_PEER, NULL);
+  }
+}
+#endif
+
+
+// IsHttpLocation returns nonzero for the URLs this source handles
+int IsHttpLocation(const char * location)
+{
+  return strncmp(location, "http://", 7) == 0
+#ifdef HTTPS_SOURCE
+    || strncmp(location, "https://", 8) == 0
+#endif
+    ;
+}
+
+// split url into host, port and path.  Returns 0 if it is one we handle.
+static int ParseUrl(const char * url, int * secure, char * host, int hostSize, char * port, char * path, int pathSize)
+{
+  const char * p;
+  *secure = strncmp(url, "https://", 8) == 0;
+  if (!IsHttpLocation(url)) {
+    return -1;
+  }
+  p = url + (*secure ? 8 : 7);
+  const char * end = p + strcspn(p, "/?#");
+  const char * colon = memchr(p, ':', end - p);
+  const char * hostEnd = colon ? colon : end;
+  if (hostEnd == p || hostEnd - p >= hostSize) {
+    return -1;
+  }
+  memcpy(host, p, hostEnd - p);
+  host[hostEnd - p] = '\0';
+  if (colon) {
+    snprintf(port, 8, "%.*s", (int) (end - colon - 1), colon + 1);
+  }
+  else {
+    strcpy(port, *secure ? "443" : "80");
+  }
+  // manifests made with find have spaces and such in them, which aren't
+  // allowed in a request
+  const char * from = *end == '/' ? end : "/";
+  int length = 0;
+  if (*end == '?') {
+    path[length++] = '/';
+    from = end;
+  }
+  for (; *from && *from != '#' && length < pathSize - 4; from++) {
+    unsigned char ch = *from;
+    if (ch <= ' ' || ch >= 0x7f || ch == '"') {
+      length += sprintf(path + length, "%%%02X", ch);
+    }
+    else {
+      path[length++] = ch;
+    }
+  }
+  path[length] = '\0';
+  return 0;
+}
+
+static int ConnectTo(const char * host, const char * port)
+{
+  struct addrinfo hints, * addresses, * a;
+  struct timeval timeout = { HTTP_TIMEOUT_S, 0 };
+  int fd = -1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &addresses) != 0) {
+    return -1;
+  }
+  for (a = addresses; a && fd < 0; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    // the send timeout bounds connect too
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  return fd;
+}
+
+static long RawRead(HttpConnection * c, void * buf, size_t size)
+{
+#ifdef HTTPS_SOURCE
+  if (c->ssl) {
+    int n = SSL_read(c->ssl, buf, size);
+    return n > 0 ? n : SSL_get_error(c->ssl, n) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+  }
+#endif
+  ssize_t n;
+  do {
+    n = recv(c->fd, buf, size, 0);
+  } while (n < 0 && errno == EINTR);
+  return n;
+}
+
+static int RawWrite(HttpConnection * c, const char * text, size_t size)
+{
+  while (size > 0) {
+    ssize_t n;
+#ifdef HTTPS_SOURCE
+    if (c->ssl) {
+      n = SSL_write(c->ssl, text, size);
+    }
+    else
+#endif
+    n = send(c->fd, text, size, MSG_NOSIGNAL);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+	continue;
+      }
+      return -1;
+    }
+    text += n;
+    size -= n;
+  }
+  return 0;
+}
+
+// FillBuffer reads more into the buffer when it is empty.  Returns the bytes
+// buffered, 0 at the close or -1 on error.
+static long FillBuffer(HttpConnection * c)
+{
+  if (c->bufferStart == c->bufferEnd) {
+    long n = RawRead(c, c->buffer, sizeof(c->buffer));
+    c->bufferStart = 0;
+    c->bufferEnd = n > 0 ? n : 0;
+    if (n <= 0) {
+      return n;
+    }
+  }
+  return c->bufferEnd - c->bufferStart;
+}
+
+// ReadLine reads a CRLF terminated line, without the line end.  Returns
+// -1 at the close or on error.
+static int ReadLine(HttpConnection * c, char * line, int size)
+{
+  int length = 0;
+  for (;;) {
+    if (FillBuffer(c) <= 0) {
+      return -1;
+    }
+    char ch = c->buffer[c->bufferStart++];
+    if (ch == '\n') {
+      break;
+    }
+    if (ch != '\r' && length < size - 1) {
+      line[length++] = ch;
+    }
+  }
+  line[length] = '\0';
+  return length;
+}
+
+static void CloseConnection(HttpConnection * c)
+{
+#ifdef HTTPS_SOURCE
+  if (c->ssl) {
+    SSL_free(c->ssl);
+  }
+#endif
+  if (c->fd >= 0) {
+    close(c->fd);
+  }
+  if (c->tee) {
+    fclose(c->tee);
+  }
+  free(c);
+}
+
+// header value if line is "name: value", else NULL
+static const char * HeaderValue(const char * line, const char * name)
+{
+  size_t length = strlen(name);
+  if (strncasecmp(line, name, length) != 0 || line[length] != ':') {
+    return NULL;
+  }
+  line += length + 1;
+  while (*line == ' ' || *line == '\t') {
+    line++;
+  }
+  return line;
+}
+
+// OpenRequest sends a GET, conditional when etag or lastModified is set,
+// and reads the response head.  Returns NULL if the server couldn't be
+// reached or answered with something other than HTTP.
+static HttpConnection * OpenRequest(const char * url, const char * etag, const char * lastModified)
+{
+  char host[256], port[8], path[MAX_URL], request[MAX_URL + 1024], line[MAX_URL + 64];
+  int secure;
+
+  if (ParseUrl(url, &secure, host, sizeof(host), port, path, sizeof(path)) != 0) {
+    printf("Failed parsing URL '%s'\n", url);
+    return NULL;
+  }
+  HttpConnection * c = calloc(1, sizeof(HttpConnection));
+  c->fd = ConnectTo(host, port);
+  if (c->fd < 0) {
+    CloseConnection(c);
+    return NULL;
+  }
+#ifdef HTTPS_SOURCE
+  if (secure) {
+    pthread_once(&sslOnce, InitSsl);
+    c->ssl = sslContext ? SSL_new(sslContext) : NULL;
+    if (c->ssl == NULL) {
+      CloseConnection(c);
+      return NULL;
+    }
+    SSL_set_fd(c->ssl, c->fd);
+    SSL_set_tlsext_host_name(c->ssl, host);
+    SSL_set1_host(c->ssl, host);
+    if (SSL_connect(c->ssl) != 1) {
+      printf("Failed TLS handshake with '%s'\n", host);
+      CloseConnection(c);
+      return NULL;
+    }
+  }
+#endif
+
+  int length = snprintf(request, sizeof(request),
+			"GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: pislides\r\nConnection: close\r\n",
+			path, host);
+  if (etag && etag[0]) {
+    length += snprintf(request + length, sizeof(request) - length, "If-None-Match: %s\r\n", etag);
+  }
+  if (lastModified && lastModified[0]) {
+    length += snprintf(request + length, sizeof(request) - length, "If-Modified-Since: %s\r\n", lastModified);
+  }
+  length += snprintf(request + length, sizeof(request) - length, "\r\n");
+  if (RawWrite(c, request, length) != 0 || ReadLine(c, line, sizeof(line)) < 0 ||
+      sscanf(line, "HTTP/%*d.%*d %d", &c->status) != 1) {
+    CloseConnection(c);
+    return NULL;
+  }
+
+  c->remaining = -1;
+  for (;;) {
+    const char * value;
+    if (ReadLine(c, line, sizeof(line)) < 0) {
+      CloseConnection(c);
+      return NULL;
+    }
+    if (line[0] == '\0') {
+      break;
+    }
+    if ((value = HeaderValue(line, "Content-Length"))) {
+      c->remaining = strtoll(value, NULL, 10);
+    }
+    else if ((value = HeaderValue(line, "Transfer-Encoding"))) {
+      c->chunked = strcasecmp(value, "chunked") == 0;
+    }
+    else if ((value = HeaderValue(line, "ETag"))) {
+      snprintf(c->etag, sizeof(c->etag), "%s", value);
+    }
+    else if ((value = HeaderValue(line, "Last-Modified"))) {
+      snprintf(c->lastModified, sizeof(c->lastModified), "%s", value);
+    }
+    else if ((value = HeaderValue(line, "Location"))) {
+      snprintf(c->location, sizeof(c->location), "%s", value);
+    }
+  }
+  if (c->chunked) {
+    c->remaining = 0;	// the first chunk size is still to come
+  }
+  c->ended = c->status == 304 || c->status == 204 || (!c->chunked && c->remaining == 0);
+  return c;
+}
+
+// ReadBody is the ImageReadFunc for a response body, copying what it
+// reads to the connection's cache file
+static long ReadBody(void * context, void * buf, size_t size)
+{
+  HttpConnection * c = (HttpConnection *) context;
+  char line[64];
+
+  if (c->ended) {
+    return 0;
+  }
+  if (c->chunked && c->remaining == 0) {
+    // the CRLF ending the previous chunk, then the next chunk's size
+    if (c->received > 0 && ReadLine(c, line, sizeof(line)) < 0) {
+      return -1;
+    }
+    if (ReadLine(c, line, sizeof(line)) < 0) {
+      return -1;
+    }
+    c->remaining = strtoll(line, NULL, 16);
+    if (c->remaining == 0) {
+      c->ended = 1;
+      return 0;
+    }
+  }
+  long n = FillBuffer(c);
+  if (n <= 0) {
+    // the close ends a body of unknown length, anything else is an error
+    if (n == 0 && c->remaining < 0 && !c->chunked) {
+      c->ended = 1;
+      return 0;
+    }
+    return -1;
+  }
+  if ((size_t) n > size) {
+    n = size;
+  }
+  if (c->remaining >= 0 && n > c->remaining) {
+    n = c->remaining;
+  }
+  memcpy(buf, c->buffer + c->bufferStart, n);
+  c->bufferStart += n;
+  c->received += n;
+  if (c->remaining > 0) {
+    c->remaining -= n;
+    if (c->remaining == 0 && !c->chunked) {
+      c->ended = 1;
+    }
+  }
+  if (c->tee && !c->teeFailed && fwrite(buf, 1, n, c->tee) != (size_t) n) {
+    c->teeFailed = 1;
+  }
+  return n;
+}
+
+// ResolveUrl makes reference, relative to base, an absolute URL
+static void ResolveUrl(const char * base, const char * reference, char * url, int size)
+{
+  char result[MAX_URL];
+  if (strstr(reference, "://")) {
+    snprintf(result, sizeof(result), "%s", reference);
+  }
+  else if (reference[0] == '/') {
+    // scheme and authority from base
+    const char * authority = strstr(base, "://");
+    int length = authority ? (int) (authority + 3 - base) + (int) strcspn(authority + 3, "/?#") : 0;
+    snprintf(result, sizeof(result), "%.*s%s", length, base, reference);
+  }
+  else {
+    // base's directory
+    while (strncmp(reference, "./", 2) == 0) {
+      reference += 2;
+    }
+    int length = strcspn(base, "?#");
+    while (length > 0 && base[length - 1] != '/') {
+      length--;
+    }
+    snprintf(result, sizeof(result), "%.*s%s", length, base, reference);
+  }
+  snprintf(url, size, "%s", result);
+}
+
+
+// Fetch opens a request for url, following redirects.  Returns NULL if
+// the server couldn't be reached.
+static HttpConnection * Fetch(const char * url, const char * etag, const char * lastModified)
+{
+  char target[MAX_URL];
+  int redirects;
+
+  snprintf(target, sizeof(target), "%s", url);
+  for (redirects = 0; ; redirects++) {
+    HttpConnection * c = OpenRequest(target, etag, lastModified);
+    if (c == NULL || c->location[0] == '\0' || c->status < 300 || c->status == 304 ||
+	c->status >= 400 || redirects == MAX_REDIRECTS) {
+      return c;
+    }
+    ResolveUrl(target, c->location, target, sizeof(target));
+    CloseConnection(c);
+  }
+}
+
+// cache file for a URL, named by its FNV-1a hash.  suffix is "" for the
+// data, ".meta" for the validators, or a temporary name.
+static void CachePath(const char * url, const char * suffix, char * path, int size)
+{
+  unsigned long long hash = 14695981039346656037ULL;
+  const unsigned char * p;
+  for (p = (const unsigned char *) url; *p; p++) {
+    hash = (hash ^ *p) * 1099511628211ULL;
+  }
+  snprintf(path, size, "%s/%016llx%s", HTTP_CACHE_DIR, hash, suffix);
+}
+
+// the validators saved with a cached response.  Returns 0 if the data
+// is cached.
+static int ReadCacheMeta(const char * url, char * etag, int etagSize, char * lastModified, int lastModifiedSize)
+{
+  char path[512], line[512];
+  struct stat st;
+
+  etag[0] = lastModified[0] = '\0';
+  CachePath(url, "", path, sizeof(path));
+  if (stat(path, &st) != 0) {
+    return -1;
+  }
+  CachePath(url, ".meta", path, sizeof(path));
+  FILE * fp = fopen(path, "r");
+  if (fp) {
+    while (fgets(line, sizeof(line), fp)) {
+      const char * value;
+      line[strcspn(line, "\r\n")] = '\0';
+      if ((value = HeaderValue(line, "ETag"))) {
+	snprintf(etag, etagSize, "%s", value);
+      }
+      else if ((value = HeaderValue(line, "Last-Modified"))) {
+	snprintf(lastModified, lastModifiedSize, "%s", value);
+      }
+    }
+    fclose(fp);
+  }
+  return 0;
+}
+
+typedef struct {
+  struct stat st;
+  char name[256];
+} CacheFile;
+
+static int CompareMtimes(const void * a, const void * b)
+{
+  const CacheFile * fa = *(const CacheFile * const *) a, * fb = *(const CacheFile * const *) b;
+  return (fa->st.st_mtime > fb->st.st_mtime) - (fa->st.st_mtime < fb->st.st_mtime);
+}
+
+// TrimCache sizes the cache, and removes the least recently used files
+// while it is over its limit.  Called with cacheLock held.
+static void TrimCache(long long limit)
+{
+  DIR * dir = opendir(HTTP_CACHE_DIR);
+  struct dirent * entry;
+  CacheFile * files = NULL;
+  int count = 0, allocated = 0, i;
+  char path[512];
+
+  cacheBytes = 0;
+  if (dir == NULL) {
+    return;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.' || strchr(entry->d_name, '.')) {
+      continue;	// validators go with their data, temporary files are busy
+    }
+    if (count == allocated) {
+      allocated = allocated ? allocated * 2 : 64;
+      files = realloc(files, allocated * sizeof(CacheFile));
+    }
+    snprintf(path, sizeof(path), "%s/%s", HTTP_CACHE_DIR, entry->d_name);
+    if (stat(path, &files[count].st) == 0) {
+      snprintf(files[count].name, sizeof(files[count].name), "%s", entry->d_name);
+      cacheBytes += files[count].st.st_size;
+      count++;
+    }
+  }
+  closedir(dir);
+
+  if (cacheBytes > limit) {
+    CacheFile ** order = malloc(count * sizeof(CacheFile *));
+    for (i = 0; i < count; i++) {
+      order[i] = files + i;
+    }
+    qsort(order, count, sizeof(CacheFile *), CompareMtimes);
+    long long target = limit / 100 * CACHE_TRIM_PERCENT;
+    for (i = 0; i < count && cacheBytes > target; i++) {
+      snprintf(path, sizeof(path), "%s/%s", HTTP_CACHE_DIR, order[i]->name);
+      unlink(path);
+      snprintf(path, sizeof(path), "%s/%s.meta", HTTP_CACHE_DIR, order[i]->name);
+      unlink(path);
+      cacheBytes -= order[i]->st.st_size;
+    }
+    free(order);
+  }
+  free(files);
+}
+
+// start copying c's body into the cache for url
+static void StartCaching(HttpConnection * c, const char * url)
+{
+  char path[512], suffix[32];
+  mkdir(HTTP_CACHE_DIR, 0755);
+  snprintf(suffix, sizeof(suffix), ".part%lx", (unsigned long) pthread_self());
+  CachePath(url, suffix, path, sizeof(path));
+  c->tee = fopen(path, "wb");
+}
+
+// FinishCaching keeps the copied body if all of it arrived, with its
+// validators, and drops it otherwise
+static void FinishCaching(HttpConnection * c, const char * url)
+{
+  char part[512], path[512], suffix[32];
+  snprintf(suffix, sizeof(suffix), ".part%lx", (unsigned long) pthread_self());
+  CachePath(url, suffix, part, sizeof(part));
+  if (c->tee == NULL) {
+    return;
+  }
+  int ok = fclose(c->tee) == 0 && !c->teeFailed && c->ended;
+  c->tee = NULL;
+  if (!ok) {
+    unlink(part);
+    return;
+  }
+  CachePath(url, ".meta", path, sizeof(path));
+  FILE * fp = fopen(path, "w");
+  if (fp) {
+    if (c->etag[0]) {
+      fprintf(fp, "ETag: %s\n", c->etag);
+    }
+    if (c->lastModified[0]) {
+      fprintf(fp, "Last-Modified: %s\n", c->lastModified);
+    }
+    fclose(fp);
+  }
+  CachePath(url, "", path, sizeof(path));
+  rename(part, path);
+
+  pthread_mutex_lock(&cacheLock);
+  long long limit = (long long) HTTP_CACHE_MB * 1024 * 1024;
+  if (cacheBytes < 0) {
+    TrimCache(limit);
+  }
+  else {
+    cacheBytes += c->received;
+    if (cacheBytes > limit) {
+      TrimCache(limit);
+    }
+  }
+  pthread_mutex_unlock(&cacheLock);
+}
+
+// mark a cached URL used, for the least recently used order
+static void TouchCache(const char * url, char * path, int size)
+{
+  CachePath(url, "", path, size);
+  utimes(path, NULL);
+}
+
+static void Count(long * counter, long long bytes)
+{
+  pthread_mutex_lock(&fetchLock);
+  if (counter) {
+    (*counter)++;
+  }
+  bytesFetched += bytes;
+  pthread_mutex_unlock(&fetchLock);
+}
+
+static void AcquireFetchSlot()
+{
+  pthread_mutex_lock(&fetchLock);
+  while (fetchesActive >= HTTP_MAX_FETCHES) {
+    pthread_cond_wait(&fetchSlotFree, &fetchLock);
+  }
+  fetchesActive++;
+  pthread_mutex_unlock(&fetchLock);
+}
+
+static void ReleaseFetchSlot()
+{
+  pthread_mutex_lock(&fetchLock);
+  fetchesActive--;
+  pthread_cond_signal(&fetchSlotFree);
+  pthread_mutex_unlock(&fetchLock);
+}
+
+// OpenFresh fetches url unless the cached copy is still current.  Returns
+// the connection to read a new body from, or NULL with cachedPath set to
+// the copy to use, or to "" if there is neither.
+static HttpConnection * OpenFresh(const char * url, char * cachedPath, int size)
+{
+  char etag[256], lastModified[64];
+  int cached = ReadCacheMeta(url, etag, sizeof(etag), lastModified, sizeof(lastModified)) == 0;
+
+  cachedPath[0] = '\0';
+  uint64_t stage = StageBegin();
+  HttpConnection * c = Fetch(url, etag, lastModified);
+  StageEnd(STAGE_OPEN, stage);
+  if (c && c->status == 200) {
+    Count(&fetched, 0);
+    return c;
+  }
+  if (c && c->status == 304 && cached) {
+    Count(&notModified, 0);
+    CountStat(COUNTER_HTTP_NOT_MODIFIED, 1);
+    TouchCache(url, cachedPath, size);
+  }
+  else if (c == NULL && cached) {
+    Count(&offline, 0);
+    printf("Failed reaching '%s', using the cached copy\n", url);
+    TouchCache(url, cachedPath, size);
+  }
+  else {
+    Count(&failed, 0);
+    if (c) {
+      printf("Failed fetching '%s': HTTP %d\n", url, c->status);
+    }
+    else {
+      printf("Failed reaching '%s'\n", url);
+    }
+  }
+  if (c) {
+    CloseConnection(c);
+  }
+  return NULL;
+}
+
+// DecodeHttpImage is decodeJpegToFit for an image URL
+VGubyte * DecodeHttpImage(const char * url, unsigned maxWidth, unsigned maxHeight,
+			  unsigned * width, unsigned * height, VGImageFormat * format)
+{
+  char cachedPath[512], scratch[4096];
+  VGubyte * pixels = NULL;
+
+  AcquireFetchSlot();
+  HttpConnection * c = OpenFresh(url, cachedPath, sizeof(cachedPath));
+  if (c) {
+    StartCaching(c, url);
+    pixels = decodeJpegStreamToFit(ReadBody, c, url, maxWidth, maxHeight, width, height, format);
+    // the decoder stops at the end of the image, the cache wants the
+    // whole body
+    while (pixels && ReadBody(c, scratch, sizeof(scratch)) > 0) {
+    }
+    Count(NULL, c->received);
+    FinishCaching(c, url);
+    CloseConnection(c);
+  }
+  ReleaseFetchSlot();
+
+  if (c == NULL && cachedPath[0]) {
+    pixels = decodeJpegToFit(cachedPath, maxWidth, maxHeight, width, height, format);
+  }
+  return pixels;
+}
+
+// ScanHttpManifest adds the images listed in the manifest at url to the
+// catalog
+void ScanHttpManifest(char * url)
+{
+  char cachedPath[512], line[MAX_URL], entry[MAX_URL];
+  FILE * fp = NULL;
+  char * text = NULL;
+  size_t length = 0;
+
+  // size the cache, trimming it if the limit went down
+  pthread_mutex_lock(&cacheLock);
+  if (cacheBytes < 0) {
+    TrimCache((long long) HTTP_CACHE_MB * 1024 * 1024);
+  }
+  pthread_mutex_unlock(&cacheLock);
+
+  AcquireFetchSlot();
+  HttpConnection * c = OpenFresh(url, cachedPath, sizeof(cachedPath));
+  if (c) {
+    StartCaching(c, url);
+    long n;
+    size_t allocated = 0;
+    do {
+      if (allocated - length < 4096) {
+	allocated = allocated ? allocated * 2 : 65536;
+	text = realloc(text, allocated);
+      }
+      n = ReadBody(c, text + length, allocated - length);
+      length += n > 0 ? n : 0;
+    } while (n > 0);
+    Count(NULL, c->received);
+    if (n < 0) {
+      printf("Failed reading the manifest '%s'\n", url);
+    }
+    FinishCaching(c, url);
+    CloseConnection(c);
+    fp = fmemopen(text, length, "r");
+  }
+  else if (cachedPath[0]) {
+    fp = fopen(cachedPath, "r");
+  }
+  ReleaseFetchSlot();
+
+  if (fp) {
+    while (fgets(line, sizeof(line), fp)) {
+      char * p = line + strspn(line, " \t");
+      p[strcspn(p, "\r\n")] = '\0';
+      if (p[0] == '\0' || p[0] == '#') {
+	continue;
+      }
+      ResolveUrl(url, p, entry, sizeof(entry));
+      AddFileRecord(strdup(entry));
+    }
+    fclose(fp);
+  }
+  free(text);
+}
+
+void PrintHttpStats()
+{
+  if (fetched + notModified + offline + failed == 0) {
+    return;	// not in use
+  }
+  pthread_mutex_lock(&cacheLock);
+  long long cached = cacheBytes;
+  pthread_mutex_unlock(&cacheLock);
+  pthread_mutex_lock(&fetchLock);
+  printf("http: %ld fetched (%.1f MB), %ld not modified, %ld from cache offline, %ld failed, cache %.1f of %d MB\n",
+	 fetched, bytesFetched / 1048576.0, notModified, offline, failed,
+	 cached > 0 ? cached / 1048576.0 : 0.0, HTTP_CACHE_MB);
+  pthread_mutex_unlock(&fetchLock);
+}
@@ -0,0 +1,314 @@
+// Memory governor.  Sizes caches, decode-ahead and decode threads to the
+// memory the board, or the cgroup pislides runs in, actually has, and
+// sheds cached data when memory gets tight, before the OOM killer picks
+// a victim.
+//
+// Three sources are polled about once a second, all cheap reads:
+//   /proc/meminfo          MemTotal and MemAvailable
+//   cgroup v2              memory.max and memory.current, the tightest
+//                          limit from our cgroup up to the root
+//   /proc/pressure/memory  the share of time tasks stalled on memory
+//                          (PSI), which rises before memory runs out
+//
+// Memory that may be used is whatever is available now plus what the
+// caches already hold, less a reserve for the rest of the system.  A
+// quarter of it goes to caches.  When the reserve is breached or stalls
+// pass a threshold the governor is under pressure: caches are cut to
+// half of what they hold and the registered shedders are asked to free
+// the rest, decode-ahead drops to nothing and decoding to one thread.
+// Pressure has to stay clear for a while before limits grow again.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pislides.h"
+
+#define POLL_INTERVAL_MS 1000.0
+#define MB (1024 * 1024)
+
+// memory left for everything else, the larger of these
+#define RESERVE_FRACTION 0.10
+#define RESERVE_MIN (32 * MB)
+
+// PSI "some" avg10 percentage at which we start shedding
+#define PRESSURE_STALL_PERCENT 10.0
+
+// quiet polls before limits may grow again after pressure
+#define CALM_POLLS 10
+
+#define MAX_DECODE_AHEAD 4
+#define MAX_DECODE_THREADS 4
+#define MAX_SHEDDERS 8
+
+static MemoryLimits limits;
+static MemoryStatus status;
+static size_t slideBytes;
+static double nextPoll;
+static int calmPolls = CALM_POLLS;
+static char cgroupDir[512];
+static size_t cgroupMountLength;
+static int haveCgroup;
+static long sheds;
+
+typedef struct {
+  MemoryUsageFunc usage;
+  MemoryShedFunc shed;
+} Shedder;
+
+static Shedder shedders[MAX_SHEDDERS];
+static int shedderCount;
+
+
+// read a whole small file into buf, returns the length or -1
+static int ReadSmallFile(const char * path, char * buf, int size)
+{
+  FILE * fp = fopen(path, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+  int n = fread(buf, 1, size - 1, fp);
+  fclose(fp);
+  buf[n > 0 ? n : 0] = '\0';
+  return n;
+}
+
+// MeminfoValue finds "key: value kB" in /proc/meminfo text, in bytes
+static size_t MeminfoValue(const char * text, const char * key)
+{
+  const char * p = strstr(text, key);
+  if (p == NULL) {
+    return 0;
+  }
+  return (size_t) strtoull(p + strlen(key), NULL, 10) * 1024;
+}
+
+// find our cgroup v2 directory: the cgroup2 mount plus the "0::" path
+static void FindCgroup()
+{
+  char mounts[8192], self[4096], mountPoint[256] = "";
+  char * line;
+
+  haveCgroup = 0;
+  if (ReadSmallFile("/proc/self/mounts", mounts, sizeof(mounts)) <= 0 ||
+      ReadSmallFile("/proc/self/cgroup", self, sizeof(self)) <= 0) {
+    return;
+  }
+  for (line = strtok(mounts, "\n"); line; line = strtok(NULL, "\n")) {
+    char dev[64], dir[256], type[64];
+    if (sscanf(line, "%63s %255s %63s", dev, dir, type) == 3 && strcmp(type, "cgroup2") == 0) {
+      strcpy(mountPoint, dir);
+      break;
+    }
+  }
+  char * path = strstr(self, "0::");
+  if (mountPoint[0] == '\0' || path == NULL || (path != self && path[-1] != '\n')) {
+    return;
+  }
+  path += 3;
+  char * end = strchr(path, '\n');
+  if (end) {
+    *end = '\0';
+  }
+  snprintf(cgroupDir, sizeof(cgroupDir), "%s%s", mountPoint, strcmp(path, "/") ? path : "");
+  cgroupMountLength = strlen(mountPoint);
+  haveCgroup = 1;
+}
+
+// CgroupRoom sets *limit to the tightest memory.max from our cgroup up to
+// the root and *room to what that cgroup can still take.  Returns 0 if
+// no cgroup sets a limit.
+static int CgroupRoom(size_t * limit, size_t * room)
+{
+  char dir[512], buf[64], path[600];
+  int limited = 0;
+
+  if (!haveCgroup) {
+    return 0;
+  }
+  strcpy(dir, cgroupDir);
+  for (;;) {
+    snprintf(path, sizeof(path), "%s/memory.max", dir);
+    if (ReadSmallFile(path, buf, sizeof(buf)) > 0 && strncmp(buf, "max", 3) != 0) {
+      size_t max = strtoull(buf, NULL, 10);
+      snprintf(path, sizeof(path), "%s/memory.current", dir);
+      size_t current = ReadSmallFile(path, buf, sizeof(buf)) > 0 ? strtoull(buf, NULL, 10) : 0;
+      size_t left = max > current ? max - current : 0;
+      if (!limited || left < *room) {
+	*limit = max;
+	*room = left;
+      }
+      limited = 1;
+    }
+    // the root cgroup has no memory.max, stop at the mount point
+    char * slash = strrchr(dir, '/');
+    if (strlen(dir) <= cgroupMountLength || slash == NULL || (size_t) (slash - dir) < cgroupMountLength) {
+      break;
+    }
+    *slash = '\0';
+  }
+  return limited;
+}
+
+static double PressureStall()
+{
+  char buf[256];
+  if (ReadSmallFile("/proc/pressure/memory", buf, sizeof(buf)) <= 0) {
+    return 0.0;
+  }
+  const char * p = strstr(buf, "some avg10=");
+  return p ? strtod(p + strlen("some avg10="), NULL) : 0.0;
+}
+
+static size_t CachedBytes()
+{
+  size_t total = 0;
+  int i;
+  for (i = 0; i < shedderCount; i++) {
+    total += shedders[i].usage();
+  }
+  return total;
+}
+
+// ask the shedders to bring the caches down to target bytes in all
+static void Shed(size_t target)
+{
+  int i;
+  size_t held = CachedBytes();
+  for (i = 0; i < shedderCount && held > target; i++) {
+    size_t used = shedders[i].usage();
+    size_t cut = held - target < used ? held - target : used;
+    shedders[i].shed(used - cut);
+    held -= cut;
+  }
+  sheds++;
+}
+
+static void Poll()
+{
+  char meminfo[4096];
+  size_t total = 0, available = 0;
+
+  if (ReadSmallFile("/proc/meminfo", meminfo, sizeof(meminfo)) > 0) {
+    total = MeminfoValue(meminfo, "MemTotal:");
+    available = MeminfoValue(meminfo, "MemAvailable:");
+  }
+  if (total == 0) {
+    return;	// no /proc, leave the limits alone
+  }
+  status.cgroupLimited = CgroupRoom(&status.cgroupLimit, &status.cgroupRoom);
+  if (status.cgroupLimited) {
+    if (status.cgroupLimit < total) {
+      total = status.cgroupLimit;
+    }
+    if (status.cgroupRoom < available) {
+      available = status.cgroupRoom;
+    }
+  }
+  status.total = total;
+  status.available = available;
+  status.stall = PressureStall();
+  status.cached = CachedBytes();
+
+  size_t reserve = total * RESERVE_FRACTION > RESERVE_MIN ? total * RESERVE_FRACTION : RESERVE_MIN;
+  size_t usable = available + status.cached > reserve ? available + status.cached - reserve : 0;
+  status.underPressure = available < reserve || status.stall >= PRESSURE_STALL_PERCENT;
+
+  if (status.underPressure) {
+    calmPolls = 0;
+    limits.cacheBytes = status.cached / 2 < usable / 4 ? status.cached / 2 : usable / 4;
+    limits.decodeAhead = 0;
+    limits.decodeThreads = 1;
+    if (status.cached > limits.cacheBytes) {
+      Shed(limits.cacheBytes);
+    }
+    return;
+  }
+  if (++calmPolls < CALM_POLLS) {
+    // hold what we have, but never more than now fits
+    if (limits.cacheBytes > usable / 4) {
+      limits.cacheBytes = usable / 4;
+    }
+    return;
+  }
+
+  limits.cacheBytes = usable / 4;
+  // decoded slides waiting to be shown come out of the same quarter
+  limits.decodeAhead = slideBytes ? (int) (usable / 4 / slideBytes) : 1;
+  if (limits.decodeAhead > MAX_DECODE_AHEAD) {
+    limits.decodeAhead = MAX_DECODE_AHEAD;
+  }
+  // a decoder thread needs its own source and raster buffers
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  limits.decodeThreads = 1 + (int) (usable / (256 * MB));
+  if (limits.decodeThreads > cpus) {
+    limits.decodeThreads = cpus > 0 ? cpus : 1;
+  }
+  if (limits.decodeThreads > MAX_DECODE_THREADS) {
+    limits.decodeThreads = MAX_DECODE_THREADS;
+  }
+}
+
+
+// InitMemoryGovernor starts governing.  bytesPerSlide is the memory a
+// decoded slide waiting to be shown takes.
+void InitMemoryGovernor(size_t bytesPerSlide)
+{
+  slideBytes = bytesPerSlide;
+  limits.cacheBytes = 16 * MB;
+  limits.decodeAhead = 1;
+  limits.decodeThreads = 1;
+  FindCgroup();
+  calmPolls = CALM_POLLS;
+  Poll();
+  nextPoll = vgwrap_now_ms() + POLL_INTERVAL_MS;
+}
+
+// RegisterMemoryShedder adds a cache for the governor to account for and
+// shrink.  usage returns the bytes it holds, shed must bring it down to
+// at most the given number of bytes.  Caches are shed in the order they
+// were registered.
+void RegisterMemoryShedder(MemoryUsageFunc usage, MemoryShedFunc shed)
+{
+  if (shedderCount < MAX_SHEDDERS) {
+    shedders[shedderCount].usage = usage;
+    shedders[shedderCount].shed = shed;
+    shedderCount++;
+  }
+}
+
+// NextMemoryPoll returns when UpdateMemoryGovernor next wants to run, or
+// `limit` if that comes first
+double NextMemoryPoll(double limit)
+{
+  return nextPoll < limit ? nextPoll : limit;
+}
+
+// UpdateMemoryGovernor polls memory if a poll is due
+void UpdateMemoryGovernor(double now)
+{
+  if (now < nextPoll) {
+    return;
+  }
+  Poll();
+  while (nextPoll <= now) {
+    nextPoll += POLL_INTERVAL_MS;
+  }
+}
+
+// GetMemoryLimits returns the current limits for caches, decode-ahead
+// and decoding threads
+const MemoryLimits * GetMemoryLimits()
+{
+  return &limits;
+}
+
+void PrintMemoryStats()
+{
+  printf("memory: %zu of %zu MB available%s, stalled %.2f%%, caches %zu/%zu MB, decode ahead %d, %d threads, %ld sheds\n",
+	 status.available / MB, status.total / MB, status.cgroupLimited ? " (cgroup)" : "",
+	 status.stall, status.cached / MB, limits.cacheBytes / MB,
+	 limits.decodeAhead, limits.decodeThreads, sheds);
+}
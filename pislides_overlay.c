@@ -0,0 +1,255 @@
+// Overlay compositor for small things drawn over the slide, like a clock,
+// captions or status badges.
+//
+// The display surface is created with EGL_BUFFER_PRESERVED, so between
+// slides only the overlays that changed need redrawing.  Whenever a full
+// frame is drawn the slide pixels under each overlay are copied into a
+// per-overlay cache image, still on the GPU.  On a tick, each changed
+// overlay's region is restored from its cache and the overlay is drawn
+// again with scissoring limited to that region, and nothing else on the
+// surface is touched.  When nothing changed nothing is drawn or swapped.
+//
+// Overlays shouldn't overlap much; when they do, overlays that intersect
+// a changed one are redrawn with it.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pislides.h"
+
+
+typedef struct _Overlay {
+  int inUse;
+  VGint x, y, width, height;
+  OverlayDrawFunc draw;
+  OverlayRefreshFunc refresh;
+  void * context;
+  double intervalMs;
+  double nextRefresh;
+
+  // slide pixels under the overlay, and the region they came from
+  VGImage background;
+  VGint bgX, bgY, bgWidth, bgHeight;
+  int hasBackground;
+
+  int dirty;
+} Overlay;
+
+#define MAX_OVERLAYS 16
+static Overlay overlays[MAX_OVERLAYS];
+
+static long overlayTicks, overlayPixelsFilled;
+
+
+static int Intersects(Overlay * a, VGint x, VGint y, VGint w, VGint h)
+{
+  return a->x < x + w && x < a->x + a->width &&
+    a->y < y + h && y < a->y + a->height;
+}
+
+// copy the surface pixels under an overlay's current region into its cache
+static void CaptureBackground(Overlay * o)
+{
+  if (o->background == VG_INVALID_HANDLE ||
+      o->bgWidth != o->width || o->bgHeight != o->height) {
+    if (o->background != VG_INVALID_HANDLE) {
+      vgDestroyImage(o->background);
+    }
+    o->background = vgCreateImage(VG_sABGR_8888, o->width, o->height, VG_IMAGE_QUALITY_NONANTIALIASED);
+  }
+  o->bgX = o->x;
+  o->bgY = o->y;
+  o->bgWidth = o->width;
+  o->bgHeight = o->height;
+  vgGetPixels(o->background, 0, 0, o->x, o->y, o->width, o->height);
+  o->hasBackground = 1;
+}
+
+static void DrawOverlay(Overlay * o)
+{
+  ScissorRect(o->x, o->y, o->width, o->height);
+  vgSeti(VG_BLEND_MODE, VG_BLEND_SRC_OVER);
+  // leave the path matrix selected, text drawing works on the current one
+  SetImageToSurfaceTransform();
+  vgLoadIdentity();
+  SetPathToSurfaceTransform();
+  vgLoadIdentity();
+  o->draw(o->context, o->x, o->y, o->width, o->height);
+  NoScissor();
+}
+
+
+// AddOverlay registers an overlay covering the given screen region.  draw
+// renders it and must stay inside the region.  If refresh is set it is
+// called every intervalMs and returns nonzero when the overlay changed.
+// Returns an overlay id, or -1 if there's no room.
+int AddOverlay(VGint x, VGint y, VGint width, VGint height,
+	       OverlayDrawFunc draw, OverlayRefreshFunc refresh,
+	       double intervalMs, void * context)
+{
+  int i;
+  for (i = 0; i < MAX_OVERLAYS; i++) {
+    Overlay * o = overlays + i;
+    if (!o->inUse) {
+      memset(o, 0, sizeof(*o));
+      o->inUse = 1;
+      o->x = x;
+      o->y = y;
+      o->width = width;
+      o->height = height;
+      o->draw = draw;
+      o->refresh = refresh;
+      o->intervalMs = intervalMs;
+      o->nextRefresh = vgwrap_now_ms() + intervalMs;
+      o->context = context;
+      o->dirty = 1;
+      return i;
+    }
+  }
+  return -1;
+}
+
+void RemoveOverlay(int id)
+{
+  Overlay * o = overlays + id;
+  // leave the slide showing where the overlay was
+  if (o->hasBackground) {
+    vgSetPixels(o->bgX, o->bgY, o->background, 0, 0, o->bgWidth, o->bgHeight);
+    End();
+  }
+  if (o->background != VG_INVALID_HANDLE) {
+    vgDestroyImage(o->background);
+  }
+  o->inUse = 0;
+}
+
+// InvalidateOverlay marks an overlay for redrawing on the next update
+void InvalidateOverlay(int id)
+{
+  overlays[id].dirty = 1;
+}
+
+// MoveOverlay gives an overlay a new region.  The old region is restored
+// and the new one captured on the next update.
+void MoveOverlay(int id, VGint x, VGint y, VGint width, VGint height)
+{
+  Overlay * o = overlays + id;
+  o->x = x;
+  o->y = y;
+  o->width = width;
+  o->height = height;
+  o->dirty = 1;
+}
+
+// ComposeOverlays is called after a full frame of slide content has been
+// drawn and before it is presented.  It caches the slide under every
+// overlay and draws them all.
+void ComposeOverlays()
+{
+  int i;
+  for (i = 0; i < MAX_OVERLAYS; i++) {
+    Overlay * o = overlays + i;
+    if (o->inUse) {
+      CaptureBackground(o);
+    }
+  }
+  for (i = 0; i < MAX_OVERLAYS; i++) {
+    Overlay * o = overlays + i;
+    if (o->inUse) {
+      DrawOverlay(o);
+      o->dirty = 0;
+    }
+  }
+}
+
+// NextOverlayRefresh returns when the next overlay refresh is due, or
+// `limit` if that comes first
+double NextOverlayRefresh(double limit)
+{
+  int i;
+  for (i = 0; i < MAX_OVERLAYS; i++) {
+    Overlay * o = overlays + i;
+    if (o->inUse && o->refresh && o->nextRefresh < limit) {
+      limit = o->nextRefresh;
+    }
+  }
+  return limit;
+}
+
+// UpdateOverlays runs due refreshes and redraws only the overlays that
+// changed on top of the preserved frame, presenting the result.  Returns
+// the number of pixels written, 0 when the frame was left alone.
+long UpdateOverlays(double now)
+{
+  int i, j;
+  for (i = 0; i < MAX_OVERLAYS; i++) {
+    Overlay * o = overlays + i;
+    if (o->inUse && o->refresh && now >= o->nextRefresh) {
+      if (o->refresh(o->context, now)) {
+	o->dirty = 1;
+      }
+      while (o->nextRefresh <= now) {
+	o->nextRefresh += o->intervalMs;
+      }
+    }
+  }
+
+  // restoring a region also wipes any other overlay drawn into it
+  for (i = 0; i < MAX_OVERLAYS; i++) {
+    Overlay * o = overlays + i;
+    if (!o->inUse || !o->dirty || !o->hasBackground) {
+      continue;
+    }
+    for (j = 0; j < MAX_OVERLAYS; j++) {
+      Overlay * other = overlays + j;
+      if (other->inUse && !other->dirty && Intersects(other, o->bgX, o->bgY, o->bgWidth, o->bgHeight)) {
+	other->dirty = 1;
+	i = -1;		// rescan, other may in turn overlap something
+	break;
+      }
+    }
+  }
+
+  long pixels = 0;
+  for (i = 0; i < MAX_OVERLAYS; i++) {
+    Overlay * o = overlays + i;
+    if (o->inUse && o->dirty && o->hasBackground) {
+      vgSetPixels(o->bgX, o->bgY, o->background, 0, 0, o->bgWidth, o->bgHeight);
+      pixels += o->bgWidth * o->bgHeight;
+    }
+  }
+  for (i = 0; i < MAX_OVERLAYS; i++) {
+    Overlay * o = overlays + i;
+    if (o->inUse && o->dirty &&
+	(!o->hasBackground || o->bgX != o->x || o->bgY != o->y ||
+	 o->bgWidth != o->width || o->bgHeight != o->height)) {
+      CaptureBackground(o);
+    }
+  }
+  for (i = 0; i < MAX_OVERLAYS; i++) {
+    Overlay * o = overlays + i;
+    if (o->inUse && o->dirty) {
+      DrawOverlay(o);
+      pixels += o->width * o->height;
+      o->dirty = 0;
+    }
+  }
+
+  if (pixels) {
+    End();
+    overlayTicks++;
+    overlayPixelsFilled += pixels;
+  }
+  return pixels;
+}
+
+void PrintOverlayStats()
+{
+  if (overlayTicks) {
+    printf("overlays: %ld updates, %ld pixels per update, %.2f%% of the screen\n",
+	   overlayTicks, overlayPixelsFilled / overlayTicks,
+	   100.0 * overlayPixelsFilled / overlayTicks / ((double) screenWidth * screenHeight));
+  }
+}
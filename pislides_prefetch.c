@@ -0,0 +1,235 @@
+// Prefetch.  The images after the ones being decoded ahead are read into
+// the page cache a window at a time, in the order they lie on the disk
+// rather than the order they will be shown.  On a USB hard drive or a
+// slow SD card reading a few random photos costs mostly seeks, and a
+// window read in one sweep costs one pass over the disk instead.
+//
+// Where each file starts comes from FIEMAP.  Filesystems without it, and
+// files without a mapped extent, are placed by inode number, which on
+// most filesystems follows where the inode was allocated, and so roughly
+// where its data went.  Reads are started with POSIX_FADV_WILLNEED, which
+// queues the whole file for reading and returns, so a window is a batch
+// of asynchronous reads, issued in disk order, that the block layer can
+// merge and sweep through.
+//
+// Windows are issued from the executor's background lane, in the idle
+// I/O class, so they never hold up a decode that needs the disk now.
+// The disk's own counters, from /proc/diskstats, are kept from the first
+// window, to see what the reads cost.
+//
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "pislides.h"
+
+#define MAX_PREFETCH 64
+
+typedef struct _PrefetchFile {
+  char * path;
+  int fd;
+  int mapped;			// offset is where its data is, not its inode
+  dev_t device;
+  unsigned long long offset;
+  off_t size;
+} PrefetchFile;
+
+// the window being read, owned by prefetchTask while it runs
+static Task prefetchTask;
+static char * window[MAX_PREFETCH];
+static int windowCount;
+
+static long windows, windowsSkipped, filesRead, filesUnmapped;
+static double bytesRead;
+static dev_t disk;
+static DiskStats diskAtStart;
+static int diskKnown;
+
+
+// where a file's data starts on its device, from its first extent.
+// Returns 0 if the filesystem can't say.
+static int PhysicalOffset(int fd, unsigned long long * offset)
+{
+  struct {
+    struct fiemap map;
+    struct fiemap_extent extent;
+  } request;
+  memset(&request, 0, sizeof(request));
+  request.map.fm_length = FIEMAP_MAX_OFFSET;
+  request.map.fm_extent_count = 1;
+  if (ioctl(fd, FS_IOC_FIEMAP, &request) != 0 || request.map.fm_mapped_extents == 0 ||
+      (request.extent.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))) {
+    return 0;
+  }
+  *offset = request.extent.fe_physical;
+  return 1;
+}
+
+// disk order: by device, then files with extents by where they start,
+// then the rest by inode
+static int CompareDiskOrder(const void * a, const void * b)
+{
+  const PrefetchFile * fa = a, * fb = b;
+  if (fa->device != fb->device) {
+    return fa->device < fb->device ? -1 : 1;
+  }
+  if (fa->mapped != fb->mapped) {
+    return fb->mapped - fa->mapped;
+  }
+  return (fa->offset > fb->offset) - (fa->offset < fb->offset);
+}
+
+// start reading count files, in disk order or as given, stopping early if
+// cancelled.  Returns the files read.
+static int Prefetch(char ** paths, int count, int diskOrder, volatile int * cancelled)
+{
+  PrefetchFile files[MAX_PREFETCH];
+  struct stat st;
+  int i, opened = 0;
+
+  if (count > MAX_PREFETCH) {
+    count = MAX_PREFETCH;
+  }
+  for (i = 0; i < count && !(cancelled && *cancelled); i++) {
+    PrefetchFile * f = files + opened;
+    f->fd = open(paths[i], O_RDONLY | O_CLOEXEC);
+    if (f->fd < 0) {
+      continue;
+    }
+    if (fstat(f->fd, &st) != 0) {
+      close(f->fd);
+      continue;
+    }
+    f->path = paths[i];
+    f->device = st.st_dev;
+    f->size = st.st_size;
+    f->mapped = diskOrder && PhysicalOffset(f->fd, &f->offset);
+    if (!f->mapped) {
+      f->offset = st.st_ino;
+    }
+    opened++;
+  }
+  if (diskOrder) {
+    qsort(files, opened, sizeof(PrefetchFile), CompareDiskOrder);
+  }
+  for (i = 0; i < opened; i++) {
+    if (!(cancelled && *cancelled)) {
+      posix_fadvise(files[i].fd, 0, 0, POSIX_FADV_WILLNEED);
+      bytesRead += files[i].size;
+      filesRead++;
+      filesUnmapped += diskOrder && !files[i].mapped;
+    }
+    close(files[i].fd);
+  }
+  return opened;
+}
+
+static void PrefetchWindow(Task * task)
+{
+  int i;
+  Prefetch(window, windowCount, 1, &task->cancelled);
+  for (i = 0; i < windowCount; i++) {
+    free(window[i]);
+  }
+  windowCount = 0;
+}
+
+
+// ReadDiskStats reads the counters of the disk, or partition, device is
+// on.  Returns -1 if it isn't a block device listed in /proc/diskstats.
+int ReadDiskStats(dev_t device, DiskStats * stats)
+{
+  char line[256];
+  unsigned major, minor;
+  unsigned long reads, merged, sectors, ms;
+  int found = -1;
+  FILE * f = fopen("/proc/diskstats", "r");
+  if (f == NULL) {
+    return -1;
+  }
+  while (found != 0 && fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%u %u %*s %lu %lu %lu %lu", &major, &minor, &reads, &merged, &sectors, &ms) == 6 &&
+	major == major(device) && minor == minor(device)) {
+      stats->reads = reads;
+      stats->merged = merged;
+      stats->sectors = sectors;
+      stats->readMs = ms;
+      found = 0;
+    }
+  }
+  fclose(f);
+  return found;
+}
+
+// PrefetchFiles starts reading count files into the page cache, in disk
+// order if diskOrder is set, otherwise as given, and returns once every
+// read is queued
+void PrefetchFiles(char ** paths, int count, int diskOrder)
+{
+  Prefetch(paths, count, diskOrder, NULL);
+}
+
+// PrefetchImages has count images read into the page cache in the
+// background, in disk order.  Images from HTTP are left alone.  A window
+// still being read when the next comes is left to finish, and the new one
+// skipped.
+void PrefetchImages(char ** paths, int count)
+{
+  struct stat st;
+  int i;
+  if (!TaskFinished(&prefetchTask)) {
+    windowsSkipped++;
+    return;
+  }
+  windowCount = 0;
+  for (i = 0; i < count && windowCount < MAX_PREFETCH; i++) {
+    if (!IsHttpLocation(paths[i])) {
+      window[windowCount++] = strdup(paths[i]);
+    }
+  }
+  if (windowCount == 0) {
+    return;
+  }
+  if (!diskKnown && stat(window[0], &st) == 0 && ReadDiskStats(st.st_dev, &diskAtStart) == 0) {
+    disk = st.st_dev;
+    diskKnown = 1;
+  }
+  windows++;
+  prefetchTask.run = PrefetchWindow;
+  prefetchTask.context = NULL;
+  SubmitTask(&prefetchTask, LANE_BACKGROUND);
+}
+
+void PrintPrefetchStats()
+{
+  DiskStats now;
+  if (windows == 0) {
+    return;
+  }
+  printf("prefetch: %ld windows (%ld skipped), %ld files, %.1f MB, %ld placed by inode",
+	 windows, windowsSkipped, filesRead, bytesRead / (1024 * 1024), filesUnmapped);
+  if (diskKnown && ReadDiskStats(disk, &now) == 0) {
+    printf("; disk %ld reads (%ld merged), %.1f MB, %.0f ms reading",
+	   now.reads - diskAtStart.reads, now.merged - diskAtStart.merged,
+	   (now.sectors - diskAtStart.sectors) / 2048.0, now.readMs - diskAtStart.readMs);
+  }
+  printf("\n");
+}
+
+// FinishPrefetch stops the window being read
+void FinishPrefetch()
+{
+  CancelTask(&prefetchTask);
+  WaitTask(&prefetchTask);
+  PrefetchWindow(&prefetchTask);
+}
@@ -0,0 +1,535 @@
+// Compressed slide cache.  Slides the history no longer keeps decoded
+// are kept here compressed, so going back past the decoded ones, or an
+// image coming round again in a short playlist, costs expanding a raster
+// in memory instead of reading and decoding the JPEG again.
+//
+// The codec is lossless and made to be fast rather than small, expanding
+// a slide several times faster than decoding its JPEG.  Each row is split
+// into its channels (R, G, B and A, L, or the 5, 6 and 5 bit fields of
+// RGB565), each sample is predicted by the one above it, and the
+// prediction errors are stored in groups of 16, each group packed with as
+// few bits as its largest needs.  Flat areas, such as skies and an opaque
+// alpha channel, cost a byte per group; photographs come out at a little
+// over half.  Predicting from above only leaves every sample of a row
+// independent, which is what makes it quick.
+//
+// Slides are compressed in the executor's background lane, after they
+// are handed over, and expanded by whichever thread wants them, straight
+// into the raster that is uploaded.  The cache is kept within a budget
+// set by the history, least recently used slides going first.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "pislides.h"
+
+#define MAX_CACHED_SLIDES 256
+#define GROUP 16
+#define MAX_CHANNELS 4
+
+typedef struct _CachedSlide {
+  char * path;
+  unsigned maxWidth, maxHeight;	// what it was fitted to
+  unsigned width, height;
+  VGImageFormat format;
+  VGubyte * raster;		// being compressed, NULL once done
+  uint8_t * data;		// compressed, NULL until done
+  size_t length;
+  int users;			// expanding it now
+  int evicted;			// freed by the last user
+  Task compress;
+} CachedSlide;
+
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+// most recently used first
+static CachedSlide * slides[MAX_CACHED_SLIDES];
+static int slideCount;
+static size_t budget;
+
+static long hits, misses, compressed, evictions;
+static double compressMs, expandMs;
+static size_t rawBytes, packedBytes;	// of the slides compressed
+
+
+// how a format splits into channels, and the bits in each
+static int Channels(VGImageFormat format, int * bits)
+{
+  int i;
+  if (format == VG_sL_8) {
+    bits[0] = 8;
+    return 1;
+  }
+  if (format == VG_sRGB_565) {
+    bits[0] = 5;
+    bits[1] = 6;
+    bits[2] = 5;
+    return 3;
+  }
+  for (i = 0; i < 4; i++) {
+    bits[i] = 8;
+  }
+  return 4;
+}
+
+// split row into one plane of width samples per channel
+static void SplitRow(const VGubyte * row, int channels, unsigned width, uint8_t * planes)
+{
+  unsigned x;
+  int c;
+  if (channels == 3) {
+    const uint16_t * px = (const uint16_t *) row;
+    for (x = 0; x < width; x++) {
+      planes[x] = px[x] >> 11;
+      planes[width + x] = (px[x] >> 5) & 63;
+      planes[2 * width + x] = px[x] & 31;
+    }
+    return;
+  }
+  for (c = 0; c < channels; c++) {
+    for (x = 0; x < width; x++) {
+      planes[c * width + x] = row[x * channels + c];
+    }
+  }
+}
+
+static void JoinRow(const uint8_t * planes, int channels, unsigned width, VGubyte * row)
+{
+  unsigned x;
+  int c;
+  if (channels == 3) {
+    uint16_t * px = (uint16_t *) row;
+    for (x = 0; x < width; x++) {
+      px[x] = (planes[x] << 11) | (planes[width + x] << 5) | planes[2 * width + x];
+    }
+    return;
+  }
+  for (c = 0; c < channels; c++) {
+    for (x = 0; x < width; x++) {
+      row[x * channels + c] = planes[c * width + x];
+    }
+  }
+}
+
+// the prediction errors of a plane of k bit samples, from the sample
+// above, or to the left on the first row, zigzagged so small errors
+// either way are small numbers
+static void Residuals(const uint8_t * cur, const uint8_t * up, unsigned width, int k, uint8_t * z)
+{
+  int shift = 8 - k;
+  unsigned x;
+  if (up == NULL) {
+    for (x = 0; x < width; x++) {
+      int8_t s = (int8_t) ((cur[x] - (x ? cur[x - 1] : 0)) << shift) >> shift;
+      z[x] = ((s << 1) ^ (s >> 7)) & ((1 << k) - 1);
+    }
+    return;
+  }
+  for (x = 0; x < width; x++) {
+    int8_t s = (int8_t) ((cur[x] - up[x]) << shift) >> shift;
+    z[x] = ((s << 1) ^ (s >> 7)) & ((1 << k) - 1);
+  }
+}
+
+static void Unresiduals(const uint8_t * z, const uint8_t * up, unsigned width, int k, uint8_t * cur)
+{
+  unsigned x;
+  if (up == NULL) {
+    uint8_t last = 0;
+    for (x = 0; x < width; x++) {
+      last = (last + ((z[x] >> 1) ^ -(z[x] & 1))) & ((1 << k) - 1);
+      cur[x] = last;
+    }
+    return;
+  }
+  for (x = 0; x < width; x++) {
+    cur[x] = (up[x] + ((z[x] >> 1) ^ -(z[x] & 1))) & ((1 << k) - 1);
+  }
+}
+
+// pack a plane's residuals in groups of 16, each a byte of how many bits
+// its samples take and then the samples, 8 to a word of that many bytes.
+// Returns the end of what was written.
+static uint8_t * Pack(const uint8_t * z, unsigned width, uint8_t * out)
+{
+  unsigned x, i, half, j;
+  for (x = 0; x < width; x += GROUP) {
+    uint8_t group[GROUP];
+    unsigned n = width - x < GROUP ? width - x : GROUP, all = 0;
+    memcpy(group, z + x, n);
+    memset(group + n, 0, GROUP - n);
+    for (i = 0; i < GROUP; i++) {
+      all |= group[i];
+    }
+    int bits = all ? 32 - __builtin_clz(all) : 0;
+    *out++ = bits;
+    for (half = 0; half < GROUP && bits; half += 8) {
+      uint64_t word = 0;
+      for (i = 0; i < 8; i++) {
+	word |= (uint64_t) group[half + i] << (i * bits);
+      }
+      for (j = 0; j < bits; j++) {
+	*out++ = word >> (8 * j);
+      }
+    }
+  }
+  return out;
+}
+
+static const uint8_t * Unpack(const uint8_t * in, const uint8_t * end, unsigned width, int k, uint8_t * z)
+{
+  unsigned x, i, half, j;
+  for (x = 0; x < width; x += GROUP) {
+    uint8_t group[GROUP];
+    if (in >= end) {
+      return NULL;
+    }
+    int bits = *in++;
+    if (bits > k || end - in < 2 * bits) {
+      return NULL;
+    }
+    unsigned mask = (1u << bits) - 1, n = width - x < GROUP ? width - x : GROUP;
+    for (half = 0; half < GROUP; half += 8) {
+      uint64_t word = 0;
+      for (j = 0; j < bits; j++) {
+	word |= (uint64_t) *in++ << (8 * j);
+      }
+      for (i = 0; i < 8; i++) {
+	group[half + i] = (word >> (i * bits)) & mask;
+      }
+    }
+    memcpy(z + x, group, n);
+  }
+  return in;
+}
+
+// compress a width x height raster, returning the data and its length
+static uint8_t * Compress(const VGubyte * raster, VGImageFormat format, unsigned width, unsigned height,
+			  size_t * length)
+{
+  int bits[MAX_CHANNELS], channels = Channels(format, bits), c;
+  size_t stride = ImageBytes(format, width, 1);
+  size_t groups = (width + GROUP - 1) / GROUP;
+  size_t bound = (size_t) height * channels * groups * (1 + GROUP);
+  uint8_t * data = malloc(bound);
+  uint8_t * planes = malloc((size_t) 3 * channels * width);
+  unsigned y;
+  if (data == NULL || planes == NULL) {
+    free(data);
+    free(planes);
+    return NULL;
+  }
+  uint8_t * out = data, * cur = planes, * up = planes + channels * width, * z = up + channels * width;
+  for (y = 0; y < height; y++) {
+    uint8_t * swap = up;
+    up = cur;
+    cur = swap;
+    SplitRow(raster + y * stride, channels, width, cur);
+    for (c = 0; c < channels; c++) {
+      Residuals(cur + c * width, y ? up + c * width : NULL, width, bits[c], z);
+      out = Pack(z, width, out);
+    }
+  }
+  free(planes);
+  *length = out - data;
+  uint8_t * fitted = realloc(data, *length);
+  return fitted ? fitted : data;
+}
+
+// expand compressed data into raster.  Returns 0 if the data is damaged.
+static int Expand(const uint8_t * data, size_t length, VGImageFormat format, unsigned width, unsigned height,
+		  VGubyte * raster)
+{
+  int bits[MAX_CHANNELS], channels = Channels(format, bits), c;
+  size_t stride = ImageBytes(format, width, 1);
+  uint8_t * planes = malloc((size_t) 3 * channels * width);
+  const uint8_t * in = data, * end = data + length;
+  unsigned y;
+  if (planes == NULL) {
+    return 0;
+  }
+  uint8_t * cur = planes, * up = planes + channels * width, * z = up + channels * width;
+  for (y = 0; y < height && in; y++) {
+    uint8_t * swap = up;
+    up = cur;
+    cur = swap;
+    for (c = 0; c < channels && in; c++) {
+      in = Unpack(in, end, width, bits[c], z);
+      Unresiduals(z, y ? up + c * width : NULL, width, bits[c], cur + c * width);
+    }
+    JoinRow(cur, channels, width, raster + y * stride);
+  }
+  free(planes);
+  return in != NULL;
+}
+
+
+static void FreeSlide(CachedSlide * slide)
+{
+  if (slide->raster) {
+    FreeDecodedImage(slide->raster);
+  }
+  free(slide->data);
+  free(slide->path);
+  free(slide);
+}
+
+static void CompressSlide(Task * task)
+{
+  CachedSlide * slide = task->context;
+  double started = vgwrap_now_ms();
+  size_t length = 0;
+  uint8_t * data = Compress(slide->raster, slide->format, slide->width, slide->height, &length);
+  double took = vgwrap_now_ms() - started;
+
+  pthread_mutex_lock(&cacheLock);
+  FreeDecodedImage(slide->raster);
+  slide->raster = NULL;
+  slide->data = data;
+  slide->length = length;
+  if (data) {
+    compressed++;
+    compressMs += took;
+    rawBytes += ImageBytes(slide->format, slide->width, slide->height);
+    packedBytes += length;
+  }
+  pthread_mutex_unlock(&cacheLock);
+}
+
+// a slide is settled once compressed, or failing that
+static int Settled(CachedSlide * slide)
+{
+  return slide->raster == NULL;
+}
+
+// the memory a slide holds.  Called with cacheLock held.
+static size_t SlideBytes(CachedSlide * slide)
+{
+  return slide->raster ? ImageBytes(slide->format, slide->width, slide->height) : slide->length;
+}
+
+// drop slide i from the cache.  Called with cacheLock held, and only for
+// a settled slide, whose compression can't be running.
+static void Evict(int i)
+{
+  CachedSlide * slide = slides[i];
+  memmove(slides + i, slides + i + 1, (slideCount - i - 1) * sizeof(CachedSlide *));
+  slideCount--;
+  evictions++;
+  if (slide->users > 0) {
+    slide->evicted = 1;
+  }
+  else {
+    FreeSlide(slide);
+  }
+}
+
+// evict the least recently used settled slides until at most bytes are
+// held.  Called with cacheLock held.
+static void EvictTo(size_t bytes)
+{
+  size_t held = 0;
+  int i;
+  for (i = 0; i < slideCount; i++) {
+    held += SlideBytes(slides[i]);
+  }
+  for (i = slideCount - 1; i >= 0 && held > bytes; i--) {
+    if (Settled(slides[i])) {
+      held -= SlideBytes(slides[i]);
+      Evict(i);
+    }
+  }
+}
+
+static int Find(const char * path, unsigned maxWidth, unsigned maxHeight)
+{
+  int i;
+  for (i = 0; i < slideCount; i++) {
+    if (slides[i]->maxWidth == maxWidth && slides[i]->maxHeight == maxHeight &&
+	strcmp(slides[i]->path, path) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+// SetSlideCacheBudget sets the memory the cache may hold, evicting
+// slides if it holds more
+void SetSlideCacheBudget(size_t bytes)
+{
+  pthread_mutex_lock(&cacheLock);
+  budget = bytes;
+  EvictTo(budget);
+  pthread_mutex_unlock(&cacheLock);
+}
+
+// CacheSlide takes a raster from DecodeImage, fitted to maxWidth x
+// maxHeight, to compress and keep.  The raster is the cache's from here
+// on.
+void CacheSlide(const char * path, unsigned maxWidth, unsigned maxHeight,
+		VGubyte * raster, VGImageFormat format, unsigned width, unsigned height)
+{
+  pthread_mutex_lock(&cacheLock);
+  int i = Find(path, maxWidth, maxHeight), j;
+  for (j = slideCount - 1; i < 0 && slideCount == MAX_CACHED_SLIDES && j >= 0; j--) {
+    if (Settled(slides[j])) {
+      Evict(j);
+    }
+  }
+  if (i >= 0 || budget == 0 || slideCount == MAX_CACHED_SLIDES) {
+    pthread_mutex_unlock(&cacheLock);
+    FreeDecodedImage(raster);
+    return;
+  }
+  CachedSlide * slide = calloc(1, sizeof(CachedSlide));
+  slide->path = strdup(path);
+  slide->maxWidth = maxWidth;
+  slide->maxHeight = maxHeight;
+  slide->width = width;
+  slide->height = height;
+  slide->format = format;
+  slide->raster = raster;
+  slide->compress.run = CompressSlide;
+  slide->compress.context = slide;
+  memmove(slides + 1, slides, slideCount * sizeof(CachedSlide *));
+  slides[0] = slide;
+  slideCount++;
+  pthread_mutex_unlock(&cacheLock);
+  SubmitTask(&slide->compress, LANE_BACKGROUND);
+
+  // make room once it is compressed, it is all but the raster until then
+  pthread_mutex_lock(&cacheLock);
+  EvictTo(budget);
+  pthread_mutex_unlock(&cacheLock);
+}
+
+// IsSlideCached tells whether LoadCachedSlide would find a slide
+int IsSlideCached(const char * path, unsigned maxWidth, unsigned maxHeight)
+{
+  pthread_mutex_lock(&cacheLock);
+  int i = Find(path, maxWidth, maxHeight);
+  int cached = i >= 0 && (slides[i]->raster || slides[i]->data);
+  pthread_mutex_unlock(&cacheLock);
+  return cached;
+}
+
+// LoadCachedSlide is DecodeImage from the cache: a raster expanded from a
+// cached slide, or NULL if it isn't cached.  Safe to call from any
+// thread.
+VGubyte * LoadCachedSlide(const char * path, unsigned maxWidth, unsigned maxHeight,
+			  unsigned * width, unsigned * height, VGImageFormat * format)
+{
+  pthread_mutex_lock(&cacheLock);
+  int i = Find(path, maxWidth, maxHeight);
+  if (i < 0) {
+    misses++;
+    pthread_mutex_unlock(&cacheLock);
+    CountStat(COUNTER_SLIDE_CACHE_MISSES, 1);
+    return NULL;
+  }
+  CachedSlide * slide = slides[i];
+  memmove(slides + 1, slides, i * sizeof(CachedSlide *));
+  slides[0] = slide;
+  slide->users++;
+  pthread_mutex_unlock(&cacheLock);
+
+  // one just handed over may not be compressed yet; doing it here beats
+  // waiting for an idle core
+  if (UnqueueTask(&slide->compress)) {
+    CompressSlide(&slide->compress);
+  }
+  else {
+    WaitTask(&slide->compress);
+  }
+
+  // kept while it has users
+  pthread_mutex_lock(&cacheLock);
+  const uint8_t * data = slide->data;
+  size_t length = slide->length;
+  pthread_mutex_unlock(&cacheLock);
+
+  double started = vgwrap_now_ms();
+  VGubyte * raster = data ? malloc(ImageBytes(slide->format, slide->width, slide->height)) : NULL;
+  if (raster && !Expand(data, length, slide->format, slide->width, slide->height, raster)) {
+    printf("Failed expanding the cached slide '%s'\n", path);
+    free(raster);
+    raster = NULL;
+  }
+
+  pthread_mutex_lock(&cacheLock);
+  if (raster) {
+    hits++;
+    expandMs += vgwrap_now_ms() - started;
+    *width = slide->width;
+    *height = slide->height;
+    *format = slide->format;
+  }
+  else {
+    misses++;
+  }
+  if (--slide->users == 0 && slide->evicted) {
+    FreeSlide(slide);
+  }
+  pthread_mutex_unlock(&cacheLock);
+  CountStat(raster ? COUNTER_SLIDE_CACHE_HITS : COUNTER_SLIDE_CACHE_MISSES, 1);
+  return raster;
+}
+
+// CompressedSlideBytes returns the memory held by the cache
+size_t CompressedSlideBytes()
+{
+  size_t bytes = 0;
+  int i;
+  pthread_mutex_lock(&cacheLock);
+  for (i = 0; i < slideCount; i++) {
+    bytes += SlideBytes(slides[i]);
+  }
+  pthread_mutex_unlock(&cacheLock);
+  return bytes;
+}
+
+// ShedCompressedSlides evicts slides until at most bytes are held
+void ShedCompressedSlides(size_t bytes)
+{
+  pthread_mutex_lock(&cacheLock);
+  EvictTo(bytes);
+  pthread_mutex_unlock(&cacheLock);
+}
+
+void PrintSlideCacheStats()
+{
+  pthread_mutex_lock(&cacheLock);
+  long lookups = hits + misses;
+  size_t held = 0;
+  int i;
+  for (i = 0; i < slideCount; i++) {
+    held += SlideBytes(slides[i]);
+  }
+  if (lookups > 0 || slideCount > 0) {
+    printf("slide cache: %d slides, %.1f of %.1f MB, %.2fx compression, %ld hits %ld misses (%.0f%%), %ld evicted, compress %.1f ms expand %.1f ms\n",
+	   slideCount, held / (1024.0 * 1024.0), budget / (1024.0 * 1024.0),
+	   packedBytes ? (double) rawBytes / packedBytes : 0.0,
+	   hits, misses, lookups ? 100.0 * hits / lookups : 0.0, evictions,
+	   compressed ? compressMs / compressed : 0.0, hits ? expandMs / hits : 0.0);
+  }
+  pthread_mutex_unlock(&cacheLock);
+}
+
+// FinishSlideCache waits for the slides being compressed and frees every
+// slide
+void FinishSlideCache()
+{
+  int i;
+  for (i = 0; i < slideCount; i++) {
+    CancelTask(&slides[i]->compress);
+    WaitTask(&slides[i]->compress);
+  }
+  while (slideCount > 0) {
+    FreeSlide(slides[--slideCount]);
+  }
+}
@@ -0,0 +1,70 @@
+// Image sources.  The images location pislides is started with decides
+// where the catalog comes from: a URL is the manifest of an HTTP source,
+// anything else a local directory tree.  Each catalog entry is decoded by
+// the source its path belongs to.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pislides.h"
+
+
+typedef struct _ImageSource {
+  const char * name;
+  // nonzero if the location, or an image path, is this source's
+  int (*claims)(const char * location);
+  // adds every image at the location to the catalog
+  void (*scan)(char * location);
+  // decodes an image to a raster fitted inside maxWidth x maxHeight
+  VGubyte * (*decode)(const char * path, unsigned maxWidth, unsigned maxHeight,
+		      unsigned * width, unsigned * height, VGImageFormat * format);
+} ImageSource;
+
+static int IsDirectoryLocation(const char * location)
+{
+  return 1;
+}
+
+// the first that claims a location has it, so directories go last
+static const ImageSource sources[] = {
+  { "http", IsHttpLocation, ScanHttpManifest, DecodeHttpImage },
+  { "directory", IsDirectoryLocation, ScanImageDirectory, DecodeInDecoderProcess }
+};
+
+static const ImageSource * SourceFor(const char * location)
+{
+  int i;
+  for (i = 0; i < sizeof(sources) / sizeof(sources[0]) - 1; i++) {
+    if (sources[i].claims(location)) {
+      return sources + i;
+    }
+  }
+  return sources + i;
+}
+
+
+// ScanImageSource adds every image at location to the catalog
+void ScanImageSource(char * location)
+{
+  SourceFor(location)->scan(location);
+}
+
+// DecodeImage decodes a catalog image to a raster, bottom row first,
+// fitted inside maxWidth x maxHeight, in the format given by format.
+// Returns NULL on failure.  Safe to call from any thread.  The raster is
+// freed with FreeDecodedImage.
+VGubyte * DecodeImage(const char * path, unsigned maxWidth, unsigned maxHeight,
+		      unsigned * width, unsigned * height, VGImageFormat * format)
+{
+  return SourceFor(path)->decode(path, maxWidth, maxHeight, width, height, format);
+}
+
+// FreeDecodedImage frees a raster from DecodeImage, which may be mapped
+// from a decoder process rather than allocated
+void FreeDecodedImage(VGubyte * pixels)
+{
+  if (!FreeDecoderRaster(pixels)) {
+    free(pixels);
+  }
+}
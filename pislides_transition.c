@@ -0,0 +1,344 @@
+// Frame paced slide transitions: cross-fades between the outgoing and
+// incoming slide, and optional Ken Burns pan and zoom while a slide is up.
+//
+// Both images stay resident for the length of a fade and every frame is
+// redrawn from scratch and presented with End(), which with a swap
+// interval set waits for vertical sync.  Animation progress is taken from
+// the clock rather than counted in frames, so a missed frame shortens the
+// animation by one step instead of stretching it.  When frames keep
+// missing the refresh deadline the quality level is lowered, first image
+// filtering and finally the frame rate, and it is raised again once
+// frames are back on time.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "pislides.h"
+
+
+// a slide on screen, with the Ken Burns motion it follows over its life
+typedef struct _Slide {
+  CenteredScaledImage * csv;
+  double shownAt;
+  // zoom and pan (in pixels) at the start and end of the slide's life
+  VGfloat zoomFrom, zoomTo;
+  VGfloat panFromX, panFromY, panToX, panToY;
+} Slide;
+
+static TransitionSettings settings;
+static Slide current, outgoing;
+
+// quality levels, from best to cheapest
+#define QUALITY_LEVELS 4
+static const VGImageQuality levelImageQuality[QUALITY_LEVELS] = {
+  VG_IMAGE_QUALITY_BETTER,
+  VG_IMAGE_QUALITY_FASTER,
+  VG_IMAGE_QUALITY_NONANTIALIASED,
+  VG_IMAGE_QUALITY_NONANTIALIASED
+};
+static const int levelSwapInterval[QUALITY_LEVELS] = { 1, 1, 1, 2 };
+
+// consecutive late frames before degrading, on time frames before
+// trying the next better level again
+#define LATE_FRAMES_TO_DEGRADE 2
+#define GOOD_FRAMES_TO_RECOVER 120
+
+static int qualityLevel;
+static int lateFrames, goodFrames;
+
+// frame time statistics, the last FRAME_SAMPLES present intervals
+#define FRAME_SAMPLES 4096
+static double frameSamples[FRAME_SAMPLES];
+static int frameSampleCount, frameSampleNext;
+static long framesPresented, framesDropped;
+static double lastPresent;
+
+
+static VGfloat RandomRange(VGfloat from, VGfloat to)
+{
+  return from + (to - from) * ((VGfloat) rand() / (VGfloat) RAND_MAX);
+}
+
+// pick the pan and zoom path for a new slide.  Zooming only ever enlarges,
+// so the screen stays covered as well as the fitted image covered it.
+static void ChooseMotion(Slide * slide)
+{
+  slide->zoomFrom = slide->zoomTo = 1.0f;
+  slide->panFromX = slide->panFromY = slide->panToX = slide->panToY = 0.0f;
+  if (!settings.kenBurns) {
+    return;
+  }
+
+  // pan only at the zoomed in end so the letterbox edges stay put where
+  // the image is at its fitted size
+  VGfloat zoomed = 1.0f + settings.kenBurnsZoom;
+  VGfloat panX = RandomRange(-1.0f, 1.0f) * screenWidth * settings.kenBurnsPan;
+  VGfloat panY = RandomRange(-1.0f, 1.0f) * screenHeight * settings.kenBurnsPan;
+  if (rand() & 1) {
+    slide->zoomFrom = zoomed;
+    slide->panFromX = panX;
+    slide->panFromY = panY;
+  }
+  else {
+    slide->zoomTo = zoomed;
+    slide->panToX = panX;
+    slide->panToY = panY;
+  }
+}
+
+// a slide's life runs from the start of its fade in to the end of its
+// fade out
+static double SlideLifeMs()
+{
+  return settings.fadeMs * 2 + settings.holdMs;
+}
+
+// draw a slide at time now with the given opacity
+static void DrawSlide(Slide * slide, double now, VGfloat opacity)
+{
+  CenteredScaledImage * csv = slide->csv;
+  VGfloat t = (VGfloat) ((now - slide->shownAt) / SlideLifeMs());
+  if (t < 0.0f) {
+    t = 0.0f;
+  }
+  else if (t > 1.0f) {
+    t = 1.0f;
+  }
+
+  VGfloat zoom = slide->zoomFrom + (slide->zoomTo - slide->zoomFrom) * t;
+  VGfloat panX = slide->panFromX + (slide->panToX - slide->panFromX) * t;
+  VGfloat panY = slide->panFromY + (slide->panToY - slide->panFromY) * t;
+
+  // zoom about the screen center, then place the image as usual
+  SetImageToSurfaceTransform();
+  vgLoadIdentity();
+  Translate(screenWidth / 2.0f + panX, screenHeight / 2.0f + panY);
+  Scale(zoom, zoom);
+  Translate(-screenWidth / 2.0f, -screenHeight / 2.0f);
+  Translate(csv->offsetX, csv->offsetY);
+  Scale(csv->finalScale, csv->finalScale);
+
+  DrawScaledImage(csv, opacity);
+}
+
+static void SetQualityLevel(int level)
+{
+  qualityLevel = level;
+  vgSeti(VG_IMAGE_QUALITY, levelImageQuality[level]);
+  SwapInterval(levelSwapInterval[level]);
+  lateFrames = goodFrames = 0;
+}
+
+// account for a presented frame and adapt the quality level
+static void RecordFrame(double presentedAt)
+{
+  framesPresented++;
+  if (lastPresent > 0.0) {
+    double interval = presentedAt - lastPresent;
+    frameSamples[frameSampleNext] = interval;
+    frameSampleNext = (frameSampleNext + 1) % FRAME_SAMPLES;
+    if (frameSampleCount < FRAME_SAMPLES) {
+      frameSampleCount++;
+    }
+
+    // anything past half a period late missed its refresh
+    double budget = settings.refreshMs * levelSwapInterval[qualityLevel];
+    int periods = (int) (interval / budget + 0.5);
+    if (interval > budget * 1.5) {
+      framesDropped += periods - 1;
+      goodFrames = 0;
+      if (++lateFrames >= LATE_FRAMES_TO_DEGRADE && qualityLevel < QUALITY_LEVELS - 1) {
+	SetQualityLevel(qualityLevel + 1);
+      }
+    }
+    else {
+      lateFrames = 0;
+      if (++goodFrames >= GOOD_FRAMES_TO_RECOVER && qualityLevel > 0) {
+	SetQualityLevel(qualityLevel - 1);
+      }
+    }
+  }
+  lastPresent = presentedAt;
+}
+
+// animate until the time end.  Each frame draws the outgoing slide, if
+// any, and the current slide faded in over fadeMs from its start.  Stops
+// early if a command arrives, and returns it.
+static int RunFrames(double end)
+{
+  // the first present after an idle period says nothing about pacing
+  lastPresent = 0.0;
+  for (;;) {
+    double now = vgwrap_now_ms();
+    if (now > end) {
+      now = end;
+    }
+
+    uint64_t drawBegin = StageBegin();
+    StartClear(screenWidth, screenHeight, 0, 0, 0);
+    VGfloat opacity = 1.0f;
+    if (outgoing.csv && settings.fadeMs > 0.0) {
+      opacity = (VGfloat) ((now - current.shownAt) / settings.fadeMs);
+      if (opacity > 1.0f) {
+	opacity = 1.0f;
+      }
+    }
+    // once faded in, nothing of the outgoing slide is left around a
+    // smaller slide or between collage cells
+    if (outgoing.csv && opacity < 1.0f) {
+      DrawSlide(&outgoing, now, 1.0f);
+    }
+    DrawSlide(&current, now, opacity);
+    ComposeOverlays();
+    StageEnd(STAGE_DRAW, drawBegin);
+    End();
+    RecordFrame(vgwrap_now_ms());
+    UpdateMemoryGovernor(vgwrap_now_ms());
+
+    if (now >= end) {
+      return COMMAND_NONE;
+    }
+    int command = PollCommand();
+    if (command != COMMAND_NONE) {
+      return command;
+    }
+  }
+}
+
+static int IsPauseCommand(int command)
+{
+  return command == COMMAND_PAUSE || command == COMMAND_RESUME || command == COMMAND_TOGGLE_PAUSE;
+}
+
+
+void InitTransitions(const TransitionSettings * newSettings)
+{
+  settings = *newSettings;
+  memset(&current, 0, sizeof(current));
+  memset(&outgoing, 0, sizeof(outgoing));
+  SetQualityLevel(0);
+}
+
+// TransitionTo fades from the slide on screen to incoming, which becomes
+// owned by the transition engine.  A command other than pause or resume
+// cuts the fade short, and is left for HoldSlide to return; pausing takes
+// effect once the fade is done.
+void TransitionTo(CenteredScaledImage * incoming)
+{
+  outgoing = current;
+  current.csv = incoming;
+  current.shownAt = vgwrap_now_ms();
+  ChooseMotion(&current);
+
+  double end = current.shownAt;
+  if (outgoing.csv && settings.fadeMs > 0.0) {
+    end += settings.fadeMs;
+  }
+  int command, deferred = COMMAND_NONE;
+  while ((command = RunFrames(end)) != COMMAND_NONE) {
+    if (!IsPauseCommand(command)) {
+      UntakeCommand(command);
+      break;
+    }
+    // two toggles cancel out, otherwise the latest wins
+    deferred = command == COMMAND_TOGGLE_PAUSE && deferred == COMMAND_TOGGLE_PAUSE ? COMMAND_NONE : command;
+  }
+  UntakeCommand(deferred);
+
+  if (outgoing.csv) {
+    FreeScaledImage(outgoing.csv);
+    outgoing.csv = NULL;
+  }
+}
+
+// HoldSlide keeps the current slide up for holdMs, animating it if Ken
+// Burns motion is on.  Otherwise the GPU stays idle apart from redrawing
+// overlays that changed.  Pausing stops the clock, and the motion, until
+// resumed or until pauseTimeoutMs passes.  Returns COMMAND_NONE when the
+// hold is over, or the command that ended it early.
+int HoldSlide()
+{
+  double end = vgwrap_now_ms() + settings.holdMs;
+  double pausedAt = 0.0;	// when the pause began, 0 if playing
+
+  for (;;) {
+    double now = vgwrap_now_ms();
+    int command;
+    if (pausedAt == 0.0 && now >= end) {
+      return COMMAND_NONE;
+    }
+    if (settings.kenBurns && pausedAt == 0.0) {
+      command = RunFrames(end);
+      if (command == COMMAND_NONE) {
+	return COMMAND_NONE;
+      }
+    }
+    else {
+      double until = end;
+      if (pausedAt > 0.0) {
+	until = settings.pauseTimeoutMs > 0.0 ? pausedAt + settings.pauseTimeoutMs : now + 3600000.0;
+      }
+      command = WaitForEvents(NextMemoryPoll(NextOverlayRefresh(until)));
+      now = vgwrap_now_ms();
+      UpdateOverlays(now);
+      UpdateMemoryGovernor(now);
+      if (command == COMMAND_NONE && pausedAt > 0.0 && settings.pauseTimeoutMs > 0.0 &&
+	  now >= pausedAt + settings.pauseTimeoutMs) {
+	command = COMMAND_RESUME;
+      }
+    }
+
+    if (command == COMMAND_TOGGLE_PAUSE) {
+      command = pausedAt > 0.0 ? COMMAND_RESUME : COMMAND_PAUSE;
+    }
+    if (command == COMMAND_PAUSE && pausedAt == 0.0) {
+      pausedAt = now;
+    }
+    else if (command == COMMAND_RESUME && pausedAt > 0.0) {
+      // carry on where the slide was, motion included
+      end += now - pausedAt;
+      current.shownAt += now - pausedAt;
+      pausedAt = 0.0;
+    }
+    else if (command != COMMAND_NONE && !IsPauseCommand(command)) {
+      return command;
+    }
+  }
+}
+
+void FinishTransitions()
+{
+  if (current.csv) {
+    FreeScaledImage(current.csv);
+    current.csv = NULL;
+  }
+}
+
+
+static int CompareDoubles(const void * a, const void * b)
+{
+  double da = *(const double *) a, db = *(const double *) b;
+  return (da > db) - (da < db);
+}
+
+// PrintFrameStats reports present interval percentiles over the recent
+// frames, and totals since startup
+void PrintFrameStats()
+{
+  if (frameSampleCount == 0) {
+    return;
+  }
+  double sorted[FRAME_SAMPLES];
+  memcpy(sorted, frameSamples, frameSampleCount * sizeof(double));
+  qsort(sorted, frameSampleCount, sizeof(double), CompareDoubles);
+
+  printf("frames: %ld presented, %ld dropped, p50 %.2f ms, p99 %.2f ms, max %.2f ms, quality level %d\n",
+	 framesPresented, framesDropped,
+	 sorted[frameSampleCount / 2],
+	 sorted[(frameSampleCount * 99) / 100],
+	 sorted[frameSampleCount - 1],
+	 qualityLevel);
+}
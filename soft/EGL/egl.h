@@ -0,0 +1,59 @@
+// EGL declarations for the software backend (see eglsoft.c).  There is a
+// single display with a single window surface held in memory.
+
+#ifndef __egl_h_
+#define __egl_h_
+
+#include <stdint.h>
+
+typedef int32_t EGLint;
+typedef unsigned int EGLBoolean;
+typedef unsigned int EGLenum;
+typedef void *EGLConfig;
+typedef void *EGLContext;
+typedef void *EGLDisplay;
+typedef void *EGLSurface;
+typedef void *EGLNativeDisplayType;
+
+#define EGL_FALSE 0
+#define EGL_TRUE 1
+
+#define EGL_DEFAULT_DISPLAY ((EGLNativeDisplayType)0)
+#define EGL_NO_CONTEXT ((EGLContext)0)
+#define EGL_NO_DISPLAY ((EGLDisplay)0)
+#define EGL_NO_SURFACE ((EGLSurface)0)
+
+#define EGL_SUCCESS 0x3000
+#define EGL_NOT_INITIALIZED 0x3001
+#define EGL_BAD_SURFACE 0x300D
+#define EGL_ALPHA_SIZE 0x3021
+#define EGL_BLUE_SIZE 0x3022
+#define EGL_GREEN_SIZE 0x3023
+#define EGL_RED_SIZE 0x3024
+#define EGL_SURFACE_TYPE 0x3033
+#define EGL_NONE 0x3038
+#define EGL_WIDTH 0x3057
+#define EGL_HEIGHT 0x3056
+#define EGL_SWAP_BEHAVIOR 0x3093
+#define EGL_BUFFER_PRESERVED 0x3094
+#define EGL_BUFFER_DESTROYED 0x3095
+#define EGL_OPENVG_API 0x30A1
+#define EGL_WINDOW_BIT 0x0004
+
+EGLDisplay eglGetDisplay(EGLNativeDisplayType display_id);
+EGLBoolean eglInitialize(EGLDisplay dpy, EGLint * major, EGLint * minor);
+EGLBoolean eglTerminate(EGLDisplay dpy);
+EGLBoolean eglBindAPI(EGLenum api);
+EGLBoolean eglChooseConfig(EGLDisplay dpy, const EGLint * attrib_list,
+			   EGLConfig * configs, EGLint config_size, EGLint * num_config);
+EGLContext eglCreateContext(EGLDisplay dpy, EGLConfig config,
+			    EGLContext share_context, const EGLint * attrib_list);
+EGLBoolean eglDestroyContext(EGLDisplay dpy, EGLContext ctx);
+EGLBoolean eglDestroySurface(EGLDisplay dpy, EGLSurface surface);
+EGLBoolean eglSurfaceAttrib(EGLDisplay dpy, EGLSurface surface, EGLint attribute, EGLint value);
+EGLBoolean eglMakeCurrent(EGLDisplay dpy, EGLSurface draw, EGLSurface read, EGLContext ctx);
+EGLBoolean eglSwapBuffers(EGLDisplay dpy, EGLSurface surface);
+EGLBoolean eglSwapInterval(EGLDisplay dpy, EGLint interval);
+EGLint eglGetError(void);
+
+#endif
@@ -0,0 +1,22 @@
+// The few OpenGL ES calls vgwrap makes, for the software backend.  Only
+// glClear does anything; it clears the surface.
+
+#ifndef __gl_h_
+#define __gl_h_
+
+typedef unsigned int GLbitfield;
+typedef unsigned int GLenum;
+typedef int GLint;
+typedef int GLsizei;
+typedef float GLfloat;
+
+#define GL_COLOR_BUFFER_BIT 0x00004000
+#define GL_PROJECTION 0x1701
+
+void glClear(GLbitfield mask);
+void glViewport(GLint x, GLint y, GLsizei width, GLsizei height);
+void glMatrixMode(GLenum mode);
+void glLoadIdentity(void);
+void glFrustumf(GLfloat left, GLfloat right, GLfloat bottom, GLfloat top, GLfloat zNear, GLfloat zFar);
+
+#endif
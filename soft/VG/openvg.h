@@ -0,0 +1,304 @@
+// OpenVG 1.1 declarations for the software backend.
+//
+// Only the part of the API that vgwrap and pislides use is declared and
+// implemented (see vgsoft.c).  Names and values follow the Khronos
+// header, so code written against it builds unchanged for either backend.
+
+#ifndef _OPENVG_H
+#define _OPENVG_H
+
+#include <stdint.h>
+
+#define OPENVG_VERSION_1_1 2
+
+typedef float VGfloat;
+typedef int8_t VGbyte;
+typedef uint8_t VGubyte;
+typedef int16_t VGshort;
+typedef int32_t VGint;
+typedef uint32_t VGuint;
+typedef uint32_t VGbitfield;
+
+typedef enum {
+  VG_FALSE = 0,
+  VG_TRUE = 1
+} VGboolean;
+
+#define VG_MAXSHORT ((VGshort)((~((unsigned)0)) >> 1))
+#define VG_MAXINT ((VGint)((~((unsigned)0)) >> 1))
+
+typedef VGuint VGHandle;
+#define VG_INVALID_HANDLE ((VGHandle)0)
+
+typedef VGHandle VGPath;
+typedef VGHandle VGImage;
+typedef VGHandle VGMaskLayer;
+typedef VGHandle VGFont;
+typedef VGHandle VGPaint;
+
+typedef enum {
+  VG_NO_ERROR = 0,
+  VG_BAD_HANDLE_ERROR = 0x1000,
+  VG_ILLEGAL_ARGUMENT_ERROR = 0x1001,
+  VG_OUT_OF_MEMORY_ERROR = 0x1002,
+  VG_PATH_CAPABILITY_ERROR = 0x1003,
+  VG_UNSUPPORTED_IMAGE_FORMAT_ERROR = 0x1004,
+  VG_UNSUPPORTED_PATH_FORMAT_ERROR = 0x1005,
+  VG_IMAGE_IN_USE_ERROR = 0x1006,
+  VG_NO_CONTEXT_ERROR = 0x1007
+} VGErrorCode;
+
+typedef enum {
+  VG_MATRIX_MODE = 0x1100,
+  VG_FILL_RULE = 0x1101,
+  VG_IMAGE_QUALITY = 0x1102,
+  VG_RENDERING_QUALITY = 0x1103,
+  VG_BLEND_MODE = 0x1104,
+  VG_IMAGE_MODE = 0x1105,
+  VG_SCISSOR_RECTS = 0x1106,
+  VG_STROKE_LINE_WIDTH = 0x1110,
+  VG_STROKE_CAP_STYLE = 0x1111,
+  VG_STROKE_JOIN_STYLE = 0x1112,
+  VG_STROKE_MITER_LIMIT = 0x1113,
+  VG_CLEAR_COLOR = 0x1121,
+  VG_MASKING = 0x1130,
+  VG_SCISSORING = 0x1131,
+  VG_MAX_SCISSOR_RECTS = 0x1160,
+  VG_MAX_COLOR_RAMP_STOPS = 0x1164,
+  VG_MAX_IMAGE_WIDTH = 0x1165,
+  VG_MAX_IMAGE_HEIGHT = 0x1166,
+  VG_MAX_IMAGE_PIXELS = 0x1167,
+  VG_MAX_IMAGE_BYTES = 0x1168
+} VGParamType;
+
+typedef enum {
+  VG_RENDERING_QUALITY_NONANTIALIASED = 0x1200,
+  VG_RENDERING_QUALITY_FASTER = 0x1201,
+  VG_RENDERING_QUALITY_BETTER = 0x1202
+} VGRenderingQuality;
+
+typedef enum {
+  VG_MATRIX_PATH_USER_TO_SURFACE = 0x1400,
+  VG_MATRIX_IMAGE_USER_TO_SURFACE = 0x1401,
+  VG_MATRIX_FILL_PAINT_TO_USER = 0x1402,
+  VG_MATRIX_STROKE_PAINT_TO_USER = 0x1403,
+  VG_MATRIX_GLYPH_USER_TO_SURFACE = 0x1404
+} VGMatrixMode;
+
+#define VG_PATH_FORMAT_STANDARD 0
+
+typedef enum {
+  VG_PATH_DATATYPE_S_8 = 0,
+  VG_PATH_DATATYPE_S_16 = 1,
+  VG_PATH_DATATYPE_S_32 = 2,
+  VG_PATH_DATATYPE_F = 3
+} VGPathDatatype;
+
+typedef enum {
+  VG_ABSOLUTE = 0,
+  VG_RELATIVE = 1
+} VGPathAbsRel;
+
+typedef enum {
+  VG_CLOSE_PATH = (0 << 1),
+  VG_MOVE_TO = (1 << 1),
+  VG_LINE_TO = (2 << 1),
+  VG_HLINE_TO = (3 << 1),
+  VG_VLINE_TO = (4 << 1),
+  VG_QUAD_TO = (5 << 1),
+  VG_CUBIC_TO = (6 << 1),
+  VG_SQUAD_TO = (7 << 1),
+  VG_SCUBIC_TO = (8 << 1)
+} VGPathSegment;
+
+typedef enum {
+  VG_MOVE_TO_ABS = VG_MOVE_TO | VG_ABSOLUTE,
+  VG_MOVE_TO_REL = VG_MOVE_TO | VG_RELATIVE,
+  VG_LINE_TO_ABS = VG_LINE_TO | VG_ABSOLUTE,
+  VG_LINE_TO_REL = VG_LINE_TO | VG_RELATIVE,
+  VG_HLINE_TO_ABS = VG_HLINE_TO | VG_ABSOLUTE,
+  VG_HLINE_TO_REL = VG_HLINE_TO | VG_RELATIVE,
+  VG_VLINE_TO_ABS = VG_VLINE_TO | VG_ABSOLUTE,
+  VG_VLINE_TO_REL = VG_VLINE_TO | VG_RELATIVE,
+  VG_QUAD_TO_ABS = VG_QUAD_TO | VG_ABSOLUTE,
+  VG_QUAD_TO_REL = VG_QUAD_TO | VG_RELATIVE,
+  VG_CUBIC_TO_ABS = VG_CUBIC_TO | VG_ABSOLUTE,
+  VG_CUBIC_TO_REL = VG_CUBIC_TO | VG_RELATIVE,
+  VG_SQUAD_TO_ABS = VG_SQUAD_TO | VG_ABSOLUTE,
+  VG_SQUAD_TO_REL = VG_SQUAD_TO | VG_RELATIVE,
+  VG_SCUBIC_TO_ABS = VG_SCUBIC_TO | VG_ABSOLUTE,
+  VG_SCUBIC_TO_REL = VG_SCUBIC_TO | VG_RELATIVE
+} VGPathCommand;
+
+typedef enum {
+  VG_PATH_CAPABILITY_APPEND_FROM = (1 << 0),
+  VG_PATH_CAPABILITY_APPEND_TO = (1 << 1),
+  VG_PATH_CAPABILITY_ALL = (1 << 12) - 1
+} VGPathCapabilities;
+
+typedef enum {
+  VG_CAP_BUTT = 0x1700,
+  VG_CAP_ROUND = 0x1701,
+  VG_CAP_SQUARE = 0x1702
+} VGCapStyle;
+
+typedef enum {
+  VG_JOIN_MITER = 0x1800,
+  VG_JOIN_ROUND = 0x1801,
+  VG_JOIN_BEVEL = 0x1802
+} VGJoinStyle;
+
+typedef enum {
+  VG_EVEN_ODD = 0x1900,
+  VG_NON_ZERO = 0x1901
+} VGFillRule;
+
+typedef enum {
+  VG_STROKE_PATH = (1 << 0),
+  VG_FILL_PATH = (1 << 1)
+} VGPaintMode;
+
+typedef enum {
+  VG_PAINT_TYPE = 0x1A00,
+  VG_PAINT_COLOR = 0x1A01,
+  VG_PAINT_COLOR_RAMP_SPREAD_MODE = 0x1A02,
+  VG_PAINT_COLOR_RAMP_STOPS = 0x1A03,
+  VG_PAINT_LINEAR_GRADIENT = 0x1A04,
+  VG_PAINT_RADIAL_GRADIENT = 0x1A05,
+  VG_PAINT_PATTERN_TILING_MODE = 0x1A06,
+  VG_PAINT_COLOR_RAMP_PREMULTIPLIED = 0x1A07
+} VGPaintParamType;
+
+typedef enum {
+  VG_PAINT_TYPE_COLOR = 0x1B00,
+  VG_PAINT_TYPE_LINEAR_GRADIENT = 0x1B01,
+  VG_PAINT_TYPE_RADIAL_GRADIENT = 0x1B02,
+  VG_PAINT_TYPE_PATTERN = 0x1B03
+} VGPaintType;
+
+typedef enum {
+  VG_COLOR_RAMP_SPREAD_PAD = 0x1C00,
+  VG_COLOR_RAMP_SPREAD_REPEAT = 0x1C01,
+  VG_COLOR_RAMP_SPREAD_REFLECT = 0x1C02
+} VGColorRampSpreadMode;
+
+typedef enum {
+  VG_sRGBX_8888 = 0,
+  VG_sRGBA_8888 = 1,
+  VG_sRGBA_8888_PRE = 2,
+  VG_sRGB_565 = 3,
+  VG_sRGBA_5551 = 4,
+  VG_sRGBA_4444 = 5,
+  VG_sL_8 = 6,
+  VG_lRGBX_8888 = 7,
+  VG_lRGBA_8888 = 8,
+  VG_lRGBA_8888_PRE = 9,
+  VG_lL_8 = 10,
+  VG_A_8 = 11,
+  VG_BW_1 = 12,
+  VG_sXRGB_8888 = 0 | (1 << 6),
+  VG_sARGB_8888 = 1 | (1 << 6),
+  VG_sARGB_8888_PRE = 2 | (1 << 6),
+  VG_sBGRX_8888 = 0 | (1 << 7),
+  VG_sBGRA_8888 = 1 | (1 << 7),
+  VG_sBGRA_8888_PRE = 2 | (1 << 7),
+  VG_sBGR_565 = 3 | (1 << 7),
+  VG_sXBGR_8888 = 0 | (1 << 6) | (1 << 7),
+  VG_sABGR_8888 = 1 | (1 << 6) | (1 << 7),
+  VG_sABGR_8888_PRE = 2 | (1 << 6) | (1 << 7)
+} VGImageFormat;
+
+typedef enum {
+  VG_IMAGE_QUALITY_NONANTIALIASED = (1 << 0),
+  VG_IMAGE_QUALITY_FASTER = (1 << 1),
+  VG_IMAGE_QUALITY_BETTER = (1 << 2)
+} VGImageQuality;
+
+typedef enum {
+  VG_IMAGE_FORMAT = 0x1E00,
+  VG_IMAGE_WIDTH = 0x1E01,
+  VG_IMAGE_HEIGHT = 0x1E02
+} VGImageParamType;
+
+typedef enum {
+  VG_DRAW_IMAGE_NORMAL = 0x1F00,
+  VG_DRAW_IMAGE_MULTIPLY = 0x1F01,
+  VG_DRAW_IMAGE_STENCIL = 0x1F02
+} VGImageMode;
+
+typedef enum {
+  VG_BLEND_SRC = 0x2000,
+  VG_BLEND_SRC_OVER = 0x2001,
+  VG_BLEND_DST_OVER = 0x2002,
+  VG_BLEND_SRC_IN = 0x2003,
+  VG_BLEND_DST_IN = 0x2004,
+  VG_BLEND_MULTIPLY = 0x2005,
+  VG_BLEND_SCREEN = 0x2006,
+  VG_BLEND_DARKEN = 0x2007,
+  VG_BLEND_LIGHTEN = 0x2008,
+  VG_BLEND_ADDITIVE = 0x2009
+} VGBlendMode;
+
+VGErrorCode vgGetError(void);
+void vgFlush(void);
+void vgFinish(void);
+
+void vgSetf(VGParamType type, VGfloat value);
+void vgSeti(VGParamType type, VGint value);
+void vgSetfv(VGParamType type, VGint count, const VGfloat * values);
+void vgSetiv(VGParamType type, VGint count, const VGint * values);
+VGfloat vgGetf(VGParamType type);
+VGint vgGeti(VGParamType type);
+
+void vgSetParameterf(VGHandle object, VGint paramType, VGfloat value);
+void vgSetParameteri(VGHandle object, VGint paramType, VGint value);
+void vgSetParameterfv(VGHandle object, VGint paramType, VGint count, const VGfloat * values);
+VGint vgGetParameteri(VGHandle object, VGint paramType);
+
+void vgLoadIdentity(void);
+void vgLoadMatrix(const VGfloat * m);
+void vgGetMatrix(VGfloat * m);
+void vgMultMatrix(const VGfloat * m);
+void vgTranslate(VGfloat tx, VGfloat ty);
+void vgScale(VGfloat sx, VGfloat sy);
+void vgShear(VGfloat shx, VGfloat shy);
+void vgRotate(VGfloat angle);
+
+VGPath vgCreatePath(VGint pathFormat, VGPathDatatype datatype,
+		    VGfloat scale, VGfloat bias,
+		    VGint segmentCapacityHint, VGint coordCapacityHint,
+		    VGbitfield capabilities);
+void vgClearPath(VGPath path, VGbitfield capabilities);
+void vgDestroyPath(VGPath path);
+void vgAppendPathData(VGPath dstPath, VGint numSegments,
+		      const VGubyte * pathSegments, const void * pathData);
+void vgDrawPath(VGPath path, VGbitfield paintModes);
+
+VGPaint vgCreatePaint(void);
+void vgDestroyPaint(VGPaint paint);
+void vgSetPaint(VGPaint paint, VGbitfield paintModes);
+
+VGImage vgCreateImage(VGImageFormat format, VGint width, VGint height,
+		      VGbitfield allowedQuality);
+VGImage vgChildImage(VGImage parent, VGint x, VGint y, VGint width, VGint height);
+void vgDestroyImage(VGImage image);
+void vgClearImage(VGImage image, VGint x, VGint y, VGint width, VGint height);
+void vgImageSubData(VGImage image, const void * data, VGint dataStride,
+		    VGImageFormat dataFormat,
+		    VGint x, VGint y, VGint width, VGint height);
+void vgGetImageSubData(VGImage image, void * data, VGint dataStride,
+		       VGImageFormat dataFormat,
+		       VGint x, VGint y, VGint width, VGint height);
+void vgDrawImage(VGImage image);
+
+void vgSetPixels(VGint dx, VGint dy, VGImage src, VGint sx, VGint sy,
+		 VGint width, VGint height);
+void vgWritePixels(const void * data, VGint dataStride, VGImageFormat dataFormat,
+		   VGint dx, VGint dy, VGint width, VGint height);
+void vgGetPixels(VGImage dst, VGint dx, VGint dy, VGint sx, VGint sy,
+		 VGint width, VGint height);
+void vgReadPixels(void * data, VGint dataStride, VGImageFormat dataFormat,
+		  VGint sx, VGint sy, VGint width, VGint height);
+void vgClear(VGint x, VGint y, VGint width, VGint height);
+
+#endif
@@ -0,0 +1,32 @@
+// VGU utility declarations for the software backend, see VG/openvg.h
+
+#ifndef _VGU_H
+#define _VGU_H
+
+#include "openvg.h"
+
+typedef enum {
+  VGU_NO_ERROR = 0,
+  VGU_BAD_HANDLE_ERROR = 0xF000,
+  VGU_ILLEGAL_ARGUMENT_ERROR = 0xF001,
+  VGU_OUT_OF_MEMORY_ERROR = 0xF002,
+  VGU_PATH_CAPABILITY_ERROR = 0xF003,
+  VGU_BAD_WARP_ERROR = 0xF004
+} VGUErrorCode;
+
+typedef enum {
+  VGU_ARC_OPEN = 0xF100,
+  VGU_ARC_CHORD = 0xF101,
+  VGU_ARC_PIE = 0xF102
+} VGUArcType;
+
+VGUErrorCode vguLine(VGPath path, VGfloat x0, VGfloat y0, VGfloat x1, VGfloat y1);
+VGUErrorCode vguPolygon(VGPath path, const VGfloat * points, VGint count, VGboolean closed);
+VGUErrorCode vguRect(VGPath path, VGfloat x, VGfloat y, VGfloat width, VGfloat height);
+VGUErrorCode vguRoundRect(VGPath path, VGfloat x, VGfloat y, VGfloat width, VGfloat height,
+			  VGfloat arcWidth, VGfloat arcHeight);
+VGUErrorCode vguEllipse(VGPath path, VGfloat cx, VGfloat cy, VGfloat width, VGfloat height);
+VGUErrorCode vguArc(VGPath path, VGfloat x, VGfloat y, VGfloat width, VGfloat height,
+		    VGfloat startAngle, VGfloat angleExtent, VGUArcType arcType);
+
+#endif
@@ -0,0 +1,222 @@
+//
+// EGL for the software OpenVG backend: one display, one context and one
+// window surface, all living in memory.
+//
+// Swapping hands the finished frame to the present function, if one has
+// been set, and with a swap interval set waits for the next tick of a
+// virtual vertical sync so frame pacing behaves as it does on the Pi.
+// Without a present function frames are simply dropped, which is what
+// headless runs and benchmarks want.  The surface is never cleared on
+// swap, so it always behaves as EGL_BUFFER_PRESERVED.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include "EGL/egl.h"
+#include "GLES/gl.h"
+#include "VG/openvg.h"
+#include "vgsoft.h"
+#include "eglstate.h"
+
+#define DEFAULT_WIDTH 1920
+#define DEFAULT_HEIGHT 1080
+#define VSYNC_HZ 60
+
+static int displayHandle = 1, contextHandle = 1, surfaceHandle = 1;
+static EGLint lastError = EGL_SUCCESS;
+static EGLint swapInterval = 1;
+static struct timespec nextVsync;
+static VGSoftPresentFunc presentFunc;
+static void *presentContext;
+
+
+// vgsoft_set_present sets the function that shows each swapped frame
+void vgsoft_set_present(VGSoftPresentFunc present, void *context)
+{
+	presentFunc = present;
+	presentContext = context;
+}
+
+static void add_ns(struct timespec *t, long ns)
+{
+	t->tv_nsec += ns;
+	while (t->tv_nsec >= 1000000000L) {
+		t->tv_nsec -= 1000000000L;
+		t->tv_sec++;
+	}
+}
+
+static int before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// wait_vsync sleeps until `intervals` virtual refreshes after the last
+// one waited for.  A caller that is already late lands on the next tick.
+static void wait_vsync(int intervals)
+{
+	struct timespec now;
+	long period = 1000000000L / VSYNC_HZ;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (nextVsync.tv_sec == 0) {
+		nextVsync = now;
+	}
+	add_ns(&nextVsync, period * intervals);
+	while (before(&nextVsync, &now)) {
+		add_ns(&nextVsync, period);
+	}
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &nextVsync, NULL);
+}
+
+
+EGLDisplay eglGetDisplay(EGLNativeDisplayType display_id)
+{
+	return &displayHandle;
+}
+
+EGLBoolean eglInitialize(EGLDisplay dpy, EGLint * major, EGLint * minor)
+{
+	if (major) {
+		*major = 1;
+	}
+	if (minor) {
+		*minor = 4;
+	}
+	return EGL_TRUE;
+}
+
+EGLBoolean eglTerminate(EGLDisplay dpy)
+{
+	vgsoft_close_framebuffer();
+	vgsoft_destroy_surface();
+	return EGL_TRUE;
+}
+
+EGLBoolean eglBindAPI(EGLenum api)
+{
+	return api == EGL_OPENVG_API ? EGL_TRUE : EGL_FALSE;
+}
+
+EGLBoolean eglChooseConfig(EGLDisplay dpy, const EGLint * attrib_list,
+			   EGLConfig * configs, EGLint config_size, EGLint * num_config)
+{
+	if (configs && config_size > 0) {
+		configs[0] = &displayHandle;
+	}
+	*num_config = 1;
+	return EGL_TRUE;
+}
+
+EGLContext eglCreateContext(EGLDisplay dpy, EGLConfig config,
+			    EGLContext share_context, const EGLint * attrib_list)
+{
+	return &contextHandle;
+}
+
+EGLBoolean eglDestroyContext(EGLDisplay dpy, EGLContext ctx)
+{
+	return EGL_TRUE;
+}
+
+EGLBoolean eglDestroySurface(EGLDisplay dpy, EGLSurface surface)
+{
+	return EGL_TRUE;
+}
+
+EGLBoolean eglSurfaceAttrib(EGLDisplay dpy, EGLSurface surface, EGLint attribute, EGLint value)
+{
+	// only preserved buffers are supported, and they're the default
+	return attribute == EGL_SWAP_BEHAVIOR && value == EGL_BUFFER_PRESERVED ? EGL_TRUE : EGL_FALSE;
+}
+
+EGLBoolean eglMakeCurrent(EGLDisplay dpy, EGLSurface draw, EGLSurface read, EGLContext ctx)
+{
+	return EGL_TRUE;
+}
+
+EGLBoolean eglSwapBuffers(EGLDisplay dpy, EGLSurface surface)
+{
+	VGSoftSurface *s = vgsoft_surface();
+	if (s->pixels == NULL) {
+		lastError = EGL_BAD_SURFACE;
+		return EGL_FALSE;
+	}
+	if (swapInterval > 0) {
+		wait_vsync(swapInterval);
+	}
+	if (presentFunc) {
+		presentFunc(s, presentContext);
+	}
+	s->damage = (VGSoftRect) { 0, 0, 0, 0 };
+	return EGL_TRUE;
+}
+
+EGLBoolean eglSwapInterval(EGLDisplay dpy, EGLint interval)
+{
+	swapInterval = interval < 0 ? 0 : interval;
+	return EGL_TRUE;
+}
+
+EGLint eglGetError(void)
+{
+	EGLint e = lastError;
+	lastError = EGL_SUCCESS;
+	return e;
+}
+
+
+void glClear(GLbitfield mask)
+{
+	if (mask & GL_COLOR_BUFFER_BIT) {
+		vgsoft_clear_surface(0);
+	}
+}
+
+void glViewport(GLint x, GLint y, GLsizei width, GLsizei height)
+{
+}
+
+void glMatrixMode(GLenum mode)
+{
+}
+
+void glLoadIdentity(void)
+{
+}
+
+void glFrustumf(GLfloat left, GLfloat right, GLfloat bottom, GLfloat top, GLfloat zNear, GLfloat zFar)
+{
+}
+
+
+// oglinit creates the in-memory surface.  Its size comes from the
+// PISLIDES_SOFT_SIZE environment variable, as WIDTHxHEIGHT, and defaults
+// to 1080p.  If PISLIDES_FB names a framebuffer device frames are shown
+// on it, and the surface takes the display's size.
+extern void oglinit(STATE_T * state)
+{
+	const char *size = getenv("PISLIDES_SOFT_SIZE");
+	const char *device = getenv("PISLIDES_FB");
+	int w = DEFAULT_WIDTH, h = DEFAULT_HEIGHT;
+
+	if (size && (sscanf(size, "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0)) {
+		printf("Ignoring bad PISLIDES_SOFT_SIZE '%s'\n", size);
+		w = DEFAULT_WIDTH;
+		h = DEFAULT_HEIGHT;
+	}
+	if (device && device[0] && vgsoft_open_framebuffer(device, &w, &h) != 0) {
+		exit(1);
+	}
+	state->display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	state->context = &contextHandle;
+	state->surface = &surfaceHandle;
+	state->screen_width = w;
+	state->screen_height = h;
+	int result = vgsoft_create_surface(w, h);
+	assert(result == 0);
+}
@@ -0,0 +1,607 @@
+//
+// Framebuffer output for the software backend: presents frames straight
+// into a Linux fbdev device (/dev/fb0), a KMS dumb buffer (/dev/dri/card0)
+// or, for testing, a regular file or memfd standing in for a framebuffer.
+// No EGL or GPU driver is involved.
+//
+// Two pages are used when the device allows it, flipped by panning on
+// fbdev and by page flips on KMS, so a frame is never shown half written.
+// Each page remembers which part of the surface changed since it was last
+// written, and only that part is converted and copied.  During a fade
+// that is the letterboxed image, and while a slide is held it is just
+// the overlays that were redrawn.
+//
+// Conversion from the surface's premultiplied RGBA to the framebuffer's
+// format is done four pixels at a time with GCC vector extensions, in the
+// same pass as the vertical flip.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fb.h>
+
+#if defined(__has_include)
+#if __has_include(<drm/drm.h>) && __has_include(<drm/drm_mode.h>)
+#include <drm/drm.h>
+#include <drm/drm_mode.h>
+#define HAVE_DRM 1
+#endif
+#endif
+
+#include "vgsoft.h"
+
+#define MAX_PAGES 2
+
+// pixel layouts we can write
+enum { FB_XRGB8888, FB_XBGR8888, FB_RGB565, FB_BGR888 };
+
+typedef struct {
+	int fd;
+	int kind;			// FB_KIND_*
+	int width, height;		// visible size
+	int format;
+	int bytesPerPixel;
+	int stride;			// bytes per row
+	uint8_t *map;			// start of the mapping
+	size_t mapLength;
+	uint8_t *pages[MAX_PAGES];
+	int pageCount;
+	int back;			// page being written next
+	VGSoftRect pending[MAX_PAGES];	// changed since the page was written
+	struct fb_var_screeninfo var;	// fbdev only
+	struct fb_var_screeninfo savedVar;
+
+#ifdef HAVE_DRM
+	uint32_t crtc, connector;
+	struct drm_mode_modeinfo mode;
+	struct drm_mode_crtc savedCrtc;
+	uint32_t handles[MAX_PAGES], fbIds[MAX_PAGES];
+	size_t pageLength;
+	int flipPending;
+#endif
+} Framebuffer;
+
+enum { FB_KIND_FBDEV, FB_KIND_FILE, FB_KIND_DRM };
+
+static Framebuffer fb = { .fd = -1 };
+
+
+//
+// Pixel conversion.  Rows of the surface are bottom up, framebuffer rows
+// top down.
+//
+
+typedef uint32_t v4u32 __attribute__ ((vector_size(16)));
+
+static void row_xrgb8888(uint8_t *dst, const uint32_t *src, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		v4u32 p;
+		memcpy(&p, src + i, 16);
+		// R is in the low byte of the surface, B in the low byte of XRGB
+		p = ((p & 0xff) << 16) | ((p >> 16) & 0xff) | (p & 0xff00) | 0xff000000;
+		memcpy(dst + i * 4, &p, 16);
+	}
+	for (; i < n; i++) {
+		uint32_t p = src[i];
+		p = ((p & 0xff) << 16) | ((p >> 16) & 0xff) | (p & 0xff00) | 0xff000000;
+		memcpy(dst + i * 4, &p, 4);
+	}
+}
+
+static void row_xbgr8888(uint8_t *dst, const uint32_t *src, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		v4u32 p;
+		memcpy(&p, src + i, 16);
+		p |= 0xff000000;
+		memcpy(dst + i * 4, &p, 16);
+	}
+	for (; i < n; i++) {
+		uint32_t p = src[i] | 0xff000000;
+		memcpy(dst + i * 4, &p, 4);
+	}
+}
+
+static void row_rgb565(uint8_t *dst, const uint32_t *src, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		v4u32 p;
+		uint16_t out[4];
+		memcpy(&p, src + i, 16);
+		p = ((p & 0xf8) << 8) | ((p >> 5) & 0x7e0) | ((p >> 19) & 0x1f);
+		out[0] = (uint16_t) p[0];
+		out[1] = (uint16_t) p[1];
+		out[2] = (uint16_t) p[2];
+		out[3] = (uint16_t) p[3];
+		memcpy(dst + i * 2, out, 8);
+	}
+	for (; i < n; i++) {
+		uint32_t p = src[i];
+		uint16_t o = (uint16_t) (((p & 0xf8) << 8) | ((p >> 5) & 0x7e0) | ((p >> 19) & 0x1f));
+		memcpy(dst + i * 2, &o, 2);
+	}
+}
+
+static void row_bgr888(uint8_t *dst, const uint32_t *src, int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		uint32_t p = src[i];
+		dst[i * 3] = (uint8_t) (p >> 16);
+		dst[i * 3 + 1] = (uint8_t) (p >> 8);
+		dst[i * 3 + 2] = (uint8_t) p;
+	}
+}
+
+// copy a rectangle of the surface, in surface coordinates, to a page
+static void copy_rect(const VGSoftSurface *s, uint8_t *page, const VGSoftRect *r)
+{
+	int x0 = r->x0, x1 = r->x1, y0 = r->y0, y1 = r->y1, y;
+	// the surface may be larger than the visible framebuffer, or smaller
+	if (x1 > fb.width) x1 = fb.width;
+	if (y1 > s->height) y1 = s->height;
+	if (x1 > s->width) x1 = s->width;
+	for (y = y0; y < y1; y++) {
+		int row = s->height - 1 - y;
+		if (row >= fb.height) {
+			continue;
+		}
+		const uint32_t *src = s->pixels + (size_t) y * s->width + x0;
+		uint8_t *dst = page + (size_t) row * fb.stride + x0 * fb.bytesPerPixel;
+		switch (fb.format) {
+		case FB_XRGB8888:
+			row_xrgb8888(dst, src, x1 - x0);
+			break;
+		case FB_XBGR8888:
+			row_xbgr8888(dst, src, x1 - x0);
+			break;
+		case FB_RGB565:
+			row_rgb565(dst, src, x1 - x0);
+			break;
+		default:
+			row_bgr888(dst, src, x1 - x0);
+		}
+	}
+}
+
+
+//
+// fbdev and plain files
+//
+
+// framebuffer_format picks our pixel layout for an fbdev mode
+static int framebuffer_format(const struct fb_var_screeninfo *var)
+{
+	if (var->bits_per_pixel == 32) {
+		return var->red.offset == 0 ? FB_XBGR8888 : FB_XRGB8888;
+	}
+	if (var->bits_per_pixel == 16) {
+		return FB_RGB565;
+	}
+	if (var->bits_per_pixel == 24) {
+		return FB_BGR888;
+	}
+	return -1;
+}
+
+static int open_fbdev(void)
+{
+	struct fb_fix_screeninfo fix;
+
+	if (ioctl(fb.fd, FBIOGET_VSCREENINFO, &fb.var) != 0 ||
+	    ioctl(fb.fd, FBIOGET_FSCREENINFO, &fix) != 0) {
+		return -1;
+	}
+	fb.savedVar = fb.var;
+	fb.format = framebuffer_format(&fb.var);
+	if (fb.format < 0) {
+		printf("Unsupported framebuffer depth %d\n", fb.var.bits_per_pixel);
+		return -1;
+	}
+
+	// ask for a virtual screen twice the height to flip between halves
+	if (fb.var.yres_virtual < fb.var.yres * 2) {
+		struct fb_var_screeninfo want = fb.var;
+		want.yres_virtual = fb.var.yres * 2;
+		want.yoffset = 0;
+		if (ioctl(fb.fd, FBIOPUT_VSCREENINFO, &want) == 0) {
+			ioctl(fb.fd, FBIOGET_VSCREENINFO, &fb.var);
+			ioctl(fb.fd, FBIOGET_FSCREENINFO, &fix);
+		}
+	}
+
+	fb.kind = FB_KIND_FBDEV;
+	fb.width = fb.var.xres;
+	fb.height = fb.var.yres;
+	fb.bytesPerPixel = fb.var.bits_per_pixel / 8;
+	fb.stride = fix.line_length;
+	fb.mapLength = fix.smem_len;
+	fb.pageCount = fb.var.yres_virtual >= fb.var.yres * 2 &&
+		(size_t) fb.stride * fb.height * 2 <= fb.mapLength ? 2 : 1;
+	fb.map = mmap(NULL, fb.mapLength, PROT_READ | PROT_WRITE, MAP_SHARED, fb.fd, 0);
+	if (fb.map == MAP_FAILED) {
+		return -1;
+	}
+	fb.pages[0] = fb.map;
+	fb.pages[1] = fb.map + (size_t) fb.stride * fb.height;
+	// write to the page not being scanned out
+	fb.back = fb.pageCount == 2 && fb.var.yoffset == 0 ? 1 : 0;
+	return 0;
+}
+
+// a regular file or memfd is treated as two 32 bit pages of the surface
+// size, or 16 bit with PISLIDES_FB_BPP=16
+static int open_file(int width, int height)
+{
+	const char *bpp = getenv("PISLIDES_FB_BPP");
+
+	fb.kind = FB_KIND_FILE;
+	fb.width = width;
+	fb.height = height;
+	fb.format = bpp && atoi(bpp) == 16 ? FB_RGB565 : FB_XRGB8888;
+	fb.bytesPerPixel = fb.format == FB_RGB565 ? 2 : 4;
+	fb.stride = width * fb.bytesPerPixel;
+	fb.pageCount = 2;
+	fb.mapLength = (size_t) fb.stride * height * fb.pageCount;
+	if (ftruncate(fb.fd, fb.mapLength) != 0) {
+		return -1;
+	}
+	fb.map = mmap(NULL, fb.mapLength, PROT_READ | PROT_WRITE, MAP_SHARED, fb.fd, 0);
+	if (fb.map == MAP_FAILED) {
+		return -1;
+	}
+	fb.pages[0] = fb.map;
+	fb.pages[1] = fb.map + (size_t) fb.stride * height;
+	fb.back = 0;
+	return 0;
+}
+
+// show the page just written
+static void flip_fbdev(void)
+{
+	if (fb.pageCount == 2) {
+		fb.var.yoffset = fb.back * fb.height;
+		ioctl(fb.fd, FBIOPAN_DISPLAY, &fb.var);
+	}
+}
+
+
+//
+// KMS dumb buffers
+//
+
+#ifdef HAVE_DRM
+
+// find a connected connector, its preferred mode and a CRTC to drive it
+static int find_output(void)
+{
+	struct drm_mode_card_res res;
+	uint32_t *connectors = NULL, *crtcs = NULL, *encoders = NULL;
+	int i, found = -1;
+
+	memset(&res, 0, sizeof(res));
+	if (ioctl(fb.fd, DRM_IOCTL_MODE_GETRESOURCES, &res) != 0) {
+		return -1;
+	}
+	connectors = calloc(res.count_connectors + 1, sizeof(uint32_t));
+	crtcs = calloc(res.count_crtcs + 1, sizeof(uint32_t));
+	encoders = calloc(res.count_encoders + 1, sizeof(uint32_t));
+	res.connector_id_ptr = (uintptr_t) connectors;
+	res.crtc_id_ptr = (uintptr_t) crtcs;
+	res.encoder_id_ptr = (uintptr_t) encoders;
+	res.count_fbs = 0;
+	if (ioctl(fb.fd, DRM_IOCTL_MODE_GETRESOURCES, &res) != 0) {
+		goto done;
+	}
+
+	for (i = 0; i < (int) res.count_connectors && found < 0; i++) {
+		struct drm_mode_get_connector conn;
+		struct drm_mode_modeinfo *modes;
+		uint32_t *connEncoders;
+
+		memset(&conn, 0, sizeof(conn));
+		conn.connector_id = connectors[i];
+		if (ioctl(fb.fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn) != 0 ||
+		    conn.connection != 1 || conn.count_modes == 0) {
+			continue;	// 1 is connected
+		}
+		modes = calloc(conn.count_modes, sizeof(*modes));
+		connEncoders = calloc(conn.count_encoders + 1, sizeof(uint32_t));
+		conn.modes_ptr = (uintptr_t) modes;
+		conn.encoders_ptr = (uintptr_t) connEncoders;
+		conn.count_props = 0;
+		if (ioctl(fb.fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn) == 0 && conn.count_modes > 0) {
+			uint32_t m;
+			fb.mode = modes[0];
+			for (m = 0; m < conn.count_modes; m++) {
+				if (modes[m].type & DRM_MODE_TYPE_PREFERRED) {
+					fb.mode = modes[m];
+					break;
+				}
+			}
+			// use the CRTC the connector's encoder already drives, or
+			// the first one the encoder can drive
+			struct drm_mode_get_encoder enc;
+			memset(&enc, 0, sizeof(enc));
+			enc.encoder_id = conn.encoder_id ? conn.encoder_id : connEncoders[0];
+			if (ioctl(fb.fd, DRM_IOCTL_MODE_GETENCODER, &enc) == 0) {
+				fb.crtc = enc.crtc_id;
+				if (fb.crtc == 0) {
+					int c;
+					for (c = 0; c < (int) res.count_crtcs; c++) {
+						if (enc.possible_crtcs & (1u << c)) {
+							fb.crtc = crtcs[c];
+							break;
+						}
+					}
+				}
+				if (fb.crtc) {
+					fb.connector = conn.connector_id;
+					found = 0;
+				}
+			}
+		}
+		free(modes);
+		free(connEncoders);
+	}
+
+done:
+	free(connectors);
+	free(crtcs);
+	free(encoders);
+	return found;
+}
+
+static int open_drm(void)
+{
+	int i;
+
+	if (find_output() != 0) {
+		return -1;
+	}
+	fb.kind = FB_KIND_DRM;
+	fb.width = fb.mode.hdisplay;
+	fb.height = fb.mode.vdisplay;
+	fb.format = FB_XRGB8888;
+	fb.bytesPerPixel = 4;
+	fb.pageCount = 2;
+
+	for (i = 0; i < fb.pageCount; i++) {
+		struct drm_mode_create_dumb create;
+		struct drm_mode_fb_cmd cmd;
+		struct drm_mode_map_dumb map;
+
+		memset(&create, 0, sizeof(create));
+		create.width = fb.width;
+		create.height = fb.height;
+		create.bpp = 32;
+		if (ioctl(fb.fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) != 0) {
+			return -1;
+		}
+		fb.handles[i] = create.handle;
+		fb.stride = create.pitch;
+		fb.pageLength = create.size;
+
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.width = fb.width;
+		cmd.height = fb.height;
+		cmd.pitch = create.pitch;
+		cmd.bpp = 32;
+		cmd.depth = 24;
+		cmd.handle = create.handle;
+		if (ioctl(fb.fd, DRM_IOCTL_MODE_ADDFB, &cmd) != 0) {
+			return -1;
+		}
+		fb.fbIds[i] = cmd.fb_id;
+
+		memset(&map, 0, sizeof(map));
+		map.handle = create.handle;
+		if (ioctl(fb.fd, DRM_IOCTL_MODE_MAP_DUMB, &map) != 0) {
+			return -1;
+		}
+		fb.pages[i] = mmap(NULL, fb.pageLength, PROT_READ | PROT_WRITE, MAP_SHARED, fb.fd, map.offset);
+		if (fb.pages[i] == MAP_FAILED) {
+			fb.pages[i] = NULL;
+			return -1;
+		}
+		memset(fb.pages[i], 0, fb.pageLength);
+	}
+
+	// remember what was on screen to put it back on close
+	memset(&fb.savedCrtc, 0, sizeof(fb.savedCrtc));
+	fb.savedCrtc.crtc_id = fb.crtc;
+	ioctl(fb.fd, DRM_IOCTL_MODE_GETCRTC, &fb.savedCrtc);
+
+	struct drm_mode_crtc set;
+	memset(&set, 0, sizeof(set));
+	set.crtc_id = fb.crtc;
+	set.fb_id = fb.fbIds[0];
+	set.set_connectors_ptr = (uintptr_t) &fb.connector;
+	set.count_connectors = 1;
+	set.mode = fb.mode;
+	set.mode_valid = 1;
+	if (ioctl(fb.fd, DRM_IOCTL_MODE_SETCRTC, &set) != 0) {
+		return -1;
+	}
+	fb.back = 1;
+	return 0;
+}
+
+// wait for the last page flip to complete, after which the page it
+// replaced is no longer scanned out
+static void wait_flip(void)
+{
+	char buffer[256];
+	while (fb.flipPending) {
+		ssize_t n = read(fb.fd, buffer, sizeof(buffer));
+		if (n < 0 && errno != EINTR) {
+			break;
+		}
+		if (n >= (ssize_t) sizeof(struct drm_event)) {
+			struct drm_event *e = (struct drm_event *) buffer;
+			if (e->type == DRM_EVENT_FLIP_COMPLETE) {
+				break;
+			}
+		}
+	}
+	fb.flipPending = 0;
+}
+
+static void flip_drm(void)
+{
+	struct drm_mode_crtc_page_flip flip;
+	memset(&flip, 0, sizeof(flip));
+	flip.crtc_id = fb.crtc;
+	flip.fb_id = fb.fbIds[fb.back];
+	flip.flags = DRM_MODE_PAGE_FLIP_EVENT;
+	fb.flipPending = ioctl(fb.fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip) == 0;
+}
+
+static void close_drm(void)
+{
+	int i;
+	wait_flip();
+	if (fb.savedCrtc.mode_valid) {
+		fb.savedCrtc.set_connectors_ptr = (uintptr_t) &fb.connector;
+		fb.savedCrtc.count_connectors = 1;
+		ioctl(fb.fd, DRM_IOCTL_MODE_SETCRTC, &fb.savedCrtc);
+	}
+	for (i = 0; i < MAX_PAGES; i++) {
+		if (fb.pages[i]) {
+			munmap(fb.pages[i], fb.pageLength);
+		}
+		if (fb.fbIds[i]) {
+			ioctl(fb.fd, DRM_IOCTL_MODE_RMFB, &fb.fbIds[i]);
+		}
+		if (fb.handles[i]) {
+			struct drm_mode_destroy_dumb destroy = { .handle = fb.handles[i] };
+			ioctl(fb.fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+		}
+	}
+}
+
+#endif
+
+
+// present_framebuffer is the soft backend's present function: it brings
+// the back page up to date with the surface and shows it
+static void present_framebuffer(const VGSoftSurface *s, void *context)
+{
+	int i;
+	VGSoftRect *r;
+
+	for (i = 0; i < fb.pageCount; i++) {
+		VGSoftRect *p = fb.pending + i;
+		const VGSoftRect *d = &s->damage;
+		if (d->x0 >= d->x1 || d->y0 >= d->y1) {
+			continue;
+		}
+		if (p->x0 >= p->x1 || p->y0 >= p->y1) {
+			*p = *d;
+			continue;
+		}
+		if (d->x0 < p->x0) p->x0 = d->x0;
+		if (d->y0 < p->y0) p->y0 = d->y0;
+		if (d->x1 > p->x1) p->x1 = d->x1;
+		if (d->y1 > p->y1) p->y1 = d->y1;
+	}
+
+	r = fb.pending + fb.back;
+	if (r->x0 >= r->x1 || r->y0 >= r->y1) {
+		return;		// nothing changed since this page was shown
+	}
+#ifdef HAVE_DRM
+	if (fb.kind == FB_KIND_DRM) {
+		wait_flip();
+	}
+#endif
+	copy_rect(s, fb.pages[fb.back], r);
+	memset(r, 0, sizeof(*r));
+
+	if (fb.kind == FB_KIND_FBDEV) {
+		flip_fbdev();
+	}
+#ifdef HAVE_DRM
+	else if (fb.kind == FB_KIND_DRM) {
+		flip_drm();
+	}
+#endif
+	fb.back = (fb.back + 1) % fb.pageCount;
+}
+
+
+// vgsoft_open_framebuffer presents the soft backend's frames on device,
+// an fbdev or DRM device node or a regular file.  width and height hold
+// the size to use for a file, and are set to the display's size.
+// Returns 0 on success.
+int vgsoft_open_framebuffer(const char *device, int *width, int *height)
+{
+	struct stat st;
+	int i, result = -1;
+
+	fb.fd = open(device, O_RDWR | O_CLOEXEC | (strncmp(device, "/dev/", 5) ? O_CREAT : 0), 0644);
+	if (fb.fd < 0 || fstat(fb.fd, &st) != 0) {
+		printf("Failed opening '%s' for output!\n", device);
+		return -1;
+	}
+	if (S_ISREG(st.st_mode)) {
+		result = open_file(*width, *height);
+	}
+#ifdef HAVE_DRM
+	else if (strncmp(device, "/dev/dri/", 9) == 0) {
+		result = open_drm();
+	}
+#endif
+	else {
+		result = open_fbdev();
+	}
+	if (result != 0) {
+		printf("Failed setting up '%s' for output!\n", device);
+		vgsoft_close_framebuffer();
+		return -1;
+	}
+
+	// every page starts out of date
+	for (i = 0; i < fb.pageCount; i++) {
+		fb.pending[i] = (VGSoftRect) { 0, 0, fb.width, fb.height };
+	}
+	*width = fb.width;
+	*height = fb.height;
+	vgsoft_set_present(present_framebuffer, NULL);
+	return 0;
+}
+
+void vgsoft_close_framebuffer(void)
+{
+	if (fb.fd < 0) {
+		return;
+	}
+	vgsoft_set_present(NULL, NULL);
+#ifdef HAVE_DRM
+	if (fb.kind == FB_KIND_DRM) {
+		close_drm();
+	}
+	else
+#endif
+	if (fb.map && fb.map != MAP_FAILED) {
+		// put the console's mode back
+		if (fb.kind == FB_KIND_FBDEV) {
+			ioctl(fb.fd, FBIOPUT_VSCREENINFO, &fb.savedVar);
+		}
+		munmap(fb.map, fb.mapLength);
+	}
+	close(fb.fd);
+	memset(&fb, 0, sizeof(fb));
+	fb.fd = -1;
+}
@@ -0,0 +1,2358 @@
+//
+// Software OpenVG: the subset of OpenVG 1.1 used by vgwrap and pislides,
+// rendered by the CPU into an in-memory surface.
+//
+// Paths are flattened to line segments in surface space and filled with
+// an exact area coverage accumulator, so every fill is anti-aliased.
+// Paint can be a color or a linear or radial gradient.  Images are drawn
+// through the full affine image transform with bilinear filtering done
+// two pixels at a time in vector registers (GCC vector extensions, which
+// become SSE2 on x86 and NEON on ARM).
+//
+// Deliberate simplifications: blend modes other than SRC and SRC_OVER
+// act as SRC_OVER, strokes have butt caps and no joins, the rendering
+// quality setting is ignored (fills are always anti-aliased), images
+// are drawn with the affine part of the image transform only, and the
+// linear color formats, masks, filters and fonts are not implemented.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+
+#include "VG/openvg.h"
+#include "VG/vgu.h"
+#include "vgsoft.h"
+
+// the image size limit, unless PISLIDES_SOFT_MAX_IMAGE sets a smaller
+// one to mimic a GPU's
+#define MAX_IMAGE_SIZE 16384
+#define MAX_IMAGE_PIXELS ((int64_t) max_image_size() * 4096)
+#define MAX_SCISSOR_RECTS 32
+#define MAX_RAMP_STOPS 32
+
+// curves are flattened until they are within this many pixels of the
+// true curve
+#define FLATTEN_TOLERANCE 0.2f
+
+
+//
+// Objects
+//
+
+enum { OBJ_PATH = 1, OBJ_PAINT, OBJ_IMAGE };
+
+typedef struct {
+	VGPathDatatype datatype;
+	VGfloat scale, bias;
+	VGubyte *segments;
+	int segmentCount, segmentAlloc;
+	VGfloat *coords;
+	int coordCount, coordAlloc;
+} Path;
+
+typedef struct {
+	VGPaintType type;
+	VGfloat color[4];
+	VGfloat linear[4];
+	VGfloat radial[5];
+	VGColorRampSpreadMode spread;
+	VGboolean premultipliedRamp;
+	VGfloat stops[MAX_RAMP_STOPS * 5];
+	int stopCount;
+	int refs;		// times set on the context
+	int destroyed;		// freed once no longer set
+} Paint;
+
+// pixel storage, shared by an image and its children
+typedef struct {
+	int refs;
+	uint32_t pixels[];
+} ImageStorage;
+
+typedef struct {
+	VGImageFormat format;
+	int width, height;
+	int stride;		// pixels from one row to the next
+	ImageStorage *storage;
+	uint32_t *pixels;	// premultiplied, like the surface
+} Image;
+
+typedef struct {
+	int type;
+	union {
+		Path path;
+		Paint paint;
+		Image image;
+	} u;
+} Object;
+
+static Object **objects;
+static int objectAlloc;
+
+
+//
+// Context state
+//
+
+typedef struct {
+	VGfloat m[9];		// OpenVG order: sx shy w0 shx sy w1 tx ty w2
+} Matrix;
+
+static struct {
+	VGErrorCode error;
+	VGMatrixMode matrixMode;
+	Matrix matrices[5];
+	VGFillRule fillRule;
+	VGImageQuality imageQuality;
+	VGRenderingQuality renderingQuality;
+	VGBlendMode blendMode;
+	VGImageMode imageMode;
+	VGint scissorRects[MAX_SCISSOR_RECTS * 4];
+	int scissorCount;
+	VGboolean scissoring;
+	VGfloat strokeWidth;
+	VGCapStyle capStyle;
+	VGJoinStyle joinStyle;
+	VGfloat miterLimit;
+	VGfloat clearColor[4];
+	VGPaint fillPaint, strokePaint;
+} ctx;
+
+static VGSoftSurface surface;
+static int contextReady = 0;
+
+// everything outside content is contentColor, so clearing the whole
+// surface to that color again only changes content
+static VGSoftRect content;
+static uint32_t contentColor;
+
+static void set_error(VGErrorCode error)
+{
+	if (ctx.error == VG_NO_ERROR) {
+		ctx.error = error;
+	}
+}
+
+static int max_image_size(void)
+{
+	static int size;
+	if (size == 0) {
+		const char *limit = getenv("PISLIDES_SOFT_MAX_IMAGE");
+		size = limit ? atoi(limit) : 0;
+		if (size <= 0 || size > MAX_IMAGE_SIZE) {
+			size = MAX_IMAGE_SIZE;
+		}
+	}
+	return size;
+}
+
+static void init_context(void)
+{
+	int i;
+	if (contextReady) {
+		return;
+	}
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.matrixMode = VG_MATRIX_PATH_USER_TO_SURFACE;
+	for (i = 0; i < 5; i++) {
+		Matrix *mat = &ctx.matrices[i];
+		memset(mat, 0, sizeof(*mat));
+		mat->m[0] = mat->m[4] = mat->m[8] = 1.0f;
+	}
+	ctx.fillRule = VG_EVEN_ODD;
+	ctx.imageQuality = VG_IMAGE_QUALITY_FASTER;
+	ctx.renderingQuality = VG_RENDERING_QUALITY_BETTER;
+	ctx.blendMode = VG_BLEND_SRC_OVER;
+	ctx.imageMode = VG_DRAW_IMAGE_NORMAL;
+	ctx.strokeWidth = 1.0f;
+	ctx.capStyle = VG_CAP_BUTT;
+	ctx.joinStyle = VG_JOIN_MITER;
+	ctx.miterLimit = 4.0f;
+	contextReady = 1;
+}
+
+static VGHandle new_object(int type)
+{
+	int i;
+	for (i = 0; i < objectAlloc; i++) {
+		if (objects[i] == NULL) {
+			break;
+		}
+	}
+	if (i == objectAlloc) {
+		int grow = objectAlloc ? objectAlloc : 64;
+		Object **more = realloc(objects, (objectAlloc + grow) * sizeof(Object *));
+		if (more == NULL) {
+			set_error(VG_OUT_OF_MEMORY_ERROR);
+			return VG_INVALID_HANDLE;
+		}
+		objects = more;
+		memset(objects + objectAlloc, 0, grow * sizeof(Object *));
+		objectAlloc += grow;
+	}
+	objects[i] = calloc(1, sizeof(Object));
+	if (objects[i] == NULL) {
+		set_error(VG_OUT_OF_MEMORY_ERROR);
+		return VG_INVALID_HANDLE;
+	}
+	objects[i]->type = type;
+	return (VGHandle) (i + 1);
+}
+
+static Object *get_object(VGHandle handle, int type)
+{
+	if (handle == VG_INVALID_HANDLE || handle > (VGHandle) objectAlloc ||
+	    objects[handle - 1] == NULL ||
+	    (type && objects[handle - 1]->type != type)) {
+		set_error(VG_BAD_HANDLE_ERROR);
+		return NULL;
+	}
+	return objects[handle - 1];
+}
+
+static void free_object(VGHandle handle)
+{
+	free(objects[handle - 1]);
+	objects[handle - 1] = NULL;
+}
+
+
+//
+// Surface
+//
+
+static void rect_union(VGSoftRect *a, const VGSoftRect *b)
+{
+	if (b->x0 >= b->x1 || b->y0 >= b->y1) {
+		return;
+	}
+	if (a->x0 >= a->x1 || a->y0 >= a->y1) {
+		*a = *b;
+		return;
+	}
+	if (b->x0 < a->x0) a->x0 = b->x0;
+	if (b->y0 < a->y0) a->y0 = b->y0;
+	if (b->x1 > a->x1) a->x1 = b->x1;
+	if (b->y1 > a->y1) a->y1 = b->y1;
+}
+
+// record that pixels in a rectangle may have changed
+static void damage(int x0, int y0, int x1, int y1)
+{
+	VGSoftRect r = { x0, y0, x1, y1 };
+	rect_union(&surface.damage, &r);
+	rect_union(&content, &r);
+}
+
+int vgsoft_create_surface(int width, int height)
+{
+	init_context();
+	free(surface.pixels);
+	surface.pixels = calloc((size_t) width * height, 4);
+	if (surface.pixels == NULL) {
+		return -1;
+	}
+	surface.width = width;
+	surface.height = height;
+	memset(&content, 0, sizeof(content));
+	contentColor = 0;
+	surface.damage = (VGSoftRect) { 0, 0, width, height };
+	return 0;
+}
+
+// vgsoft_clear_surface sets every pixel of the surface to pixel
+void vgsoft_clear_surface(uint32_t pixel)
+{
+	size_t i, n = (size_t) surface.width * surface.height;
+	if (surface.pixels == NULL) {
+		return;
+	}
+	if (pixel == contentColor) {
+		uint32_t *p = surface.pixels;
+		int y;
+		if (content.x0 >= content.x1) {
+			return;
+		}
+		rect_union(&surface.damage, &content);
+		for (y = content.y0; y < content.y1; y++) {
+			for (i = content.x0; i < (size_t) content.x1; i++) {
+				p[(size_t) y * surface.width + i] = pixel;
+			}
+		}
+	}
+	else {
+		for (i = 0; i < n; i++) {
+			surface.pixels[i] = pixel;
+		}
+		surface.damage = (VGSoftRect) { 0, 0, surface.width, surface.height };
+	}
+	memset(&content, 0, sizeof(content));
+	contentColor = pixel;
+}
+
+void vgsoft_destroy_surface(void)
+{
+	free(surface.pixels);
+	memset(&surface, 0, sizeof(surface));
+}
+
+VGSoftSurface *vgsoft_surface(void)
+{
+	return &surface;
+}
+
+
+//
+// Pixel helpers.  Pixels are uint32 with R in the low byte.
+//
+
+#define PIX_R(p) ((p) & 0xff)
+#define PIX_G(p) (((p) >> 8) & 0xff)
+#define PIX_B(p) (((p) >> 16) & 0xff)
+#define PIX_A(p) ((p) >> 24)
+
+static inline uint32_t pack(unsigned r, unsigned g, unsigned b, unsigned a)
+{
+	return r | (g << 8) | (b << 16) | (a << 24);
+}
+
+// x * a / 255 for 8 bit values, exact
+static inline unsigned mul255(unsigned x, unsigned a)
+{
+	unsigned t = x * a + 128;
+	return (t + (t >> 8)) >> 8;
+}
+
+// scale all four channels of a premultiplied pixel by a / 255
+static inline uint32_t scale_pixel(uint32_t p, unsigned a)
+{
+	uint32_t rb = (p & 0x00ff00ff) * a + 0x00800080;
+	uint32_t ag = ((p >> 8) & 0x00ff00ff) * a + 0x00800080;
+	rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+	ag = (ag + ((ag >> 8) & 0x00ff00ff)) & 0xff00ff00;
+	return rb | ag;
+}
+
+// premultiplied source over destination
+static inline uint32_t over(uint32_t src, uint32_t dst)
+{
+	unsigned sa = PIX_A(src);
+	if (sa == 255) {
+		return src;
+	}
+	if (sa == 0) {
+		return dst;
+	}
+	uint32_t d = scale_pixel(dst, 255 - sa);
+	// no channel can overflow, premultiplied channels are <= alpha
+	return src + d;
+}
+
+// blend a premultiplied source pixel with coverage onto a destination
+static inline uint32_t blend(uint32_t src, unsigned coverage, uint32_t dst)
+{
+	if (coverage < 255) {
+		if (ctx.blendMode == VG_BLEND_SRC) {
+			return scale_pixel(src, coverage) + scale_pixel(dst, 255 - coverage);
+		}
+		src = scale_pixel(src, coverage);
+	}
+	else if (ctx.blendMode == VG_BLEND_SRC) {
+		return src;
+	}
+	return over(src, dst);
+}
+
+static uint32_t color_to_pixel(const VGfloat c[4])
+{
+	VGfloat a = c[3] < 0.0f ? 0.0f : c[3] > 1.0f ? 1.0f : c[3];
+	unsigned ch[3], i;
+	for (i = 0; i < 3; i++) {
+		VGfloat v = c[i] < 0.0f ? 0.0f : c[i] > 1.0f ? 1.0f : c[i];
+		ch[i] = (unsigned) (v * a * 255.0f + 0.5f);
+	}
+	return pack(ch[0], ch[1], ch[2], (unsigned) (a * 255.0f + 0.5f));
+}
+
+
+//
+// Image format conversion between the premultiplied internal layout and
+// the client formats
+//
+
+// channel shifts within a 32 bit word for the 8888 formats, indexed by
+// the format's order bits (bit 6 alpha first, bit 7 BGR)
+static const int shiftR[4] = { 24, 16, 8, 0 };
+static const int shiftG[4] = { 16, 8, 16, 8 };
+static const int shiftB[4] = { 8, 0, 24, 16 };
+static const int shiftA[4] = { 0, 24, 0, 24 };
+
+static int format_supported(VGImageFormat f)
+{
+	int base = f & 0x3f;
+	if (f & ~0xff) {
+		return 0;
+	}
+	if (base <= 2) {
+		return 1;	// all the 8888 orders
+	}
+	return f == VG_sRGB_565 || f == VG_sBGR_565 || f == VG_sL_8;
+}
+
+static int format_bytes(VGImageFormat f)
+{
+	int base = f & 0x3f;
+	return base <= 2 ? 4 : base == VG_sL_8 ? 1 : 2;
+}
+
+// convert a row of client pixels to premultiplied internal pixels
+static void row_from_format(uint32_t *dst, const void *src, VGImageFormat f, int n)
+{
+	int base = f & 0x3f, order = f >> 6, i;
+
+	if (base <= 2) {
+		const uint32_t *s = src;
+		if (order == 3 && base == 2) {
+			memcpy(dst, s, n * 4);	// sABGR_8888_PRE is our layout
+			return;
+		}
+		for (i = 0; i < n; i++) {
+			uint32_t p = s[i];
+			unsigned r = (p >> shiftR[order]) & 0xff;
+			unsigned g = (p >> shiftG[order]) & 0xff;
+			unsigned b = (p >> shiftB[order]) & 0xff;
+			unsigned a = base == 0 ? 255 : (p >> shiftA[order]) & 0xff;
+			if (base == 1 && a != 255) {
+				r = mul255(r, a);
+				g = mul255(g, a);
+				b = mul255(b, a);
+			}
+			dst[i] = pack(r, g, b, a);
+		}
+	}
+	else if (base == VG_sL_8) {
+		const uint8_t *s = src;
+		for (i = 0; i < n; i++) {
+			dst[i] = pack(s[i], s[i], s[i], 255);
+		}
+	}
+	else {
+		// 565, red in the top bits unless BGR
+		const uint16_t *s = src;
+		for (i = 0; i < n; i++) {
+			unsigned hi = (s[i] >> 11) & 0x1f, mid = (s[i] >> 5) & 0x3f, lo = s[i] & 0x1f;
+			unsigned c0 = (hi << 3) | (hi >> 2), g = (mid << 2) | (mid >> 4), c2 = (lo << 3) | (lo >> 2);
+			dst[i] = order & 2 ? pack(c2, g, c0, 255) : pack(c0, g, c2, 255);
+		}
+	}
+}
+
+// convert a row of premultiplied internal pixels to a client format
+static void row_to_format(void *dst, const uint32_t *src, VGImageFormat f, int n)
+{
+	int base = f & 0x3f, order = f >> 6, i;
+
+	if (base <= 2) {
+		uint32_t *d = dst;
+		if (order == 3 && base == 2) {
+			memcpy(d, src, n * 4);
+			return;
+		}
+		for (i = 0; i < n; i++) {
+			uint32_t p = src[i];
+			unsigned r = PIX_R(p), g = PIX_G(p), b = PIX_B(p), a = PIX_A(p);
+			if (base != 2 && a != 255 && a != 0) {
+				r = r * 255 / a;
+				g = g * 255 / a;
+				b = b * 255 / a;
+			}
+			if (base == 0) {
+				a = 255;
+			}
+			d[i] = (r << shiftR[order]) | (g << shiftG[order]) | (b << shiftB[order]) | (a << shiftA[order]);
+		}
+	}
+	else if (base == VG_sL_8) {
+		uint8_t *d = dst;
+		for (i = 0; i < n; i++) {
+			uint32_t p = src[i];
+			d[i] = (uint8_t) ((PIX_R(p) * 54 + PIX_G(p) * 183 + PIX_B(p) * 19) >> 8);
+		}
+	}
+	else {
+		uint16_t *d = dst;
+		for (i = 0; i < n; i++) {
+			uint32_t p = src[i];
+			unsigned c0 = PIX_R(p), c2 = PIX_B(p);
+			if (order & 2) {
+				c0 = PIX_B(p);
+				c2 = PIX_R(p);
+			}
+			d[i] = (uint16_t) (((c0 >> 3) << 11) | ((PIX_G(p) >> 2) << 5) | (c2 >> 3));
+		}
+	}
+}
+
+// clip a copy of width x height between two rectangles of the given
+// sizes, adjusting both origins.  Returns 0 if nothing is left.
+static int clip_copy(VGint *sx, VGint *sy, int sw, int sh,
+		     VGint *dx, VGint *dy, int dw, int dh,
+		     VGint *width, VGint *height)
+{
+	if (*sx < 0) { *dx -= *sx; *width += *sx; *sx = 0; }
+	if (*sy < 0) { *dy -= *sy; *height += *sy; *sy = 0; }
+	if (*dx < 0) { *sx -= *dx; *width += *dx; *dx = 0; }
+	if (*dy < 0) { *sy -= *dy; *height += *dy; *dy = 0; }
+	if (*sx + *width > sw) *width = sw - *sx;
+	if (*sy + *height > sh) *height = sh - *sy;
+	if (*dx + *width > dw) *width = dw - *dx;
+	if (*dy + *height > dh) *height = dh - *dy;
+	return *width > 0 && *height > 0;
+}
+
+
+//
+// Errors, flush and parameters
+//
+
+VGErrorCode vgGetError(void)
+{
+	VGErrorCode e = ctx.error;
+	ctx.error = VG_NO_ERROR;
+	return e;
+}
+
+void vgFlush(void)
+{
+}
+
+void vgFinish(void)
+{
+}
+
+static Matrix *current_matrix(void)
+{
+	return &ctx.matrices[ctx.matrixMode - VG_MATRIX_PATH_USER_TO_SURFACE];
+}
+
+void vgSetf(VGParamType type, VGfloat value)
+{
+	switch (type) {
+	case VG_STROKE_LINE_WIDTH:
+		ctx.strokeWidth = value;
+		break;
+	case VG_STROKE_MITER_LIMIT:
+		ctx.miterLimit = value;
+		break;
+	default:
+		vgSeti(type, (VGint) value);
+	}
+}
+
+void vgSeti(VGParamType type, VGint value)
+{
+	init_context();
+	switch (type) {
+	case VG_MATRIX_MODE:
+		if (value < VG_MATRIX_PATH_USER_TO_SURFACE || value > VG_MATRIX_GLYPH_USER_TO_SURFACE) {
+			set_error(VG_ILLEGAL_ARGUMENT_ERROR);
+			return;
+		}
+		ctx.matrixMode = value;
+		break;
+	case VG_FILL_RULE:
+		ctx.fillRule = value;
+		break;
+	case VG_IMAGE_QUALITY:
+		ctx.imageQuality = value;
+		break;
+	case VG_RENDERING_QUALITY:
+		ctx.renderingQuality = value;
+		break;
+	case VG_BLEND_MODE:
+		ctx.blendMode = value;
+		break;
+	case VG_IMAGE_MODE:
+		ctx.imageMode = value;
+		break;
+	case VG_STROKE_LINE_WIDTH:
+		ctx.strokeWidth = (VGfloat) value;
+		break;
+	case VG_STROKE_CAP_STYLE:
+		ctx.capStyle = value;
+		break;
+	case VG_STROKE_JOIN_STYLE:
+		ctx.joinStyle = value;
+		break;
+	case VG_SCISSORING:
+		ctx.scissoring = value ? VG_TRUE : VG_FALSE;
+		break;
+	case VG_MASKING:
+		break;
+	default:
+		set_error(VG_ILLEGAL_ARGUMENT_ERROR);
+	}
+}
+
+void vgSetfv(VGParamType type, VGint count, const VGfloat *values)
+{
+	int i;
+	init_context();
+	if (type == VG_CLEAR_COLOR && count == 4) {
+		memcpy(ctx.clearColor, values, sizeof(ctx.clearColor));
+	}
+	else if (type == VG_SCISSOR_RECTS) {
+		VGint rects[MAX_SCISSOR_RECTS * 4];
+		if (count > MAX_SCISSOR_RECTS * 4) {
+			count = MAX_SCISSOR_RECTS * 4;
+		}
+		for (i = 0; i < count; i++) {
+			rects[i] = (VGint) values[i];
+		}
+		vgSetiv(type, count, rects);
+	}
+	else if (count == 1) {
+		vgSetf(type, values[0]);
+	}
+	else {
+		set_error(VG_ILLEGAL_ARGUMENT_ERROR);
+	}
+}
+
+void vgSetiv(VGParamType type, VGint count, const VGint *values)
+{
+	init_context();
+	if (type == VG_SCISSOR_RECTS) {
+		if (count > MAX_SCISSOR_RECTS * 4) {
+			count = MAX_SCISSOR_RECTS * 4;
+		}
+		memcpy(ctx.scissorRects, values, (count & ~3) * sizeof(VGint));
+		ctx.scissorCount = count / 4;
+	}
+	else if (type == VG_CLEAR_COLOR && count == 4) {
+		int i;
+		for (i = 0; i < 4; i++) {
+			ctx.clearColor[i] = (VGfloat) values[i];
+		}
+	}
+	else if (count == 1) {
+		vgSeti(type, values[0]);
+	}
+	else {
+		set_error(VG_ILLEGAL_ARGUMENT_ERROR);
+	}
+}
+
+VGfloat vgGetf(VGParamType type)
+{
+	if (type == VG_STROKE_LINE_WIDTH) {
+		return ctx.strokeWidth;
+	}
+	return (VGfloat) vgGeti(type);
+}
+
+VGint vgGeti(VGParamType type)
+{
+	init_context();
+	switch (type) {
+	case VG_MATRIX_MODE:
+		return ctx.matrixMode;
+	case VG_FILL_RULE:
+		return ctx.fillRule;
+	case VG_IMAGE_QUALITY:
+		return ctx.imageQuality;
+	case VG_RENDERING_QUALITY:
+		return ctx.renderingQuality;
+	case VG_BLEND_MODE:
+		return ctx.blendMode;
+	case VG_IMAGE_MODE:
+		return ctx.imageMode;
+	case VG_SCISSORING:
+		return ctx.scissoring;
+	case VG_MAX_SCISSOR_RECTS:
+		return MAX_SCISSOR_RECTS;
+	case VG_MAX_COLOR_RAMP_STOPS:
+		return MAX_RAMP_STOPS;
+	case VG_MAX_IMAGE_WIDTH:
+	case VG_MAX_IMAGE_HEIGHT:
+		return max_image_size();
+	case VG_MAX_IMAGE_PIXELS:
+		return MAX_IMAGE_PIXELS;
+	case VG_MAX_IMAGE_BYTES:
+		return MAX_IMAGE_PIXELS * 4;
+	default:
+		set_error(VG_ILLEGAL_ARGUMENT_ERROR);
+		return 0;
+	}
+}
+
+void vgSetParameterf(VGHandle object, VGint paramType, VGfloat value)
+{
+	vgSetParameterfv(object, paramType, 1, &value);
+}
+
+void vgSetParameteri(VGHandle object, VGint paramType, VGint value)
+{
+	Object *o = get_object(object, OBJ_PAINT);
+	if (o == NULL) {
+		return;
+	}
+	Paint *p = &o->u.paint;
+	switch (paramType) {
+	case VG_PAINT_TYPE:
+		p->type = value;
+		break;
+	case VG_PAINT_COLOR_RAMP_SPREAD_MODE:
+		p->spread = value;
+		break;
+	case VG_PAINT_COLOR_RAMP_PREMULTIPLIED:
+		p->premultipliedRamp = value ? VG_TRUE : VG_FALSE;
+		break;
+	case VG_PAINT_PATTERN_TILING_MODE:
+		break;
+	default:
+		set_error(VG_ILLEGAL_ARGUMENT_ERROR);
+	}
+}
+
+void vgSetParameterfv(VGHandle object, VGint paramType, VGint count, const VGfloat *values)
+{
+	Object *o = get_object(object, OBJ_PAINT);
+	if (o == NULL) {
+		return;
+	}
+	Paint *p = &o->u.paint;
+	switch (paramType) {
+	case VG_PAINT_COLOR:
+		if (count == 4) {
+			memcpy(p->color, values, sizeof(p->color));
+		}
+		break;
+	case VG_PAINT_LINEAR_GRADIENT:
+		if (count == 4) {
+			memcpy(p->linear, values, sizeof(p->linear));
+		}
+		break;
+	case VG_PAINT_RADIAL_GRADIENT:
+		if (count == 5) {
+			memcpy(p->radial, values, sizeof(p->radial));
+		}
+		break;
+	case VG_PAINT_COLOR_RAMP_STOPS:
+		if (count > MAX_RAMP_STOPS * 5) {
+			count = MAX_RAMP_STOPS * 5;
+		}
+		p->stopCount = count / 5;
+		memcpy(p->stops, values, p->stopCount * 5 * sizeof(VGfloat));
+		break;
+	default:
+		if (count == 1) {
+			vgSetParameteri(object, paramType, (VGint) values[0]);
+		}
+	}
+}
+
+VGint vgGetParameteri(VGHandle object, VGint paramType)
+{
+	Object *o = get_object(object, 0);
+	if (o == NULL) {
+		return 0;
+	}
+	if (o->type == OBJ_IMAGE) {
+		switch (paramType) {
+		case VG_IMAGE_FORMAT:
+			return o->u.image.format;
+		case VG_IMAGE_WIDTH:
+			return o->u.image.width;
+		case VG_IMAGE_HEIGHT:
+			return o->u.image.height;
+		}
+	}
+	else if (o->type == OBJ_PAINT) {
+		switch (paramType) {
+		case VG_PAINT_TYPE:
+			return o->u.paint.type;
+		case VG_PAINT_COLOR_RAMP_SPREAD_MODE:
+			return o->u.paint.spread;
+		}
+	}
+	set_error(VG_ILLEGAL_ARGUMENT_ERROR);
+	return 0;
+}
+
+
+//
+// Matrices
+//
+
+static void mat_mult(Matrix *r, const Matrix *a, const Matrix *b)
+{
+	Matrix t;
+	int row, col;
+	// column major: element (row, col) is m[col * 3 + row]
+	for (col = 0; col < 3; col++) {
+		for (row = 0; row < 3; row++) {
+			t.m[col * 3 + row] =
+				a->m[0 * 3 + row] * b->m[col * 3 + 0] +
+				a->m[1 * 3 + row] * b->m[col * 3 + 1] +
+				a->m[2 * 3 + row] * b->m[col * 3 + 2];
+		}
+	}
+	*r = t;
+}
+
+static void force_affine(void)
+{
+	if (ctx.matrixMode != VG_MATRIX_IMAGE_USER_TO_SURFACE) {
+		Matrix *m = current_matrix();
+		m->m[2] = m->m[5] = 0.0f;
+		m->m[8] = 1.0f;
+	}
+}
+
+void vgLoadIdentity(void)
+{
+	init_context();
+	Matrix *m = current_matrix();
+	memset(m, 0, sizeof(*m));
+	m->m[0] = m->m[4] = m->m[8] = 1.0f;
+}
+
+void vgLoadMatrix(const VGfloat *m)
+{
+	init_context();
+	memcpy(current_matrix()->m, m, 9 * sizeof(VGfloat));
+	force_affine();
+}
+
+void vgGetMatrix(VGfloat *m)
+{
+	init_context();
+	memcpy(m, current_matrix()->m, 9 * sizeof(VGfloat));
+}
+
+void vgMultMatrix(const VGfloat *m)
+{
+	Matrix b;
+	init_context();
+	memcpy(b.m, m, sizeof(b.m));
+	mat_mult(current_matrix(), current_matrix(), &b);
+	force_affine();
+}
+
+void vgTranslate(VGfloat tx, VGfloat ty)
+{
+	VGfloat m[9] = { 1, 0, 0, 0, 1, 0, tx, ty, 1 };
+	vgMultMatrix(m);
+}
+
+void vgScale(VGfloat sx, VGfloat sy)
+{
+	VGfloat m[9] = { sx, 0, 0, 0, sy, 0, 0, 0, 1 };
+	vgMultMatrix(m);
+}
+
+void vgShear(VGfloat shx, VGfloat shy)
+{
+	VGfloat m[9] = { 1, shy, 0, shx, 1, 0, 0, 0, 1 };
+	vgMultMatrix(m);
+}
+
+void vgRotate(VGfloat angle)
+{
+	VGfloat a = angle * (VGfloat) M_PI / 180.0f;
+	VGfloat c = cosf(a), s = sinf(a);
+	VGfloat m[9] = { c, s, 0, -s, c, 0, 0, 0, 1 };
+	vgMultMatrix(m);
+}
+
+static inline void transform_point(const Matrix *m, VGfloat x, VGfloat y, VGfloat *ox, VGfloat *oy)
+{
+	*ox = m->m[0] * x + m->m[3] * y + m->m[6];
+	*oy = m->m[1] * x + m->m[4] * y + m->m[7];
+}
+
+// invert the affine part of m, returns 0 if it is singular
+static int invert_affine(const Matrix *m, Matrix *inv)
+{
+	VGfloat a = m->m[0], b = m->m[3], c = m->m[6];
+	VGfloat d = m->m[1], e = m->m[4], f = m->m[7];
+	VGfloat det = a * e - b * d;
+	if (fabsf(det) < 1e-12f) {
+		return 0;
+	}
+	VGfloat id = 1.0f / det;
+	memset(inv, 0, sizeof(*inv));
+	inv->m[0] = e * id;
+	inv->m[3] = -b * id;
+	inv->m[6] = (b * f - c * e) * id;
+	inv->m[1] = -d * id;
+	inv->m[4] = a * id;
+	inv->m[7] = (c * d - a * f) * id;
+	inv->m[8] = 1.0f;
+	return 1;
+}
+
+
+//
+// Paths
+//
+
+// number of coordinates each segment type takes
+static int segment_coords(VGubyte segment)
+{
+	switch (segment & ~1) {
+	case VG_CLOSE_PATH:
+		return 0;
+	case VG_MOVE_TO:
+	case VG_LINE_TO:
+	case VG_SQUAD_TO:
+		return 2;
+	case VG_HLINE_TO:
+	case VG_VLINE_TO:
+		return 1;
+	case VG_QUAD_TO:
+	case VG_SCUBIC_TO:
+		return 4;
+	case VG_CUBIC_TO:
+		return 6;
+	default:
+		return -1;	// arcs aren't supported
+	}
+}
+
+VGPath vgCreatePath(VGint pathFormat, VGPathDatatype datatype,
+		    VGfloat scale, VGfloat bias,
+		    VGint segmentCapacityHint, VGint coordCapacityHint,
+		    VGbitfield capabilities)
+{
+	init_context();
+	if (pathFormat != VG_PATH_FORMAT_STANDARD) {
+		set_error(VG_UNSUPPORTED_PATH_FORMAT_ERROR);
+		return VG_INVALID_HANDLE;
+	}
+	if (datatype < VG_PATH_DATATYPE_S_8 || datatype > VG_PATH_DATATYPE_F || scale == 0.0f) {
+		set_error(VG_ILLEGAL_ARGUMENT_ERROR);
+		return VG_INVALID_HANDLE;
+	}
+	VGHandle h = new_object(OBJ_PATH);
+	if (h != VG_INVALID_HANDLE) {
+		Path *p = &objects[h - 1]->u.path;
+		p->datatype = datatype;
+		p->scale = scale;
+		p->bias = bias;
+	}
+	return h;
+}
+
+void vgClearPath(VGPath path, VGbitfield capabilities)
+{
+	Object *o = get_object(path, OBJ_PATH);
+	if (o) {
+		o->u.path.segmentCount = 0;
+		o->u.path.coordCount = 0;
+	}
+}
+
+void vgDestroyPath(VGPath path)
+{
+	Object *o = get_object(path, OBJ_PATH);
+	if (o) {
+		free(o->u.path.segments);
+		free(o->u.path.coords);
+		free_object(path);
+	}
+}
+
+void vgAppendPathData(VGPath dstPath, VGint numSegments,
+		      const VGubyte *pathSegments, const void *pathData)
+{
+	Object *o = get_object(dstPath, OBJ_PATH);
+	int i, j, n = 0;
+	if (o == NULL) {
+		return;
+	}
+	Path *p = &o->u.path;
+	for (i = 0; i < numSegments; i++) {
+		int c = segment_coords(pathSegments[i]);
+		if (c < 0) {
+			set_error(VG_ILLEGAL_ARGUMENT_ERROR);
+			return;
+		}
+		n += c;
+	}
+
+	if (p->segmentCount + numSegments > p->segmentAlloc) {
+		int alloc = (p->segmentCount + numSegments) * 2;
+		VGubyte *s = realloc(p->segments, alloc);
+		if (s == NULL) {
+			set_error(VG_OUT_OF_MEMORY_ERROR);
+			return;
+		}
+		p->segments = s;
+		p->segmentAlloc = alloc;
+	}
+	if (p->coordCount + n > p->coordAlloc) {
+		int alloc = (p->coordCount + n) * 2;
+		VGfloat *c = realloc(p->coords, alloc * sizeof(VGfloat));
+		if (c == NULL) {
+			set_error(VG_OUT_OF_MEMORY_ERROR);
+			return;
+		}
+		p->coords = c;
+		p->coordAlloc = alloc;
+	}
+
+	memcpy(p->segments + p->segmentCount, pathSegments, numSegments);
+	p->segmentCount += numSegments;
+	VGfloat *dst = p->coords + p->coordCount;
+	for (j = 0; j < n; j++) {
+		VGfloat v;
+		switch (p->datatype) {
+		case VG_PATH_DATATYPE_S_8:
+			v = ((const int8_t *) pathData)[j];
+			break;
+		case VG_PATH_DATATYPE_S_16:
+			v = ((const int16_t *) pathData)[j];
+			break;
+		case VG_PATH_DATATYPE_S_32:
+			v = (VGfloat) ((const int32_t *) pathData)[j];
+			break;
+		default:
+			v = ((const VGfloat *) pathData)[j];
+		}
+		dst[j] = v * p->scale + p->bias;
+	}
+	p->coordCount += n;
+}
+
+
+//
+// Flattening.  Paths become closed polygons of surface space points.
+//
+
+typedef struct {
+	VGfloat *pts;		// x,y pairs
+	int count, alloc;
+	int *starts;		// first point of each contour
+	int contours, contourAlloc;
+	int *closed;		// whether the contour had an explicit close
+} Polygons;
+
+static Polygons fillPolys, strokePolys;
+
+static void poly_reset(Polygons *pl)
+{
+	pl->count = 0;
+	pl->contours = 0;
+}
+
+static void poly_point(Polygons *pl, VGfloat x, VGfloat y)
+{
+	if (pl->count == pl->alloc) {
+		pl->alloc = pl->alloc ? pl->alloc * 2 : 256;
+		pl->pts = realloc(pl->pts, pl->alloc * 2 * sizeof(VGfloat));
+	}
+	pl->pts[pl->count * 2] = x;
+	pl->pts[pl->count * 2 + 1] = y;
+	pl->count++;
+}
+
+static void poly_contour(Polygons *pl)
+{
+	if (pl->contours == pl->contourAlloc) {
+		pl->contourAlloc = pl->contourAlloc ? pl->contourAlloc * 2 : 16;
+		pl->starts = realloc(pl->starts, pl->contourAlloc * sizeof(int));
+		pl->closed = realloc(pl->closed, pl->contourAlloc * sizeof(int));
+	}
+	pl->starts[pl->contours] = pl->count;
+	pl->closed[pl->contours] = 0;
+	pl->contours++;
+}
+
+static int contour_end(const Polygons *pl, int c)
+{
+	return c + 1 < pl->contours ? pl->starts[c + 1] : pl->count;
+}
+
+static void flatten_quad(Polygons *pl, const Matrix *m, VGfloat x0, VGfloat y0,
+			 VGfloat x1, VGfloat y1, VGfloat x2, VGfloat y2)
+{
+	VGfloat sx0, sy0, sx1, sy1, sx2, sy2;
+	transform_point(m, x0, y0, &sx0, &sy0);
+	transform_point(m, x1, y1, &sx1, &sy1);
+	transform_point(m, x2, y2, &sx2, &sy2);
+	VGfloat dx = sx0 - 2 * sx1 + sx2, dy = sy0 - 2 * sy1 + sy2;
+	VGfloat dev = sqrtf(dx * dx + dy * dy) * 0.25f;
+	int n = (int) ceilf(sqrtf(dev / FLATTEN_TOLERANCE));
+	int i;
+	if (n < 1) n = 1;
+	if (n > 100) n = 100;
+	for (i = 1; i <= n; i++) {
+		VGfloat t = (VGfloat) i / n, u = 1.0f - t;
+		poly_point(pl, u * u * sx0 + 2 * u * t * sx1 + t * t * sx2,
+			   u * u * sy0 + 2 * u * t * sy1 + t * t * sy2);
+	}
+}
+
+static void flatten_cubic(Polygons *pl, const Matrix *m, VGfloat x0, VGfloat y0,
+			  VGfloat x1, VGfloat y1, VGfloat x2, VGfloat y2,
+			  VGfloat x3, VGfloat y3)
+{
+	VGfloat sx0, sy0, sx1, sy1, sx2, sy2, sx3, sy3;
+	transform_point(m, x0, y0, &sx0, &sy0);
+	transform_point(m, x1, y1, &sx1, &sy1);
+	transform_point(m, x2, y2, &sx2, &sy2);
+	transform_point(m, x3, y3, &sx3, &sy3);
+	VGfloat ax = sx0 - 2 * sx1 + sx2, ay = sy0 - 2 * sy1 + sy2;
+	VGfloat bx = sx1 - 2 * sx2 + sx3, by = sy1 - 2 * sy2 + sy3;
+	VGfloat dev = sqrtf(fmaxf(ax * ax + ay * ay, bx * bx + by * by)) * 0.75f;
+	int n = (int) ceilf(sqrtf(dev / FLATTEN_TOLERANCE));
+	int i;
+	if (n < 1) n = 1;
+	if (n > 100) n = 100;
+	for (i = 1; i <= n; i++) {
+		VGfloat t = (VGfloat) i / n, u = 1.0f - t;
+		VGfloat a = u * u * u, b = 3 * u * u * t, c = 3 * u * t * t, d = t * t * t;
+		poly_point(pl, a * sx0 + b * sx1 + c * sx2 + d * sx3,
+			   a * sy0 + b * sy1 + c * sy2 + d * sy3);
+	}
+}
+
+// flatten a path through matrix m
+static void flatten_path(const Path *p, const Matrix *m, Polygons *pl)
+{
+	VGfloat sx = 0, sy = 0;		// contour start
+	VGfloat ox = 0, oy = 0;		// current point
+	VGfloat px = 0, py = 0;		// last control point, for smooth curves
+	const VGfloat *c = p->coords;
+	int i, open = 0;
+	VGfloat tx, ty;
+
+	poly_reset(pl);
+	for (i = 0; i < p->segmentCount; i++) {
+		VGubyte seg = p->segments[i];
+		int rel = seg & 1;
+		VGfloat bx = rel ? ox : 0, by = rel ? oy : 0;
+		VGfloat x1, y1, x2, y2, x3, y3;
+
+		switch (seg & ~1) {
+		case VG_CLOSE_PATH:
+			if (open) {
+				pl->closed[pl->contours - 1] = 1;
+			}
+			ox = px = sx;
+			oy = py = sy;
+			open = 0;
+			break;
+		case VG_MOVE_TO:
+			sx = ox = px = c[0] + bx;
+			sy = oy = py = c[1] + by;
+			c += 2;
+			open = 0;
+			break;
+		default:
+			if (!open) {
+				poly_contour(pl);
+				transform_point(m, ox, oy, &tx, &ty);
+				poly_point(pl, tx, ty);
+				sx = ox;
+				sy = oy;
+				open = 1;
+			}
+			switch (seg & ~1) {
+			case VG_LINE_TO:
+				ox = c[0] + bx;
+				oy = c[1] + by;
+				c += 2;
+				transform_point(m, ox, oy, &tx, &ty);
+				poly_point(pl, tx, ty);
+				px = ox;
+				py = oy;
+				break;
+			case VG_HLINE_TO:
+				ox = c[0] + bx;
+				c += 1;
+				transform_point(m, ox, oy, &tx, &ty);
+				poly_point(pl, tx, ty);
+				px = ox;
+				py = oy;
+				break;
+			case VG_VLINE_TO:
+				oy = c[0] + by;
+				c += 1;
+				transform_point(m, ox, oy, &tx, &ty);
+				poly_point(pl, tx, ty);
+				px = ox;
+				py = oy;
+				break;
+			case VG_QUAD_TO:
+			case VG_SQUAD_TO:
+				if ((seg & ~1) == VG_QUAD_TO) {
+					x1 = c[0] + bx;
+					y1 = c[1] + by;
+					x2 = c[2] + bx;
+					y2 = c[3] + by;
+					c += 4;
+				}
+				else {
+					x1 = 2 * ox - px;
+					y1 = 2 * oy - py;
+					x2 = c[0] + bx;
+					y2 = c[1] + by;
+					c += 2;
+				}
+				flatten_quad(pl, m, ox, oy, x1, y1, x2, y2);
+				px = x1;
+				py = y1;
+				ox = x2;
+				oy = y2;
+				break;
+			case VG_CUBIC_TO:
+			case VG_SCUBIC_TO:
+				if ((seg & ~1) == VG_CUBIC_TO) {
+					x1 = c[0] + bx;
+					y1 = c[1] + by;
+					x2 = c[2] + bx;
+					y2 = c[3] + by;
+					x3 = c[4] + bx;
+					y3 = c[5] + by;
+					c += 6;
+				}
+				else {
+					x1 = 2 * ox - px;
+					y1 = 2 * oy - py;
+					x2 = c[0] + bx;
+					y2 = c[1] + by;
+					x3 = c[2] + bx;
+					y3 = c[3] + by;
+					c += 4;
+				}
+				flatten_cubic(pl, m, ox, oy, x1, y1, x2, y2, x3, y3);
+				px = x2;
+				py = y2;
+				ox = x3;
+				oy = y3;
+				break;
+			}
+		}
+	}
+}
+
+// build stroke outlines for flattened contours: one rectangle per line
+// segment, all wound the same way so they union under nonzero filling
+static void stroke_polygons(const Polygons *in, Polygons *out, VGfloat halfWidth)
+{
+	int c, i;
+	poly_reset(out);
+	for (c = 0; c < in->contours; c++) {
+		int start = in->starts[c], end = contour_end(in, c);
+		int n = end - start;
+		int segments = in->closed[c] ? n : n - 1;
+		for (i = 0; i < segments; i++) {
+			const VGfloat *a = in->pts + (start + i) * 2;
+			const VGfloat *b = in->pts + (start + (i + 1) % n) * 2;
+			VGfloat dx = b[0] - a[0], dy = b[1] - a[1];
+			VGfloat len = sqrtf(dx * dx + dy * dy);
+			if (len < 1e-6f) {
+				continue;
+			}
+			VGfloat nx = -dy / len * halfWidth, ny = dx / len * halfWidth;
+			poly_contour(out);
+			poly_point(out, a[0] + nx, a[1] + ny);
+			poly_point(out, a[0] - nx, a[1] - ny);
+			poly_point(out, b[0] - nx, b[1] - ny);
+			poly_point(out, b[0] + nx, b[1] + ny);
+			out->closed[out->contours - 1] = 1;
+		}
+	}
+}
+
+
+//
+// Coverage accumulation.  Each edge adds its signed area to the cells it
+// crosses; a running sum along each row then gives the winding weighted
+// coverage of every pixel.
+//
+
+static float *accum;
+static size_t accumAlloc;
+
+typedef struct {
+	int x0, y0, x1, y1;	// pixel bounds, exclusive upper
+} Rect;
+
+static void accumulate_line(float *acc, int w, int h, VGfloat x0, VGfloat y0, VGfloat x1, VGfloat y1)
+{
+	float dir = 1.0f;
+	int y, ystart, yend;
+
+	if (y0 == y1) {
+		return;
+	}
+	if (y0 > y1) {
+		VGfloat t;
+		t = x0; x0 = x1; x1 = t;
+		t = y0; y0 = y1; y1 = t;
+		dir = -1.0f;
+	}
+	float dxdy = (x1 - x0) / (y1 - y0);
+	float x = x0;
+	if (y0 < 0.0f) {
+		x -= y0 * dxdy;
+	}
+	ystart = y0 < 0.0f ? 0 : (int) y0;
+	yend = (int) ceilf(y1);
+	if (yend > h) {
+		yend = h;
+	}
+	for (y = ystart; y < yend; y++) {
+		float *row = acc + (size_t) y * (w + 2);
+		float dy = fminf((float) (y + 1), y1) - fmaxf((float) y, y0);
+		float xnext = x + dxdy * dy;
+		float d = dy * dir;
+		float xa = x < xnext ? x : xnext, xb = x < xnext ? xnext : x;
+		float xaf = floorf(xa);
+		int xai = (int) xaf;
+		float xbc = ceilf(xb);
+		int xbi = (int) xbc;
+
+		if (xbi <= xai + 1) {
+			float xmf = 0.5f * (x + xnext) - xaf;
+			row[xai] += d - d * xmf;
+			row[xai + 1] += d * xmf;
+		}
+		else {
+			float s = 1.0f / (xb - xa);
+			float xa0 = xa - xaf;
+			float a0 = 0.5f * s * (1.0f - xa0) * (1.0f - xa0);
+			float xb1 = xb - xbc + 1.0f;
+			float am = 0.5f * s * xb1 * xb1;
+			int xi;
+			row[xai] += d * a0;
+			if (xbi == xai + 2) {
+				row[xai + 1] += d * (1.0f - a0 - am);
+			}
+			else {
+				float a1 = s * (1.5f - xa0);
+				row[xai + 1] += d * (a1 - a0);
+				for (xi = xai + 2; xi < xbi - 1; xi++) {
+					row[xi] += d * s;
+				}
+				float a2 = a1 + (xbi - xai - 3) * s;
+				row[xbi - 1] += d * (1.0f - a2 - am);
+			}
+			row[xbi] += d * am;
+		}
+		x = xnext;
+	}
+}
+
+// add an edge, in region relative coordinates, splitting it where it
+// leaves the region horizontally.  Parts left of the region become
+// vertical edges on its left side, so they still count for winding;
+// parts right of it don't affect any visible pixel.
+static void add_edge(float *acc, int w, int h, VGfloat x0, VGfloat y0, VGfloat x1, VGfloat y1)
+{
+	VGfloat bounds[2] = { 0.0f, (VGfloat) w };
+	int i;
+
+	if ((y0 <= 0.0f && y1 <= 0.0f) || (y0 >= h && y1 >= h) || y0 == y1) {
+		return;
+	}
+	for (i = 0; i < 2; i++) {
+		VGfloat bx = bounds[i];
+		if ((x0 < bx && x1 > bx) || (x0 > bx && x1 < bx)) {
+			VGfloat t = (bx - x0) / (x1 - x0);
+			VGfloat my = y0 + (y1 - y0) * t;
+			add_edge(acc, w, h, x0, y0, bx, my);
+			add_edge(acc, w, h, bx, my, x1, y1);
+			return;
+		}
+	}
+	if (x0 >= w && x1 >= w) {
+		return;
+	}
+	if (x0 < 0.0f) x0 = 0.0f;
+	if (x1 < 0.0f) x1 = 0.0f;
+	accumulate_line(acc, w, h, x0, y0, x1, y1);
+}
+
+// the drawable area: the surface, cut down to the scissor rectangles'
+// bounds.  Pixels are tested against individual rectangles when shading.
+static int clip_bounds(Rect *r)
+{
+	r->x0 = 0;
+	r->y0 = 0;
+	r->x1 = surface.width;
+	r->y1 = surface.height;
+	if (ctx.scissoring) {
+		int i;
+		Rect u = { surface.width, surface.height, 0, 0 };
+		for (i = 0; i < ctx.scissorCount; i++) {
+			const VGint *s = ctx.scissorRects + i * 4;
+			if (s[2] <= 0 || s[3] <= 0) {
+				continue;
+			}
+			if (s[0] < u.x0) u.x0 = s[0];
+			if (s[1] < u.y0) u.y0 = s[1];
+			if (s[0] + s[2] > u.x1) u.x1 = s[0] + s[2];
+			if (s[1] + s[3] > u.y1) u.y1 = s[1] + s[3];
+		}
+		if (u.x0 > r->x0) r->x0 = u.x0;
+		if (u.y0 > r->y0) r->y0 = u.y0;
+		if (u.x1 < r->x1) r->x1 = u.x1;
+		if (u.y1 < r->y1) r->y1 = u.y1;
+	}
+	return r->x0 < r->x1 && r->y0 < r->y1;
+}
+
+// clip a span [*xs, *xe) on row y to the scissor rectangles.  With more
+// than one rectangle the span is cut to the first one that contains
+// part of it, good enough for the disjoint rectangles callers use.
+static int scissor_span(int y, int *xs, int *xe)
+{
+	int i;
+	if (!ctx.scissoring) {
+		return *xs < *xe;
+	}
+	for (i = 0; i < ctx.scissorCount; i++) {
+		const VGint *s = ctx.scissorRects + i * 4;
+		if (y >= s[1] && y < s[1] + s[3]) {
+			int a = *xs > s[0] ? *xs : s[0];
+			int b = *xe < s[0] + s[2] ? *xe : s[0] + s[2];
+			if (a < b) {
+				*xs = a;
+				*xe = b;
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+
+//
+// Paint
+//
+
+typedef struct {
+	int type;
+	uint32_t color;			// premultiplied, for color paint
+	uint32_t ramp[256];		// premultiplied, for gradients
+	VGColorRampSpreadMode spread;
+	// surface to paint space, for gradients
+	Matrix toPaint;
+	VGfloat g[5];
+} Shader;
+
+static Shader shader;
+
+static void build_ramp(const Paint *p)
+{
+	VGfloat stops[(MAX_RAMP_STOPS + 2) * 5];
+	int n = 0, i, j;
+
+	// stops must be in order and inside [0,1], add end stops if missing
+	for (i = 0; i < p->stopCount; i++) {
+		const VGfloat *s = p->stops + i * 5;
+		if (s[0] < 0.0f || s[0] > 1.0f || (n > 0 && s[0] < stops[(n - 1) * 5])) {
+			continue;
+		}
+		memcpy(stops + n * 5, s, 5 * sizeof(VGfloat));
+		n++;
+	}
+	if (n == 0) {
+		VGfloat def[10] = { 0, 0, 0, 0, 1, 1, 1, 1, 1, 1 };
+		memcpy(stops, def, sizeof(def));
+		n = 2;
+	}
+	if (stops[0] > 0.0f) {
+		memmove(stops + 5, stops, n * 5 * sizeof(VGfloat));
+		stops[0] = 0.0f;
+		n++;
+	}
+	if (stops[(n - 1) * 5] < 1.0f) {
+		memcpy(stops + n * 5, stops + (n - 1) * 5, 5 * sizeof(VGfloat));
+		stops[n * 5] = 1.0f;
+		n++;
+	}
+
+	j = 0;
+	for (i = 0; i < 256; i++) {
+		VGfloat t = i / 255.0f, c[4];
+		int k;
+		while (j < n - 2 && t > stops[(j + 1) * 5]) {
+			j++;
+		}
+		const VGfloat *a = stops + j * 5, *b = stops + (j + 1) * 5;
+		VGfloat span = b[0] - a[0];
+		VGfloat f = span > 0.0f ? (t - a[0]) / span : 0.0f;
+		for (k = 0; k < 4; k++) {
+			c[k] = a[k + 1] + (b[k + 1] - a[k + 1]) * f;
+		}
+		shader.ramp[i] = color_to_pixel(c);
+	}
+}
+
+// set up shading for a paint drawn through the given user to surface
+// matrix
+static int prepare_shader(VGPaint handle, const Matrix *userToSurface, VGMatrixMode paintMatrix)
+{
+	static const Paint defaultPaint = { VG_PAINT_TYPE_COLOR, { 0, 0, 0, 1 } };
+	const Paint *p = &defaultPaint;
+
+	if (handle != VG_INVALID_HANDLE && handle <= (VGHandle) objectAlloc && objects[handle - 1]) {
+		p = &objects[handle - 1]->u.paint;
+	}
+	shader.type = p->type ? p->type : VG_PAINT_TYPE_COLOR;
+	if (shader.type == VG_PAINT_TYPE_COLOR || shader.type == VG_PAINT_TYPE_PATTERN) {
+		shader.type = VG_PAINT_TYPE_COLOR;
+		shader.color = color_to_pixel(p->color);
+		return 1;
+	}
+
+	Matrix paintToSurface;
+	mat_mult(&paintToSurface, userToSurface, &ctx.matrices[paintMatrix - VG_MATRIX_PATH_USER_TO_SURFACE]);
+	if (!invert_affine(&paintToSurface, &shader.toPaint)) {
+		return 0;
+	}
+	shader.spread = p->spread ? p->spread : VG_COLOR_RAMP_SPREAD_PAD;
+	memcpy(shader.g, shader.type == VG_PAINT_TYPE_LINEAR_GRADIENT ? p->linear : p->radial, sizeof(shader.g));
+	build_ramp(p);
+	return 1;
+}
+
+static inline uint32_t ramp_lookup(VGfloat t)
+{
+	switch (shader.spread) {
+	case VG_COLOR_RAMP_SPREAD_REPEAT:
+		t = t - floorf(t);
+		break;
+	case VG_COLOR_RAMP_SPREAD_REFLECT:
+		t = fabsf(t);
+		t = fmodf(t, 2.0f);
+		if (t > 1.0f) {
+			t = 2.0f - t;
+		}
+		break;
+	default:
+		t = t < 0.0f ? 0.0f : t > 1.0f ? 1.0f : t;
+	}
+	return shader.ramp[(int) (t * 255.0f + 0.5f)];
+}
+
+// gradient parameter at surface point (x, y)
+static VGfloat gradient_t(VGfloat x, VGfloat y)
+{
+	VGfloat u, v;
+	transform_point(&shader.toPaint, x, y, &u, &v);
+	if (shader.type == VG_PAINT_TYPE_LINEAR_GRADIENT) {
+		VGfloat dx = shader.g[2] - shader.g[0], dy = shader.g[3] - shader.g[1];
+		VGfloat len2 = dx * dx + dy * dy;
+		if (len2 <= 0.0f) {
+			return 1.0f;
+		}
+		return ((u - shader.g[0]) * dx + (v - shader.g[1]) * dy) / len2;
+	}
+
+	// radial: center (cx, cy), focus (fx, fy), radius r
+	VGfloat cx = shader.g[0], cy = shader.g[1], fx = shader.g[2], fy = shader.g[3], r = shader.g[4];
+	if (r <= 0.0f) {
+		return 1.0f;
+	}
+	VGfloat fdx = fx - cx, fdy = fy - cy;
+	VGfloat fd2 = fdx * fdx + fdy * fdy;
+	if (fd2 > r * r * 0.998f) {
+		// keep the focus just inside the circle
+		VGfloat s = r * 0.999f / sqrtf(fd2);
+		fdx *= s;
+		fdy *= s;
+		fx = cx + fdx;
+		fy = cy + fdy;
+		fd2 = fdx * fdx + fdy * fdy;
+	}
+	VGfloat dx = u - fx, dy = v - fy;
+	VGfloat den = r * r - fd2;
+	VGfloat cross = dx * fdy - dy * fdx;
+	VGfloat num = dx * fdx + dy * fdy + sqrtf(r * r * (dx * dx + dy * dy) - cross * cross);
+	return num / den;
+}
+
+// shade a span of pixels [xs, xe) on row y with per pixel coverage
+// (0..255), blending into the surface
+static void shade_span(int y, int xs, int xe, const uint8_t *coverage)
+{
+	uint32_t *dst = surface.pixels + (size_t) y * surface.width;
+	int x;
+	if (shader.type == VG_PAINT_TYPE_COLOR) {
+		uint32_t c = shader.color;
+		for (x = xs; x < xe; x++) {
+			unsigned cov = coverage[x - xs];
+			if (cov) {
+				dst[x] = blend(c, cov, dst[x]);
+			}
+		}
+		return;
+	}
+	for (x = xs; x < xe; x++) {
+		unsigned cov = coverage[x - xs];
+		if (cov) {
+			uint32_t c = ramp_lookup(gradient_t(x + 0.5f, y + 0.5f));
+			dst[x] = blend(c, cov, dst[x]);
+		}
+	}
+}
+
+
+//
+// Filling
+//
+
+// fill polygons with the shader, using the given fill rule
+static void fill_polygons(const Polygons *pl, VGFillRule rule)
+{
+	Rect clip, r;
+	int c, i, y;
+	VGfloat minx = 1e30f, miny = 1e30f, maxx = -1e30f, maxy = -1e30f;
+
+	if (pl->count == 0 || !clip_bounds(&clip)) {
+		return;
+	}
+	for (i = 0; i < pl->count; i++) {
+		VGfloat x = pl->pts[i * 2], yy = pl->pts[i * 2 + 1];
+		if (x < minx) minx = x;
+		if (x > maxx) maxx = x;
+		if (yy < miny) miny = yy;
+		if (yy > maxy) maxy = yy;
+	}
+	r.x0 = (int) floorf(minx);
+	r.y0 = (int) floorf(miny);
+	r.x1 = (int) ceilf(maxx) + 1;
+	r.y1 = (int) ceilf(maxy) + 1;
+	if (r.x0 < clip.x0) r.x0 = clip.x0;
+	if (r.y0 < clip.y0) r.y0 = clip.y0;
+	if (r.x1 > clip.x1) r.x1 = clip.x1;
+	if (r.y1 > clip.y1) r.y1 = clip.y1;
+	if (r.x0 >= r.x1 || r.y0 >= r.y1) {
+		return;
+	}
+
+	int w = r.x1 - r.x0, h = r.y1 - r.y0;
+	size_t need = (size_t) (w + 2) * h;
+	if (need > accumAlloc) {
+		free(accum);
+		accum = malloc(need * sizeof(float));
+		accumAlloc = accum ? need : 0;
+		if (accum == NULL) {
+			set_error(VG_OUT_OF_MEMORY_ERROR);
+			return;
+		}
+	}
+	memset(accum, 0, need * sizeof(float));
+
+	for (c = 0; c < pl->contours; c++) {
+		int start = pl->starts[c], end = contour_end(pl, c);
+		for (i = start; i < end; i++) {
+			const VGfloat *a = pl->pts + i * 2;
+			const VGfloat *b = pl->pts + (i + 1 < end ? i + 1 : start) * 2;
+			add_edge(accum, w, h, a[0] - r.x0, a[1] - r.y0, b[0] - r.x0, b[1] - r.y0);
+		}
+	}
+
+	damage(r.x0, r.y0, r.x1, r.y1);
+	uint8_t *coverage = malloc(w);
+	for (y = 0; y < h; y++) {
+		float *row = accum + (size_t) y * (w + 2);
+		float sum = 0.0f;
+		int first = -1, last = -1, x;
+		for (x = 0; x < w; x++) {
+			float a;
+			sum += row[x];
+			a = fabsf(sum);
+			if (rule == VG_EVEN_ODD) {
+				a = fmodf(a, 2.0f);
+				if (a > 1.0f) {
+					a = 2.0f - a;
+				}
+			}
+			else if (a > 1.0f) {
+				a = 1.0f;
+			}
+			coverage[x] = (uint8_t) (a * 255.0f + 0.5f);
+			if (coverage[x]) {
+				if (first < 0) {
+					first = x;
+				}
+				last = x;
+			}
+		}
+		if (first < 0) {
+			continue;
+		}
+		int xs = r.x0 + first, xe = r.x0 + last + 1;
+		if (scissor_span(r.y0 + y, &xs, &xe)) {
+			shade_span(r.y0 + y, xs, xe, coverage + (xs - r.x0));
+		}
+	}
+	free(coverage);
+}
+
+void vgDrawPath(VGPath path, VGbitfield paintModes)
+{
+	Object *o = get_object(path, OBJ_PATH);
+	const Matrix *m = &ctx.matrices[0];
+	if (o == NULL || surface.pixels == NULL) {
+		return;
+	}
+
+	flatten_path(&o->u.path, m, &fillPolys);
+	if ((paintModes & VG_FILL_PATH) &&
+	    prepare_shader(ctx.fillPaint, m, VG_MATRIX_FILL_PAINT_TO_USER)) {
+		fill_polygons(&fillPolys, ctx.fillRule);
+	}
+	if ((paintModes & VG_STROKE_PATH) && ctx.strokeWidth > 0.0f &&
+	    prepare_shader(ctx.strokePaint, m, VG_MATRIX_STROKE_PAINT_TO_USER)) {
+		// stroke width is in user units, scale it by the matrix
+		VGfloat scale = sqrtf(fabsf(m->m[0] * m->m[4] - m->m[1] * m->m[3]));
+		stroke_polygons(&fillPolys, &strokePolys, ctx.strokeWidth * scale * 0.5f);
+		fill_polygons(&strokePolys, VG_NON_ZERO);
+	}
+}
+
+
+//
+// Paint objects
+//
+
+VGPaint vgCreatePaint(void)
+{
+	init_context();
+	VGHandle h = new_object(OBJ_PAINT);
+	if (h != VG_INVALID_HANDLE) {
+		Paint *p = &objects[h - 1]->u.paint;
+		p->type = VG_PAINT_TYPE_COLOR;
+		p->color[3] = 1.0f;
+		p->spread = VG_COLOR_RAMP_SPREAD_PAD;
+		p->linear[2] = 1.0f;
+		p->radial[4] = 1.0f;
+	}
+	return h;
+}
+
+static void release_paint(VGPaint handle)
+{
+	if (handle == VG_INVALID_HANDLE) {
+		return;
+	}
+	Paint *p = &objects[handle - 1]->u.paint;
+	p->refs--;
+	if (p->destroyed && p->refs == 0) {
+		free_object(handle);
+	}
+}
+
+// a paint destroyed while it is set stays usable until it is replaced
+void vgDestroyPaint(VGPaint paint)
+{
+	Object *o = get_object(paint, OBJ_PAINT);
+	if (o == NULL || o->u.paint.destroyed) {
+		return;
+	}
+	o->u.paint.destroyed = 1;
+	if (o->u.paint.refs == 0) {
+		free_object(paint);
+	}
+}
+
+void vgSetPaint(VGPaint paint, VGbitfield paintModes)
+{
+	init_context();
+	if (paint != VG_INVALID_HANDLE) {
+		Object *o = get_object(paint, OBJ_PAINT);
+		if (o == NULL || o->u.paint.destroyed) {
+			return;
+		}
+	}
+	if (paintModes & VG_FILL_PATH) {
+		if (paint != VG_INVALID_HANDLE) {
+			objects[paint - 1]->u.paint.refs++;
+		}
+		release_paint(ctx.fillPaint);
+		ctx.fillPaint = paint;
+	}
+	if (paintModes & VG_STROKE_PATH) {
+		if (paint != VG_INVALID_HANDLE) {
+			objects[paint - 1]->u.paint.refs++;
+		}
+		release_paint(ctx.strokePaint);
+		ctx.strokePaint = paint;
+	}
+}
+
+
+//
+// Images
+//
+
+VGImage vgCreateImage(VGImageFormat format, VGint width, VGint height,
+		      VGbitfield allowedQuality)
+{
+	init_context();
+	if (!format_supported(format)) {
+		set_error(VG_UNSUPPORTED_IMAGE_FORMAT_ERROR);
+		return VG_INVALID_HANDLE;
+	}
+	if (width <= 0 || height <= 0 || width > max_image_size() || height > max_image_size() ||
+	    (int64_t) width * height > MAX_IMAGE_PIXELS ||
+	    (allowedQuality & ~(VG_IMAGE_QUALITY_NONANTIALIASED | VG_IMAGE_QUALITY_FASTER | VG_IMAGE_QUALITY_BETTER)) ||
+	    allowedQuality == 0) {
+		set_error(VG_ILLEGAL_ARGUMENT_ERROR);
+		return VG_INVALID_HANDLE;
+	}
+	ImageStorage *storage = calloc(1, sizeof(ImageStorage) + (size_t) width * height * 4);
+	if (storage == NULL) {
+		set_error(VG_OUT_OF_MEMORY_ERROR);
+		return VG_INVALID_HANDLE;
+	}
+	VGHandle h = new_object(OBJ_IMAGE);
+	if (h == VG_INVALID_HANDLE) {
+		free(storage);
+		return h;
+	}
+	storage->refs = 1;
+	Image *img = &objects[h - 1]->u.image;
+	img->format = format;
+	img->width = width;
+	img->height = height;
+	img->stride = width;
+	img->storage = storage;
+	img->pixels = storage->pixels;
+	return h;
+}
+
+// a child image is a window on its parent's pixels, which stay until the
+// parent and every child are destroyed
+VGImage vgChildImage(VGImage parent, VGint x, VGint y, VGint width, VGint height)
+{
+	Object *o = get_object(parent, OBJ_IMAGE);
+	if (o == NULL) {
+		return VG_INVALID_HANDLE;
+	}
+	Image *p = &o->u.image;
+	if (x < 0 || y < 0 || width <= 0 || height <= 0 || x > p->width - width || y > p->height - height) {
+		set_error(VG_ILLEGAL_ARGUMENT_ERROR);
+		return VG_INVALID_HANDLE;
+	}
+	VGHandle h = new_object(OBJ_IMAGE);
+	if (h == VG_INVALID_HANDLE) {
+		return h;
+	}
+	Image *img = &objects[h - 1]->u.image;
+	img->format = p->format;
+	img->width = width;
+	img->height = height;
+	img->stride = p->stride;
+	img->storage = p->storage;
+	img->pixels = p->pixels + (size_t) y * p->stride + x;
+	img->storage->refs++;
+	return h;
+}
+
+void vgDestroyImage(VGImage image)
+{
+	Object *o = get_object(image, OBJ_IMAGE);
+	if (o) {
+		if (--o->u.image.storage->refs == 0) {
+			free(o->u.image.storage);
+		}
+		free_object(image);
+	}
+}
+
+void vgClearImage(VGImage image, VGint x, VGint y, VGint width, VGint height)
+{
+	Object *o = get_object(image, OBJ_IMAGE);
+	VGint sx = 0, sy = 0, j, i;
+	if (o == NULL) {
+		return;
+	}
+	Image *img = &o->u.image;
+	if (!clip_copy(&sx, &sy, img->width, img->height, &x, &y, img->width, img->height, &width, &height)) {
+		return;
+	}
+	uint32_t c = color_to_pixel(ctx.clearColor);
+	for (j = 0; j < height; j++) {
+		uint32_t *row = img->pixels + (size_t) (y + j) * img->stride + x;
+		for (i = 0; i < width; i++) {
+			row[i] = c;
+		}
+	}
+}
+
+void vgImageSubData(VGImage image, const void *data, VGint dataStride,
+		    VGImageFormat dataFormat,
+		    VGint x, VGint y, VGint width, VGint height)
+{
+	Object *o = get_object(image, OBJ_IMAGE);
+	VGint sx = 0, sy = 0, j;
+	if (o == NULL) {
+		return;
+	}
+	if (!format_supported(dataFormat)) {
+		set_error(VG_UNSUPPORTED_IMAGE_FORMAT_ERROR);
+		return;
+	}
+	Image *img = &o->u.image;
+	if (!clip_copy(&sx, &sy, width, height, &x, &y, img->width, img->height, &width, &height)) {
+		return;
+	}
+	int bpp = format_bytes(dataFormat);
+	for (j = 0; j < height; j++) {
+		const uint8_t *src = (const uint8_t *) data + (ptrdiff_t) (sy + j) * dataStride + sx * bpp;
+		row_from_format(img->pixels + (size_t) (y + j) * img->stride + x, src, dataFormat, width);
+	}
+}
+
+void vgGetImageSubData(VGImage image, void *data, VGint dataStride,
+		       VGImageFormat dataFormat,
+		       VGint x, VGint y, VGint width, VGint height)
+{
+	Object *o = get_object(image, OBJ_IMAGE);
+	VGint dx = 0, dy = 0, j;
+	if (o == NULL) {
+		return;
+	}
+	if (!format_supported(dataFormat)) {
+		set_error(VG_UNSUPPORTED_IMAGE_FORMAT_ERROR);
+		return;
+	}
+	Image *img = &o->u.image;
+	if (!clip_copy(&x, &y, img->width, img->height, &dx, &dy, width, height, &width, &height)) {
+		return;
+	}
+	int bpp = format_bytes(dataFormat);
+	for (j = 0; j < height; j++) {
+		uint8_t *dst = (uint8_t *) data + (ptrdiff_t) (dy + j) * dataStride + dx * bpp;
+		row_to_format(dst, img->pixels + (size_t) (y + j) * img->stride + x, dataFormat, width);
+	}
+}
+
+
+//
+// Image drawing
+//
+
+typedef uint8_t v8u8 __attribute__ ((vector_size(8)));
+typedef uint16_t v8u16 __attribute__ ((vector_size(16)));
+
+// bilinear sample between pixels (x, y) .. (x + 1, y + 1) with 8 bit
+// fractions fx, fy.  Both pixel pairs are loaded as one vector each, so
+// the vertical blend does two pixels at once and the horizontal blend
+// finishes all four channels together.
+static inline uint32_t bilinear(const Image *img, int x, int y, unsigned fx, unsigned fy)
+{
+	const uint32_t *r0 = img->pixels + (size_t) y * img->stride;
+	const uint32_t *r1 = y + 1 < img->height ? r0 + img->stride : r0;
+	uint32_t pair0[2], pair1[2];
+	v8u8 b0, b1;
+
+	if (x + 1 < img->width) {
+		memcpy(pair0, r0 + x, 8);
+		memcpy(pair1, r1 + x, 8);
+	}
+	else {
+		pair0[0] = pair0[1] = r0[x];
+		pair1[0] = pair1[1] = r1[x];
+	}
+	memcpy(&b0, pair0, 8);
+	memcpy(&b1, pair1, 8);
+
+	v8u16 top = __builtin_convertvector(b0, v8u16);
+	v8u16 bottom = __builtin_convertvector(b1, v8u16);
+	v8u16 v = (top * (uint16_t) (256 - fy) + bottom * (uint16_t) fy) >> 8;
+	v8u16 swapped = __builtin_shuffle(v, (v8u16) { 4, 5, 6, 7, 0, 1, 2, 3 });
+	v8u16 h = (v * (uint16_t) (256 - fx) + swapped * (uint16_t) fx) >> 8;
+	return h[0] | (h[1] << 8) | (h[2] << 16) | ((uint32_t) h[3] << 24);
+}
+
+void vgDrawImage(VGImage image)
+{
+	Object *o = get_object(image, OBJ_IMAGE);
+	const Matrix *m = &ctx.matrices[VG_MATRIX_IMAGE_USER_TO_SURFACE - VG_MATRIX_PATH_USER_TO_SURFACE];
+	Matrix inv;
+	Rect clip, r;
+	int i, y;
+
+	if (o == NULL || surface.pixels == NULL || !clip_bounds(&clip) || !invert_affine(m, &inv)) {
+		return;
+	}
+	const Image *img = &o->u.image;
+
+	// surface bounds of the transformed image
+	VGfloat cx[4], cy[4];
+	VGfloat corners[8] = { 0, 0, img->width, 0, 0, img->height, img->width, img->height };
+	VGfloat minx = 1e30f, miny = 1e30f, maxx = -1e30f, maxy = -1e30f;
+	for (i = 0; i < 4; i++) {
+		transform_point(m, corners[i * 2], corners[i * 2 + 1], &cx[i], &cy[i]);
+		minx = fminf(minx, cx[i]);
+		maxx = fmaxf(maxx, cx[i]);
+		miny = fminf(miny, cy[i]);
+		maxy = fmaxf(maxy, cy[i]);
+	}
+	r.x0 = (int) floorf(minx);
+	r.y0 = (int) floorf(miny);
+	r.x1 = (int) ceilf(maxx);
+	r.y1 = (int) ceilf(maxy);
+	if (r.x0 < clip.x0) r.x0 = clip.x0;
+	if (r.y0 < clip.y0) r.y0 = clip.y0;
+	if (r.x1 > clip.x1) r.x1 = clip.x1;
+	if (r.y1 > clip.y1) r.y1 = clip.y1;
+	if (r.x0 >= r.x1 || r.y0 >= r.y1) {
+		return;
+	}
+
+	// multiply mode tints by the fill paint color.  A white paint, the
+	// usual way to fade an image, only scales by its alpha.
+	uint32_t tint = 0xffffffff;
+	int multiply = ctx.imageMode == VG_DRAW_IMAGE_MULTIPLY;
+	if (multiply) {
+		prepare_shader(ctx.fillPaint, m, VG_MATRIX_FILL_PAINT_TO_USER);
+		tint = shader.type == VG_PAINT_TYPE_COLOR ? shader.color : shader.ramp[128];
+	}
+	unsigned tintA = PIX_A(tint);
+	unsigned tintR = tintA ? PIX_R(tint) * 255 / tintA : 0;
+	unsigned tintG = tintA ? PIX_G(tint) * 255 / tintA : 0;
+	unsigned tintB = tintA ? PIX_B(tint) * 255 / tintA : 0;
+	int colored = multiply && (tintR != 255 || tintG != 255 || tintB != 255);
+	if (multiply && tintA == 0) {
+		return;
+	}
+	int filtered = ctx.imageQuality != VG_IMAGE_QUALITY_NONANTIALIASED;
+	damage(r.x0, r.y0, r.x1, r.y1);
+
+	// image coordinates step linearly along a row, in 16.16 fixed point
+	int64_t dudx = (int64_t) (inv.m[0] * 65536.0f), dvdx = (int64_t) (inv.m[1] * 65536.0f);
+	int64_t wmax = (int64_t) img->width << 16, hmax = (int64_t) img->height << 16;
+
+	for (y = r.y0; y < r.y1; y++) {
+		int xs = r.x0, xe = r.x1, x;
+		if (!scissor_span(y, &xs, &xe)) {
+			continue;
+		}
+		VGfloat u0, v0;
+		transform_point(&inv, xs + 0.5f, y + 0.5f, &u0, &v0);
+		int64_t u = (int64_t) (u0 * 65536.0f), v = (int64_t) (v0 * 65536.0f);
+		uint32_t *dst = surface.pixels + (size_t) y * surface.width;
+
+		for (x = xs; x < xe; x++, u += dudx, v += dvdx) {
+			if (u < 0 || v < 0 || u >= wmax || v >= hmax) {
+				continue;
+			}
+			uint32_t p;
+			if (filtered) {
+				// sample centers are at +0.5, clamp at the edges
+				int64_t su = u - 32768, sv = v - 32768;
+				if (su < 0) su = 0;
+				if (sv < 0) sv = 0;
+				p = bilinear(img, (int) (su >> 16), (int) (sv >> 16),
+					     (unsigned) ((su >> 8) & 0xff), (unsigned) ((sv >> 8) & 0xff));
+			}
+			else {
+				p = img->pixels[(size_t) (v >> 16) * img->stride + (u >> 16)];
+			}
+			if (colored) {
+				p = pack(mul255(PIX_R(p), tintR), mul255(PIX_G(p), tintG),
+					 mul255(PIX_B(p), tintB), PIX_A(p));
+			}
+			if (tintA != 255) {
+				p = scale_pixel(p, tintA);
+			}
+			dst[x] = blend(p, 255, dst[x]);
+		}
+	}
+}
+
+
+//
+// Pixel copies between images, memory and the surface.  These ignore the
+// transforms, blending and scissoring.
+//
+
+void vgSetPixels(VGint dx, VGint dy, VGImage src, VGint sx, VGint sy,
+		 VGint width, VGint height)
+{
+	Object *o = get_object(src, OBJ_IMAGE);
+	VGint j;
+	if (o == NULL || surface.pixels == NULL) {
+		return;
+	}
+	const Image *img = &o->u.image;
+	if (!clip_copy(&sx, &sy, img->width, img->height, &dx, &dy, surface.width, surface.height, &width, &height)) {
+		return;
+	}
+	damage(dx, dy, dx + width, dy + height);
+	for (j = 0; j < height; j++) {
+		memcpy(surface.pixels + (size_t) (dy + j) * surface.width + dx,
+		       img->pixels + (size_t) (sy + j) * img->stride + sx, width * 4);
+	}
+}
+
+void vgWritePixels(const void *data, VGint dataStride, VGImageFormat dataFormat,
+		   VGint dx, VGint dy, VGint width, VGint height)
+{
+	VGint sx = 0, sy = 0, j;
+	if (surface.pixels == NULL) {
+		return;
+	}
+	if (!format_supported(dataFormat)) {
+		set_error(VG_UNSUPPORTED_IMAGE_FORMAT_ERROR);
+		return;
+	}
+	if (!clip_copy(&sx, &sy, width, height, &dx, &dy, surface.width, surface.height, &width, &height)) {
+		return;
+	}
+	damage(dx, dy, dx + width, dy + height);
+	int bpp = format_bytes(dataFormat);
+	for (j = 0; j < height; j++) {
+		const uint8_t *src = (const uint8_t *) data + (ptrdiff_t) (sy + j) * dataStride + sx * bpp;
+		row_from_format(surface.pixels + (size_t) (dy + j) * surface.width + dx, src, dataFormat, width);
+	}
+}
+
+void vgGetPixels(VGImage dst, VGint dx, VGint dy, VGint sx, VGint sy,
+		 VGint width, VGint height)
+{
+	Object *o = get_object(dst, OBJ_IMAGE);
+	VGint j;
+	if (o == NULL || surface.pixels == NULL) {
+		return;
+	}
+	Image *img = &o->u.image;
+	if (!clip_copy(&sx, &sy, surface.width, surface.height, &dx, &dy, img->width, img->height, &width, &height)) {
+		return;
+	}
+	for (j = 0; j < height; j++) {
+		memcpy(img->pixels + (size_t) (dy + j) * img->stride + dx,
+		       surface.pixels + (size_t) (sy + j) * surface.width + sx, width * 4);
+	}
+}
+
+void vgReadPixels(void *data, VGint dataStride, VGImageFormat dataFormat,
+		  VGint sx, VGint sy, VGint width, VGint height)
+{
+	VGint dx = 0, dy = 0, j;
+	if (surface.pixels == NULL) {
+		return;
+	}
+	if (!format_supported(dataFormat)) {
+		set_error(VG_UNSUPPORTED_IMAGE_FORMAT_ERROR);
+		return;
+	}
+	if (!clip_copy(&sx, &sy, surface.width, surface.height, &dx, &dy, width, height, &width, &height)) {
+		return;
+	}
+	int bpp = format_bytes(dataFormat);
+	for (j = 0; j < height; j++) {
+		uint8_t *dst = (uint8_t *) data + (ptrdiff_t) (dy + j) * dataStride + dx * bpp;
+		row_to_format(dst, surface.pixels + (size_t) (sy + j) * surface.width + sx, dataFormat, width);
+	}
+}
+
+// vgClear fills a rectangle with the clear color, within the scissor
+// rectangles
+void vgClear(VGint x, VGint y, VGint width, VGint height)
+{
+	Rect clip;
+	int j, i;
+	if (surface.pixels == NULL || !clip_bounds(&clip)) {
+		return;
+	}
+	int x0 = x > clip.x0 ? x : clip.x0, x1 = x + width < clip.x1 ? x + width : clip.x1;
+	int y0 = y > clip.y0 ? y : clip.y0, y1 = y + height < clip.y1 ? y + height : clip.y1;
+	uint32_t c = color_to_pixel(ctx.clearColor);
+	if (x0 == 0 && y0 == 0 && x1 == surface.width && y1 == surface.height &&
+	    (!ctx.scissoring || ctx.scissorCount == 1)) {
+		vgsoft_clear_surface(c);
+		return;
+	}
+	if (x0 < x1 && y0 < y1) {
+		damage(x0, y0, x1, y1);
+	}
+	for (j = y0; j < y1; j++) {
+		int xs = x0, xe = x1;
+		if (!scissor_span(j, &xs, &xe)) {
+			continue;
+		}
+		uint32_t *row = surface.pixels + (size_t) j * surface.width;
+		for (i = xs; i < xe; i++) {
+			row[i] = c;
+		}
+	}
+}
+
+
+//
+// VGU.  Shapes are built from lines and cubic curves.
+//
+
+static VGUErrorCode append(VGPath path, int n, const VGubyte *segs, const VGfloat *coords)
+{
+	Object *o = get_object(path, OBJ_PATH);
+	if (o == NULL) {
+		return VGU_BAD_HANDLE_ERROR;
+	}
+	// VGU data is always float, whatever the path's datatype, so append
+	// straight into the path's float storage
+	Path *p = &o->u.path;
+	VGPathDatatype saved = p->datatype;
+	VGfloat scale = p->scale, bias = p->bias;
+	p->datatype = VG_PATH_DATATYPE_F;
+	p->scale = 1.0f;
+	p->bias = 0.0f;
+	vgAppendPathData(path, n, segs, coords);
+	p->datatype = saved;
+	p->scale = scale;
+	p->bias = bias;
+	return VGU_NO_ERROR;
+}
+
+VGUErrorCode vguLine(VGPath path, VGfloat x0, VGfloat y0, VGfloat x1, VGfloat y1)
+{
+	VGubyte segs[] = { VG_MOVE_TO_ABS, VG_LINE_TO_ABS };
+	VGfloat coords[] = { x0, y0, x1, y1 };
+	return append(path, 2, segs, coords);
+}
+
+VGUErrorCode vguPolygon(VGPath path, const VGfloat *points, VGint count, VGboolean closed)
+{
+	VGubyte *segs;
+	int i;
+	if (count <= 0 || points == NULL) {
+		return VGU_ILLEGAL_ARGUMENT_ERROR;
+	}
+	segs = malloc(count + 1);
+	segs[0] = VG_MOVE_TO_ABS;
+	for (i = 1; i < count; i++) {
+		segs[i] = VG_LINE_TO_ABS;
+	}
+	segs[count] = VG_CLOSE_PATH;
+	VGUErrorCode e = append(path, closed ? count + 1 : count, segs, points);
+	free(segs);
+	return e;
+}
+
+VGUErrorCode vguRect(VGPath path, VGfloat x, VGfloat y, VGfloat width, VGfloat height)
+{
+	VGubyte segs[] = { VG_MOVE_TO_ABS, VG_HLINE_TO_REL, VG_VLINE_TO_REL, VG_HLINE_TO_REL, VG_CLOSE_PATH };
+	VGfloat coords[] = { x, y, width, height, -width };
+	if (width <= 0 || height <= 0) {
+		return VGU_ILLEGAL_ARGUMENT_ERROR;
+	}
+	return append(path, 5, segs, coords);
+}
+
+// control point distance for a quarter circle as a cubic
+#define KAPPA 0.5522847498f
+
+// append an elliptical arc of radii rx, ry about (cx, cy) from angle a0
+// sweeping ext radians, as cubics of at most 90 degrees.  The current
+// point must already be at the arc's start.
+static VGUErrorCode append_arc(VGPath path, VGfloat cx, VGfloat cy, VGfloat rx, VGfloat ry,
+			       VGfloat a0, VGfloat ext)
+{
+	int n = (int) ceilf(fabsf(ext) / ((VGfloat) M_PI / 2.0f) - 1e-4f), i;
+	if (n < 1) {
+		n = 1;
+	}
+	VGfloat step = ext / n;
+	VGfloat k = 4.0f / 3.0f * tanf(step / 4.0f);
+	for (i = 0; i < n; i++) {
+		VGfloat s = a0 + step * i, e = s + step;
+		VGfloat cs = cosf(s), ss = sinf(s), ce = cosf(e), se = sinf(e);
+		VGubyte seg = VG_CUBIC_TO_ABS;
+		VGfloat coords[6] = {
+			cx + rx * (cs - k * ss), cy + ry * (ss + k * cs),
+			cx + rx * (ce + k * se), cy + ry * (se - k * ce),
+			cx + rx * ce, cy + ry * se
+		};
+		VGUErrorCode err = append(path, 1, &seg, coords);
+		if (err != VGU_NO_ERROR) {
+			return err;
+		}
+	}
+	return VGU_NO_ERROR;
+}
+
+VGUErrorCode vguRoundRect(VGPath path, VGfloat x, VGfloat y, VGfloat width, VGfloat height,
+			  VGfloat arcWidth, VGfloat arcHeight)
+{
+	if (width <= 0 || height <= 0) {
+		return VGU_ILLEGAL_ARGUMENT_ERROR;
+	}
+	VGfloat rx = fminf(fmaxf(arcWidth, 0.0f), width) / 2.0f;
+	VGfloat ry = fminf(fmaxf(arcHeight, 0.0f), height) / 2.0f;
+	VGfloat h = (VGfloat) M_PI / 2.0f;
+	VGubyte move = VG_MOVE_TO_ABS, line = VG_LINE_TO_ABS, close = VG_CLOSE_PATH;
+	VGfloat p[2];
+
+	p[0] = x + rx;
+	p[1] = y;
+	append(path, 1, &move, p);
+	p[0] = x + width - rx;
+	append(path, 1, &line, p);
+	append_arc(path, x + width - rx, y + ry, rx, ry, -h, h);
+	p[0] = x + width;
+	p[1] = y + height - ry;
+	append(path, 1, &line, p);
+	append_arc(path, x + width - rx, y + height - ry, rx, ry, 0, h);
+	p[0] = x + rx;
+	p[1] = y + height;
+	append(path, 1, &line, p);
+	append_arc(path, x + rx, y + height - ry, rx, ry, h, h);
+	p[0] = x;
+	p[1] = y + ry;
+	append(path, 1, &line, p);
+	append_arc(path, x + rx, y + ry, rx, ry, 2 * h, h);
+	return append(path, 1, &close, NULL);
+}
+
+VGUErrorCode vguEllipse(VGPath path, VGfloat cx, VGfloat cy, VGfloat width, VGfloat height)
+{
+	VGubyte move = VG_MOVE_TO_ABS, close = VG_CLOSE_PATH;
+	VGfloat p[2] = { cx + width / 2.0f, cy };
+	if (width <= 0 || height <= 0) {
+		return VGU_ILLEGAL_ARGUMENT_ERROR;
+	}
+	append(path, 1, &move, p);
+	append_arc(path, cx, cy, width / 2.0f, height / 2.0f, 0.0f, 2.0f * (VGfloat) M_PI);
+	return append(path, 1, &close, NULL);
+}
+
+VGUErrorCode vguArc(VGPath path, VGfloat x, VGfloat y, VGfloat width, VGfloat height,
+		    VGfloat startAngle, VGfloat angleExtent, VGUArcType arcType)
+{
+	VGfloat rx = width / 2.0f, ry = height / 2.0f;
+	VGfloat a0 = startAngle * (VGfloat) M_PI / 180.0f;
+	VGfloat ext = angleExtent * (VGfloat) M_PI / 180.0f;
+	VGubyte move = VG_MOVE_TO_ABS, line = VG_LINE_TO_ABS, close = VG_CLOSE_PATH;
+	VGfloat p[2] = { x + rx * cosf(a0), y + ry * sinf(a0) };
+
+	if (width <= 0 || height <= 0) {
+		return VGU_ILLEGAL_ARGUMENT_ERROR;
+	}
+	append(path, 1, &move, p);
+	append_arc(path, x, y, rx, ry, a0, ext);
+	if (arcType == VGU_ARC_PIE) {
+		p[0] = x;
+		p[1] = y;
+		append(path, 1, &line, p);
+	}
+	if (arcType != VGU_ARC_OPEN) {
+		append(path, 1, &close, NULL);
+	}
+	return VGU_NO_ERROR;
+}
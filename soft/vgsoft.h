@@ -0,0 +1,34 @@
+// Interface between the software OpenVG rasterizer (vgsoft.c) and the
+// code that owns and presents its surface (eglsoft.c).
+
+#include <stdint.h>
+
+// The drawing surface.  Pixels are premultiplied RGBA, R in the lowest
+// addressed byte, so on a little endian machine they read back as
+// VG_sABGR_8888 without conversion.  Row 0 is the bottom of the screen,
+// as in OpenVG.
+typedef struct {
+  int x0, y0, x1, y1;		// exclusive upper bounds, empty if x0 >= x1
+} VGSoftRect;
+
+// damage is the part of the surface that changed since the last present.
+// eglSwapBuffers empties it after presenting.
+typedef struct {
+  uint32_t *pixels;
+  int width;
+  int height;
+  VGSoftRect damage;
+} VGSoftSurface;
+
+extern int vgsoft_create_surface(int width, int height);
+extern void vgsoft_destroy_surface(void);
+extern VGSoftSurface *vgsoft_surface(void);
+extern void vgsoft_clear_surface(uint32_t pixel);
+
+// Called by eglSwapBuffers with each finished frame (eglsoft.c).
+typedef void (*VGSoftPresentFunc)(const VGSoftSurface *surface, void *context);
+extern void vgsoft_set_present(VGSoftPresentFunc present, void *context);
+
+// Framebuffer output (framebuffer.c).
+extern int vgsoft_open_framebuffer(const char *device, int *width, int *height);
+extern void vgsoft_close_framebuffer(void);
@@ -3,6 +3,8 @@
 #include "VG/vgu.h"
 #include "EGL/egl.h"
 #include "GLES/gl.h"
+#include <stddef.h>
+#include <stdint.h>
 
 #include "vgwrap_fontinfo.h"
 
@@ -10,6 +12,9 @@
 extern void vgwrap_init(int * screen_width, int * screen_height, int include_fonts);
 extern void vgwrap_finish();
 
+// Timing
+extern double vgwrap_now_ms();
+
 // Terminal manipulation
 extern void saveterm();
 extern void restoreterm();
@@ -28,18 +33,22 @@ extern void Scale(VGfloat, VGfloat);
 
 #ifdef VGWRAP_INCLUDE_FONTS
 
-extern Fontinfo load_font_from_data(const int * Points,
-				    const int * PointIndices,
-				    const unsigned char * Instructions,
-				    const int * InstructionIndices,
-				    const int * InstructionCounts,
-				    const int * adv,
-				    const short * cmap,
-				    int ng);
-extern void unload_font(VGPath * glyphs, int n);
+extern Fontinfo register_font_from_data(const int * Points,
+					const int * PointIndices,
+					const unsigned char * Instructions,
+					const int * InstructionIndices,
+					const int * InstructionCounts,
+					const int * adv,
+					const short * cmap,
+					int ng);
+extern int load_font_file(const char * filename, Fontinfo * f);
+extern void preload_font(Fontinfo);
+extern void unload_font(Fontinfo);
+extern void unregister_font(Fontinfo *);
+extern int font_resident_glyphs();
 
-void LoadAllFonts();
-void UnloadAllFonts();
+void RegisterAllFonts();
+void UnregisterAllFonts();
 
 extern void Text(VGfloat, VGfloat, char *, Fontinfo, int);
 extern void TextMid(VGfloat, VGfloat, char *, Fontinfo, int);
@@ -75,10 +84,113 @@ extern void FillRadialGradient(VGfloat, VGfloat, VGfloat, VGfloat, VGfloat, VGfl
 
 // Images
 extern VGImage createImageFromJpeg(const char *filename);
+extern VGubyte *decodeJpegToFit(const char *filename, unsigned, unsigned, unsigned *, unsigned *, VGImageFormat *);
+extern VGImage createImageFromRaster(VGubyte *, VGImageFormat, unsigned *, unsigned *);
+extern void SetRgb565Images(int);
+extern void SetDecodeCancel(volatile int *);
+extern int DecodeCancelled();
+extern void SetRasterAllocator(void *(*)(size_t), void (*)(void *));
+// reads up to size bytes into buf, returns the count, 0 at the end or -1
+typedef long (*ImageReadFunc)(void *context, void *buf, size_t size);
+extern VGubyte *decodeJpegStreamToFit(ImageReadFunc, void *, const char *, unsigned, unsigned, unsigned *, unsigned *,
+				      VGImageFormat *);
+extern VGubyte *decodeJpegStreamScaled(ImageReadFunc, void *, const char *, unsigned, unsigned, unsigned *, unsigned *,
+				       VGImageFormat *);
 extern void makeimage(VGfloat, VGfloat, int, int, VGubyte *);
 extern void ImageToScreenWithoutTransform(VGfloat, VGfloat, int, int, char *);
+extern void DrawImageOpacity(VGImage, VGfloat);
+
+// Tiled images, for images larger than the GPU allows in one
+typedef struct {
+	int width, height;		// of the whole image
+	int columns, rows;
+	int stepX, stepY;		// distance between tile origins
+	VGImageFormat format;
+	VGImage *tiles;			// bottom row first
+} TiledImage;
+extern TiledImage *createTiledImage(VGImageFormat, int, int);
+extern void tiledImageSubData(TiledImage *, const void *, VGint, int, int);
+extern TiledImage *createTiledImageFromRaster(VGubyte *, VGImageFormat, unsigned *, unsigned *);
+extern TiledImage *createTiledImageFromJpeg(const char *);
+extern void drawTiledImage(TiledImage *, VGfloat);
+extern void releaseTiledImage(TiledImage *);
+extern void PrintTileStats();
+
+// Image atlases, many small images packed into a few large ones
+#define MAX_ATLAS_PAGES 4
+#define MAX_ATLAS_IMAGES 64
+typedef struct {
+	VGImageFormat format;
+	int width, height;		// of each page
+	int pageCount, imageCount;
+	VGImage pages[MAX_ATLAS_PAGES];
+	VGImage images[MAX_ATLAS_IMAGES];	// children of the pages
+	int shelfX, shelfY, shelfHeight;	// packing in the last page
+} ImageAtlas;
+extern ImageAtlas *createImageAtlas(VGImageFormat, int, int);
+extern VGImage atlasImageFromRaster(ImageAtlas *, const VGubyte *, VGint, int, int);
+extern void releaseImageAtlas(ImageAtlas *);
+extern void PrintAtlasStats();
+
+// Image memory budget
+extern void SetImageBudget(size_t);
+extern size_t ImageBudget();
+extern size_t ImageBytes(VGImageFormat, int, int);
+extern VGImage AcquireImage(VGImageFormat, int, int);
+extern void ReleaseImage(VGImage);
+extern void FlushImagePool();
+extern size_t IdleImageBytes();
+extern void TrimImagePool(size_t);
+extern void PrintImagePoolStats();
+
+// Colour management, embedded ICC profiles to sRGB
+typedef struct ColorLut ColorLut;
+extern ColorLut *AcquireColorLut(const unsigned char *, size_t);
+extern void ReleaseColorLut(ColorLut *);
+extern void ExpandColorLut(const ColorLut *, const unsigned char *, VGubyte *, unsigned);
+extern void PrintColorStats();
 
 // Rendering Buffer setup
 extern void Start(int, int);
+extern void StartClear(int, int, unsigned int, unsigned int, unsigned int);
+extern void SwapInterval(int);
+extern void ScissorRect(VGint, VGint, VGint, VGint);
+extern void NoScissor();
 extern void End();
 extern void SaveEnd(char *);
+
+// Screen capture
+#define CAPTURE_RAW 0
+#define CAPTURE_PPM 1
+#define CAPTURE_PNG 2
+#define CAPTURE_JPEG 3
+
+extern void InitCapture(const char *, int, double);
+extern int CaptureScreen();
+extern double LatestCapture(char *, int);
+extern void PrintCaptureStats();
+extern void FinishCapture();
+
+// Stage timing and counters
+enum { STAGE_OPEN, STAGE_HEADER, STAGE_DECODE, STAGE_CONVERT, STAGE_UPLOAD, STAGE_DRAW, STAGE_SWAP,
+	STAGE_DECODER, STAGE_COUNT };
+enum { COUNTER_BYTES_READ, COUNTER_PIXELS_DECODED, COUNTER_POOL_REUSES, COUNTER_POOL_MISSES,
+	COUNTER_SLIDE_CACHE_HITS, COUNTER_SLIDE_CACHE_MISSES, COUNTER_COLOR_LUT_HITS, COUNTER_COLOR_LUT_BUILDS,
+	COUNTER_HTTP_NOT_MODIFIED, COUNTER_COUNT };
+
+extern uint64_t StageBegin();
+extern void StageEnd(int, uint64_t);
+extern void StageRecord(int, uint64_t);
+extern void CountStat(int, uint64_t);
+extern uint64_t GetCountStat(int);
+extern void InitStats(const char *, const char *, double);
+extern void PrintStageStats();
+
+typedef struct {
+	uint64_t count;
+	double mean_ms, p50_ms, p99_ms, max_ms;
+} StageSummary;
+
+extern void GetStageStats(int, StageSummary *);
+extern void ResetStageStats();
+extern void FinishStats();
@@ -0,0 +1,122 @@
+// Image atlases.
+//
+// Many small images each in their own VGImage cost a GPU allocation and
+// an upload apiece, and images the pool has no same-sized match for are
+// created and destroyed every time.  An ImageAtlas packs small images
+// into a few large pages instead, on shelves: rows as tall as the first
+// image placed in them, filled left to right, then the next row above.
+// Each packed image is a child image of its page, drawn like any other
+// VGImage with its own transform, so a set of them costs one upload per
+// image into pages that come from the pool, all the same size, and are
+// reused from one set to the next.
+//
+// Packing images tallest first keeps the shelves full.  Images are kept
+// ATLAS_PADDING pixels apart so filtering at one's edge never reaches its
+// neighbour's pixels.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "vgwrap.h"
+
+#define ATLAS_PADDING 2
+
+static long atlases_created, atlas_pages, atlas_images;
+static double atlas_used_pixels, atlas_page_pixels;
+
+
+// createImageAtlas makes an empty atlas of format images, with pages of
+// width x height or the largest image the GPU allows if smaller
+ImageAtlas *createImageAtlas(VGImageFormat format, int width, int height) {
+	ImageAtlas *a = calloc(1, sizeof(ImageAtlas));
+	if (a == NULL) {
+		return NULL;
+	}
+	a->format = format;
+	a->width = width < vgGeti(VG_MAX_IMAGE_WIDTH) ? width : vgGeti(VG_MAX_IMAGE_WIDTH);
+	a->height = height < vgGeti(VG_MAX_IMAGE_HEIGHT) ? height : vgGeti(VG_MAX_IMAGE_HEIGHT);
+	if ((size_t) a->width * a->height > (size_t) vgGeti(VG_MAX_IMAGE_PIXELS)) {
+		a->height = vgGeti(VG_MAX_IMAGE_PIXELS) / a->width;
+	}
+	atlases_created++;
+	return a;
+}
+
+// find room for a width x height image, on the current shelf, a new one
+// above it, or a new page.  Returns 0 if there is none.
+static int place(ImageAtlas *a, int width, int height, int *x, int *y) {
+	if (width > a->width || height > a->height) {
+		return 0;
+	}
+	if (a->pageCount > 0 && a->shelfX + width > a->width) {
+		a->shelfY += a->shelfHeight + ATLAS_PADDING;
+		a->shelfX = 0;
+		a->shelfHeight = 0;
+	}
+	if (a->pageCount == 0 || a->shelfY + height > a->height) {
+		if (a->pageCount == MAX_ATLAS_PAGES) {
+			return 0;
+		}
+		VGImage page = AcquireImage(a->format, a->width, a->height);
+		if (page == VG_INVALID_HANDLE) {
+			return 0;
+		}
+		a->pages[a->pageCount++] = page;
+		a->shelfX = a->shelfY = a->shelfHeight = 0;
+		atlas_pages++;
+		atlas_page_pixels += (double) a->width * a->height;
+	}
+	*x = a->shelfX;
+	*y = a->shelfY;
+	a->shelfX += width + ATLAS_PADDING;
+	if (height > a->shelfHeight) {
+		a->shelfHeight = height;
+	}
+	return 1;
+}
+
+// atlasImageFromRaster packs a raster in the atlas's format, bottom row
+// first and stride bytes a row, into the atlas.  Returns its image, which
+// belongs to the atlas, or VG_INVALID_HANDLE if there is no room.
+VGImage atlasImageFromRaster(ImageAtlas *a, const VGubyte *data, VGint stride, int width, int height) {
+	int x, y;
+	if (a->imageCount == MAX_ATLAS_IMAGES || !place(a, width, height, &x, &y)) {
+		return VG_INVALID_HANDLE;
+	}
+	VGImage page = a->pages[a->pageCount - 1];
+	vgImageSubData(page, data, stride, a->format, x, y, width, height);
+	VGImage image = vgChildImage(page, x, y, width, height);
+	if (image == VG_INVALID_HANDLE) {
+		printf("Failed making a %dx%d atlas image\n", width, height);
+		return image;
+	}
+	a->images[a->imageCount++] = image;
+	atlas_images++;
+	atlas_used_pixels += (double) width * height;
+	return image;
+}
+
+// releaseImageAtlas destroys an atlas's images and gives its pages back
+// to the pool
+void releaseImageAtlas(ImageAtlas *a) {
+	int i;
+	if (a == NULL) {
+		return;
+	}
+	for (i = 0; i < a->imageCount; i++) {
+		vgDestroyImage(a->images[i]);
+	}
+	for (i = 0; i < a->pageCount; i++) {
+		ReleaseImage(a->pages[i]);
+	}
+	free(a);
+}
+
+void PrintAtlasStats() {
+	if (atlases_created > 0) {
+		printf("atlases: %ld made, %ld pages, %ld images, pages %.0f%% filled\n",
+		       atlases_created, atlas_pages, atlas_images,
+		       atlas_page_pixels > 0.0 ? 100.0 * atlas_used_pixels / atlas_page_pixels : 0.0);
+	}
+}
@@ -0,0 +1,402 @@
+// Asynchronous screen capture.
+//
+// The render thread only reads the surface back into one of a small pool
+// of buffers.  Encoding and writing happen on a worker thread, so taking
+// a capture costs a vgReadPixels and nothing else.  Captures are written
+// to a temporary file and renamed into place, so readers of the latest
+// capture never see a partial file.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <jpeglib.h>
+#include <png.h>
+#include <zlib.h>
+
+#include "vgwrap.h"
+#include "eglstate.h"
+
+extern STATE_T * state;	// global graphics state
+
+#define CAPTURE_BUFFERS 2
+#define CAPTURE_PATH_MAX 512
+
+typedef struct {
+	void *pixels;			// RGBA, bottom row first
+	int width, height;
+	int format;
+	char path[CAPTURE_PATH_MAX];	// where to write, "" for stdout
+	int queued;			// waiting for or being written
+	long sequence;			// jobs are written in queue order
+} CaptureJob;
+
+static CaptureJob jobs[CAPTURE_BUFFERS];
+static int capture_started = 0;
+static int capture_stopping = 0;
+static pthread_t capture_thread;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t capture_wake = PTHREAD_COND_INITIALIZER;
+
+static char capture_dir[CAPTURE_PATH_MAX - 32];	// room for the file name
+static int capture_format;
+static double capture_interval_ms;
+static double last_capture_ms = -1.0;
+
+static char latest_path[CAPTURE_PATH_MAX];
+static double latest_time_ms;
+static long captures_written, captures_skipped, captures_failed;
+static long next_sequence;
+
+static const char *capture_extensions[] = { "raw", "ppm", "png", "jpg" };
+
+
+// write_raw writes the raster as it comes from vgReadPixels, the format
+// SaveEnd has always produced
+static int write_raw(CaptureJob *job, FILE *fp)
+{
+	size_t n = (size_t) job->width * job->height * 4;
+	return fwrite(job->pixels, 1, n, fp) == n ? 0 : -1;
+}
+
+// top_row returns a row of the image counting from the top
+static unsigned char *top_row(CaptureJob *job, int y)
+{
+	return (unsigned char *) job->pixels + (size_t) (job->height - 1 - y) * job->width * 4;
+}
+
+static void rgba_to_rgb(const unsigned char *src, unsigned char *dst, int n)
+{
+	while (n--) {
+		dst[0] = src[0];
+		dst[1] = src[1];
+		dst[2] = src[2];
+		src += 4;
+		dst += 3;
+	}
+}
+
+static int write_ppm(CaptureJob *job, FILE *fp)
+{
+	unsigned char *rgb = malloc(job->width * 3);
+	int y, result = 0;
+	fprintf(fp, "P6\n%d %d\n255\n", job->width, job->height);
+	for (y = 0; y < job->height && result == 0; y++) {
+		rgba_to_rgb(top_row(job, y), rgb, job->width);
+		if (fwrite(rgb, 3, job->width, fp) != (size_t) job->width) {
+			result = -1;
+		}
+	}
+	free(rgb);
+	return result;
+}
+
+static int write_png(CaptureJob *job, FILE *fp)
+{
+	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop info = png ? png_create_info_struct(png) : NULL;
+	unsigned char *rgb = malloc(job->width * 3);
+	int y;
+
+	if (info == NULL || setjmp(png_jmpbuf(png))) {
+		png_destroy_write_struct(&png, &info);
+		free(rgb);
+		return -1;
+	}
+	png_init_io(png, fp);
+	// fastest zlib level, the sub filter is nearly free and helps photos
+	png_set_compression_level(png, Z_BEST_SPEED);
+	png_set_filter(png, 0, PNG_FILTER_SUB);
+	png_set_IHDR(png, info, job->width, job->height, 8, PNG_COLOR_TYPE_RGB,
+		     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(png, info);
+	for (y = 0; y < job->height; y++) {
+		rgba_to_rgb(top_row(job, y), rgb, job->width);
+		png_write_row(png, rgb);
+	}
+	png_write_end(png, info);
+	png_destroy_write_struct(&png, &info);
+	free(rgb);
+	return 0;
+}
+
+// CaptureError returns from a failed encode, such as a write to a full
+// disk, instead of exiting, which is libjpeg's default
+typedef struct {
+	struct jpeg_error_mgr pub;
+	jmp_buf jump;
+} CaptureError;
+
+static void capture_error_exit(j_common_ptr cinfo) {
+	(*cinfo->err->output_message) (cinfo);
+	longjmp(((CaptureError *) cinfo->err)->jump, 1);
+}
+
+static int write_jpeg(CaptureJob *job, FILE *fp)
+{
+	struct jpeg_compress_struct jc;
+	CaptureError jerr;
+	JSAMPROW row;
+	int y;
+#ifndef JCS_EXTENSIONS
+	unsigned char *rgb = malloc(job->width * 3);
+#endif
+
+	jc.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = capture_error_exit;
+	if (setjmp(jerr.jump)) {
+		jpeg_destroy_compress(&jc);
+#ifndef JCS_EXTENSIONS
+		free(rgb);
+#endif
+		return -1;
+	}
+	jpeg_create_compress(&jc);
+	jpeg_stdio_dest(&jc, fp);
+	jc.image_width = job->width;
+	jc.image_height = job->height;
+#ifdef JCS_EXTENSIONS
+	// libjpeg-turbo reads the RGBA rows directly
+	jc.input_components = 4;
+	jc.in_color_space = JCS_EXT_RGBX;
+#else
+	jc.input_components = 3;
+	jc.in_color_space = JCS_RGB;
+#endif
+	jpeg_set_defaults(&jc);
+	jpeg_set_quality(&jc, 85, TRUE);
+	jc.dct_method = JDCT_IFAST;
+	jpeg_start_compress(&jc, TRUE);
+	for (y = 0; y < job->height; y++) {
+#ifdef JCS_EXTENSIONS
+		row = top_row(job, y);
+#else
+		rgba_to_rgb(top_row(job, y), rgb, job->width);
+		row = rgb;
+#endif
+		jpeg_write_scanlines(&jc, &row, 1);
+	}
+	jpeg_finish_compress(&jc);
+	jpeg_destroy_compress(&jc);
+#ifndef JCS_EXTENSIONS
+	free(rgb);
+#endif
+	return 0;
+}
+
+static int encode(CaptureJob *job, FILE *fp)
+{
+	switch (job->format) {
+	case CAPTURE_PPM:
+		return write_ppm(job, fp);
+	case CAPTURE_PNG:
+		return write_png(job, fp);
+	case CAPTURE_JPEG:
+		return write_jpeg(job, fp);
+	default:
+		return write_raw(job, fp);
+	}
+}
+
+// write_job encodes a capture to its destination.  Files are written
+// beside their final name and renamed over it once complete.
+static void write_job(CaptureJob *job)
+{
+	if (job->path[0] == '\0') {
+		encode(job, stdout);
+		fflush(stdout);
+		return;
+	}
+
+	char tmp[CAPTURE_PATH_MAX + 8];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", job->path);
+	FILE *fp = fopen(tmp, "wb");
+	if (fp == NULL) {
+		printf("Failed opening '%s' for writing!\n", tmp);
+		return;
+	}
+	int result = encode(job, fp);
+	if (fclose(fp) != 0 || result != 0 || rename(tmp, job->path) != 0) {
+		printf("Failed writing capture '%s'\n", job->path);
+		remove(tmp);
+		pthread_mutex_lock(&capture_lock);
+		captures_failed++;
+		pthread_mutex_unlock(&capture_lock);
+		return;
+	}
+
+	pthread_mutex_lock(&capture_lock);
+	strcpy(latest_path, job->path);
+	latest_time_ms = vgwrap_now_ms();
+	captures_written++;
+	pthread_mutex_unlock(&capture_lock);
+}
+
+static void *capture_worker(void *arg)
+{
+	int i;
+	pthread_mutex_lock(&capture_lock);
+	for (;;) {
+		CaptureJob *job = NULL;
+		for (i = 0; i < CAPTURE_BUFFERS; i++) {
+			if (jobs[i].queued && (job == NULL || jobs[i].sequence < job->sequence)) {
+				job = jobs + i;
+			}
+		}
+		if (job == NULL) {
+			if (capture_stopping) {
+				break;
+			}
+			pthread_cond_wait(&capture_wake, &capture_lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&capture_lock);
+		write_job(job);
+		pthread_mutex_lock(&capture_lock);
+		job->queued = 0;
+		pthread_cond_broadcast(&capture_wake);
+	}
+	pthread_mutex_unlock(&capture_lock);
+	return NULL;
+}
+
+static void start_worker()
+{
+	if (!capture_started) {
+		capture_stopping = 0;
+		pthread_create(&capture_thread, NULL, capture_worker, NULL);
+		capture_started = 1;
+	}
+}
+
+// queue_capture reads the surface into a free pool buffer and hands it to
+// the worker.  If wait is set it blocks for a buffer, otherwise a busy
+// pool skips the capture.  Returns 1 if a capture was queued.
+static int queue_capture(int format, const char *path, int wait)
+{
+	int w = state->screen_width, h = state->screen_height;
+	CaptureJob *job = NULL;
+	int i;
+
+	start_worker();
+	pthread_mutex_lock(&capture_lock);
+	for (;;) {
+		for (i = 0; i < CAPTURE_BUFFERS; i++) {
+			if (!jobs[i].queued) {
+				job = jobs + i;
+				break;
+			}
+		}
+		if (job || !wait) {
+			break;
+		}
+		pthread_cond_wait(&capture_wake, &capture_lock);
+	}
+	pthread_mutex_unlock(&capture_lock);
+	if (job == NULL) {
+		captures_skipped++;
+		return 0;
+	}
+
+	// the buffer is ours until it is queued
+	if (job->pixels == NULL || job->width != w || job->height != h) {
+		free(job->pixels);
+		job->pixels = malloc((size_t) w * h * 4);
+		job->width = w;
+		job->height = h;
+	}
+	vgReadPixels(job->pixels, w * 4, VG_sABGR_8888, 0, 0, w, h);
+	job->format = format;
+	snprintf(job->path, sizeof(job->path), "%s", path);
+
+	pthread_mutex_lock(&capture_lock);
+	job->queued = 1;
+	job->sequence = next_sequence++;
+	pthread_cond_broadcast(&capture_wake);
+	pthread_mutex_unlock(&capture_lock);
+	return 1;
+}
+
+
+// InitCapture sets where CaptureScreen writes, in which format, and the
+// shortest time allowed between captures
+void InitCapture(const char *directory, int format, double minIntervalMs)
+{
+	snprintf(capture_dir, sizeof(capture_dir), "%s", directory);
+	capture_format = format;
+	capture_interval_ms = minIntervalMs;
+	last_capture_ms = -1.0;
+}
+
+// CaptureScreen snapshots the surface as it is now, which with preserved
+// buffers is also the frame on display after End.  Returns 1 if a capture
+// was queued, 0 if it was rate limited or the encoder is still busy.
+int CaptureScreen()
+{
+	double now = vgwrap_now_ms();
+	if (capture_dir[0] == '\0' ||
+	    (last_capture_ms >= 0.0 && now - last_capture_ms < capture_interval_ms)) {
+		return 0;
+	}
+
+	char path[CAPTURE_PATH_MAX];
+	snprintf(path, sizeof(path), "%s/capture.%s", capture_dir, capture_extensions[capture_format]);
+	if (!queue_capture(capture_format, path, 0)) {
+		return 0;
+	}
+	last_capture_ms = now;
+	return 1;
+}
+
+// LatestCapture copies the path of the newest completed capture into
+// path and returns how many milliseconds ago it was written, or -1 if
+// nothing has been captured yet
+double LatestCapture(char *path, int size)
+{
+	double age = -1.0;
+	pthread_mutex_lock(&capture_lock);
+	if (latest_path[0] != '\0') {
+		snprintf(path, size, "%s", latest_path);
+		age = vgwrap_now_ms() - latest_time_ms;
+	}
+	pthread_mutex_unlock(&capture_lock);
+	return age;
+}
+
+void PrintCaptureStats()
+{
+	printf("captures: %ld written, %ld failed, %ld skipped while encoding\n",
+	       captures_written, captures_failed, captures_skipped);
+}
+
+// FinishCapture writes out anything still queued and stops the worker
+void FinishCapture()
+{
+	int i;
+	if (!capture_started) {
+		return;
+	}
+	pthread_mutex_lock(&capture_lock);
+	capture_stopping = 1;
+	pthread_cond_broadcast(&capture_wake);
+	pthread_mutex_unlock(&capture_lock);
+	pthread_join(capture_thread, NULL);
+	capture_started = 0;
+	for (i = 0; i < CAPTURE_BUFFERS; i++) {
+		free(jobs[i].pixels);
+		jobs[i].pixels = NULL;
+	}
+}
+
+// SaveEnd dumps the raw raster and renders to the display.  The dump is
+// written by the capture worker, an empty filename means stdout.
+void SaveEnd(char *filename) {
+	assert(vgGetError() == VG_NO_ERROR);
+	queue_capture(CAPTURE_RAW, filename, 1);
+	eglSwapBuffers(state->display, state->surface);
+	assert(eglGetError() == EGL_SUCCESS);
+}
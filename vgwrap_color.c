@@ -0,0 +1,434 @@
+// Colour management for decoded images.
+//
+// JPEGs with an embedded ICC profile, Adobe RGB or a phone's Display P3,
+// are converted to sRGB, which is what the display shows.  Converting
+// pixel by pixel through the profile's tone curves and matrices costs
+// powers and a matrix multiply per pixel, so instead the whole transform
+// is sampled once into a 33x33x33 grid and pixels are interpolated
+// between the four grid points of the tetrahedron they fall in.  The grid
+// holds linear light, unclipped, since interpolating across the steep sRGB
+// encoding near black or across the gamut boundary would be visibly off;
+// the result is clipped and encoded through a table.  That
+// is a handful of table reads and integer multiplies, done in the pass
+// that expands the decoder's RGB scanline to RGBA.  Grids are cached by
+// profile, as a slideshow sees the same few profiles over and over.
+//
+// Matrix/TRC RGB profiles are understood, which covers Adobe RGB, Display
+// P3, ProPhoto and sRGB itself.  Images without a profile, with an sRGB
+// profile or with a profile that isn't understood are left alone and pay
+// nothing beyond the profile check.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "vgwrap.h"
+
+#define GRID 33
+#define MAX_LUTS 4
+
+struct ColorLut {
+	uint64_t key;		// hash of the profile
+	int refs;		// users, the cache's own reference included
+	unsigned long lastUse;
+	// output for each grid point, linear RGB with 1.0 at 16384, not yet
+	// clipped to the sRGB gamut
+	int16_t table[GRID * GRID * GRID * 3];
+};
+
+static pthread_mutex_t lut_lock = PTHREAD_MUTEX_INITIALIZER;
+static ColorLut *luts[MAX_LUTS];
+static unsigned long lut_clock;
+static long lut_builds, lut_hits, srgb_profiles, unsupported_profiles;
+
+// grid cell and 8 bit weight (0 to 256) for each input value
+static uint8_t grid_index[256];
+static uint16_t grid_weight[256];
+// sRGB encoding of linear light, indexed by 12 bits
+#define ENCODE_BITS 12
+static uint8_t encode_table[(1 << ENCODE_BITS) + 1];
+static pthread_once_t grid_once = PTHREAD_ONCE_INIT;
+
+// sRGB's primaries adapted to the D50 profile connection space, as in
+// the ICC's own sRGB profile
+static const double srgb_to_xyz[3][3] = {
+	{0.4361, 0.3851, 0.1431},
+	{0.2225, 0.7169, 0.0606},
+	{0.0139, 0.0971, 0.7141}
+};
+
+// a profile's tone curve, from its curv or para tag
+typedef struct {
+	int type;		// -1 table, else the para function type
+	double params[7];
+	const uint8_t *table;
+	unsigned entries;
+} ToneCurve;
+
+typedef struct {
+	double to_xyz[3][3];
+	ToneCurve trc[3];
+} RgbProfile;
+
+
+static uint32_t be32(const uint8_t *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static uint16_t be16(const uint8_t *p) {
+	return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static double s15fixed16(const uint8_t *p) {
+	return (int32_t) be32(p) / 65536.0;
+}
+
+// find_tag returns a tag's data, checked to lie inside the profile
+static const uint8_t *find_tag(const uint8_t *icc, size_t length, const char *sig, uint32_t *size) {
+	uint32_t count = be32(icc + 128), i;
+	for (i = 0; i < count && 132 + i * 12 + 12 <= length; i++) {
+		const uint8_t *tag = icc + 132 + i * 12;
+		uint32_t offset = be32(tag + 4);
+		*size = be32(tag + 8);
+		if (memcmp(tag, sig, 4) == 0 && offset < length && *size <= length - offset && *size >= 12) {
+			return icc + offset;
+		}
+	}
+	return NULL;
+}
+
+static int read_curve(const uint8_t *tag, uint32_t size, ToneCurve *curve) {
+	static const int para_count[5] = { 1, 3, 4, 5, 7 };
+	int i;
+	if (memcmp(tag, "curv", 4) == 0) {
+		uint32_t entries = be32(tag + 8);
+		if (12 + (uint64_t) entries * 2 > size) {
+			return -1;
+		}
+		if (entries <= 1) {
+			// identity, or a plain gamma in u8Fixed8
+			curve->type = 0;
+			curve->params[0] = entries ? be16(tag + 12) / 256.0 : 1.0;
+			return 0;
+		}
+		curve->type = -1;
+		curve->table = tag + 12;
+		curve->entries = entries;
+		return 0;
+	}
+	if (memcmp(tag, "para", 4) == 0) {
+		curve->type = be16(tag + 8);
+		if (curve->type > 4 || 12 + para_count[curve->type] * 4 > size) {
+			return -1;
+		}
+		for (i = 0; i < para_count[curve->type]; i++) {
+			curve->params[i] = s15fixed16(tag + 12 + i * 4);
+		}
+		return 0;
+	}
+	return -1;
+}
+
+// eval_curve maps an encoded value from 0 to 1 to linear light
+static double eval_curve(const ToneCurve *curve, double x) {
+	const double *p = curve->params;
+	double y;
+	switch (curve->type) {
+	case -1: {
+		double pos = x * (curve->entries - 1);
+		unsigned i = (unsigned) pos;
+		if (i >= curve->entries - 1) {
+			return be16(curve->table + (curve->entries - 1) * 2) / 65535.0;
+		}
+		double a = be16(curve->table + i * 2), b = be16(curve->table + i * 2 + 2);
+		return (a + (b - a) * (pos - i)) / 65535.0;
+	}
+	case 0:
+		y = pow(x, p[0]);
+		break;
+	case 1:
+		y = x >= -p[2] / p[1] ? pow(p[1] * x + p[2], p[0]) : 0.0;
+		break;
+	case 2:
+		y = x >= -p[2] / p[1] ? pow(p[1] * x + p[2], p[0]) + p[3] : p[3];
+		break;
+	case 3:
+		y = x >= p[4] ? pow(p[1] * x + p[2], p[0]) : p[3] * x;
+		break;
+	default:
+		y = x >= p[4] ? pow(p[1] * x + p[2], p[0]) + p[5] : p[3] * x + p[6];
+		break;
+	}
+	return y < 0.0 ? 0.0 : y > 1.0 ? 1.0 : y;
+}
+
+static double srgb_decode(double v) {
+	return v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+}
+
+static double srgb_encode(double v) {
+	v = v < 0.0 ? 0.0 : v > 1.0 ? 1.0 : v;
+	return v <= 0.0031308 ? v * 12.92 : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+}
+
+static void init_grid() {
+	int v;
+	for (v = 0; v <= 1 << ENCODE_BITS; v++) {
+		encode_table[v] = (uint8_t) (srgb_encode(v / (double) (1 << ENCODE_BITS)) * 255.0 + 0.5);
+	}
+	for (v = 0; v < 256; v++) {
+		int pos = (v * (GRID - 1) * 256 + 127) / 255;
+		grid_index[v] = pos >> 8;
+		grid_weight[v] = pos & 255;
+		if (grid_index[v] == GRID - 1) {
+			grid_index[v] = GRID - 2;
+			grid_weight[v] = 256;
+		}
+	}
+}
+
+// parse_profile reads an RGB matrix/TRC profile.  Returns 0 if it is one.
+static int parse_profile(const uint8_t *icc, size_t length, RgbProfile *profile) {
+	static const char *xyz_tags[3] = { "rXYZ", "gXYZ", "bXYZ" };
+	static const char *trc_tags[3] = { "rTRC", "gTRC", "bTRC" };
+	uint32_t size;
+	int c, i;
+
+	if (length < 132 || be32(icc) > length || memcmp(icc + 16, "RGB ", 4) != 0 ||
+	    memcmp(icc + 20, "XYZ ", 4) != 0) {
+		return -1;
+	}
+	for (c = 0; c < 3; c++) {
+		const uint8_t *tag = find_tag(icc, length, xyz_tags[c], &size);
+		if (tag == NULL || memcmp(tag, "XYZ ", 4) != 0 || size < 20) {
+			return -1;
+		}
+		for (i = 0; i < 3; i++) {
+			profile->to_xyz[i][c] = s15fixed16(tag + 8 + i * 4);
+		}
+		tag = find_tag(icc, length, trc_tags[c], &size);
+		if (tag == NULL || read_curve(tag, size, &profile->trc[c]) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// is_srgb tells whether a profile is sRGB, near enough that converting
+// would change no pixel
+static int is_srgb(const RgbProfile *profile) {
+	int c, i, v;
+	for (c = 0; c < 3; c++) {
+		for (i = 0; i < 3; i++) {
+			if (fabs(profile->to_xyz[i][c] - srgb_to_xyz[i][c]) > 0.002) {
+				return 0;
+			}
+		}
+		for (v = 0; v <= 255; v += 15) {
+			if (fabs(eval_curve(&profile->trc[c], v / 255.0) - srgb_decode(v / 255.0)) > 0.5 / 255.0) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+static void invert3(const double m[3][3], double inv[3][3]) {
+	double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+	    - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+	    + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	int i, j;
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+			int i1 = (j + 1) % 3, i2 = (j + 2) % 3, j1 = (i + 1) % 3, j2 = (i + 2) % 3;
+			inv[i][j] = (m[i1][j1] * m[i2][j2] - m[i1][j2] * m[i2][j1]) / det;
+		}
+	}
+}
+
+// build_lut samples profile to sRGB at every grid point
+static ColorLut *build_lut(const RgbProfile *profile, uint64_t key) {
+	ColorLut *lut = malloc(sizeof(ColorLut));
+	double from_xyz[3][3], m[3][3], linear[3][GRID];
+	int r, g, b, i, j, k;
+
+	if (lut == NULL) {
+		return NULL;
+	}
+	lut->key = key;
+	lut->refs = 1;
+	// profile RGB to XYZ to linear sRGB, in one matrix
+	invert3(srgb_to_xyz, from_xyz);
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+			m[i][j] = 0.0;
+			for (k = 0; k < 3; k++) {
+				m[i][j] += from_xyz[i][k] * profile->to_xyz[k][j];
+			}
+		}
+	}
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < GRID; j++) {
+			linear[i][j] = eval_curve(&profile->trc[i], j / (double) (GRID - 1));
+		}
+	}
+	int16_t *out = lut->table;
+	for (r = 0; r < GRID; r++) {
+		for (g = 0; g < GRID; g++) {
+			for (b = 0; b < GRID; b++) {
+				for (i = 0; i < 3; i++) {
+					double v = m[i][0] * linear[0][r] + m[i][1] * linear[1][g] + m[i][2] * linear[2][b];
+					v = v < -1.99 ? -1.99 : v > 1.99 ? 1.99 : v;
+					*out++ = (int16_t) lrint(v * 16384.0);
+				}
+			}
+		}
+	}
+	return lut;
+}
+
+static uint64_t hash_profile(const unsigned char *icc, size_t length) {
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+	for (i = 0; i < length; i++) {
+		hash = (hash ^ icc[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+
+// AcquireColorLut returns the transform from an embedded ICC profile to
+// sRGB, or NULL if pixels should be left as they are.  Release it with
+// ReleaseColorLut.
+ColorLut *AcquireColorLut(const unsigned char *icc, size_t length) {
+	RgbProfile profile;
+	ColorLut *lut = NULL;
+	int i, victim = 0;
+
+	pthread_once(&grid_once, init_grid);
+	uint64_t key = hash_profile(icc, length);
+	pthread_mutex_lock(&lut_lock);
+	for (i = 0; i < MAX_LUTS; i++) {
+		if (luts[i] && luts[i]->key == key) {
+			lut = luts[i];
+			lut->refs++;
+			lut->lastUse = ++lut_clock;
+			lut_hits++;
+			pthread_mutex_unlock(&lut_lock);
+			CountStat(COUNTER_COLOR_LUT_HITS, 1);
+			return lut;
+		}
+	}
+	pthread_mutex_unlock(&lut_lock);
+
+	if (parse_profile(icc, length, &profile) != 0) {
+		pthread_mutex_lock(&lut_lock);
+		unsupported_profiles++;
+		pthread_mutex_unlock(&lut_lock);
+		return NULL;
+	}
+	if (is_srgb(&profile)) {
+		pthread_mutex_lock(&lut_lock);
+		srgb_profiles++;
+		pthread_mutex_unlock(&lut_lock);
+		return NULL;
+	}
+	lut = build_lut(&profile, key);
+	if (lut == NULL) {
+		return NULL;
+	}
+
+	// cache it in place of the least recently used, unless another
+	// thread got there first
+	CountStat(COUNTER_COLOR_LUT_BUILDS, 1);
+	pthread_mutex_lock(&lut_lock);
+	lut_builds++;
+	for (i = 0; i < MAX_LUTS; i++) {
+		if (luts[i] == NULL) {
+			victim = i;
+			break;
+		}
+		if (luts[i]->lastUse < luts[victim]->lastUse) {
+			victim = i;
+		}
+	}
+	if (luts[victim] && --luts[victim]->refs == 0) {
+		free(luts[victim]);
+	}
+	luts[victim] = lut;
+	lut->refs++;
+	lut->lastUse = ++lut_clock;
+	pthread_mutex_unlock(&lut_lock);
+	return lut;
+}
+
+void ReleaseColorLut(ColorLut *lut) {
+	if (lut == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&lut_lock);
+	if (--lut->refs == 0) {
+		free(lut);
+	}
+	pthread_mutex_unlock(&lut_lock);
+}
+
+// the tetrahedra of a grid cell, by which of the fractional positions
+// r > g, g > b and r > b: offsets of the second and third corners from
+// the first, and the positions, largest first, weighting the corners
+#define SR (GRID * GRID * 3)
+#define SG (GRID * 3)
+#define SB 3
+static const struct {
+	int a, b;
+	uint8_t w1, w2, w3;
+} tetrahedra[8] = {
+	{SB, SG + SB, 2, 1, 0},	// b >= g >= r
+	{SB, SG + SB, 2, 1, 0},	// can't happen
+	{SG, SG + SB, 1, 2, 0},	// g > b >= r
+	{SG, SR + SG, 1, 0, 2},	// g >= r > b
+	{SB, SR + SB, 2, 0, 1},	// b >= r > g
+	{SR, SR + SB, 0, 2, 1},	// r > b >= g
+	{SR, SR + SG, 0, 1, 2},	// can't happen
+	{SR, SR + SG, 0, 1, 2},	// r > g > b
+};
+
+// ExpandColorLut converts a scanline of RGB to sRGB and expands it to
+// RGBA.  Each pixel is interpolated between four corners of its grid
+// cell, chosen by the order of its fractional positions.  The choice is
+// looked up rather than branched on, as neighbouring pixels in a photo
+// fall in different tetrahedra about as often as not.
+void ExpandColorLut(const ColorLut *lut, const unsigned char *rgb, VGubyte *rgba, unsigned width) {
+	unsigned x;
+	int c;
+
+	for (x = 0; x < width; x++, rgb += 3, rgba += 4) {
+		int f[3] = { grid_weight[rgb[0]], grid_weight[rgb[1]], grid_weight[rgb[2]] };
+		int t = (f[0] > f[1]) << 2 | (f[1] > f[2]) << 1 | (f[0] > f[2]);
+		const int16_t *c000 = lut->table + grid_index[rgb[0]] * SR + grid_index[rgb[1]] * SG +
+		    grid_index[rgb[2]] * SB;
+		const int16_t *a = c000 + tetrahedra[t].a, *b = c000 + tetrahedra[t].b;
+		const int16_t *c111 = c000 + SR + SG + SB;
+		int w1 = f[tetrahedra[t].w1], w2 = f[tetrahedra[t].w2], w3 = f[tetrahedra[t].w3];
+		// weights are out of 256, so this is linear light with 1.0 at
+		// 1 << 22, clipped only now
+		for (c = 0; c < 3; c++) {
+			int v = c000[c] * 256 + w1 * (a[c] - c000[c]) + w2 * (b[c] - a[c]) + w3 * (c111[c] - b[c]);
+			v = v < 0 ? 0 : v > 1 << 22 ? 1 << 22 : v;
+			rgba[c] = encode_table[(v + (1 << (21 - ENCODE_BITS))) >> (22 - ENCODE_BITS)];
+		}
+		rgba[3] = 255;
+	}
+}
+
+void PrintColorStats() {
+	pthread_mutex_lock(&lut_lock);
+	if (lut_builds + lut_hits + srgb_profiles + unsupported_profiles > 0) {
+		printf("color: %ld profiles converted (%ld tables built), %ld sRGB, %ld not understood\n",
+		       lut_builds + lut_hits, lut_builds, srgb_profiles, unsupported_profiles);
+	}
+	pthread_mutex_unlock(&lut_lock);
+}
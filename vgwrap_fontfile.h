@@ -0,0 +1,38 @@
+// Binary font file layout written by "font2openvg -b" and mapped by
+// load_font_file().  Everything is little endian and every section starts
+// on a 4 byte boundary, so the loader can hand the mapped instruction and
+// coordinate arrays straight to vgAppendPathData.
+
+#include <stdint.h>
+
+#define VGWRAP_FONTFILE_MAGIC 0x31464756u	// "VGF1"
+#define VGWRAP_FONTFILE_EMPTY_SLOT 0xffffffffu
+
+typedef struct {
+	uint32_t magic;
+	uint32_t fileSize;
+	uint32_t glyphCount;
+	float pointScale;		// int16 coordinate * pointScale = em units
+
+	// per glyph tables, int32[glyphCount] each
+	uint32_t instructionIndicesOffset;
+	uint32_t instructionCountsOffset;
+	uint32_t pointIndicesOffset;	// in x,y pairs
+	uint32_t advancesOffset;	// 16.16 fixed point
+
+	// open addressed Unicode map, uint32 codepoint,glyph pairs
+	uint32_t cmapOffset;
+	uint32_t cmapSlots;		// power of two
+
+	// path segment bytes and int16 x,y pairs shared by all glyphs
+	uint32_t instructionsOffset;
+	uint32_t instructionBytes;
+	uint32_t pointsOffset;
+	uint32_t pointCount;
+} VGFontFileHeader;
+
+// first probe slot for a codepoint, callers mask with cmapSlots - 1
+static inline uint32_t vgwrap_fontfile_hash(uint32_t codepoint)
+{
+	return codepoint * 2654435761u;
+}
@@ -2,7 +2,31 @@ typedef struct {
 	const short *CharacterMap;
 	const int *GlyphAdvances;
 	int Count;
-	VGPath Glyphs[256];
+
+	// outline data for every glyph, kept so the paths can be built on
+	// first use instead of when the typeface is registered.  Points are
+	// PointType coordinates, multiplied by PointScale when drawn.
+	const void *Points;
+	VGPathDatatype PointType;
+	VGfloat PointScale;
+	const int *PointIndices;
+	const unsigned char *Instructions;
+	const int *InstructionIndices;
+	const int *InstructionCounts;
+
+	// Count entries, VG_INVALID_HANDLE until the glyph is first drawn.
+	// Shared by every copy of the Fontinfo.
+	VGPath *Glyphs;
+
+	// Unicode map of a font file, codepoint,glyph pairs in
+	// CharacterSlots open addressed slots.  NULL for built in faces,
+	// which use the 256 entry CharacterMap.
+	const unsigned int *CharacterHash;
+	int CharacterSlots;
+
+	// file mapping backing a typeface loaded by load_font_file
+	void *Mapping;
+	size_t MappingLength;
 } Fontinfo;
 
 extern Fontinfo SansTypeface;
@@ -4,54 +4,79 @@
 //
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "vgwrap.h"
+#include "vgwrap_fontfile.h"
 
 #ifdef VGWRAP_INCLUDE_FONTS
 
-static const int MAXFONTPATH = 256;
-
+#ifndef VGWRAP_NO_BUILTIN_FONTS
 #include "fonts/DejaVuSans.inc"	// font data
 #include "fonts/DejaVuSerif.inc"
 #include "fonts/DejaVuSansMono.inc"
+#endif
+
+// where RegisterAllFonts looks for font files when the faces aren't built in
+#ifndef VGWRAP_FONT_DIR
+#define VGWRAP_FONT_DIR "fonts"
+#endif
 
 Fontinfo SansTypeface, SerifTypeface, MonoTypeface;
 
-void LoadAllFonts()
+// number of glyph paths currently held by the GPU, across all typefaces
+static int resident_glyphs = 0;
+
+// RegisterAllFonts makes the standard typefaces available.  No GPU objects
+// are created here, glyph paths are built the first time they are drawn.
+#ifdef VGWRAP_NO_BUILTIN_FONTS
+void RegisterAllFonts()
 {
-  SansTypeface = load_font_from_data(DejaVuSans_glyphPoints,
-				     DejaVuSans_glyphPointIndices,
-				     DejaVuSans_glyphInstructions,
-				     DejaVuSans_glyphInstructionIndices,
-				     DejaVuSans_glyphInstructionCounts,
-				     DejaVuSans_glyphAdvances,
-				     DejaVuSans_characterMap,
-				     DejaVuSans_glyphCount);
-
-  SerifTypeface = load_font_from_data(DejaVuSerif_glyphPoints,
-				      DejaVuSerif_glyphPointIndices,
-				      DejaVuSerif_glyphInstructions,
-				      DejaVuSerif_glyphInstructionIndices,
-				      DejaVuSerif_glyphInstructionCounts,
-				      DejaVuSerif_glyphAdvances,
-				      DejaVuSerif_characterMap,
-				      DejaVuSerif_glyphCount);
-
-  MonoTypeface = load_font_from_data(DejaVuSansMono_glyphPoints,
-				     DejaVuSansMono_glyphPointIndices,
-				     DejaVuSansMono_glyphInstructions,
-				     DejaVuSansMono_glyphInstructionIndices,
-				     DejaVuSansMono_glyphInstructionCounts,
-				     DejaVuSansMono_glyphAdvances,
-				     DejaVuSansMono_characterMap,
-				     DejaVuSansMono_glyphCount);
-}
-
-void UnloadAllFonts()
+  load_font_file(VGWRAP_FONT_DIR "/DejaVuSans.vgf", &SansTypeface);
+  load_font_file(VGWRAP_FONT_DIR "/DejaVuSerif.vgf", &SerifTypeface);
+  load_font_file(VGWRAP_FONT_DIR "/DejaVuSansMono.vgf", &MonoTypeface);
+}
+#else
+void RegisterAllFonts()
+{
+  SansTypeface = register_font_from_data(DejaVuSans_glyphPoints,
+					 DejaVuSans_glyphPointIndices,
+					 DejaVuSans_glyphInstructions,
+					 DejaVuSans_glyphInstructionIndices,
+					 DejaVuSans_glyphInstructionCounts,
+					 DejaVuSans_glyphAdvances,
+					 DejaVuSans_characterMap,
+					 DejaVuSans_glyphCount);
+
+  SerifTypeface = register_font_from_data(DejaVuSerif_glyphPoints,
+					  DejaVuSerif_glyphPointIndices,
+					  DejaVuSerif_glyphInstructions,
+					  DejaVuSerif_glyphInstructionIndices,
+					  DejaVuSerif_glyphInstructionCounts,
+					  DejaVuSerif_glyphAdvances,
+					  DejaVuSerif_characterMap,
+					  DejaVuSerif_glyphCount);
+
+  MonoTypeface = register_font_from_data(DejaVuSansMono_glyphPoints,
+					 DejaVuSansMono_glyphPointIndices,
+					 DejaVuSansMono_glyphInstructions,
+					 DejaVuSansMono_glyphInstructionIndices,
+					 DejaVuSansMono_glyphInstructionCounts,
+					 DejaVuSansMono_glyphAdvances,
+					 DejaVuSansMono_characterMap,
+					 DejaVuSansMono_glyphCount);
+}
+#endif
+
+void UnregisterAllFonts()
 {
-  unload_font(SansTypeface.Glyphs, SansTypeface.Count);
-  unload_font(SerifTypeface.Glyphs, SerifTypeface.Count);
-  unload_font(MonoTypeface.Glyphs, MonoTypeface.Count);
+  unregister_font(&SansTypeface);
+  unregister_font(&SerifTypeface);
+  unregister_font(&MonoTypeface);
 }
 
 
@@ -59,59 +84,289 @@ void UnloadAllFonts()
 // Font functions
 //
 
-// loadfont loads font path data
-// derived from http://web.archive.org/web/20070808195131/http://developer.hybrid.fi/font2openvg/renderFont.cpp.txt
-Fontinfo load_font_from_data(const int *Points,
-			     const int *PointIndices,
-			     const unsigned char *Instructions,
-			     const int *InstructionIndices,
-			     const int *InstructionCounts,
-			     const int *adv, const short *cmap, int ng)
+// register_font_from_data records where a typeface's outline data lives.
+// The returned Fontinfo owns an empty glyph path table.
+Fontinfo register_font_from_data(const int *Points,
+				 const int *PointIndices,
+				 const unsigned char *Instructions,
+				 const int *InstructionIndices,
+				 const int *InstructionCounts,
+				 const int *adv, const short *cmap, int ng)
 {
 	Fontinfo f;
-	int i;
 
-	memset(f.Glyphs, 0, MAXFONTPATH * sizeof(VGPath));
-	if (ng > MAXFONTPATH) {
-		return f;
-	}
-	for (i = 0; i < ng; i++) {
-		const int *p = &Points[PointIndices[i] * 2];
-		const unsigned char *instructions = &Instructions[InstructionIndices[i]];
-		int ic = InstructionCounts[i];
-		VGPath path = vgCreatePath(VG_PATH_FORMAT_STANDARD, VG_PATH_DATATYPE_S_32,
-					   1.0f / 65536.0f, 0.0f, 0, 0,
-					   VG_PATH_CAPABILITY_ALL);
-		f.Glyphs[i] = path;
-		if (ic) {
-			vgAppendPathData(path, ic, instructions, p);
-		}
-	}
+	memset(&f, 0, sizeof(f));
+	f.Points = Points;
+	f.PointType = VG_PATH_DATATYPE_S_32;
+	f.PointScale = 1.0f / 65536.0f;
+	f.PointIndices = PointIndices;
+	f.Instructions = Instructions;
+	f.InstructionIndices = InstructionIndices;
+	f.InstructionCounts = InstructionCounts;
 	f.CharacterMap = cmap;
 	f.GlyphAdvances = adv;
 	f.Count = ng;
+	f.Glyphs = (VGPath *) calloc(ng, sizeof(VGPath));
 	return f;
 }
 
-// unloadfont frees font path data
-void unload_font(VGPath * glyphs, int n) {
-	int i;
+// glyph_path returns the path for a glyph, building it on first use
+// derived from http://web.archive.org/web/20070808195131/http://developer.hybrid.fi/font2openvg/renderFont.cpp.txt
+static VGPath glyph_path(Fontinfo f, int glyph)
+{
+	VGPath path = f.Glyphs[glyph];
+	if (path != VG_INVALID_HANDLE) {
+		return path;
+	}
+
+	int pointSize = f.PointType == VG_PATH_DATATYPE_S_16 ? 2 : 4;
+	const char *p = (const char *) f.Points + f.PointIndices[glyph] * 2 * pointSize;
+	const unsigned char *instructions = &f.Instructions[f.InstructionIndices[glyph]];
+	int ic = f.InstructionCounts[glyph];
+	path = vgCreatePath(VG_PATH_FORMAT_STANDARD, f.PointType,
+			    f.PointScale, 0.0f, 0, 0,
+			    VG_PATH_CAPABILITY_ALL);
+	if (ic) {
+		vgAppendPathData(path, ic, instructions, p);
+	}
+	f.Glyphs[glyph] = path;
+	resident_glyphs++;
+	return path;
+}
+
+// section_fits checks that count elements of size bytes at offset lie
+// inside a mapped file of length bytes, and are 4 byte aligned
+static int section_fits(uint32_t offset, uint32_t count, uint32_t size, size_t length)
+{
+	return (offset & 3) == 0 &&
+		(uint64_t) offset + (uint64_t) count * size <= length;
+}
+
+// load_font_file maps a binary font written by "font2openvg -b" and
+// registers it.  Nothing is copied, glyph paths are built straight from
+// the mapping on first use.  Returns 0 on success; on failure f is left
+// an empty typeface that draws nothing.
+int load_font_file(const char *filename, Fontinfo *f)
+{
+	struct stat st;
+	memset(f, 0, sizeof(*f));
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		printf("Failed opening '%s' for reading!\n", filename);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(VGFontFileHeader)) {
+		printf("'%s' is not a font file\n", filename);
+		close(fd);
+		return -1;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("Failed mapping '%s'\n", filename);
+		return -1;
+	}
+
+	const VGFontFileHeader *h = (const VGFontFileHeader *) map;
+	size_t length = st.st_size;
+	uint32_t n = h->glyphCount;
+	if (h->magic != VGWRAP_FONTFILE_MAGIC || h->fileSize != length ||
+	    h->cmapSlots == 0 || (h->cmapSlots & (h->cmapSlots - 1)) != 0 ||
+	    !section_fits(h->instructionIndicesOffset, n, 4, length) ||
+	    !section_fits(h->instructionCountsOffset, n, 4, length) ||
+	    !section_fits(h->pointIndicesOffset, n, 4, length) ||
+	    !section_fits(h->advancesOffset, n, 4, length) ||
+	    !section_fits(h->cmapOffset, h->cmapSlots, 8, length) ||
+	    !section_fits(h->instructionsOffset, h->instructionBytes, 1, length) ||
+	    !section_fits(h->pointsOffset, h->pointCount, 4, length)) {
+		printf("'%s' is not a valid font file\n", filename);
+		munmap(map, length);
+		return -1;
+	}
+
+	const char *base = (const char *) map;
+	f->Count = n;
+	f->GlyphAdvances = (const int *) (base + h->advancesOffset);
+	f->Points = base + h->pointsOffset;
+	f->PointType = VG_PATH_DATATYPE_S_16;
+	f->PointScale = h->pointScale;
+	f->PointIndices = (const int *) (base + h->pointIndicesOffset);
+	f->Instructions = (const unsigned char *) (base + h->instructionsOffset);
+	f->InstructionIndices = (const int *) (base + h->instructionIndicesOffset);
+	f->InstructionCounts = (const int *) (base + h->instructionCountsOffset);
+	f->CharacterHash = (const unsigned int *) (base + h->cmapOffset);
+	f->CharacterSlots = h->cmapSlots;
+	f->Mapping = map;
+	f->MappingLength = length;
+	f->Glyphs = (VGPath *) calloc(n, sizeof(VGPath));
+
+	// the per glyph tables come from the file, make sure no glyph's
+	// segments or coordinates reach outside it.  font2openvg only emits
+	// absolute moves, lines and quadratics, and closes, anything else
+	// would take a different number of coordinates.
+	uint32_t i, j;
 	for (i = 0; i < n; i++) {
-		vgDestroyPath(glyphs[i]);
+		uint32_t first = f->InstructionIndices[i];
+		uint32_t count = f->InstructionCounts[i];
+		uint64_t points = 0;
+		if ((uint64_t) first + count > h->instructionBytes) {
+			points = UINT64_MAX;
+		} else {
+			for (j = 0; j < count && points != UINT64_MAX; j++) {
+				switch (f->Instructions[first + j]) {
+				case VG_MOVE_TO:
+				case VG_LINE_TO:
+					points += 1;
+					break;
+				case VG_QUAD_TO:
+					points += 2;
+					break;
+				case VG_CLOSE_PATH:
+					break;
+				default:
+					points = UINT64_MAX;
+					break;
+				}
+			}
+		}
+		if (points > h->pointCount || (uint32_t) f->PointIndices[i] > h->pointCount - points) {
+			printf("'%s' has a corrupt glyph table\n", filename);
+			unregister_font(f);
+			return -1;
+		}
+	}
+
+	// every character must map to one of the glyphs, and a lookup of a
+	// character that isn't there has to reach an empty slot
+	uint32_t empty = 0;
+	for (i = 0; i < h->cmapSlots; i++) {
+		const unsigned int *entry = f->CharacterHash + i * 2;
+		if (entry[0] == VGWRAP_FONTFILE_EMPTY_SLOT) {
+			empty++;
+		} else if (entry[1] >= n) {
+			break;
+		}
+	}
+	if (i < h->cmapSlots || empty == 0) {
+		printf("'%s' has a corrupt character map\n", filename);
+		unregister_font(f);
+		return -1;
+	}
+	return 0;
+}
+
+// glyph_index maps a character to a glyph of f, -1 if it has none or f
+// is a typeface that failed to load
+static int glyph_index(Fontinfo f, unsigned int character)
+{
+	if (f.CharacterHash == NULL) {
+		return character < 256 && f.CharacterMap ? f.CharacterMap[character] : -1;
+	}
+
+	unsigned int mask = f.CharacterSlots - 1;
+	unsigned int slot = vgwrap_fontfile_hash(character) & mask;
+	for (;;) {
+		const unsigned int *entry = f.CharacterHash + slot * 2;
+		if (entry[0] == character) {
+			return entry[1];
+		}
+		if (entry[0] == VGWRAP_FONTFILE_EMPTY_SLOT) {
+			return -1;
+		}
+		slot = (slot + 1) & mask;
+	}
+}
+
+// next_character decodes one UTF-8 character and advances *s past it.
+// Bytes that aren't valid UTF-8 are taken as Latin-1.
+static unsigned int next_character(const char **s)
+{
+	const unsigned char *p = (const unsigned char *) *s;
+	unsigned int c = p[0];
+	int extra = 0, i;
+
+	if (c >= 0xf8) {
+		extra = 0;
+	} else if (c >= 0xf0) {
+		extra = 3;
+		c &= 0x07;
+	} else if (c >= 0xe0) {
+		extra = 2;
+		c &= 0x0f;
+	} else if (c >= 0xc0) {
+		extra = 1;
+		c &= 0x1f;
+	}
+	for (i = 1; i <= extra; i++) {
+		if ((p[i] & 0xc0) != 0x80) {
+			*s += 1;
+			return p[0];
+		}
+		c = (c << 6) | (p[i] & 0x3f);
+	}
+	*s += extra + 1;
+	return c;
+}
+
+// preload_font builds every glyph path of a typeface up front, which is
+// what loading a font used to do.  Only worth it for text heavy screens.
+void preload_font(Fontinfo f)
+{
+	int i;
+	for (i = 0; i < f.Count; i++) {
+		glyph_path(f, i);
 	}
 }
 
+// unload_font frees the glyph paths of a typeface.  The typeface stays
+// registered and paths are rebuilt if it is drawn again.
+void unload_font(Fontinfo f)
+{
+	int i;
+	for (i = 0; i < f.Count; i++) {
+		if (f.Glyphs[i] != VG_INVALID_HANDLE) {
+			vgDestroyPath(f.Glyphs[i]);
+			f.Glyphs[i] = VG_INVALID_HANDLE;
+			resident_glyphs--;
+		}
+	}
+}
+
+// unregister_font unloads a typeface and releases its glyph path table
+// and any file mapping
+void unregister_font(Fontinfo *f)
+{
+	if (f->Glyphs == NULL) {
+		return;
+	}
+	unload_font(*f);
+	free(f->Glyphs);
+	f->Glyphs = NULL;
+	f->Count = 0;
+	if (f->Mapping) {
+		// the character map lives in the mapping
+		munmap(f->Mapping, f->MappingLength);
+		f->Mapping = NULL;
+		f->CharacterHash = NULL;
+	}
+}
+
+// font_resident_glyphs reports how many glyph paths exist on the GPU
+int font_resident_glyphs()
+{
+	return resident_glyphs;
+}
+
 
 // Text renders a string of text at a specified location, size, using the specified font glyphs
 // derived from http://web.archive.org/web/20070808195131/http://developer.hybrid.fi/font2openvg/renderFont.cpp.txt
 void Text(VGfloat x, VGfloat y, char *s, Fontinfo f, int pointsize) {
 	VGfloat size = (VGfloat) pointsize, xx = x, mm[9];
-	int i;
+	const char *p = s;
 
 	vgGetMatrix(mm);
-	for (i = 0; i < (int)strlen(s); i++) {
-		unsigned int character = (unsigned int)s[i];
-		int glyph = f.CharacterMap[character];
+	while (*p) {
+		int glyph = glyph_index(f, next_character(&p));
 		if (glyph == -1) {
 			continue;	//glyph is undefined
 		}
@@ -122,7 +377,7 @@ void Text(VGfloat x, VGfloat y, char *s, Fontinfo f, int pointsize) {
 		};
 		vgLoadMatrix(mm);
 		vgMultMatrix(mat);
-		vgDrawPath(f.Glyphs[glyph], VG_FILL_PATH);
+		vgDrawPath(glyph_path(f, glyph), VG_FILL_PATH);
 		xx += size * f.GlyphAdvances[glyph] / 65536.0f;
 	}
 	vgLoadMatrix(mm);
@@ -130,12 +385,11 @@ void Text(VGfloat x, VGfloat y, char *s, Fontinfo f, int pointsize) {
 
 // TextWidth returns the width of a text string at the specified font and size.
 VGfloat TextWidth(char *s, Fontinfo f, int pointsize) {
-	int i;
+	const char *p = s;
 	VGfloat tw = 0.0;
 	VGfloat size = (VGfloat) pointsize;
-	for (i = 0; i < (int)strlen(s); i++) {
-		unsigned int character = (unsigned int)s[i];
-		int glyph = f.CharacterMap[character];
+	while (*p) {
+		int glyph = glyph_index(f, next_character(&p));
 		if (glyph == -1) {
 			continue;	//glyph is undefined
 		}
@@ -0,0 +1,248 @@
+// GPU image memory budget.
+//
+// Every image created through AcquireImage is counted against a byte
+// budget.  Released images stay resident and are handed out again for
+// the next request with the same format and size, which for a slideshow
+// of same-sized camera pictures means the GPU allocation is made once.
+// Idle images are destroyed least recently used first when a new image
+// wouldn't fit the budget, and AcquireImage fails instead of exceeding
+// the budget or leaving a GPU error pending, so callers can fall back to
+// a smaller image.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vgwrap.h"
+
+#define MAX_POOLED_IMAGES 64
+#define DEFAULT_IMAGE_BUDGET (64 * 1024 * 1024)
+
+typedef struct {
+	VGImage img;		// VG_INVALID_HANDLE if the slot is free
+	VGImageFormat format;
+	int width, height;
+	size_t bytes;
+	int inUse;
+	unsigned long lastUse;
+} PooledImage;
+
+static PooledImage pool[MAX_POOLED_IMAGES];
+static size_t budget = DEFAULT_IMAGE_BUDGET;
+static size_t resident, peak_resident;
+static unsigned long use_clock;
+static long images_created, images_reused, images_evicted, create_failures;
+
+
+// ImageBytes returns the memory an image, or a raster, of the given
+// format and size takes
+size_t ImageBytes(VGImageFormat format, int width, int height)
+{
+	int bpp = 4;
+	switch (format & 0x3f) {
+	case VG_sRGB_565:
+	case VG_sRGBA_5551:
+	case VG_sRGBA_4444:
+		bpp = 2;
+		break;
+	case VG_sL_8:
+	case VG_lL_8:
+	case VG_A_8:
+		bpp = 1;
+		break;
+	}
+	return (size_t) width * height * bpp;
+}
+
+static void destroy_entry(PooledImage *p)
+{
+	vgDestroyImage(p->img);
+	resident -= p->bytes;
+	memset(p, 0, sizeof(*p));
+	p->img = VG_INVALID_HANDLE;
+}
+
+// evict_idle destroys the least recently used idle image.  Returns 0 if
+// there was none.
+static int evict_idle()
+{
+	PooledImage *lru = NULL;
+	int i;
+	for (i = 0; i < MAX_POOLED_IMAGES; i++) {
+		PooledImage *p = pool + i;
+		if (p->img != VG_INVALID_HANDLE && !p->inUse && (lru == NULL || p->lastUse < lru->lastUse)) {
+			lru = p;
+		}
+	}
+	if (lru == NULL) {
+		return 0;
+	}
+	destroy_entry(lru);
+	images_evicted++;
+	return 1;
+}
+
+static PooledImage *find_entry(VGImage img)
+{
+	int i;
+	for (i = 0; i < MAX_POOLED_IMAGES; i++) {
+		if (pool[i].img == img && img != VG_INVALID_HANDLE) {
+			return pool + i;
+		}
+	}
+	return NULL;
+}
+
+
+// SetImageBudget sets how many bytes of images may be resident at once
+void SetImageBudget(size_t bytes)
+{
+	budget = bytes;
+	while (resident > budget && evict_idle()) {
+	}
+}
+
+size_t ImageBudget()
+{
+	return budget;
+}
+
+// AcquireImage returns an image of the given format and size, reusing an
+// idle one if possible.  Its contents are undefined.  Returns
+// VG_INVALID_HANDLE if the image can't be had within the budget or the
+// GPU is out of memory.
+VGImage AcquireImage(VGImageFormat format, int width, int height)
+{
+	PooledImage *slot = NULL, *match = NULL;
+	size_t bytes = ImageBytes(format, width, height);
+	int i;
+
+	for (i = 0; i < MAX_POOLED_IMAGES; i++) {
+		PooledImage *p = pool + i;
+		if (p->img == VG_INVALID_HANDLE) {
+			continue;
+		}
+		if (!p->inUse && p->format == format && p->width == width && p->height == height &&
+		    (match == NULL || p->lastUse < match->lastUse)) {
+			match = p;
+		}
+	}
+	if (match) {
+		match->inUse = 1;
+		match->lastUse = ++use_clock;
+		images_reused++;
+		CountStat(COUNTER_POOL_REUSES, 1);
+		return match->img;
+	}
+	CountStat(COUNTER_POOL_MISSES, 1);
+
+	if (width <= 0 || height <= 0 || bytes > budget ||
+	    width > vgGeti(VG_MAX_IMAGE_WIDTH) || height > vgGeti(VG_MAX_IMAGE_HEIGHT) ||
+	    (size_t) width * height > (size_t) vgGeti(VG_MAX_IMAGE_PIXELS)) {
+		create_failures++;
+		return VG_INVALID_HANDLE;
+	}
+	while (resident + bytes > budget) {
+		if (!evict_idle()) {
+			create_failures++;
+			return VG_INVALID_HANDLE;
+		}
+	}
+	for (i = 0; i < MAX_POOLED_IMAGES && slot == NULL; i++) {
+		if (pool[i].img == VG_INVALID_HANDLE) {
+			slot = pool + i;
+		}
+	}
+	if (slot == NULL) {
+		if (!evict_idle()) {
+			create_failures++;
+			return VG_INVALID_HANDLE;
+		}
+		return AcquireImage(format, width, height);
+	}
+
+	// the GPU can run out before the budget does, so try again with the
+	// idle images gone before giving up
+	VGImage img;
+	for (;;) {
+		vgGetError();	// so the check below is about this call
+		img = vgCreateImage(format, width, height,
+				    VG_IMAGE_QUALITY_NONANTIALIASED | VG_IMAGE_QUALITY_FASTER | VG_IMAGE_QUALITY_BETTER);
+		if (vgGetError() == VG_NO_ERROR && img != VG_INVALID_HANDLE) {
+			break;
+		}
+		if (img != VG_INVALID_HANDLE) {
+			vgDestroyImage(img);
+		}
+		if (!evict_idle()) {
+			create_failures++;
+			return VG_INVALID_HANDLE;
+		}
+	}
+
+	slot->img = img;
+	slot->format = format;
+	slot->width = width;
+	slot->height = height;
+	slot->bytes = bytes;
+	slot->inUse = 1;
+	slot->lastUse = ++use_clock;
+	resident += bytes;
+	if (resident > peak_resident) {
+		peak_resident = resident;
+	}
+	images_created++;
+	return img;
+}
+
+// ReleaseImage gives an image back to the pool, where it stays resident
+// for reuse while the budget allows.  Images not from AcquireImage are
+// destroyed.
+void ReleaseImage(VGImage img)
+{
+	PooledImage *p = find_entry(img);
+	if (p == NULL) {
+		if (img != VG_INVALID_HANDLE) {
+			vgDestroyImage(img);
+		}
+		return;
+	}
+	p->inUse = 0;
+	while (resident > budget && evict_idle()) {
+	}
+}
+
+// FlushImagePool destroys every idle image
+void FlushImagePool()
+{
+	while (evict_idle()) {
+	}
+}
+
+// IdleImageBytes returns the bytes held by released images kept for reuse
+size_t IdleImageBytes()
+{
+	size_t idle = 0;
+	int i;
+	for (i = 0; i < MAX_POOLED_IMAGES; i++) {
+		if (pool[i].img != VG_INVALID_HANDLE && !pool[i].inUse) {
+			idle += pool[i].bytes;
+		}
+	}
+	return idle;
+}
+
+// TrimImagePool destroys idle images until at most bytes of them are left
+void TrimImagePool(size_t bytes)
+{
+	while (IdleImageBytes() > bytes && evict_idle()) {
+	}
+}
+
+void PrintImagePoolStats()
+{
+	printf("images: %ld created, %ld reused, %ld evicted, %ld refused, %.1f MB resident (peak %.1f MB of %.1f MB)\n",
+	       images_created, images_reused, images_evicted, create_failures,
+	       resident / 1048576.0, peak_resident / 1048576.0, budget / 1048576.0);
+}
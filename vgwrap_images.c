@@ -1,22 +1,309 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <setjmp.h>
 #include <jpeglib.h>
+#include <jerror.h>
 
 #include "vgwrap.h"
 
-// createImageFromJpeg decompresses a JPEG image to the standard image format
+// colour rasters are made as dithered RGB565 rather than RGBA if set
+static int rgb565_images;
+
+// decodes on this thread give up when this becomes set
+static __thread volatile int *decode_cancel;
+
+// where the rasters decodes hand back are allocated, see
+// SetRasterAllocator.  Scratch buffers always use malloc.
+static void *(*raster_alloc)(size_t) = malloc;
+static void (*raster_free)(void *) = free;
+
+// rgba_format is the format of RGBA bytes in memory
+static VGImageFormat rgba_format() {
+	unsigned int lilEndianTest = 1;
+	return ((unsigned char *)&lilEndianTest)[0] == 1 ? VG_sABGR_8888 : VG_sRGBA_8888;
+}
+
+// free_decoded frees a decode's buffer, scratch or the raster
+static void free_decoded(VGubyte *data, int scratch) {
+	if (scratch) {
+		free(data);
+	}
+	else if (data) {
+		raster_free(data);
+	}
+}
+
+// 4x4 ordered dither thresholds
+static const uint8_t bayer[4][4] = {
+	{0, 8, 2, 10},
+	{12, 4, 14, 6},
+	{3, 11, 1, 9},
+	{15, 7, 13, 5}
+};
+
+// pack_rgb565 packs a row of RGB pixels, step bytes apart, to RGB565.  An
+// ordered dither spreads the rounding over neighbouring pixels so smooth
+// gradients don't band; y picks the dither row.
+static void pack_rgb565(const VGubyte *src, unsigned step, uint16_t *dst, unsigned width, unsigned y) {
+	const uint8_t *thresholds = bayer[y & 3];
+	unsigned x;
+	for (x = 0; x < width; x++, src += step) {
+		// scaled by 31 or 63 over 255 rather than shifted, so white
+		// stays white and the expansion back to 8 bits has no bias
+		unsigned t = thresholds[x & 3] * 16 + 8;
+		unsigned r = (src[0] * 31 + t) / 255, g = (src[1] * 63 + t) / 255, b = (src[2] * 31 + t) / 255;
+		dst[x] = (uint16_t) (r << 11 | g << 5 | b);
+	}
+}
+
+// halve_image box filters a raster to half its size in place
+static void halve_image(VGubyte *data, VGImageFormat format, unsigned int *width, unsigned int *height) {
+	unsigned int w = *width / 2, h = *height / 2, x, y, c;
+	if (format == VG_sRGB_565) {
+		for (y = 0; y < h; y++) {
+			const uint16_t *s0 = (uint16_t *) data + 2 * y * *width, *s1 = s0 + *width;
+			uint16_t *d = (uint16_t *) data + y * w;
+			for (x = 0; x < w; x++, s0 += 2, s1 += 2) {
+				unsigned r = 0, g = 0, b = 0, i;
+				uint16_t p[4] = { s0[0], s0[1], s1[0], s1[1] };
+				for (i = 0; i < 4; i++) {
+					r += p[i] >> 11;
+					g += (p[i] >> 5) & 0x3f;
+					b += p[i] & 0x1f;
+				}
+				d[x] = (uint16_t) (((r + 2) >> 2) << 11 | ((g + 2) >> 2) << 5 | (b + 2) >> 2);
+			}
+		}
+	}
+	else {
+		unsigned int bpp = ImageBytes(format, 1, 1), sstride = *width * bpp;
+		for (y = 0; y < h; y++) {
+			VGubyte *s0 = data + 2 * y * sstride, *s1 = s0 + sstride;
+			VGubyte *d = data + y * w * bpp;
+			for (x = 0; x < w; x++, s0 += 2 * bpp, s1 += 2 * bpp, d += bpp) {
+				for (c = 0; c < bpp; c++) {
+					d[c] = (s0[c] + s0[c + bpp] + s1[c] + s1[c + bpp] + 2) >> 2;
+				}
+			}
+		}
+	}
+	*width = w;
+	*height = h;
+}
+
+// resample_image scales an RGBA or L_8 raster down to width x height with
+// bilinear filtering, which is enough for ratios of up to 2:1, returning
+// a new raster.  An RGBA raster is packed to RGB565 on the way if format
+// says so.
+static VGubyte *resample_image(const VGubyte *src, unsigned swidth, unsigned sheight,
+			       unsigned width, unsigned height, VGImageFormat format) {
+	unsigned bpp = format == VG_sL_8 ? 1 : 4;
+	VGubyte *dst = raster_alloc(ImageBytes(format, width, height));
+	VGubyte *row = format == VG_sRGB_565 ? malloc(width * 4) : NULL;
+	int *xs, *xf;
+	unsigned x, y, c;
+
+	xs = malloc(sizeof(int) * width * 2);
+	if (dst == NULL || xs == NULL || (format == VG_sRGB_565 && row == NULL)) {
+		if (dst) {
+			raster_free(dst);
+		}
+		free(row);
+		free(xs);
+		return NULL;
+	}
+	// source column and 8 bit fraction for each destination column
+	xf = xs + width;
+	for (x = 0; x < width; x++) {
+		int fx = (int) (((x + 0.5) * swidth / width - 0.5) * 256.0);
+		if (fx < 0) {
+			fx = 0;
+		}
+		xs[x] = fx >> 8;
+		xf[x] = fx & 255;
+		if (xs[x] >= (int) swidth - 1) {
+			xs[x] = swidth - 1;
+			xf[x] = 0;
+		}
+	}
+	for (y = 0; y < height; y++) {
+		int fy = (int) (((y + 0.5) * sheight / height - 0.5) * 256.0);
+		if (fy < 0) {
+			fy = 0;
+		}
+		unsigned sy = fy >> 8, wy = fy & 255;
+		if (sy >= sheight - 1) {
+			sy = sheight - 1;
+			wy = 0;
+		}
+		const VGubyte *r0 = src + (size_t) sy * swidth * bpp;
+		const VGubyte *r1 = wy ? r0 + swidth * bpp : r0;
+		// RGB565 rows are filtered into a scratch row, still in cache
+		// when they are packed
+		VGubyte *d = row ? row : dst + (size_t) y * width * bpp;
+		for (x = 0; x < width; x++, d += bpp) {
+			const VGubyte *p0 = r0 + xs[x] * bpp, *p1 = r1 + xs[x] * bpp;
+			unsigned wx = xf[x], step = wx ? bpp : 0;
+			for (c = 0; c < bpp; c++) {
+				unsigned top = p0[c] * (256 - wx) + p0[c + step] * wx;
+				unsigned bottom = p1[c] * (256 - wx) + p1[c + step] * wx;
+				d[c] = (top * (256 - wy) + bottom * wy + 32768) >> 16;
+			}
+		}
+		if (row) {
+			pack_rgb565(row, 4, (uint16_t *) dst + (size_t) y * width, width, y);
+		}
+	}
+	free(row);
+	free(xs);
+	return dst;
+}
+
+// StreamSource feeds libjpeg from an ImageReadFunc, so images can be
+// decoded as they arrive, from a file or a socket alike
+#define STREAM_BUFFER_SIZE 65536
+
+typedef struct {
+	struct jpeg_source_mgr pub;
+	ImageReadFunc read;
+	void *context;
+	uint64_t bytes;
+	JOCTET buffer[STREAM_BUFFER_SIZE];
+} StreamSource;
+
+static void init_source(j_decompress_ptr jdc) {
+}
+
+static boolean fill_input_buffer(j_decompress_ptr jdc) {
+	StreamSource *src = (StreamSource *) jdc->src;
+	long n = src->read(src->context, src->buffer, STREAM_BUFFER_SIZE);
+	if (n <= 0) {
+		// end the image with a fake EOI marker, as the stdio source
+		// does, so a truncated image shows what did arrive
+		WARNMS(jdc, JWRN_JPEG_EOF);
+		src->buffer[0] = (JOCTET) 0xFF;
+		src->buffer[1] = (JOCTET) JPEG_EOI;
+		n = 2;
+	}
+	else {
+		src->bytes += n;
+	}
+	src->pub.next_input_byte = src->buffer;
+	src->pub.bytes_in_buffer = n;
+	return TRUE;
+}
+
+static void skip_input_data(j_decompress_ptr jdc, long count) {
+	StreamSource *src = (StreamSource *) jdc->src;
+	while (count > (long) src->pub.bytes_in_buffer) {
+		count -= src->pub.bytes_in_buffer;
+		fill_input_buffer(jdc);
+	}
+	if (count > 0) {
+		src->pub.next_input_byte += count;
+		src->pub.bytes_in_buffer -= count;
+	}
+}
+
+static void term_source(j_decompress_ptr jdc) {
+}
+
+// read_file is the ImageReadFunc for stdio files
+static long read_file(void *context, void *buf, size_t size) {
+	size_t n = fread(buf, 1, size, (FILE *) context);
+	return n > 0 ? (long) n : ferror((FILE *) context) ? -1 : 0;
+}
+
+// DecodeError returns from a failed decode instead of exiting, which is
+// libjpeg's default
+typedef struct {
+	struct jpeg_error_mgr pub;
+	jmp_buf jump;
+} DecodeError;
+
+static void decode_error_exit(j_common_ptr cinfo) {
+	(*cinfo->err->output_message) (cinfo);
+	longjmp(((DecodeError *) cinfo->err)->jump, 1);
+}
+
+// read_icc_profile reassembles the ICC profile saved from APP2 markers,
+// which may be split over several.  Returns NULL if there is none, or if
+// it is incomplete.
+#define ICC_MARKER (JPEG_APP0 + 2)
+#define ICC_HEADER 14		// "ICC_PROFILE\0", sequence number, count
+
+static unsigned char *read_icc_profile(j_decompress_ptr jdc, size_t *length) {
+	jpeg_saved_marker_ptr marker;
+	size_t offsets[256] = { 0 }, lengths[256] = { 0 }, total = 0;
+	int count = 0, seq;
+	unsigned char *icc;
+
+	for (marker = jdc->marker_list; marker; marker = marker->next) {
+		if (marker->marker == ICC_MARKER && marker->data_length > ICC_HEADER &&
+		    memcmp(marker->data, "ICC_PROFILE", 12) == 0) {
+			seq = marker->data[12];
+			if (count == 0) {
+				count = marker->data[13];
+			}
+			if (seq == 0 || seq > count || marker->data[13] != count || lengths[seq]) {
+				return NULL;
+			}
+			lengths[seq] = marker->data_length - ICC_HEADER;
+		}
+	}
+	for (seq = 1; seq <= count; seq++) {
+		if (lengths[seq] == 0) {
+			return NULL;
+		}
+		offsets[seq] = total;
+		total += lengths[seq];
+	}
+	if (total == 0 || (icc = malloc(total)) == NULL) {
+		return NULL;
+	}
+	for (marker = jdc->marker_list; marker; marker = marker->next) {
+		if (marker->marker == ICC_MARKER && marker->data_length > ICC_HEADER &&
+		    memcmp(marker->data, "ICC_PROFILE", 12) == 0) {
+			seq = marker->data[12];
+			memcpy(icc + offsets[seq], marker->data + ICC_HEADER, lengths[seq]);
+		}
+	}
+	*length = total;
+	return icc;
+}
+
+// how decode_jpeg sizes the raster
+#define FIT_NONE 0		// scaled down only as far as it must be
+#define FIT_EXACT 1		// scaled to fit, resampled after the DCT
+#define FIT_DCT 2		// scaled to cover the fitted size by the DCT alone
+
+// decode_jpeg decompresses a JPEG image to a raster, bottom row first:
+// L_8 for a grayscale image, otherwise RGBA or, if rgb565_images is set,
+// RGB565.  The format is returned in outFormat.  With FIT_EXACT the image
+// is scaled to fit inside maxWidth x maxHeight keeping its aspect ratio;
+// with FIT_DCT only as far as the decoder's power of two scaling goes
+// while still covering that size; with FIT_NONE the decoder only scales
+// it down, by powers of two, until it is no larger than maxWidth x
+// maxHeight and maxPixels.  An embedded colour profile other than sRGB is
+// converted to sRGB.  Compressed data comes from read, name is for
+// messages.  Returns NULL on failure.
 // source: https://github.com/ileben/ShivaVG/blob/master/examples/test_image.c
-VGImage createImageFromJpeg(const char *filename) {
-	FILE *infile;
+static VGubyte *decode_jpeg(const char *name, ImageReadFunc read, void *context,
+			    unsigned maxWidth, unsigned maxHeight, size_t maxPixels,
+			    int fit, unsigned *outWidth, unsigned *outHeight, VGImageFormat *outFormat) {
 	struct jpeg_decompress_struct jdc;
-	struct jpeg_error_mgr jerr;
+	DecodeError jerr;
+	StreamSource *src;
 	JSAMPARRAY buffer;
+	JSAMPARRAY expanded = NULL;
 	unsigned int bstride;
 	unsigned int bbpp;
 
-	VGImage img;
-	VGubyte *data;
+	VGubyte *volatile data = NULL;
+	volatile int resampling = 0;	// data is scratch, not the raster
+	ColorLut *volatile lut = NULL;
 	unsigned int width;
 	unsigned int height;
 	unsigned int dstride;
@@ -25,31 +312,89 @@ VGImage createImageFromJpeg(const char *filename) {
 	VGubyte *brow;
 	VGubyte *drow;
 	unsigned int x;
-	unsigned int lilEndianTest = 1;
-	VGImageFormat rgbaFormat;
 
-	// Check for endianness
-	if (((unsigned char *)&lilEndianTest)[0] == 1)
-		rgbaFormat = VG_sABGR_8888;
-	else
-		rgbaFormat = VG_sRGBA_8888;
-
-	// Try to open image file
-	infile = fopen(filename, "rb");
-	if (infile == NULL) {
-		printf("Failed opening '%s' for reading!\n", filename);
-		return VG_INVALID_HANDLE;
+	// Setup error handling, failures come back here
+	jdc.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = decode_error_exit;
+	if (setjmp(jerr.jump)) {
+		printf("Failed decoding '%s'\n", name);
+		jpeg_destroy_decompress(&jdc);
+		ReleaseColorLut(lut);
+		free_decoded(data, resampling);
+		return NULL;
 	}
-	// Setup default error handling
-	jdc.err = jpeg_std_error(&jerr);
 	jpeg_create_decompress(&jdc);
+	jpeg_save_markers(&jdc, ICC_MARKER, 0xFFFF);
 
-	// Set input file
-	jpeg_stdio_src(&jdc, infile);
+	// Set input stream
+	src = (*jdc.mem->alloc_small) ((j_common_ptr) & jdc, JPOOL_PERMANENT, sizeof(StreamSource));
+	src->pub.init_source = init_source;
+	src->pub.fill_input_buffer = fill_input_buffer;
+	src->pub.skip_input_data = skip_input_data;
+	src->pub.resync_to_restart = jpeg_resync_to_restart;
+	src->pub.term_source = term_source;
+	src->pub.bytes_in_buffer = 0;
+	src->pub.next_input_byte = NULL;
+	src->read = read;
+	src->context = context;
+	src->bytes = 0;
+	jdc.src = &src->pub;
+	uint64_t stage = StageBegin();
 
-	// Read header and start
+	// Read header, and have the decoder scale down anything that could
+	// never be created, or when fitting, as far as it can while still
+	// covering the fitted size.  DCT scaling is nearly free compared to
+	// decoding at full size.
 	jpeg_read_header(&jdc, TRUE);
+	if (jdc.out_color_space == JCS_RGB) {
+		size_t icc_length;
+		unsigned char *icc = read_icc_profile(&jdc, &icc_length);
+		if (icc) {
+			lut = AcquireColorLut(icc, icc_length);
+			free(icc);
+		}
+	}
+	unsigned fitWidth = jdc.image_width, fitHeight = jdc.image_height;
+	if (fit && (fitWidth > maxWidth || fitHeight > maxHeight)) {
+		if ((double) maxWidth / fitWidth < (double) maxHeight / fitHeight) {
+			fitHeight = (unsigned) ((double) fitHeight * maxWidth / fitWidth + 0.5);
+			fitWidth = maxWidth;
+		}
+		else {
+			fitWidth = (unsigned) ((double) fitWidth * maxHeight / fitHeight + 0.5);
+			fitHeight = maxHeight;
+		}
+		if (fitWidth == 0) {
+			fitWidth = 1;
+		}
+		if (fitHeight == 0) {
+			fitHeight = 1;
+		}
+	}
+	jdc.scale_num = 1;
+	jdc.scale_denom = 1;
+	jpeg_calc_output_dimensions(&jdc);
+	while (jdc.scale_denom < 8) {
+		if (fit) {
+			jdc.scale_denom *= 2;
+			jpeg_calc_output_dimensions(&jdc);
+			if (jdc.output_width < fitWidth || jdc.output_height < fitHeight) {
+				jdc.scale_denom /= 2;
+				jpeg_calc_output_dimensions(&jdc);
+				break;
+			}
+		}
+		else if (jdc.output_width > maxWidth || jdc.output_height > maxHeight ||
+			 (size_t) jdc.output_width * jdc.output_height > maxPixels) {
+			jdc.scale_denom *= 2;
+			jpeg_calc_output_dimensions(&jdc);
+		}
+		else {
+			break;
+		}
+	}
 	jpeg_start_decompress(&jdc);
+	StageEnd(STAGE_HEADER, stage);
 	width = jdc.output_width;
 	height = jdc.output_height;
 
@@ -59,19 +404,68 @@ VGImage createImageFromJpeg(const char *filename) {
 	buffer = (*jdc.mem->alloc_sarray)
 	    ((j_common_ptr) & jdc, JPOOL_IMAGE, bstride, 1);
 
+	// Grayscale stays one byte a pixel.  Colour is decoded as RGBA if it
+	// is to be resampled, which packs it if need be, otherwise straight to
+	// the final format.
+	VGImageFormat format = bbpp == 1 ? VG_sL_8 : rgb565_images ? VG_sRGB_565 : rgba_format();
+	resampling = fit == FIT_EXACT && (width != fitWidth || height != fitHeight);
+	VGImageFormat decoded_format = resampling && format == VG_sRGB_565 ? rgba_format() : format;
+	if (decoded_format == VG_sRGB_565 && lut) {
+		expanded = (*jdc.mem->alloc_sarray) ((j_common_ptr) & jdc, JPOOL_IMAGE, width * 4, 1);
+	}
+
 	// Allocate image data buffer
-	dbpp = 4;
+	dbpp = ImageBytes(decoded_format, 1, 1);
 	dstride = width * dbpp;
-	data = (VGubyte *) malloc(dstride * height);
+	data = resampling ? malloc((size_t) dstride * height) : raster_alloc((size_t) dstride * height);
+	if (data == NULL) {
+		printf("Out of memory decoding '%s'\n", name);
+		jpeg_destroy_decompress(&jdc);
+		ReleaseColorLut(lut);
+		return NULL;
+	}
 
-	// Iterate until all scanlines processed
+	// Iterate until all scanlines processed, timing decoding and
+	// conversion separately
+	uint64_t decode_ns = 0, convert_ns = 0;
 	while (jdc.output_scanline < height) {
+		if (decode_cancel && *decode_cancel) {
+			jpeg_destroy_decompress(&jdc);
+			ReleaseColorLut(lut);
+			free_decoded(data, resampling);
+			return NULL;
+		}
 
 		// Read scanline into buffer
+		stage = StageBegin();
 		jpeg_read_scanlines(&jdc, buffer, 1);
-		drow = data + (height - jdc.output_scanline) * dstride;
+		uint64_t decoded = StageBegin();
+		decode_ns += decoded - stage;
+		unsigned y = height - jdc.output_scanline;
+		drow = data + (size_t) y * dstride;
 		brow = buffer[0];
-		// Expand to RGBA
+		if (dbpp == 1) {
+			memcpy(drow, brow, width);
+			convert_ns += StageBegin() - decoded;
+			continue;
+		}
+		if (dbpp == 2) {
+			if (expanded) {
+				ExpandColorLut(lut, brow, expanded[0], width);
+				pack_rgb565(expanded[0], 4, (uint16_t *) drow, width, y);
+			}
+			else {
+				pack_rgb565(brow, bbpp, (uint16_t *) drow, width, y);
+			}
+			convert_ns += StageBegin() - decoded;
+			continue;
+		}
+		// Expand to RGBA, converting to sRGB on the way if needed
+		if (lut && bbpp == 3) {
+			ExpandColorLut(lut, brow, drow, width);
+			convert_ns += StageBegin() - decoded;
+			continue;
+		}
 		for (x = 0; x < width; ++x, drow += dbpp, brow += bbpp) {
 			switch (bbpp) {
 			case 4:
@@ -88,20 +482,215 @@ VGImage createImageFromJpeg(const char *filename) {
 				break;
 			}
 		}
+		convert_ns += StageBegin() - decoded;
 	}
-
-	// Create VG image
-	img = vgCreateImage(rgbaFormat, width, height, VG_IMAGE_QUALITY_BETTER);
-	vgImageSubData(img, data, dstride, rgbaFormat, 0, 0, width, height);
+	StageRecord(STAGE_DECODE, decode_ns);
+	CountStat(COUNTER_BYTES_READ, src->bytes);
+	CountStat(COUNTER_PIXELS_DECODED, (uint64_t) width * height);
 
 	// Cleanup
 	jpeg_destroy_decompress(&jdc);
+	ReleaseColorLut(lut);
+
+	VGubyte *result = data;
+	if (resampling) {
+		uint64_t resample = StageBegin();
+		result = resample_image(data, width, height, fitWidth, fitHeight, format);
+		free(data);
+		if (result == NULL) {
+			printf("Out of memory decoding '%s'\n", name);
+			return NULL;
+		}
+		width = fitWidth;
+		height = fitHeight;
+		convert_ns += StageBegin() - resample;
+	}
+	StageRecord(STAGE_CONVERT, convert_ns);
+
+	*outWidth = width;
+	*outHeight = height;
+	*outFormat = format;
+	return result;
+}
+
+// SetRgb565Images has colour images made as RGB565, dithered, instead of
+// RGBA.  That halves their memory and upload time, for a little grain.
+void SetRgb565Images(int on) {
+	rgb565_images = on;
+}
+
+// SetDecodeCancel has decodes on the calling thread watch *cancel, and
+// return NULL quietly, between scanlines, once it is set.  NULL stops
+// watching.
+void SetDecodeCancel(volatile int *cancel) {
+	decode_cancel = cancel;
+}
+
+// DecodeCancelled tells whether the decodes on the calling thread were
+// asked to give up with SetDecodeCancel
+int DecodeCancelled() {
+	return decode_cancel && *decode_cancel;
+}
+
+// SetRasterAllocator has the rasters decodes return, and only those,
+// allocated with alloc and freed with release instead of malloc and free.
+// It is for a process that does nothing but decode.
+void SetRasterAllocator(void *(*alloc)(size_t), void (*release)(void *)) {
+	raster_alloc = alloc;
+	raster_free = release;
+}
+
+// decodeJpegToFit decompresses a JPEG image to a raster, bottom row first,
+// scaled to fit inside maxWidth x maxHeight.  Images are never enlarged.
+// The raster is malloced and its format returned in format: VG_sL_8 for
+// grayscale images, RGBA or RGB565 (see SetRgb565Images) for colour.
+// NULL is returned on failure.  Makes no OpenVG calls, so it may run on
+// any thread.
+VGubyte *decodeJpegToFit(const char *filename, unsigned maxWidth, unsigned maxHeight,
+			 unsigned *width, unsigned *height, VGImageFormat *format) {
+	uint64_t stage = StageBegin();
+	FILE *infile = fopen(filename, "rb");
+	if (infile == NULL) {
+		printf("Failed opening '%s' for reading!\n", filename);
+		return NULL;
+	}
+	StageEnd(STAGE_OPEN, stage);
+	VGubyte *data = decode_jpeg(filename, read_file, infile, maxWidth, maxHeight, 0, FIT_EXACT, width, height, format);
 	fclose(infile);
-	free(data);
+	return data;
+}
 
+// decodeJpegStreamToFit is decodeJpegToFit for compressed data that comes
+// from read, decoding it as it arrives.  name is for messages.
+VGubyte *decodeJpegStreamToFit(ImageReadFunc read, void *context, const char *name,
+			       unsigned maxWidth, unsigned maxHeight, unsigned *width, unsigned *height,
+			       VGImageFormat *format) {
+	return decode_jpeg(name, read, context, maxWidth, maxHeight, 0, FIT_EXACT, width, height, format);
+}
+
+// decodeJpegStreamScaled is decodeJpegStreamToFit without the resampling:
+// the raster is left at the smallest of the decoder's 1/1 to 1/8 scales
+// that still covers the fitted size, for the GPU to scale the rest of the
+// way when it draws.  Much quicker, for images that have to keep up with
+// a frame rate.
+VGubyte *decodeJpegStreamScaled(ImageReadFunc read, void *context, const char *name,
+				unsigned maxWidth, unsigned maxHeight, unsigned *width, unsigned *height,
+				VGImageFormat *format) {
+	return decode_jpeg(name, read, context, maxWidth, maxHeight, 0, FIT_DCT, width, height, format);
+}
+
+// createImageFromRaster makes an image from a decodeJpegToFit raster, in
+// the raster's format.  If the image doesn't fit in GPU memory the raster
+// is halved in place until it does, and width and height updated.
+// Returns VG_INVALID_HANDLE if that fails too.
+VGImage createImageFromRaster(VGubyte *data, VGImageFormat format, unsigned *width, unsigned *height) {
+	VGImage img;
+
+	// Get a VG image from the pool, halving the raster until one can be
+	// had.  Pool images allow every quality so animation can trade
+	// filtering for speed.
+	img = AcquireImage(format, *width, *height);
+	while (img == VG_INVALID_HANDLE && *width > 1 && *height > 1) {
+		halve_image(data, format, width, height);
+		img = AcquireImage(format, *width, *height);
+		if (img != VG_INVALID_HANDLE) {
+			printf("Image reduced to %ux%u to fit in GPU memory\n", *width, *height);
+		}
+	}
+	if (img != VG_INVALID_HANDLE) {
+		uint64_t stage = StageBegin();
+		vgImageSubData(img, data, ImageBytes(format, *width, 1), format, 0, 0, *width, *height);
+		StageEnd(STAGE_UPLOAD, stage);
+	}
 	return img;
 }
 
+// createTiledImageFromRaster is createImageFromRaster for a tiled image,
+// which may be larger than the GPU allows a single image to be.  Tiles
+// are loaded a band at a time, a row of tiles' worth of raster each.
+TiledImage *createTiledImageFromRaster(VGubyte *data, VGImageFormat format, unsigned *width, unsigned *height) {
+	TiledImage *t = createTiledImage(format, *width, *height);
+	while (t == NULL && *width > 1 && *height > 1) {
+		halve_image(data, format, width, height);
+		t = createTiledImage(format, *width, *height);
+		if (t != NULL) {
+			printf("Image reduced to %ux%u to fit in GPU memory\n", *width, *height);
+		}
+	}
+	if (t != NULL) {
+		uint64_t stage = StageBegin();
+		size_t stride = ImageBytes(format, *width, 1);
+		int y;
+		for (y = 0; y < t->height; y += t->stepY) {
+			int band = t->height - y < t->stepY ? t->height - y : t->stepY;
+			tiledImageSubData(t, data + y * stride, stride, y, band);
+		}
+		StageEnd(STAGE_UPLOAD, stage);
+	}
+	return t;
+}
+
+// decode_for_upload decodes a JPEG image for createImageFromJpeg or, if
+// tiled is set, createTiledImageFromJpeg.  The decoder scales it down
+// until it fits in the image budget and, unless tiled, in one image.
+static VGubyte *decode_for_upload(const char *filename, int tiled,
+				  unsigned *width, unsigned *height, VGImageFormat *format) {
+	unsigned maxWidth = tiled ? ~0u : vgGeti(VG_MAX_IMAGE_WIDTH);
+	unsigned maxHeight = tiled ? ~0u : vgGeti(VG_MAX_IMAGE_HEIGHT);
+	size_t maxPixels = ImageBudget() / (rgb565_images ? 2 : 4);
+	if (!tiled && (size_t) vgGeti(VG_MAX_IMAGE_PIXELS) < maxPixels) {
+		maxPixels = vgGeti(VG_MAX_IMAGE_PIXELS);
+	}
+	uint64_t stage = StageBegin();
+	FILE *infile = fopen(filename, "rb");
+	if (infile == NULL) {
+		printf("Failed opening '%s' for reading!\n", filename);
+		return NULL;
+	}
+	StageEnd(STAGE_OPEN, stage);
+	VGubyte *data = decode_jpeg(filename, read_file, infile, maxWidth, maxHeight, maxPixels, FIT_NONE,
+				    width, height, format);
+	fclose(infile);
+	return data;
+}
+
+// createImageFromJpeg decompresses a JPEG image to the standard image format
+//
+// Images larger than the GPU allows, or than fits the image budget, are
+// scaled down by the decoder, and halved again on the CPU if the image
+// still can't be created.  Returns VG_INVALID_HANDLE if that fails too.
+VGImage createImageFromJpeg(const char *filename) {
+	unsigned width, height;
+	VGImageFormat format;
+	VGubyte *data = decode_for_upload(filename, 0, &width, &height, &format);
+	if (data == NULL) {
+		return VG_INVALID_HANDLE;
+	}
+	VGImage img = createImageFromRaster(data, format, &width, &height);
+	if (img == VG_INVALID_HANDLE) {
+		printf("Failed creating an image for '%s'\n", filename);
+	}
+	raster_free(data);
+	return img;
+}
+
+// createTiledImageFromJpeg is createImageFromJpeg for a tiled image, so
+// only the image budget limits its size
+TiledImage *createTiledImageFromJpeg(const char *filename) {
+	unsigned width, height;
+	VGImageFormat format;
+	VGubyte *data = decode_for_upload(filename, 1, &width, &height, &format);
+	if (data == NULL) {
+		return NULL;
+	}
+	TiledImage *t = createTiledImageFromRaster(data, format, &width, &height);
+	if (t == NULL) {
+		printf("Failed creating an image for '%s'\n", filename);
+	}
+	raster_free(data);
+	return t;
+}
+
 // makeimage makes an image from a raw raster of red, green, blue, alpha values
 void makeimage(VGfloat x, VGfloat y, int w, int h, VGubyte * data) {
 	unsigned int dstride = w * 4;
@@ -115,7 +704,28 @@ void makeimage(VGfloat x, VGfloat y, int w, int h, VGubyte * data) {
 // Image places an image at the specifed location
 void ImageToScreenWithoutTransform(VGfloat x, VGfloat y, int w, int h, char *filename) {
 	VGImage img = createImageFromJpeg(filename);
-	vgSetPixels(x, y, img, 0, 0, w, h);
-	vgDestroyImage(img);
+	if (img != VG_INVALID_HANDLE) {
+		vgSetPixels(x, y, img, 0, 0, w, h);
+		ReleaseImage(img);
+	}
 }
 
+// DrawImageOpacity draws an image through the current image transform,
+// blended over what is already on the surface with the given opacity
+void DrawImageOpacity(VGImage img, VGfloat opacity) {
+	if (opacity >= 1.0f) {
+		vgSeti(VG_BLEND_MODE, VG_BLEND_SRC_OVER);
+		vgSeti(VG_IMAGE_MODE, VG_DRAW_IMAGE_NORMAL);
+		vgDrawImage(img);
+		return;
+	}
+
+	// in multiply mode the image is multiplied by the fill paint, so a
+	// white paint with alpha fades the whole image
+	VGfloat color[4] = { 1.0f, 1.0f, 1.0f, opacity };
+	setfill(color);
+	vgSeti(VG_BLEND_MODE, VG_BLEND_SRC_OVER);
+	vgSeti(VG_IMAGE_MODE, VG_DRAW_IMAGE_MULTIPLY);
+	vgDrawImage(img);
+	vgSeti(VG_IMAGE_MODE, VG_DRAW_IMAGE_NORMAL);
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "vgwrap.h"
@@ -15,14 +16,24 @@ static int loaded_fonts = 0;
 // init sets the system to its initial state
 void vgwrap_init(int *w, int *h, int include_fonts)
 {
+#ifndef VGWRAP_SOFT
   bcm_host_init();
+#endif
   memset(state, 0, sizeof(*state));
   oglinit(state);
 
 #ifdef VGWRAP_INCLUDE_FONTS
   if (include_fonts) {
+    double fontStart = vgwrap_now_ms();
     loaded_fonts = 1;
-    LoadAllFonts();
+    RegisterAllFonts();
+#ifdef VGWRAP_PRELOAD_FONTS
+    preload_font(SansTypeface);
+    preload_font(SerifTypeface);
+    preload_font(MonoTypeface);
+#endif
+    printf("fonts: %.2f ms, %d glyph paths resident\n",
+	   vgwrap_now_ms() - fontStart, font_resident_glyphs());
   }
 #endif
 
@@ -33,9 +44,13 @@ void vgwrap_init(int *w, int *h, int include_fonts)
 // finish cleans up
 void vgwrap_finish()
 {
+  FinishCapture();
+  FinishStats();
+  FlushImagePool();
+
 #ifdef VGWRAP_INCLUDE_FONTS
   if (loaded_fonts) {
-    UnloadAllFonts();
+    UnregisterAllFonts();
   }
 #endif
 
@@ -278,35 +278,46 @@ void Start(int width, int height)
 	StrokeWidth(0);
 }
 
-// End checks for errors, and renders to the display
-void End() {
-	assert(vgGetError() == VG_NO_ERROR);
-	eglSwapBuffers(state->display, state->surface);
-	assert(eglGetError() == EGL_SUCCESS);
+// StartClear begins a frame by resetting the transforms and clearing to a
+// solid color, one fill of the surface instead of the two Start and
+// Background take
+void StartClear(int width, int height, unsigned int r, unsigned int g, unsigned int b)
+{
+	SetImageToSurfaceTransform();
+	vgLoadIdentity();
+	SetPathToSurfaceTransform();
+	vgLoadIdentity();
+
+	VGfloat color[4];
+	RGB(r, g, b, color);
+	vgSetfv(VG_CLEAR_COLOR, 4, color);
+	vgClear(0, 0, width, height);
+}
+
+// ScissorRect limits drawing to a single rectangle
+void ScissorRect(VGint x, VGint y, VGint w, VGint h) {
+	VGint rect[4] = { x, y, w, h };
+	vgSetiv(VG_SCISSOR_RECTS, 4, rect);
+	vgSeti(VG_SCISSORING, VG_TRUE);
 }
 
-// dumpscreen writes the raster
-void dumpscreen(int w, int h, FILE * fp) {
-	void *ScreenBuffer = malloc(w * h * 4);
-	vgReadPixels(ScreenBuffer, (w * 4), VG_sABGR_8888, 0, 0, w, h);
-	fwrite(ScreenBuffer, 1, w * h * 4, fp);
-	free(ScreenBuffer);
+// NoScissor lets drawing reach the whole surface again
+void NoScissor() {
+	vgSeti(VG_SCISSORING, VG_FALSE);
 }
 
-// SaveEnd dumps the raster before rendering to the display 
-void SaveEnd(char *filename) {
-	FILE *fp;
+// SwapInterval sets how many display refreshes each End waits for, 0 to
+// swap without waiting for vertical sync
+void SwapInterval(int interval) {
+	eglSwapInterval(state->display, interval);
+}
+
+// End checks for errors, and renders to the display
+void End() {
 	assert(vgGetError() == VG_NO_ERROR);
-	if (strlen(filename) == 0) {
-		dumpscreen(state->screen_width, state->screen_height, stdout);
-	} else {
-		fp = fopen(filename, "wb");
-		if (fp != NULL) {
-			dumpscreen(state->screen_width, state->screen_height, fp);
-			fclose(fp);
-		}
-	}
+	uint64_t stage = StageBegin();
 	eglSwapBuffers(state->display, state->surface);
+	StageEnd(STAGE_SWAP, stage);
 	assert(eglGetError() == EGL_SUCCESS);
 }
 
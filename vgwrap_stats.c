@@ -0,0 +1,455 @@
+// Stage latency histograms and counters.
+//
+// Timed code calls StageBegin and StageEnd around a stage.  StageEnd only
+// appends the duration to a ring buffer owned by the calling thread, with
+// no locks or shared cache lines, so stages can be timed on hot paths and
+// from any thread.  Rings are drained into per-stage log-linear (HDR
+// style) histograms when stats are read: 16 sub-buckets per power of two
+// keep every percentile within about 6% of the true value.  A full ring
+// drops samples and counts them rather than blocking the timed thread.
+//
+// InitStats can expose the aggregate in Prometheus text format, through
+// a file rewritten periodically and renamed into place, and through a
+// Unix-domain socket that answers each connection with the same text.
+// Both are served by a thread of their own.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "vgwrap.h"
+
+#define RING_SIZE 1024		// samples per thread between drains
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define BUCKETS (64 * SUB_BUCKETS)
+#define STATS_TEXT_MAX 8192
+
+typedef struct {
+	uint32_t stage;
+	uint32_t ns;
+} StageSample;
+
+typedef struct StageRing {
+	StageSample samples[RING_SIZE];
+	unsigned head;		// written by the owning thread only
+	unsigned tail;		// written by the drain only
+	unsigned long dropped;
+	struct StageRing *next;
+} StageRing;
+
+typedef struct {
+	uint64_t counts[BUCKETS];
+	uint64_t total;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+} Histogram;
+
+static const char *stage_names[STAGE_COUNT] = {
+	"open", "header", "decode", "convert", "upload", "draw", "swap", "decoder"
+};
+
+static const char *counter_names[COUNTER_COUNT] = {
+	"bytes_read", "pixels_decoded", "pool_reuses", "pool_misses", "slide_cache_hits", "slide_cache_misses",
+	"color_lut_hits", "color_lut_builds", "http_not_modified"
+};
+
+static __thread StageRing *thread_ring;
+static StageRing *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// histograms are only touched with the drain lock held
+static Histogram histograms[STAGE_COUNT];
+static unsigned long dropped_samples;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t counters[COUNTER_COUNT];
+
+static char stats_file[512];
+static char stats_socket[108];
+static double stats_interval_ms;
+static int listen_fd = -1;
+static int wake_pipe[2] = { -1, -1 };
+static int stats_started = 0;
+static pthread_t stats_thread;
+
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static StageRing *ring_for_thread()
+{
+	if (thread_ring == NULL) {
+		thread_ring = calloc(1, sizeof(StageRing));
+		if (thread_ring == NULL) {
+			return NULL;
+		}
+		pthread_mutex_lock(&rings_lock);
+		thread_ring->next = rings;
+		rings = thread_ring;
+		pthread_mutex_unlock(&rings_lock);
+	}
+	return thread_ring;
+}
+
+// bucket_index maps a value to its histogram bucket.  Values below
+// SUB_BUCKETS get a bucket each; above that each power of two is split
+// into SUB_BUCKETS equal parts.
+static unsigned bucket_index(uint64_t v)
+{
+	if (v < SUB_BUCKETS) {
+		return v;
+	}
+	unsigned e = 63 - __builtin_clzll(v);
+	unsigned sub = (v >> (e - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+	return (e - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+// bucket_value is the midpoint of the values mapped to a bucket
+static uint64_t bucket_value(unsigned index)
+{
+	if (index < SUB_BUCKETS) {
+		return index;
+	}
+	unsigned e = index / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+	uint64_t width = (uint64_t) 1 << (e - SUB_BUCKET_BITS);
+	return ((uint64_t) 1 << e) + (index % SUB_BUCKETS) * width + width / 2;
+}
+
+// drain moves every ring's samples into the histograms
+static void drain()
+{
+	StageRing *r;
+	pthread_mutex_lock(&rings_lock);
+	r = rings;
+	pthread_mutex_unlock(&rings_lock);
+
+	// rings are only ever pushed on the front, so the list from the
+	// head we saw is stable
+	for (; r; r = r->next) {
+		unsigned head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		unsigned tail = r->tail;
+		for (; tail != head; tail++) {
+			StageSample *s = r->samples + tail % RING_SIZE;
+			Histogram *h = histograms + s->stage;
+			h->counts[bucket_index(s->ns)]++;
+			h->total++;
+			h->sum_ns += s->ns;
+			if (s->ns > h->max_ns) {
+				h->max_ns = s->ns;
+			}
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+		dropped_samples += __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+	}
+}
+
+static uint64_t percentile(const Histogram *h, double p)
+{
+	uint64_t rank = (uint64_t) (h->total * p + 0.5), seen = 0;
+	unsigned i;
+	if (rank == 0) {
+		rank = 1;
+	}
+	for (i = 0; i < BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= rank) {
+			uint64_t v = bucket_value(i);
+			return v < h->max_ns ? v : h->max_ns;
+		}
+	}
+	return h->max_ns;
+}
+
+// escape_label copies value into out as a Prometheus label value
+static void escape_label(const char *value, char *out, int size)
+{
+	int n = 0;
+	for (; *value && n < size - 2; value++) {
+		if (*value == '\\' || *value == '"' || *value == '\n') {
+			out[n++] = '\\';
+		}
+		out[n++] = *value == '\n' ? 'n' : *value;
+	}
+	out[n] = '\0';
+}
+
+// format_stats writes the aggregate in Prometheus text format
+static int format_stats(char *text, int size)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99 };
+	char path[512], label[1024];
+	int n = 0, s, q;
+
+#define APPEND(...) \
+	if (n < size) n += snprintf(text + n, size - n, __VA_ARGS__)
+
+	pthread_mutex_lock(&drain_lock);
+	drain();
+	APPEND("# TYPE pislides_stage_seconds summary\n");
+	for (s = 0; s < STAGE_COUNT; s++) {
+		const Histogram *h = histograms + s;
+		for (q = 0; q < 3; q++) {
+			APPEND("pislides_stage_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n",
+			       stage_names[s], quantiles[q], h->total ? percentile(h, quantiles[q]) / 1e9 : 0.0);
+		}
+		APPEND("pislides_stage_seconds_sum{stage=\"%s\"} %.9f\n", stage_names[s], h->sum_ns / 1e9);
+		APPEND("pislides_stage_seconds_count{stage=\"%s\"} %llu\n", stage_names[s],
+		       (unsigned long long) h->total);
+	}
+	APPEND("# TYPE pislides_stage_max_seconds gauge\n");
+	for (s = 0; s < STAGE_COUNT; s++) {
+		APPEND("pislides_stage_max_seconds{stage=\"%s\"} %.9f\n", stage_names[s], histograms[s].max_ns / 1e9);
+	}
+	APPEND("# TYPE pislides_stage_samples_dropped_total counter\n");
+	APPEND("pislides_stage_samples_dropped_total %lu\n", dropped_samples);
+	pthread_mutex_unlock(&drain_lock);
+
+	for (s = 0; s < COUNTER_COUNT; s++) {
+		APPEND("# TYPE pislides_%s_total counter\n", counter_names[s]);
+		APPEND("pislides_%s_total %llu\n", counter_names[s],
+		       (unsigned long long) __atomic_load_n(counters + s, __ATOMIC_RELAXED));
+	}
+
+	// the newest screen capture, when CaptureScreen is writing them
+	double age_ms = LatestCapture(path, sizeof(path));
+	if (age_ms >= 0) {
+		escape_label(path, label, sizeof(label));
+		APPEND("# TYPE pislides_latest_capture_age_seconds gauge\n");
+		APPEND("pislides_latest_capture_age_seconds{path=\"%s\"} %.3f\n", label, age_ms / 1e3);
+	}
+#undef APPEND
+	return n < size ? n : size - 1;
+}
+
+static void write_stats_file()
+{
+	char text[STATS_TEXT_MAX], tmp[sizeof(stats_file) + 8];
+	int n = format_stats(text, sizeof(text));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", stats_file);
+	FILE *fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		return;
+	}
+	int ok = fwrite(text, 1, n, fp) == (size_t) n;
+	if (fclose(fp) == 0 && ok) {
+		rename(tmp, stats_file);
+	}
+	else {
+		unlink(tmp);
+	}
+}
+
+static void answer_connection()
+{
+	char text[STATS_TEXT_MAX];
+	int fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0) {
+		return;
+	}
+	int n = format_stats(text, sizeof(text)), done = 0;
+	while (done < n) {
+		ssize_t w = send(fd, text + done, n - done, MSG_NOSIGNAL);
+		if (w <= 0) {
+			break;
+		}
+		done += w;
+	}
+	close(fd);
+}
+
+static void *stats_main(void *arg)
+{
+	double next_write = vgwrap_now_ms();
+	for (;;) {
+		struct pollfd fds[2] = {
+			{ wake_pipe[0], POLLIN, 0 },
+			{ listen_fd, POLLIN, 0 }
+		};
+		int timeout = -1;
+		if (stats_file[0]) {
+			double wait = next_write - vgwrap_now_ms();
+			timeout = wait > 0 ? (int) wait + 1 : 0;
+		}
+		poll(fds, listen_fd >= 0 ? 2 : 1, timeout);
+		if (fds[0].revents) {
+			break;
+		}
+		if (listen_fd >= 0 && (fds[1].revents & POLLIN)) {
+			answer_connection();
+		}
+		if (stats_file[0] && vgwrap_now_ms() >= next_write) {
+			write_stats_file();
+			next_write += stats_interval_ms;
+			if (next_write < vgwrap_now_ms()) {
+				next_write = vgwrap_now_ms() + stats_interval_ms;
+			}
+		}
+	}
+	return NULL;
+}
+
+
+// StageBegin returns a timestamp to pass to StageEnd
+uint64_t StageBegin()
+{
+	return now_ns();
+}
+
+// StageEnd records the time since begin against a stage
+void StageEnd(int stage, uint64_t begin)
+{
+	StageRecord(stage, now_ns() - begin);
+}
+
+// StageRecord records a duration in nanoseconds against a stage, for
+// stages timed in several pieces
+void StageRecord(int stage, uint64_t ns)
+{
+	StageRing *r = ring_for_thread();
+	if (r == NULL) {
+		return;
+	}
+	unsigned head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= RING_SIZE) {
+		__atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	r->samples[head % RING_SIZE].stage = stage;
+	r->samples[head % RING_SIZE].ns = ns > UINT32_MAX ? UINT32_MAX : ns;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// CountStat adds to one of the counters
+void CountStat(int counter, uint64_t amount)
+{
+	__atomic_fetch_add(counters + counter, amount, __ATOMIC_RELAXED);
+}
+
+// GetCountStat returns a counter's total so far
+uint64_t GetCountStat(int counter)
+{
+	return __atomic_load_n(counters + counter, __ATOMIC_RELAXED);
+}
+
+// InitStats starts serving stats.  file, if not NULL, is rewritten every
+// intervalMs; socketPath, if not NULL, is a Unix-domain socket that
+// answers every connection with the current stats.
+void InitStats(const char *file, const char *socketPath, double intervalMs)
+{
+	if (stats_started) {
+		return;
+	}
+	stats_file[0] = '\0';
+	if (file) {
+		snprintf(stats_file, sizeof(stats_file), "%s", file);
+	}
+	stats_interval_ms = intervalMs > 0 ? intervalMs : 1000.0;
+
+	if (socketPath) {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		snprintf(stats_socket, sizeof(stats_socket), "%s", socketPath);
+		strcpy(addr.sun_path, stats_socket);
+		unlink(stats_socket);
+		listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+		    listen(listen_fd, 4) != 0) {
+			printf("Failed listening for stats on '%s'\n", stats_socket);
+			if (listen_fd >= 0) {
+				close(listen_fd);
+				listen_fd = -1;
+			}
+			stats_socket[0] = '\0';
+		}
+	}
+	if (!stats_file[0] && listen_fd < 0) {
+		return;
+	}
+	if (pipe(wake_pipe) != 0) {
+		return;
+	}
+	fcntl(wake_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(wake_pipe[1], F_SETFD, FD_CLOEXEC);
+	stats_started = pthread_create(&stats_thread, NULL, stats_main, NULL) == 0;
+}
+
+// PrintStageStats reports p50/p99 of each stage timed so far
+void PrintStageStats()
+{
+	char line[512];
+	int n = 0, s;
+
+	pthread_mutex_lock(&drain_lock);
+	drain();
+	for (s = 0; s < STAGE_COUNT && n < (int) sizeof(line); s++) {
+		const Histogram *h = histograms + s;
+		if (h->total) {
+			n += snprintf(line + n, sizeof(line) - n, "%s %s %.2f/%.2f", n ? "," : "",
+				      stage_names[s], percentile(h, 0.5) / 1e6, percentile(h, 0.99) / 1e6);
+		}
+	}
+	pthread_mutex_unlock(&drain_lock);
+	if (n) {
+		printf("stages (p50/p99 ms):%s\n", line);
+	}
+}
+
+// GetStageStats summarizes a stage timed so far
+void GetStageStats(int stage, StageSummary *summary)
+{
+	pthread_mutex_lock(&drain_lock);
+	drain();
+	const Histogram *h = histograms + stage;
+	summary->count = h->total;
+	summary->mean_ms = h->total ? h->sum_ns / 1e6 / h->total : 0.0;
+	summary->p50_ms = h->total ? percentile(h, 0.5) / 1e6 : 0.0;
+	summary->p99_ms = h->total ? percentile(h, 0.99) / 1e6 : 0.0;
+	summary->max_ms = h->max_ns / 1e6;
+	pthread_mutex_unlock(&drain_lock);
+}
+
+// ResetStageStats forgets every stage timed so far
+void ResetStageStats()
+{
+	pthread_mutex_lock(&drain_lock);
+	drain();
+	memset(histograms, 0, sizeof(histograms));
+	pthread_mutex_unlock(&drain_lock);
+}
+
+// FinishStats stops serving stats and writes the file one last time
+void FinishStats()
+{
+	if (!stats_started) {
+		return;
+	}
+	ssize_t w = write(wake_pipe[1], "", 1);
+	(void) w;
+	pthread_join(stats_thread, NULL);
+	stats_started = 0;
+	if (stats_file[0]) {
+		write_stats_file();
+	}
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		listen_fd = -1;
+		unlink(stats_socket);
+	}
+	close(wake_pipe[0]);
+	close(wake_pipe[1]);
+}
@@ -0,0 +1,262 @@
+// Tiled images.
+//
+// A single VGImage is limited by VG_MAX_IMAGE_WIDTH, VG_MAX_IMAGE_HEIGHT
+// and VG_MAX_IMAGE_PIXELS, which on some GPUs is less than a screen sized
+// slide, let alone a panorama or a large scan.  A TiledImage splits such
+// an image into a grid of images within the limits, drawn with the same
+// transform each offset by its origin.  Tiles entirely off the surface
+// aren't drawn.
+//
+// Filtering at a tile's edge can't see into its neighbour, so neighbouring
+// tiles overlap by TILE_OVERLAP pixels and each is scissored to its half
+// of the overlap, where it has the pixels on both sides of every sample.
+// That also keeps the antialiased tile edges, which would show as seams,
+// off the surface.  This holds for transforms that don't shrink by more
+// than half or rotate, which is how slides are drawn; other transforms
+// draw every tile whole.  Images within the limits are a single tile and
+// draw as before.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "vgwrap.h"
+#include "eglstate.h"
+
+extern STATE_T * state;	// global graphics state
+
+#define TILE_OVERLAP 4
+
+static long tiled_images, tiles_drawn, tiles_culled;
+
+
+// split divides length into count spans no longer than limit, overlapping
+// by TILE_OVERLAP, and returns how far apart they start
+static int split(int length, int limit, int *count) {
+	if (length <= limit) {
+		*count = 1;
+		return length;
+	}
+	*count = (length - TILE_OVERLAP + limit - TILE_OVERLAP - 1) / (limit - TILE_OVERLAP);
+	return (length - TILE_OVERLAP + *count - 1) / *count;
+}
+
+static int tile_width(TiledImage *t, int column) {
+	return column == t->columns - 1 ? t->width - column * t->stepX : t->stepX + TILE_OVERLAP;
+}
+
+static int tile_height(TiledImage *t, int row) {
+	return row == t->rows - 1 ? t->height - row * t->stepY : t->stepY + TILE_OVERLAP;
+}
+
+// tile_scissor finds the surface rectangle tile column, row owns under the
+// image transform m: up to the middle of the overlap with each neighbour,
+// or the surface edge where it has none.  Returns 0 if it is off the
+// surface.
+static int tile_scissor(TiledImage *t, const VGfloat *m, int column, int row, VGint *rect) {
+	VGfloat x0 = column * t->stepX + TILE_OVERLAP / 2, x1 = x0 + t->stepX;
+	VGfloat y0 = row * t->stepY + TILE_OVERLAP / 2, y1 = y0 + t->stepY;
+	VGfloat sx0 = m[0] * x0 + m[6], sx1 = m[0] * x1 + m[6];
+	VGfloat sy0 = m[4] * y0 + m[7], sy1 = m[4] * y1 + m[7];
+	int left = lroundf(sx0 < sx1 ? sx0 : sx1), right = lroundf(sx0 < sx1 ? sx1 : sx0);
+	int bottom = lroundf(sy0 < sy1 ? sy0 : sy1), top = lroundf(sy0 < sy1 ? sy1 : sy0);
+	// the outer edges are the image's own
+	if (column == 0 || column == t->columns - 1) {
+		if ((column == 0) == (m[0] > 0)) {
+			left = 0;
+		}
+		if ((column == t->columns - 1) == (m[0] > 0)) {
+			right = state->screen_width;
+		}
+	}
+	if (row == 0 || row == t->rows - 1) {
+		if ((row == 0) == (m[4] > 0)) {
+			bottom = 0;
+		}
+		if ((row == t->rows - 1) == (m[4] > 0)) {
+			top = state->screen_height;
+		}
+	}
+	if (left < 0) {
+		left = 0;
+	}
+	if (bottom < 0) {
+		bottom = 0;
+	}
+	if (right > state->screen_width) {
+		right = state->screen_width;
+	}
+	if (top > state->screen_height) {
+		top = state->screen_height;
+	}
+	rect[0] = left;
+	rect[1] = bottom;
+	rect[2] = right - left;
+	rect[3] = top - bottom;
+	return right > left && top > bottom;
+}
+
+// on_surface tells whether a w x h rectangle at x, y, through the image
+// transform m, touches the surface
+static int on_surface(const VGfloat *m, VGfloat x, VGfloat y, VGfloat w, VGfloat h) {
+	VGfloat xs[4] = { x, x + w, x, x + w }, ys[4] = { y, y, y + h, y + h };
+	VGfloat minX = 0, maxX = 0, minY = 0, maxY = 0;
+	int i;
+	for (i = 0; i < 4; i++) {
+		VGfloat sx = m[0] * xs[i] + m[3] * ys[i] + m[6];
+		VGfloat sy = m[1] * xs[i] + m[4] * ys[i] + m[7];
+		if (i == 0 || sx < minX) {
+			minX = sx;
+		}
+		if (i == 0 || sx > maxX) {
+			maxX = sx;
+		}
+		if (i == 0 || sy < minY) {
+			minY = sy;
+		}
+		if (i == 0 || sy > maxY) {
+			maxY = sy;
+		}
+	}
+	return maxX > 0 && maxY > 0 && minX < state->screen_width && minY < state->screen_height;
+}
+
+
+// createTiledImage returns a width x height image of the given format,
+// split into as many tiles as the GPU's limits need, from the image pool.
+// Its contents are undefined.  Returns NULL if any tile can't be had.
+TiledImage *createTiledImage(VGImageFormat format, int width, int height) {
+	int maxWidth = vgGeti(VG_MAX_IMAGE_WIDTH), maxHeight = vgGeti(VG_MAX_IMAGE_HEIGHT);
+	size_t maxPixels = vgGeti(VG_MAX_IMAGE_PIXELS);
+	int row, column;
+
+	if (width <= 0 || height <= 0 || maxWidth <= 2 * TILE_OVERLAP || maxHeight <= 2 * TILE_OVERLAP) {
+		return NULL;
+	}
+	TiledImage *t = calloc(1, sizeof(TiledImage));
+	if (t == NULL) {
+		return NULL;
+	}
+	t->width = width;
+	t->height = height;
+	t->format = format;
+	t->stepX = split(width, maxWidth, &t->columns);
+	// rows short enough that a full width tile is within the pixel limit
+	int tileWidth = t->columns > 1 ? t->stepX + TILE_OVERLAP : width;
+	if ((size_t) tileWidth * maxHeight > maxPixels) {
+		maxHeight = maxPixels / tileWidth;
+	}
+	if (maxHeight <= 2 * TILE_OVERLAP) {
+		free(t);
+		return NULL;
+	}
+	t->stepY = split(height, maxHeight, &t->rows);
+
+	t->tiles = malloc(sizeof(VGImage) * t->columns * t->rows);
+	if (t->tiles == NULL) {
+		free(t);
+		return NULL;
+	}
+	for (row = 0; row < t->rows; row++) {
+		for (column = 0; column < t->columns; column++) {
+			VGImage img = AcquireImage(format, tile_width(t, column), tile_height(t, row));
+			t->tiles[row * t->columns + column] = img;
+			if (img == VG_INVALID_HANDLE) {
+				// give back the tiles already had
+				int had = row * t->columns + column, i;
+				for (i = 0; i < had; i++) {
+					ReleaseImage(t->tiles[i]);
+				}
+				free(t->tiles);
+				free(t);
+				return NULL;
+			}
+		}
+	}
+	if (t->columns * t->rows > 1) {
+		tiled_images++;
+	}
+	return t;
+}
+
+// tiledImageSubData loads rows y up to y + height of the image, bottom row
+// first, from data, which holds those rows stride bytes apart in the
+// image's format.  An image can be loaded a band at a time.
+void tiledImageSubData(TiledImage *t, const void *data, VGint stride, int y, int height) {
+	size_t bpp = ImageBytes(t->format, 1, 1);
+	int row, column;
+	for (row = 0; row < t->rows; row++) {
+		int top = row * t->stepY, bottom = top + tile_height(t, row);
+		int from = y > top ? y : top, to = y + height < bottom ? y + height : bottom;
+		if (from >= to) {
+			continue;
+		}
+		for (column = 0; column < t->columns; column++) {
+			int left = column * t->stepX;
+			const VGubyte *src = (const VGubyte *) data + (size_t) (from - y) * stride + left * bpp;
+			vgImageSubData(t->tiles[row * t->columns + column], src, stride, t->format,
+				       0, from - top, tile_width(t, column), to - from);
+		}
+	}
+}
+
+// drawTiledImage draws an image through the current image transform,
+// like DrawImageOpacity, skipping tiles that fall off the surface
+void drawTiledImage(TiledImage *t, VGfloat opacity) {
+	VGfloat m[9];
+	int row, column;
+
+	if (t->columns * t->rows == 1) {
+		DrawImageOpacity(t->tiles[0], opacity);
+		tiles_drawn++;
+		return;
+	}
+	vgGetMatrix(m);
+	// scissor unless the transform rotates, or the caller scissors
+	int scissor = m[1] == 0 && m[3] == 0 && m[2] == 0 && m[5] == 0 &&
+	    fabsf(m[0]) >= 0.5f && fabsf(m[4]) >= 0.5f && !vgGeti(VG_SCISSORING);
+	for (row = 0; row < t->rows; row++) {
+		for (column = 0; column < t->columns; column++) {
+			VGfloat x = (VGfloat) (column * t->stepX), y = (VGfloat) (row * t->stepY);
+			VGint rect[4];
+			if (scissor ? !tile_scissor(t, m, column, row, rect) :
+			    !on_surface(m, x, y, tile_width(t, column), tile_height(t, row))) {
+				tiles_culled++;
+				continue;
+			}
+			if (scissor) {
+				vgSetiv(VG_SCISSOR_RECTS, 4, rect);
+				vgSeti(VG_SCISSORING, VG_TRUE);
+			}
+			vgLoadMatrix(m);
+			vgTranslate(x, y);
+			DrawImageOpacity(t->tiles[row * t->columns + column], opacity);
+			tiles_drawn++;
+		}
+	}
+	if (scissor) {
+		vgSeti(VG_SCISSORING, VG_FALSE);
+	}
+	vgLoadMatrix(m);
+}
+
+// releaseTiledImage gives an image's tiles back to the pool
+void releaseTiledImage(TiledImage *t) {
+	int i;
+	if (t == NULL) {
+		return;
+	}
+	for (i = 0; i < t->columns * t->rows; i++) {
+		ReleaseImage(t->tiles[i]);
+	}
+	free(t->tiles);
+	free(t);
+}
+
+void PrintTileStats() {
+	if (tiled_images > 0) {
+		printf("tiles: %ld images tiled, %ld tiles drawn, %ld culled\n",
+		       tiled_images, tiles_drawn, tiles_culled);
+	}
+}
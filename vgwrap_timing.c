@@ -0,0 +1,12 @@
+#include <time.h>
+
+#include "vgwrap.h"
+
+// vgwrap_now_ms returns a monotonic timestamp in milliseconds, for
+// measuring intervals only
+double vgwrap_now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}